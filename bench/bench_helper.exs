@@ -0,0 +1,129 @@
+defmodule ExPTY.Bench do
+  @moduledoc false
+
+  # Shared setup of the benchmarks in this directory, results go to
+  # bench/results/<name>.json. Set BENCH_SAVE=<tag> to keep a run as a
+  # baseline and BENCH_LOAD=<tag> to compare against it.
+
+  @results Path.join(__DIR__, "results")
+
+  def config(name, opts \\ []) do
+    File.mkdir_p!(@results)
+
+    save =
+      case System.get_env("BENCH_SAVE") do
+        nil -> []
+        tag -> [save: [path: Path.join(@results, "#{name}-#{tag}.benchee"), tag: tag]]
+      end
+
+    load =
+      case System.get_env("BENCH_LOAD") do
+        nil -> []
+        tag -> [load: Path.join(@results, "#{name}-#{tag}.benchee")]
+      end
+
+    [
+      warmup: env_int("BENCH_WARMUP", 2),
+      time: env_int("BENCH_TIME", 10),
+      memory_time: 0,
+      percentiles: [50, 90, 99, 99.9],
+      formatters: [
+        Benchee.Formatters.Console,
+        {Benchee.Formatters.JSON, file: Path.join(@results, "#{name}.json")}
+      ]
+    ]
+    |> Keyword.merge(save)
+    |> Keyword.merge(load)
+    |> Keyword.merge(opts)
+  end
+
+  def env_int(name, default) do
+    case System.get_env(name) do
+      nil -> default
+      value -> String.to_integer(value)
+    end
+  end
+
+  def write_json!(name, term) do
+    File.mkdir_p!(@results)
+    File.write!(Path.join(@results, "#{name}.json"), Jason.encode_to_iodata!(term, pretty: true))
+  end
+
+  @doc """
+  Spawn a session that forwards its output and exit to the caller.
+  """
+  def spawn!(file, args, opts \\ []) do
+    parent = self()
+
+    opts =
+      Keyword.merge(
+        [
+          on_data: fn _, pty, data -> send(parent, {:bench_data, pty, data}) end,
+          on_exit: fn _, pty, exit_code, _ -> send(parent, {:bench_exit, pty, exit_code}) end
+        ],
+        opts
+      )
+
+    {:ok, pty} = ExPTY.spawn(file, args, opts)
+    pty
+  end
+
+  @doc """
+  Receive the output of `pty` until it exits, returns the number of bytes.
+  """
+  def drain(pty, bytes \\ 0) do
+    receive do
+      {:bench_data, ^pty, data} -> drain(pty, bytes + byte_size(data))
+      {:bench_exit, ^pty, _} -> bytes
+    after
+      30_000 -> raise "no output from #{inspect(pty)} for 30 seconds"
+    end
+  end
+
+  @doc """
+  Receive the output of `pty` until it contains `pattern`.
+  """
+  def await(pty, pattern, acc \\ "") do
+    if String.contains?(acc, pattern) do
+      :ok
+    else
+      receive do
+        {:bench_data, ^pty, data} -> await(pty, pattern, acc <> data)
+        {:bench_exit, ^pty, exit_code} -> raise "#{inspect(pty)} exited with #{exit_code}"
+      after
+        30_000 -> raise "#{inspect(pattern)} not seen in 30 seconds"
+      end
+    end
+  end
+
+  def stop(pty) do
+    ExPTY.kill(pty, 9)
+
+    receive do
+      {:bench_exit, ^pty, _} -> :ok
+    after
+      5_000 -> :ok
+    end
+
+    flush(pty)
+  end
+
+  def flush(pty) do
+    receive do
+      {:bench_data, ^pty, _} -> flush(pty)
+      {:bench_exit, ^pty, _} -> flush(pty)
+    after
+      0 -> :ok
+    end
+  end
+
+  def write_all(pty, data) do
+    case ExPTY.write(pty, data) do
+      :ok -> :ok
+      {:partial, n} -> write_all(pty, binary_part(data, n, byte_size(data) - n))
+      {:error, reason} -> raise "write failed: #{reason}"
+    end
+  end
+
+  def mib(n), do: n * 1024 * 1024
+end
@@ -0,0 +1,29 @@
+# Interactive round-trip latency: write a line to `cat` and wait for it
+# to come back, as seen by the consuming process. The native echo probe
+# (see ExPTY.probe_echo/1) measures the same round trip without the
+# genserver and the message passing, it is written along with the results.
+#
+#   MIX_ENV=bench mix run bench/latency.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+alias ExPTY.Bench
+
+Benchee.run(
+  %{
+    "write -> output" => fn pty ->
+      :ok = ExPTY.write(pty, "x\n")
+      Bench.await(pty, "\n")
+    end
+  },
+  Bench.config("latency",
+    before_scenario: fn _ ->
+      Bench.spawn!("cat", [], echo_probe: 1)
+    end,
+    after_scenario: fn pty ->
+      {:ok, stats} = ExPTY.stats(pty)
+      native = Map.take(stats, [:echo_probes, :echo_timeouts, :echo_latency])
+      Bench.write_json!("latency-native", native)
+      Bench.stop(pty)
+    end
+  )
+)
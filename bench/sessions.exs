@@ -0,0 +1,62 @@
+# Memory and threads per idle session, at 10, 100, 1,000 and 10,000
+# sessions (BENCH_SESSIONS=10,100 to change). Larger counts need enough
+# file descriptors and processes, see `ulimit -n` and `ulimit -u`.
+#
+#   MIX_ENV=bench mix run bench/sessions.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+alias ExPTY.Bench
+
+counts =
+  "BENCH_SESSIONS"
+  |> System.get_env("10,100,1000,10000")
+  |> String.split(",", trim: true)
+  |> Enum.map(&String.to_integer/1)
+
+# VmRSS in bytes and the number of threads of the VM, nil where /proc is not available
+os_usage = fn ->
+  case File.read("/proc/self/status") do
+    {:ok, status} ->
+      field = fn name ->
+        [_, value] = Regex.run(~r/^#{name}:\s+(\d+)/m, status)
+        String.to_integer(value)
+      end
+
+      %{rss: field.("VmRSS") * 1024, threads: field.("Threads")}
+
+    _ ->
+      %{rss: nil, threads: nil}
+  end
+end
+
+usage = fn ->
+  :erlang.garbage_collect()
+  Map.merge(%{beam: :erlang.memory(:total)}, os_usage.())
+end
+
+per_session = fn after_value, before_value, n ->
+  if is_integer(after_value) and is_integer(before_value), do: (after_value - before_value) / n
+end
+
+results =
+  Enum.map(counts, fn n ->
+    before = usage.()
+    {micros, ptys} = :timer.tc(fn -> for _ <- 1..n, do: Bench.spawn!("sleep", ["86400"]) end)
+    # let the reader threads settle
+    Process.sleep(1_000)
+    loaded = usage.()
+    Enum.each(ptys, &Bench.stop/1)
+
+    result = %{
+      sessions: n,
+      spawn_seconds: micros / 1_000_000,
+      beam_bytes_per_session: per_session.(loaded.beam, before.beam, n),
+      rss_bytes_per_session: per_session.(loaded.rss, before.rss, n),
+      threads_per_session: per_session.(loaded.threads, before.threads, n)
+    }
+
+    IO.inspect(result)
+    result
+  end)
+
+Bench.write_json!("sessions", results)
@@ -0,0 +1,21 @@
+# Spawn rate and latency: the time ExPTY.spawn/3 takes to return, and
+# to get the exit of a short-lived child.
+#
+#   MIX_ENV=bench mix run bench/spawn.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+alias ExPTY.Bench
+
+Benchee.run(
+  %{
+    "spawn" => {
+      fn -> Bench.spawn!("sleep", ["60"]) end,
+      after_each: &Bench.stop/1
+    },
+    "spawn + exit" => fn ->
+      pty = Bench.spawn!("true", [])
+      Bench.drain(pty)
+    end
+  },
+  Bench.config("spawn")
+)
@@ -0,0 +1,36 @@
+# Output throughput: how fast output gets from the child to the process
+# consuming it, from spawn to exit.
+#
+#   MIX_ENV=bench mix run bench/throughput.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+alias ExPTY.Bench
+
+tmp = Path.join(System.tmp_dir!(), "expty_bench_#{System.unique_integer([:positive])}")
+File.mkdir_p!(tmp)
+
+line = String.duplicate("0123456789abcdef", 7) <> "\n"
+
+files =
+  Map.new([1, 16, 64], fn n ->
+    path = Path.join(tmp, "#{n}MiB.txt")
+    chunk = String.duplicate(line, div(Bench.mib(1), byte_size(line)))
+    File.write!(path, List.duplicate(chunk, n))
+    {"#{n} MiB", {path, n}}
+  end)
+
+Benchee.run(
+  %{
+    "cat file" => fn {path, _} ->
+      pty = Bench.spawn!("cat", [path])
+      Bench.drain(pty)
+    end,
+    "yes | head -c" => fn {_, n} ->
+      pty = Bench.spawn!("/bin/sh", ["-c", "yes | head -c #{Bench.mib(n)}"])
+      Bench.drain(pty)
+    end
+  },
+  Bench.config("throughput", inputs: files)
+)
+
+File.rm_rf!(tmp)
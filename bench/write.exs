@@ -0,0 +1,28 @@
+# Write throughput for large pastes, into a raw mode `cat` that throws
+# the input away.
+#
+#   MIX_ENV=bench mix run bench/write.exs
+
+Code.require_file("bench_helper.exs", __DIR__)
+alias ExPTY.Bench
+
+pastes =
+  Map.new([{"4 KiB", 4 * 1024}, {"64 KiB", 64 * 1024}, {"1 MiB", 1024 * 1024}], fn {name, n} ->
+    {name, :binary.copy("x", n)}
+  end)
+
+Benchee.run(
+  %{
+    "paste" => fn {pty, data} -> Bench.write_all(pty, data) end
+  },
+  Bench.config("write",
+    inputs: pastes,
+    before_scenario: fn data ->
+      # canonical mode would stop at MAX_CANON bytes without a newline
+      pty = Bench.spawn!("/bin/sh", ["-c", "stty raw -echo && echo ready && exec cat > /dev/null"])
+      Bench.await(pty, "ready")
+      {pty, data}
+    end,
+    after_scenario: fn {pty, _} -> Bench.stop(pty) end
+  )
+)
@@ -23,7 +23,7 @@ static ERL_NIF_TERM error(ErlNifEnv *env, const char *msg)
   unsigned char * ptr;
   size_t len = strlen(msg);
   if ((ptr = enif_make_new_binary(env, len, &reason)) != nullptr) {
-    strcpy((char *)ptr, msg);
+    memcpy(ptr, msg, len);
     return enif_make_tuple2(env, atom_error, reason);
   } else {
     ERL_NIF_TERM msg_term = enif_make_string(env, msg, ERL_NIF_LATIN1);
@@ -36,7 +36,7 @@ static ERL_NIF_TERM make_string(ErlNifEnv *env, const char *msg, bool& success)
   unsigned char * ptr;
   size_t len = strlen(msg);
   if ((ptr = enif_make_new_binary(env, len, &erl_string)) != nullptr) {
-    strcpy((char *)ptr, msg);
+    memcpy(ptr, msg, len);
     success = true;
     return erl_string;
   } else {
@@ -45,6 +45,11 @@ static ERL_NIF_TERM make_string(ErlNifEnv *env, const char *msg, bool& success)
   }
 }
 
+static int get_opt(ErlNifEnv *env, ERL_NIF_TERM opts, const char *key, ERL_NIF_TERM *value)
+{
+  return enif_get_map_value(env, opts, atom(env, key), value);
+}
+
 int get_atom(ErlNifEnv *env, ERL_NIF_TERM term, std::string &var)
 {
   unsigned atom_length;
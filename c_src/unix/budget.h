@@ -0,0 +1,144 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+#include <string>
+
+/**
+ * Output budgets
+ * A token bucket per session, refilled at `rate` bytes per second up
+ * to `burst`, so that one session flooding its output cannot take the
+ * reader threads and the consumers of the node for itself. What
+ * happens to the output beyond the budget is up to the policy:
+ *
+ * - throttle: the reader stops reading until the bucket has refilled,
+ *   the kernel buffer fills up and the child blocks in write().
+ * - drop: the output is discarded, {:dropped, bytes} is reported once
+ *   the budget allows output again.
+ * - tail: like drop, but the last screenful of lines is kept and
+ *   delivered after {:dropped, bytes}.
+ *
+ * The settings can change at any time, the bucket is the reader's.
+ */
+
+enum pty_budget_policy {
+  PTY_BUDGET_THROTTLE,
+  PTY_BUDGET_DROP,
+  PTY_BUDGET_TAIL,
+};
+
+struct pty_output_budget {
+  // 0 when unlimited
+  std::atomic<uint64_t> rate{0};
+  std::atomic<uint64_t> burst{0};
+  std::atomic<int> policy{PTY_BUDGET_THROTTLE};
+  // bumped on every change, the reader then starts with a full bucket
+  std::atomic<uint32_t> generation{0};
+  // the size of a screenful for tail
+  std::atomic<uint32_t> cols{80};
+  std::atomic<uint32_t> rows{24};
+
+  // reader only
+  uint32_t seen = 0;
+  double tokens = 0;
+  uint64_t refilled = 0;
+  // output discarded since the last report, including the tail
+  uint64_t dropped = 0;
+  std::string tail;
+
+  bool enabled() const {
+    return rate.load(std::memory_order_relaxed) > 0;
+  }
+
+  void set(uint64_t new_rate, uint64_t new_burst, pty_budget_policy new_policy) {
+    rate = new_rate;
+    burst = new_burst;
+    policy = new_policy;
+    generation++;
+  }
+
+  void refill(uint64_t now) {
+    uint32_t current = generation.load();
+    if (current != seen) {
+      seen = current;
+      tokens = (double)burst.load();
+    } else {
+      tokens = std::min((double)burst.load(), tokens + (double)(now - refilled) * (double)rate.load() / 1e9);
+    }
+    refilled = now;
+  }
+
+  // ns until the bucket holds `n` tokens
+  uint64_t wait_for(double n) const {
+    uint64_t r = rate.load();
+    if (tokens >= n || r == 0) return 0;
+    return (uint64_t)((n - tokens) * 1e9 / (double)r) + 1;
+  }
+
+  // what a pending report waits for: the tail it delivers and half a
+  // burst, so that a steady flood is reported a couple of times per
+  // burst rather than once per read
+  double report_cost() const {
+    return std::max((double)tail.size(), (double)burst.load() / 2);
+  }
+
+  /**
+   * Keeps the last `rows` lines of what is dropped, at most four bytes
+   * per cell so that long lines and escape sequences stay bounded.
+   */
+  void keep_tail(const char *data, size_t len) {
+    size_t max = (size_t)cols.load() * rows.load() * 4;
+    if (len >= max) {
+      tail.assign(data + len - max, max);
+    } else {
+      tail.append(data, len);
+      if (tail.size() > max) tail.erase(0, tail.size() - max);
+    }
+
+    // the `rows` + 1-th newline from the end starts the screenful
+    uint32_t lines = 0, screen = rows.load();
+    for (size_t i = tail.size(); i-- > 0;) {
+      if (tail[i] == '\n' && ++lines > screen) {
+        tail.erase(0, i + 1);
+        break;
+      }
+    }
+  }
+};
+
+/**
+ * pty_rate_meter
+ * Bytes per second over windows of a quarter of a second, updated by
+ * the reader and read without locks; a session that has been quiet
+ * for a second reads as 0.
+ */
+
+struct pty_rate_meter {
+  static const uint64_t window = 250000000ULL;
+
+  std::atomic<uint64_t> rate{0};
+  std::atomic<uint64_t> updated{0};
+
+  // reader only
+  uint64_t window_start = 0;
+  uint64_t window_bytes = 0;
+
+  void add(uint64_t bytes, uint64_t now) {
+    if (window_start == 0) window_start = now;
+    window_bytes += bytes;
+    uint64_t elapsed = now - window_start;
+    if (elapsed >= window) {
+      rate.store(window_bytes * 1000000000ULL / elapsed, std::memory_order_relaxed);
+      updated.store(now, std::memory_order_relaxed);
+      window_start = now;
+      window_bytes = 0;
+    }
+  }
+
+  uint64_t get(uint64_t now) const {
+    uint64_t at = updated.load(std::memory_order_relaxed);
+    if (at == 0 || now - at > 4 * window) return 0;
+    return rate.load(std::memory_order_relaxed);
+  }
+};
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+/**
+ * pty_cr_collapser
+ * Collapses the carriage return rewrites of progress bars (pip, npm,
+ * cargo, curl...) into the final state of each line before it is sent.
+ * A line is split into segments at every bare '\r' (not part of
+ * "\r\n"), and a segment is dropped when the next one covers it on the
+ * screen anyway: it is at least as long, or it erases the line with
+ * ESC [ K, ESC [ 0 K or ESC [ 2 K.
+ *
+ * Complete lines go out right away. What follows the last '\n' is held
+ * back for up to `window` once it is being rewritten, so that a bar
+ * redrawn a thousand times a second goes out once per window; anything
+ * else, e.g. a prompt, goes out as it is.
+ */
+
+struct pty_cr_collapser {
+  // ns, 0 when disabled
+  uint64_t window = 0;
+  // the line being rewritten, collapsed
+  std::string held;
+  // uv_hrtime() and the read time of its first byte
+  uint64_t held_at = 0;
+  int64_t held_since = 0;
+  // bytes dropped since the caller last took them
+  uint64_t collapsed = 0;
+
+  // one line would rather go out than be held past this
+  static const size_t max_held = 65536;
+
+  bool due(uint64_t now) const {
+    return !held.empty() && now - held_at >= window;
+  }
+
+  /**
+   * Returns how much of `data` can go out as it is, when nothing in it
+   * is being rewritten, and 0 otherwise: what goes out then is appended
+   * to `out`, and `since` becomes the read time of its first byte.
+   */
+  size_t feed(const char *data, size_t len, uint64_t now, int64_t &since, std::string &out) {
+    if (held.empty()) {
+      size_t plain = plain_prefix(data, len);
+      if (plain == len) return len;
+      if (plain == len - 1 && data[plain] == '\r') {
+        // perhaps the first half of "\r\n"
+        hold(data + plain, 1, now, since);
+        return plain;
+      }
+      held_at = now;
+      held_since = since;
+    }
+    held.append(data, len);
+    since = held_since;
+
+    std::string rest;
+    const char *nl = (const char *)memrchr(held.data(), '\n', held.size());
+    if (nl) {
+      size_t end = (size_t)(nl - held.data()) + 1;
+      size_t pos = 0;
+      while (pos < end) {
+        size_t eol = (size_t)((const char *)memchr(held.data() + pos, '\n', end - pos) - held.data()) + 1;
+        collapse_line(held.data() + pos, eol - pos, out);
+        pos = eol;
+      }
+      rest.assign(held, end, std::string::npos);
+      held.clear();
+      if (rest.empty()) return 0;
+      held_at = now;
+      held_since = since;
+    } else {
+      rest.swap(held);
+    }
+
+    if (plain_prefix(rest.data(), rest.size()) == rest.size()) {
+      out += rest;
+    } else {
+      collapse_line(rest.data(), rest.size(), held);
+      if (held.size() > max_held) flush(out);
+    }
+    return 0;
+  }
+
+  // hands out the line being rewritten, once due or on EOF
+  bool flush(std::string &out) {
+    if (held.empty()) return false;
+    out += held;
+    held.clear();
+    return true;
+  }
+
+ private:
+  void hold(const char *data, size_t len, uint64_t now, int64_t since) {
+    held.assign(data, len);
+    held_at = now;
+    held_since = since;
+  }
+
+  // the length of the prefix without a bare '\r', up to a trailing one
+  static size_t plain_prefix(const char *data, size_t len) {
+    const char *p = data, *end = data + len;
+    while ((p = (const char *)memchr(p, '\r', end - p)) != nullptr) {
+      if (p + 1 == end || p[1] != '\n') return (size_t)(p - data);
+      p += 2;
+    }
+    return len;
+  }
+
+  static bool erases_line(const char *data, size_t len) {
+    const char *p = data, *end = data + len;
+    while ((p = (const char *)memchr(p, '\x1b', end - p)) != nullptr) {
+      size_t left = (size_t)(end - p);
+      if ((left >= 3 && p[1] == '[' && p[2] == 'K') ||
+          (left >= 4 && p[1] == '[' && (p[2] == '0' || p[2] == '2') && p[3] == 'K')) {
+        return true;
+      }
+      p++;
+    }
+    return false;
+  }
+
+  /**
+   * Appends `data`, at most one line, without its covered segments. A
+   * kept segment keeps the '\r' before it, the cursor may not have been
+   * at the start of the line before the first one.
+   */
+  void collapse_line(const char *data, size_t len, std::string &out) {
+    // the line ending, "\n" or "\r\n", and a trailing '\r' are not rewrites
+    size_t body = len;
+    if (body > 0 && data[body - 1] == '\n') body--;
+    if (body > 0 && data[body - 1] == '\r') body--;
+
+    const char *end = data + body, *seg = data, *cr;
+    bool first = true;
+    while ((cr = (const char *)memchr(seg, '\r', end - seg)) != nullptr) {
+      const char *next = cr + 1;
+      const char *next_end = (const char *)memchr(next, '\r', end - next);
+      if (!next_end) next_end = end;
+
+      size_t seg_len = (size_t)(cr - seg), next_len = (size_t)(next_end - next);
+      if (next_len >= seg_len || erases_line(next, next_len)) {
+        collapsed += seg_len + (first ? 0 : 1);
+      } else {
+        if (!first) out += '\r';
+        out.append(seg, seg_len);
+      }
+      first = false;
+      seg = next;
+    }
+    if (!first) out += '\r';
+    out.append(seg, (size_t)(data + len - seg));
+  }
+};
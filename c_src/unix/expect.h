@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include <deque>
+
+#include "regex.h"
+
+/**
+ * pty_aho_corasick
+ * Multi-pattern literal matcher compiled into a dense DFA so that
+ * scanning costs one table lookup per byte. The automaton state is
+ * carried across reads, so matches that straddle chunks are found.
+ */
+
+struct pty_aho_corasick {
+  // delta[state * 256 + byte]
+  std::vector<int32_t> delta;
+  // pattern index reported at each state, -1 if none
+  std::vector<int32_t> out;
+  std::vector<std::string> patterns;
+  int32_t state = 0;
+
+  bool compile(const std::vector<std::string> &pats) {
+    patterns = pats;
+    delta.assign(256, -1);
+    out.assign(1, -1);
+    state = 0;
+
+    for (size_t i = 0; i < patterns.size(); i++) {
+      const std::string &p = patterns[i];
+      if (p.empty()) return false;
+
+      int32_t s = 0;
+      for (unsigned char c : p) {
+        int32_t &next = delta[(size_t)s * 256 + c];
+        if (next == -1) {
+          next = (int32_t)out.size();
+          out.push_back(-1);
+          delta.resize(delta.size() + 256, -1);
+        }
+        s = delta[(size_t)s * 256 + c];
+      }
+      // keep the first pattern if the same literal is given twice
+      if (out[s] == -1) out[s] = (int32_t)i;
+    }
+
+    // BFS over the trie, filling in failure transitions
+    std::vector<int32_t> fail(out.size(), 0);
+    std::deque<int32_t> queue;
+    for (int c = 0; c < 256; c++) {
+      int32_t &next = delta[c];
+      if (next == -1) {
+        next = 0;
+      } else {
+        fail[next] = 0;
+        queue.push_back(next);
+      }
+    }
+
+    while (!queue.empty()) {
+      int32_t s = queue.front();
+      queue.pop_front();
+      if (out[s] == -1) out[s] = out[fail[s]];
+
+      for (int c = 0; c < 256; c++) {
+        int32_t &next = delta[(size_t)s * 256 + c];
+        if (next == -1) {
+          next = delta[(size_t)fail[s] * 256 + c];
+        } else {
+          fail[next] = delta[(size_t)fail[s] * 256 + c];
+          queue.push_back(next);
+        }
+      }
+    }
+    return true;
+  }
+
+  /**
+   * Scan `len` bytes, returns the index of the first pattern that
+   * ends in this chunk and sets `end` to one past its last byte,
+   * or -1 if nothing matched.
+   */
+  int32_t feed(const unsigned char *data, size_t len, size_t &end) {
+    const int32_t *d = delta.data();
+    const int32_t *o = out.data();
+    int32_t s = state;
+    for (size_t i = 0; i < len; i++) {
+      s = d[(size_t)s * 256 + data[i]];
+      if (o[s] != -1) {
+        state = 0;
+        end = i + 1;
+        return o[s];
+      }
+    }
+    state = s;
+    return -1;
+  }
+};
+
+/**
+ * pty_expect
+ * One armed expect on a session: the matcher plus the bytes seen
+ * since it was armed, which become `before` once a pattern hits.
+ */
+
+struct pty_expect {
+  bool armed = false;
+  // do not forward {:data, _} until the match
+  bool suppress = false;
+  // use regex_matcher instead of the literal matcher
+  bool regex = false;
+  pty_aho_corasick matcher;
+  pty_regex_set regex_matcher;
+  // how far back the start of a regex match and its captures are searched
+  size_t lookbehind = 4096;
+  std::string pending;
+  // upper bound of `pending`, older bytes are dropped from `before`
+  size_t max_pending = 1 << 20;
+
+  void arm(bool suppress_data) {
+    armed = true;
+    suppress = suppress_data;
+    pending.clear();
+  }
+
+  void disarm() {
+    armed = false;
+    suppress = false;
+    pending.clear();
+    matcher.state = 0;
+    if (regex) regex_matcher.reset();
+  }
+
+  int32_t feed(const unsigned char *data, size_t len, size_t &end) {
+    return regex ? regex_matcher.feed(data, len, end) : matcher.feed(data, len, end);
+  }
+
+  // Bytes dropped from the front are moved to `evicted` when suppressing, the owner
+  // has not seen them yet and they are delivered ahead of the rest.
+  void append(const char *data, size_t len, std::string &evicted) {
+    size_t over = pending.size() + len > max_pending ? pending.size() + len - max_pending : 0;
+    if (over == 0) {
+      pending.append(data, len);
+      return;
+    }
+    if (suppress) {
+      size_t from_pending = std::min(over, pending.size());
+      evicted.append(pending, 0, from_pending);
+      evicted.append(data, over - from_pending);
+    }
+    if (len >= max_pending) {
+      pending.assign(data + len - max_pending, max_pending);
+      return;
+    }
+    pending.erase(0, over);
+    pending.append(data, len);
+  }
+};
@@ -0,0 +1,257 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <atomic>
+#include <string>
+
+#include "collapse.h"
+
+/**
+ * Output filters
+ * The stages of the output pipelines of pipeline.h. Each one looks for
+ * what it has to do with memchr() first, so that output it has nothing
+ * to do with goes through as a prefix of the read buffer, uncopied.
+ */
+
+// a piece of output on its way, `since` being the read time of its first byte
+struct pty_chunk {
+  const char *data;
+  size_t len;
+  int64_t since;
+};
+
+enum pty_filter_kind {
+  PTY_FILTER_COLLAPSE,
+  PTY_FILTER_STRIP_ANSI,
+  PTY_FILTER_UTF8,
+};
+
+struct pty_filter_spec {
+  pty_filter_kind kind;
+  // collapse_progress: the window in ns
+  uint64_t window;
+  // collapse_progress: where the bytes saved are counted, may be null
+  std::atomic<uint64_t> *counter;
+};
+
+/**
+ * {:collapse_progress, ms}: the carriage return rewrites of progress
+ * bars, see collapse.h.
+ */
+
+struct pty_collapse_stage {
+  pty_cr_collapser collapser;
+  std::atomic<uint64_t> *counter;
+  std::string out;
+
+  explicit pty_collapse_stage(const pty_filter_spec &spec) : counter(spec.counter) {
+    collapser.window = spec.window;
+  }
+
+  bool apply(pty_chunk &chunk, uint64_t now) {
+    out.clear();
+    size_t plain = collapser.feed(chunk.data, chunk.len, now, chunk.since, out);
+    if (collapser.collapsed > 0) {
+      if (counter) counter->fetch_add(collapser.collapsed, std::memory_order_relaxed);
+      collapser.collapsed = 0;
+    }
+    if (plain > 0) {
+      chunk.len = plain;
+      return true;
+    }
+    chunk.data = out.data();
+    chunk.len = out.size();
+    return !out.empty();
+  }
+
+  bool flush(pty_chunk &chunk, uint64_t now, bool eof) {
+    if (!eof && !collapser.due(now)) return false;
+    out.clear();
+    chunk.since = collapser.held_since;
+    if (!collapser.flush(out)) return false;
+    chunk.data = out.data();
+    chunk.len = out.size();
+    return true;
+  }
+
+  uint64_t deadline() const {
+    return collapser.held.empty() ? 0 : collapser.held_at + collapser.window;
+  }
+};
+
+/**
+ * :strip_ansi: escape sequences taken out, for logs and plain text
+ * consumers: CSI (colors, cursor movement...), OSC (titles,
+ * hyperlinks...) up to BEL or ST, DCS, SOS, PM and APC strings up to ST,
+ * and the other ESC sequences. Sequences may span reads, C0 controls
+ * such as '\r' and '\n' are kept.
+ */
+
+struct pty_strip_ansi_stage {
+  enum state { GROUND, ESCAPE, INTERMEDIATE, CSI, STRING, STRING_ESCAPE };
+  state st = GROUND;
+  // BEL ends OSC, the other strings only end with ST
+  bool osc = false;
+  std::string out;
+
+  explicit pty_strip_ansi_stage(const pty_filter_spec &) {}
+
+  bool apply(pty_chunk &chunk, uint64_t) {
+    const char *data = chunk.data, *end = data + chunk.len;
+    if (st == GROUND) {
+      const char *esc = (const char *)memchr(data, '\x1b', chunk.len);
+      if (!esc) return true;
+      if (esc + 1 == end) {
+        // the rest of the sequence is in the next read
+        st = ESCAPE;
+        chunk.len--;
+        return chunk.len > 0;
+      }
+    }
+
+    out.clear();
+    for (const char *p = data; p < end; p++) {
+      unsigned char c = (unsigned char)*p;
+      switch (st) {
+        case GROUND: {
+          const char *esc = (const char *)memchr(p, '\x1b', end - p);
+          if (!esc) {
+            out.append(p, end - p);
+            p = end - 1;
+          } else {
+            out.append(p, esc - p);
+            p = esc;
+            st = ESCAPE;
+          }
+          break;
+        }
+        case ESCAPE:
+          escape(c);
+          break;
+        case INTERMEDIATE:
+          if (c < 0x20 || c > 0x2f) st = GROUND;
+          break;
+        case CSI:
+          if (c == 0x1b) {
+            st = ESCAPE;
+          } else if (c < 0x20) {
+            // executed even within a sequence
+            out += (char)c;
+          } else if (c >= 0x40) {
+            st = GROUND;
+          }
+          break;
+        case STRING:
+          if (c == 0x1b) {
+            st = STRING_ESCAPE;
+          } else if (c == 0x07 && osc) {
+            st = GROUND;
+          }
+          break;
+        case STRING_ESCAPE:
+          if (c == '\\') {
+            st = GROUND;
+          } else {
+            escape(c);
+          }
+          break;
+      }
+    }
+    chunk.data = out.data();
+    chunk.len = out.size();
+    return !out.empty();
+  }
+
+  bool flush(pty_chunk &, uint64_t, bool) {
+    return false;
+  }
+
+  uint64_t deadline() const {
+    return 0;
+  }
+
+ private:
+  void escape(unsigned char c) {
+    osc = c == ']';
+    if (c == '[') {
+      st = CSI;
+    } else if (c == ']' || c == 'P' || c == 'X' || c == '^' || c == '_') {
+      st = STRING;
+    } else if (c == 0x1b) {
+      st = ESCAPE;
+    } else if (c >= 0x20 && c <= 0x2f) {
+      st = INTERMEDIATE;
+    } else {
+      st = GROUND;
+    }
+  }
+};
+
+/**
+ * :utf8: what is sent never ends in the middle of a UTF-8 character,
+ * the bytes of an incomplete one at the end of a read are held for the
+ * next read, or for at most `hold` if none comes. Invalid sequences go
+ * through as they are.
+ */
+
+struct pty_utf8_stage {
+  static const uint64_t hold = 20000000ULL;
+
+  char held[4] = {};
+  size_t held_len = 0;
+  uint64_t held_at = 0;
+  int64_t held_since = 0;
+  std::string out;
+
+  explicit pty_utf8_stage(const pty_filter_spec &) {}
+
+  bool apply(pty_chunk &chunk, uint64_t now) {
+    if (held_len > 0) {
+      out.assign(held, held_len);
+      out.append(chunk.data, chunk.len);
+      chunk.data = out.data();
+      chunk.len = out.size();
+      chunk.since = held_since;
+      held_len = 0;
+    }
+
+    size_t cut = incomplete(chunk.data, chunk.len);
+    if (cut < chunk.len) {
+      held_len = chunk.len - cut;
+      memcpy(held, chunk.data + cut, held_len);
+      held_at = now;
+      held_since = chunk.since;
+      chunk.len = cut;
+    }
+    return chunk.len > 0;
+  }
+
+  bool flush(pty_chunk &chunk, uint64_t now, bool eof) {
+    if (held_len == 0 || (!eof && now - held_at < hold)) return false;
+    out.assign(held, held_len);
+    held_len = 0;
+    chunk.data = out.data();
+    chunk.len = out.size();
+    chunk.since = held_since;
+    return true;
+  }
+
+  uint64_t deadline() const {
+    return held_len > 0 ? held_at + hold : 0;
+  }
+
+ private:
+  // where an incomplete character at the end of `data` starts, or `len`
+  static size_t incomplete(const char *data, size_t len) {
+    size_t i = len, continuation = 0;
+    while (i > 0 && continuation < 3 && ((unsigned char)data[i - 1] & 0xc0) == 0x80) {
+      i--;
+      continuation++;
+    }
+    if (i == 0) return len;
+    unsigned char lead = (unsigned char)data[i - 1];
+    size_t need = (lead & 0xe0) == 0xc0 ? 1 : (lead & 0xf0) == 0xe0 ? 2 : (lead & 0xf8) == 0xf0 ? 3 : 0;
+    return continuation < need ? i - 1 : len;
+  }
+};
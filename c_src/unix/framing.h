@@ -0,0 +1,77 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+/**
+ * pty_line_framer
+ * Splits output into lines natively, like `packet: :line` in gen_tcp.
+ * A line keeps its trailing '\n' (with "\r\n" optionally normalized to
+ * "\n"), an incomplete line is carried over to the next read, and a
+ * line longer than `max_line` is delivered in pieces.
+ */
+
+struct pty_line_framer {
+  struct line {
+    // offset into the chunk, or -1 if the line is in `text`
+    ssize_t offset;
+    size_t len;
+    std::string text;
+  };
+
+  bool normalize_crlf = false;
+  size_t max_line = 65536;
+  std::string partial;
+
+  /**
+   * Appends the complete lines of `data` to `lines`. Lines that lie
+   * entirely within the chunk are referenced by offset so that the
+   * caller can hand out sub-binaries instead of copying.
+   */
+  void feed(const char *data, size_t len, std::vector<line> &lines) {
+    size_t pos = 0;
+    while (pos < len) {
+      // memchr is vectorized by the C library
+      const char *nl = (const char *)memchr(data + pos, '\n', len - pos);
+      size_t end = nl ? (size_t)(nl - data) + 1 : len;
+
+      if (!nl) {
+        partial.append(data + pos, end - pos);
+        while (partial.size() >= max_line) {
+          lines.push_back(line{-1, max_line, partial.substr(0, max_line)});
+          partial.erase(0, max_line);
+        }
+        break;
+      }
+
+      bool crlf = normalize_crlf && (end - pos >= 2 ? data[end - 2] == '\r' :
+                                     !partial.empty() && partial.back() == '\r');
+      if (partial.empty() && !crlf && end - pos <= max_line) {
+        lines.push_back(line{(ssize_t)pos, end - pos, std::string()});
+      } else {
+        partial.append(data + pos, end - pos);
+        if (crlf) {
+          partial.erase(partial.size() - 2, 1);
+        }
+        size_t off = 0;
+        while (partial.size() - off > max_line) {
+          lines.push_back(line{-1, max_line, partial.substr(off, max_line)});
+          off += max_line;
+        }
+        lines.push_back(line{-1, partial.size() - off, partial.substr(off)});
+        partial.clear();
+      }
+      pos = end;
+    }
+  }
+
+  // hands out the incomplete line, e.g. a prompt, on EOF or when idle
+  bool flush(std::vector<line> &lines) {
+    if (partial.empty()) return false;
+    lines.push_back(line{-1, partial.size(), partial});
+    partial.clear();
+    return true;
+  }
+};
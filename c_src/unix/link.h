@@ -0,0 +1,101 @@
+#pragma once
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <string>
+
+#include <erl_nif.h>
+
+/**
+ * pty_link
+ * A session connected with ExPTY.connect/3: the reader writes what it
+ * reads to the master of the peer session, or to a Unix socket, instead
+ * of sending it to the owner. With a socket and `bidirectional`, what
+ * comes back is written to the session's own master by the same reader;
+ * between two sessions each has its own link to the other.
+ *
+ * Nothing is buffered beyond one read: while the other side has not
+ * taken all of `out`, the reader polls for it to become writable rather
+ * than reading its master, the kernel buffer fills up and the child of
+ * the faster side blocks in write(). The same goes for `in` and the
+ * socket.
+ */
+
+struct pty_pipesocket_;
+
+struct pty_link_buffer {
+  std::string data;
+  size_t offset = 0;
+
+  bool empty() const {
+    return offset == data.size();
+  }
+
+  void append(const char *bytes, size_t len) {
+    if (empty()) {
+      data.assign(bytes, len);
+      offset = 0;
+    } else {
+      data.append(bytes, len);
+    }
+  }
+
+  // what is left, and the buffer emptied
+  std::string take() {
+    std::string rest = data.substr(offset);
+    data.clear();
+    offset = 0;
+    return rest;
+  }
+
+  /**
+   * Writes what `fd` takes without blocking, adding it to `written`;
+   * the bytes stay where they were until the next append(). False on
+   * errors other than EAGAIN, errno being set.
+   */
+  bool flush(int fd, bool socket, uint64_t &written) {
+    while (!empty()) {
+#if defined(MSG_NOSIGNAL)
+      ssize_t n = socket ? ::send(fd, data.data() + offset, data.size() - offset, MSG_NOSIGNAL)
+                         : ::write(fd, data.data() + offset, data.size() - offset);
+#else
+      ssize_t n = ::write(fd, data.data() + offset, data.size() - offset);
+#endif
+      if (n > 0) {
+        offset += (size_t)n;
+        written += (uint64_t)n;
+      } else if (n == -1 && errno == EINTR) {
+        continue;
+      } else {
+        // 0: a stopped terminal, it takes nothing until started again
+        return n == 0 || errno == EAGAIN;
+      }
+    }
+    return true;
+  }
+};
+
+struct pty_link {
+  // the peer session, kept with enif_keep_resource, null for a socket
+  pty_pipesocket_ *peer = nullptr;
+  // a dup of the peer's master or the socket, closed with the link
+  int fd = -1;
+  bool socket = false;
+  bool bidirectional = false;
+
+  // from the session to fd, and from the socket to the session
+  pty_link_buffer out;
+  pty_link_buffer in;
+
+  pty_link() {}
+  pty_link(const pty_link &) = delete;
+  pty_link &operator=(const pty_link &) = delete;
+
+  ~pty_link() {
+    if (fd != -1) ::close(fd);
+    if (peer) enif_release_resource(peer);
+  }
+};
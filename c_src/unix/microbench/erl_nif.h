@@ -0,0 +1,162 @@
+#pragma once
+
+/**
+ * A thin stand-in for erl_nif.h, enough for pty.cpp to run outside of
+ * the VM: terms are plain heap objects owned by their environment,
+ * resources are reference counted blocks and enif_send() hands the
+ * message to a hook instead of a process. Only what pty.cpp and the
+ * headers it includes use is provided.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef uintptr_t ERL_NIF_TERM;
+typedef struct enif_environment_t ErlNifEnv;
+typedef struct { ERL_NIF_TERM pid; } ErlNifPid;
+typedef struct {
+  size_t size;
+  unsigned char *data;
+  void *ref_bin;
+  void *__spare__[2];
+} ErlNifBinary;
+typedef struct enif_resource_type_t ErlNifResourceType;
+typedef void ErlNifResourceDtor(ErlNifEnv *, void *);
+typedef struct {
+  ERL_NIF_TERM map;
+  size_t index;
+} ErlNifMapIterator;
+typedef enum { ERL_NIF_MAP_ITERATOR_FIRST = 1, ERL_NIF_MAP_ITERATOR_LAST = 2 } ErlNifMapIteratorEntry;
+typedef enum { ERL_NIF_LATIN1 = 1, ERL_NIF_UTF8 = 2 } ErlNifCharEncoding;
+typedef enum { ERL_NIF_RT_CREATE = 1, ERL_NIF_RT_TAKEOVER = 2 } ErlNifResourceFlags;
+typedef enum { ERL_DIRTY_JOB_CPU_BOUND = 1, ERL_DIRTY_JOB_IO_BOUND = 2 } ErlDirtyJobFlags;
+#define ERL_NIF_DIRTY_JOB_IO_BOUND ERL_DIRTY_JOB_IO_BOUND
+#define ERL_NIF_DIRTY_JOB_CPU_BOUND ERL_DIRTY_JOB_CPU_BOUND
+typedef int64_t ErlNifSInt64;
+typedef uint64_t ErlNifUInt64;
+typedef int64_t ErlNifTime;
+typedef enum { ERL_NIF_SEC, ERL_NIF_MSEC, ERL_NIF_USEC, ERL_NIF_NSEC } ErlNifTimeUnit;
+
+typedef struct {
+  const char *name;
+  unsigned arity;
+  ERL_NIF_TERM (*fptr)(ErlNifEnv *, int, const ERL_NIF_TERM[]);
+  unsigned flags;
+} ErlNifFunc;
+
+typedef struct {
+  ErlNifFunc *funcs;
+  int num_of_funcs;
+  int (*load)(ErlNifEnv *, void **, ERL_NIF_TERM);
+} ErlNifEntry;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+int enif_make_existing_atom(ErlNifEnv *, const char *, ERL_NIF_TERM *, ErlNifCharEncoding);
+ERL_NIF_TERM enif_make_atom(ErlNifEnv *, const char *);
+unsigned char *enif_make_new_binary(ErlNifEnv *, size_t, ERL_NIF_TERM *);
+ERL_NIF_TERM enif_make_tuple_from_array(ErlNifEnv *, const ERL_NIF_TERM[], unsigned);
+ERL_NIF_TERM enif_make_list_from_array(ErlNifEnv *, const ERL_NIF_TERM[], unsigned);
+ERL_NIF_TERM enif_make_list_cell(ErlNifEnv *, ERL_NIF_TERM, ERL_NIF_TERM);
+ERL_NIF_TERM enif_make_string(ErlNifEnv *, const char *, ErlNifCharEncoding);
+ERL_NIF_TERM enif_make_int(ErlNifEnv *, int);
+ERL_NIF_TERM enif_make_uint(ErlNifEnv *, unsigned);
+ERL_NIF_TERM enif_make_int64(ErlNifEnv *, ErlNifSInt64);
+ERL_NIF_TERM enif_make_uint64(ErlNifEnv *, ErlNifUInt64);
+ERL_NIF_TERM enif_make_double(ErlNifEnv *, double);
+ERL_NIF_TERM enif_make_resource(ErlNifEnv *, void *);
+ERL_NIF_TERM enif_make_resource_binary(ErlNifEnv *, void *, const void *, size_t);
+ERL_NIF_TERM enif_make_sub_binary(ErlNifEnv *, ERL_NIF_TERM, size_t, size_t);
+int enif_make_map_from_arrays(ErlNifEnv *, ERL_NIF_TERM[], ERL_NIF_TERM[], size_t, ERL_NIF_TERM *);
+int enif_get_int(ErlNifEnv *, ERL_NIF_TERM, int *);
+int enif_get_uint(ErlNifEnv *, ERL_NIF_TERM, unsigned *);
+int enif_get_int64(ErlNifEnv *, ERL_NIF_TERM, ErlNifSInt64 *);
+int enif_get_uint64(ErlNifEnv *, ERL_NIF_TERM, ErlNifUInt64 *);
+int enif_get_double(ErlNifEnv *, ERL_NIF_TERM, double *);
+int enif_get_atom_length(ErlNifEnv *, ERL_NIF_TERM, unsigned *, ErlNifCharEncoding);
+int enif_get_atom(ErlNifEnv *, ERL_NIF_TERM, char *, unsigned, ErlNifCharEncoding);
+int enif_get_list_length(ErlNifEnv *, ERL_NIF_TERM, unsigned *);
+int enif_get_list_cell(ErlNifEnv *, ERL_NIF_TERM, ERL_NIF_TERM *, ERL_NIF_TERM *);
+int enif_get_string(ErlNifEnv *, ERL_NIF_TERM, char *, unsigned, ErlNifCharEncoding);
+int enif_get_tuple(ErlNifEnv *, ERL_NIF_TERM, int *, const ERL_NIF_TERM **);
+int enif_get_resource(ErlNifEnv *, ERL_NIF_TERM, ErlNifResourceType *, void **);
+int enif_get_local_pid(ErlNifEnv *, ERL_NIF_TERM, ErlNifPid *);
+int enif_get_map_value(ErlNifEnv *, ERL_NIF_TERM, ERL_NIF_TERM, ERL_NIF_TERM *);
+int enif_is_map(ErlNifEnv *, ERL_NIF_TERM);
+int enif_is_atom(ErlNifEnv *, ERL_NIF_TERM);
+int enif_is_empty_list(ErlNifEnv *, ERL_NIF_TERM);
+int enif_map_iterator_create(ErlNifEnv *, ERL_NIF_TERM, ErlNifMapIterator *, ErlNifMapIteratorEntry);
+int enif_map_iterator_get_pair(ErlNifEnv *, ErlNifMapIterator *, ERL_NIF_TERM *, ERL_NIF_TERM *);
+int enif_map_iterator_next(ErlNifEnv *, ErlNifMapIterator *);
+void enif_map_iterator_destroy(ErlNifEnv *, ErlNifMapIterator *);
+int enif_inspect_binary(ErlNifEnv *, ERL_NIF_TERM, ErlNifBinary *);
+int enif_inspect_iolist_as_binary(ErlNifEnv *, ERL_NIF_TERM, ErlNifBinary *);
+void *enif_alloc(size_t);
+void enif_free(void *);
+void *enif_alloc_resource(ErlNifResourceType *, size_t);
+void enif_release_resource(void *);
+void enif_keep_resource(void *);
+ErlNifResourceType *enif_open_resource_type(ErlNifEnv *, const char *, const char *, ErlNifResourceDtor *,
+                                            ErlNifResourceFlags, ErlNifResourceFlags *);
+ErlNifEnv *enif_alloc_env(void);
+void enif_free_env(ErlNifEnv *);
+void enif_clear_env(ErlNifEnv *);
+int enif_send(ErlNifEnv *, const ErlNifPid *, ErlNifEnv *, ERL_NIF_TERM);
+ErlNifPid *enif_self(ErlNifEnv *, ErlNifPid *);
+ErlNifTime enif_monotonic_time(ErlNifTimeUnit);
+
+#ifdef __cplusplus
+}
+#endif
+
+static inline ERL_NIF_TERM enif_make_tuple1(ErlNifEnv *env, ERL_NIF_TERM e1) {
+  ERL_NIF_TERM a[] = {e1};
+  return enif_make_tuple_from_array(env, a, 1);
+}
+
+static inline ERL_NIF_TERM enif_make_tuple2(ErlNifEnv *env, ERL_NIF_TERM e1, ERL_NIF_TERM e2) {
+  ERL_NIF_TERM a[] = {e1, e2};
+  return enif_make_tuple_from_array(env, a, 2);
+}
+
+static inline ERL_NIF_TERM enif_make_tuple3(ErlNifEnv *env, ERL_NIF_TERM e1, ERL_NIF_TERM e2, ERL_NIF_TERM e3) {
+  ERL_NIF_TERM a[] = {e1, e2, e3};
+  return enif_make_tuple_from_array(env, a, 3);
+}
+
+static inline ERL_NIF_TERM enif_make_tuple4(ErlNifEnv *env, ERL_NIF_TERM e1, ERL_NIF_TERM e2, ERL_NIF_TERM e3,
+                                            ERL_NIF_TERM e4) {
+  ERL_NIF_TERM a[] = {e1, e2, e3, e4};
+  return enif_make_tuple_from_array(env, a, 4);
+}
+
+static inline ERL_NIF_TERM enif_make_tuple5(ErlNifEnv *env, ERL_NIF_TERM e1, ERL_NIF_TERM e2, ERL_NIF_TERM e3,
+                                            ERL_NIF_TERM e4, ERL_NIF_TERM e5) {
+  ERL_NIF_TERM a[] = {e1, e2, e3, e4, e5};
+  return enif_make_tuple_from_array(env, a, 5);
+}
+
+// only ever called with no elements
+static inline ERL_NIF_TERM enif_make_list(ErlNifEnv *env, unsigned cnt) {
+  return enif_make_list_from_array(env, nullptr, 0);
+}
+
+/**
+ * Message hook of the shim, called by enif_send() with the message
+ * while `msg_env` is still valid. Returns what enif_send() returns.
+ */
+typedef int (*shim_send_hook)(const ErlNifPid *to, ErlNifEnv *msg_env, ERL_NIF_TERM msg);
+void shim_set_send_hook(shim_send_hook hook);
+
+// the entry point ERL_NIF_INIT would hand to the VM
+#define ERL_NIF_INIT(NAME, FUNCS, LOAD, RELOAD, UPGRADE, UNLOAD)            \
+  ErlNifEntry *shim_nif_init(void) {                                        \
+    static ErlNifEntry entry = {                                            \
+      FUNCS, (int)(sizeof(FUNCS) / sizeof(FUNCS[0])), LOAD                  \
+    };                                                                      \
+    (void)RELOAD;                                                           \
+    (void)UPGRADE;                                                          \
+    return &entry;                                                          \
+  }
@@ -0,0 +1,480 @@
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <atomic>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "erl_nif.h"
+
+/**
+ * Terms of the shim
+ * Each term is a node kept alive by the environment that made it, a
+ * term is the address of its node. Binaries own their bytes unless
+ * they are a view into another binary or into a resource.
+ */
+
+namespace {
+
+enum shim_kind {
+  SHIM_ATOM,
+  SHIM_INT,
+  SHIM_DOUBLE,
+  SHIM_BINARY,
+  SHIM_TUPLE,
+  SHIM_CONS,
+  SHIM_NIL,
+  SHIM_MAP,
+  SHIM_PID,
+  SHIM_RESOURCE,
+};
+
+struct shim_term {
+  shim_kind kind;
+  int64_t i = 0;
+  bool is_unsigned = false;
+  double d = 0;
+  // atom names and owned binaries
+  std::string bytes;
+  const unsigned char *data = nullptr;
+  size_t size = 0;
+  // tuple elements, [head, tail] of a cons, keys and values of a map in turn
+  std::vector<ERL_NIF_TERM> items;
+  void *resource = nullptr;
+
+  explicit shim_term(shim_kind k) : kind(k) {}
+};
+
+struct shim_resource {
+  ErlNifResourceType *type;
+  std::atomic<int> refs;
+};
+
+shim_term *node(ERL_NIF_TERM term) {
+  return reinterpret_cast<shim_term *>(term);
+}
+
+ERL_NIF_TERM term_of(shim_term *t) {
+  return reinterpret_cast<ERL_NIF_TERM>(t);
+}
+
+shim_resource *header_of(void *obj) {
+  return reinterpret_cast<shim_resource *>(static_cast<char *>(obj) - sizeof(max_align_t));
+}
+
+std::atomic<shim_send_hook> send_hook{nullptr};
+
+}  // namespace
+
+struct enif_environment_t {
+  std::deque<shim_term> terms;
+  // resources referenced by terms of this environment
+  std::vector<void *> resources;
+
+  shim_term *make(shim_kind kind) {
+    terms.emplace_back(kind);
+    return &terms.back();
+  }
+
+  void clear() {
+    for (void *obj : resources) enif_release_resource(obj);
+    resources.clear();
+    terms.clear();
+  }
+};
+
+struct enif_resource_type_t {
+  std::string name;
+  ErlNifResourceDtor *dtor;
+};
+
+void shim_set_send_hook(shim_send_hook hook) {
+  send_hook = hook;
+}
+
+extern "C" {
+
+int enif_make_existing_atom(ErlNifEnv *env, const char *name, ERL_NIF_TERM *atom, ErlNifCharEncoding) {
+  *atom = enif_make_atom(env, name);
+  return 1;
+}
+
+ERL_NIF_TERM enif_make_atom(ErlNifEnv *env, const char *name) {
+  shim_term *t = env->make(SHIM_ATOM);
+  t->bytes = name;
+  return term_of(t);
+}
+
+unsigned char *enif_make_new_binary(ErlNifEnv *env, size_t size, ERL_NIF_TERM *term) {
+  shim_term *t = env->make(SHIM_BINARY);
+  t->bytes.resize(size);
+  t->data = (const unsigned char *)t->bytes.data();
+  t->size = size;
+  *term = term_of(t);
+  return (unsigned char *)&t->bytes[0];
+}
+
+ERL_NIF_TERM enif_make_tuple_from_array(ErlNifEnv *env, const ERL_NIF_TERM arr[], unsigned cnt) {
+  shim_term *t = env->make(SHIM_TUPLE);
+  t->items.assign(arr, arr + cnt);
+  return term_of(t);
+}
+
+ERL_NIF_TERM enif_make_list_cell(ErlNifEnv *env, ERL_NIF_TERM head, ERL_NIF_TERM tail) {
+  shim_term *t = env->make(SHIM_CONS);
+  t->items = {head, tail};
+  return term_of(t);
+}
+
+ERL_NIF_TERM enif_make_list_from_array(ErlNifEnv *env, const ERL_NIF_TERM arr[], unsigned cnt) {
+  ERL_NIF_TERM list = term_of(env->make(SHIM_NIL));
+  while (cnt-- > 0) list = enif_make_list_cell(env, arr[cnt], list);
+  return list;
+}
+
+ERL_NIF_TERM enif_make_string(ErlNifEnv *env, const char *string, ErlNifCharEncoding) {
+  size_t len = strlen(string);
+  std::vector<ERL_NIF_TERM> chars(len);
+  for (size_t i = 0; i < len; i++) chars[i] = enif_make_int(env, (unsigned char)string[i]);
+  return enif_make_list_from_array(env, chars.data(), (unsigned)len);
+}
+
+ERL_NIF_TERM enif_make_int64(ErlNifEnv *env, ErlNifSInt64 value) {
+  shim_term *t = env->make(SHIM_INT);
+  t->i = value;
+  return term_of(t);
+}
+
+ERL_NIF_TERM enif_make_uint64(ErlNifEnv *env, ErlNifUInt64 value) {
+  shim_term *t = env->make(SHIM_INT);
+  t->i = (int64_t)value;
+  t->is_unsigned = true;
+  return term_of(t);
+}
+
+ERL_NIF_TERM enif_make_int(ErlNifEnv *env, int value) {
+  return enif_make_int64(env, value);
+}
+
+ERL_NIF_TERM enif_make_uint(ErlNifEnv *env, unsigned value) {
+  return enif_make_uint64(env, value);
+}
+
+ERL_NIF_TERM enif_make_double(ErlNifEnv *env, double value) {
+  shim_term *t = env->make(SHIM_DOUBLE);
+  t->d = value;
+  return term_of(t);
+}
+
+ERL_NIF_TERM enif_make_resource(ErlNifEnv *env, void *obj) {
+  shim_term *t = env->make(SHIM_RESOURCE);
+  t->resource = obj;
+  enif_keep_resource(obj);
+  env->resources.push_back(obj);
+  return term_of(t);
+}
+
+ERL_NIF_TERM enif_make_resource_binary(ErlNifEnv *env, void *obj, const void *data, size_t size) {
+  shim_term *t = env->make(SHIM_BINARY);
+  t->data = (const unsigned char *)data;
+  t->size = size;
+  enif_keep_resource(obj);
+  env->resources.push_back(obj);
+  return term_of(t);
+}
+
+ERL_NIF_TERM enif_make_sub_binary(ErlNifEnv *env, ERL_NIF_TERM bin, size_t pos, size_t size) {
+  shim_term *t = env->make(SHIM_BINARY);
+  t->data = node(bin)->data + pos;
+  t->size = size;
+  return term_of(t);
+}
+
+int enif_make_map_from_arrays(ErlNifEnv *env, ERL_NIF_TERM keys[], ERL_NIF_TERM values[], size_t cnt,
+                              ERL_NIF_TERM *map) {
+  shim_term *t = env->make(SHIM_MAP);
+  for (size_t i = 0; i < cnt; i++) {
+    t->items.push_back(keys[i]);
+    t->items.push_back(values[i]);
+  }
+  *map = term_of(t);
+  return 1;
+}
+
+int enif_get_int64(ErlNifEnv *, ERL_NIF_TERM term, ErlNifSInt64 *value) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_INT || (t->is_unsigned && t->i < 0)) return 0;
+  *value = t->i;
+  return 1;
+}
+
+int enif_get_uint64(ErlNifEnv *, ERL_NIF_TERM term, ErlNifUInt64 *value) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_INT || (!t->is_unsigned && t->i < 0)) return 0;
+  *value = (uint64_t)t->i;
+  return 1;
+}
+
+int enif_get_int(ErlNifEnv *env, ERL_NIF_TERM term, int *value) {
+  ErlNifSInt64 v;
+  if (!enif_get_int64(env, term, &v) || v < INT32_MIN || v > INT32_MAX) return 0;
+  *value = (int)v;
+  return 1;
+}
+
+int enif_get_uint(ErlNifEnv *env, ERL_NIF_TERM term, unsigned *value) {
+  ErlNifUInt64 v;
+  if (!enif_get_uint64(env, term, &v) || v > UINT32_MAX) return 0;
+  *value = (unsigned)v;
+  return 1;
+}
+
+int enif_get_double(ErlNifEnv *, ERL_NIF_TERM term, double *value) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_DOUBLE) return 0;
+  *value = t->d;
+  return 1;
+}
+
+int enif_get_atom_length(ErlNifEnv *, ERL_NIF_TERM term, unsigned *len, ErlNifCharEncoding) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_ATOM) return 0;
+  *len = (unsigned)t->bytes.size();
+  return 1;
+}
+
+int enif_get_atom(ErlNifEnv *, ERL_NIF_TERM term, char *buf, unsigned size, ErlNifCharEncoding) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_ATOM || t->bytes.size() + 1 > size) return 0;
+  memcpy(buf, t->bytes.c_str(), t->bytes.size() + 1);
+  return (int)t->bytes.size() + 1;
+}
+
+int enif_get_list_cell(ErlNifEnv *, ERL_NIF_TERM term, ERL_NIF_TERM *head, ERL_NIF_TERM *tail) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_CONS) return 0;
+  *head = t->items[0];
+  *tail = t->items[1];
+  return 1;
+}
+
+int enif_is_empty_list(ErlNifEnv *, ERL_NIF_TERM term) {
+  return node(term)->kind == SHIM_NIL;
+}
+
+int enif_get_list_length(ErlNifEnv *env, ERL_NIF_TERM term, unsigned *len) {
+  unsigned n = 0;
+  ERL_NIF_TERM head;
+  while (enif_get_list_cell(env, term, &head, &term)) n++;
+  if (node(term)->kind != SHIM_NIL) return 0;
+  *len = n;
+  return 1;
+}
+
+int enif_get_string(ErlNifEnv *env, ERL_NIF_TERM term, char *buf, unsigned size, ErlNifCharEncoding) {
+  if (size == 0) return 0;
+  unsigned n = 0;
+  ERL_NIF_TERM head;
+  while (enif_get_list_cell(env, term, &head, &term)) {
+    int c;
+    if (!enif_get_int(env, head, &c) || c < 0 || c > 255) return 0;
+    if (n + 1 >= size) {
+      buf[n] = '\0';
+      return -(int)size;
+    }
+    buf[n++] = (char)c;
+  }
+  buf[n] = '\0';
+  return (int)n + 1;
+}
+
+int enif_get_tuple(ErlNifEnv *, ERL_NIF_TERM term, int *arity, const ERL_NIF_TERM **array) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_TUPLE) return 0;
+  *arity = (int)t->items.size();
+  *array = t->items.data();
+  return 1;
+}
+
+int enif_get_resource(ErlNifEnv *, ERL_NIF_TERM term, ErlNifResourceType *type, void **obj) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_RESOURCE || header_of(t->resource)->type != type) return 0;
+  *obj = t->resource;
+  return 1;
+}
+
+int enif_get_local_pid(ErlNifEnv *, ERL_NIF_TERM term, ErlNifPid *pid) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_PID) return 0;
+  pid->pid = (ERL_NIF_TERM)t->i;
+  return 1;
+}
+
+// atoms, integers and binaries compare by value, anything else by identity
+static bool shim_equal(ERL_NIF_TERM a, ERL_NIF_TERM b) {
+  shim_term *x = node(a), *y = node(b);
+  if (x == y) return true;
+  if (x->kind != y->kind) return false;
+  switch (x->kind) {
+    case SHIM_ATOM: return x->bytes == y->bytes;
+    case SHIM_INT: return x->i == y->i;
+    case SHIM_BINARY: return x->size == y->size && memcmp(x->data, y->data, x->size) == 0;
+    default: return false;
+  }
+}
+
+int enif_get_map_value(ErlNifEnv *, ERL_NIF_TERM map, ERL_NIF_TERM key, ERL_NIF_TERM *value) {
+  shim_term *t = node(map);
+  if (t->kind != SHIM_MAP) return 0;
+  for (size_t i = 0; i < t->items.size(); i += 2) {
+    if (shim_equal(t->items[i], key)) {
+      *value = t->items[i + 1];
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int enif_is_map(ErlNifEnv *, ERL_NIF_TERM term) {
+  return node(term)->kind == SHIM_MAP;
+}
+
+int enif_is_atom(ErlNifEnv *, ERL_NIF_TERM term) {
+  return node(term)->kind == SHIM_ATOM;
+}
+
+int enif_map_iterator_create(ErlNifEnv *, ERL_NIF_TERM map, ErlNifMapIterator *iter, ErlNifMapIteratorEntry) {
+  if (node(map)->kind != SHIM_MAP) return 0;
+  iter->map = map;
+  iter->index = 0;
+  return 1;
+}
+
+int enif_map_iterator_get_pair(ErlNifEnv *, ErlNifMapIterator *iter, ERL_NIF_TERM *key, ERL_NIF_TERM *value) {
+  shim_term *t = node(iter->map);
+  if (iter->index * 2 >= t->items.size()) return 0;
+  *key = t->items[iter->index * 2];
+  *value = t->items[iter->index * 2 + 1];
+  return 1;
+}
+
+int enif_map_iterator_next(ErlNifEnv *, ErlNifMapIterator *iter) {
+  iter->index++;
+  return iter->index * 2 < node(iter->map)->items.size();
+}
+
+void enif_map_iterator_destroy(ErlNifEnv *, ErlNifMapIterator *) {}
+
+int enif_inspect_binary(ErlNifEnv *, ERL_NIF_TERM term, ErlNifBinary *bin) {
+  shim_term *t = node(term);
+  if (t->kind != SHIM_BINARY) return 0;
+  memset(bin, 0, sizeof(*bin));
+  bin->data = (unsigned char *)t->data;
+  bin->size = t->size;
+  return 1;
+}
+
+static bool shim_flatten(ErlNifEnv *env, ERL_NIF_TERM term, std::string &out) {
+  shim_term *t = node(term);
+  if (t->kind == SHIM_BINARY) {
+    out.append((const char *)t->data, t->size);
+    return true;
+  }
+  ERL_NIF_TERM head;
+  while (enif_get_list_cell(env, term, &head, &term)) {
+    int c;
+    if (enif_get_int(env, head, &c) && c >= 0 && c <= 255) {
+      out.push_back((char)c);
+    } else if (!shim_flatten(env, head, out)) {
+      return false;
+    }
+  }
+  // an improper tail may be a binary
+  return node(term)->kind == SHIM_NIL || shim_flatten(env, term, out);
+}
+
+int enif_inspect_iolist_as_binary(ErlNifEnv *env, ERL_NIF_TERM term, ErlNifBinary *bin) {
+  std::string flat;
+  if (!shim_flatten(env, term, flat)) return 0;
+  ERL_NIF_TERM copy;
+  unsigned char *ptr = enif_make_new_binary(env, flat.size(), &copy);
+  memcpy(ptr, flat.data(), flat.size());
+  return enif_inspect_binary(env, copy, bin);
+}
+
+void *enif_alloc(size_t size) {
+  return malloc(size);
+}
+
+void enif_free(void *ptr) {
+  free(ptr);
+}
+
+void *enif_alloc_resource(ErlNifResourceType *type, size_t size) {
+  char *block = (char *)malloc(sizeof(max_align_t) + size);
+  if (!block) return nullptr;
+  shim_resource *header = new (block) shim_resource();
+  header->type = type;
+  header->refs = 1;
+  return block + sizeof(max_align_t);
+}
+
+void enif_keep_resource(void *obj) {
+  header_of(obj)->refs++;
+}
+
+void enif_release_resource(void *obj) {
+  shim_resource *header = header_of(obj);
+  if (--header->refs == 0) {
+    if (header->type->dtor) header->type->dtor(nullptr, obj);
+    header->~shim_resource();
+    free(header);
+  }
+}
+
+ErlNifResourceType *enif_open_resource_type(ErlNifEnv *, const char *, const char *name, ErlNifResourceDtor *dtor,
+                                            ErlNifResourceFlags, ErlNifResourceFlags *) {
+  return new enif_resource_type_t{name, dtor};
+}
+
+ErlNifEnv *enif_alloc_env(void) {
+  return new enif_environment_t();
+}
+
+void enif_free_env(ErlNifEnv *env) {
+  env->clear();
+  delete env;
+}
+
+void enif_clear_env(ErlNifEnv *env) {
+  env->clear();
+}
+
+int enif_send(ErlNifEnv *, const ErlNifPid *to, ErlNifEnv *msg_env, ERL_NIF_TERM msg) {
+  shim_send_hook hook = send_hook;
+  int ret = hook ? hook(to, msg_env, msg) : 1;
+  // like the VM, the message environment is cleared
+  if (msg_env) msg_env->clear();
+  return ret;
+}
+
+ErlNifPid *enif_self(ErlNifEnv *, ErlNifPid *pid) {
+  pid->pid = 1;
+  return pid;
+}
+
+ErlNifTime enif_monotonic_time(ErlNifTimeUnit unit) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  int64_t ns = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  switch (unit) {
+    case ERL_NIF_SEC: return ns / 1000000000LL;
+    case ERL_NIF_MSEC: return ns / 1000000LL;
+    case ERL_NIF_USEC: return ns / 1000LL;
+    default: return ns;
+  }
+}
+
+}  // extern "C"
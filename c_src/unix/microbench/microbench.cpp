@@ -0,0 +1,596 @@
+/**
+ * expty-microbench
+ * Runs the native read and write paths, openpty/spawn and the
+ * nif_utils.h conversions against the erl_nif shim in this directory,
+ * without a VM, so that pty_pipesocket_fn and pty_pipesocket::write
+ * can be profiled on their own, e.g.
+ *
+ *   perf record -g ./expty-microbench read --bytes 268435456 --chunk 65536
+ *
+ * Sessions are spawned through expty_spawn() with this executable as
+ * the child, producing or consuming at a given rate. Results are
+ * printed as one JSON object per line.
+ */
+
+// pty.cpp is a single translation unit of static functions, the
+// benchmarks are built as part of it
+#include "../pty.cpp"
+
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+#include <map>
+#include <sstream>
+
+#ifndef EXPTY_SPAWN_HELPER
+#define EXPTY_SPAWN_HELPER "spawn-helper"
+#endif
+
+namespace microbench {
+
+struct sink_t {
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> messages{0};
+  // reported by {:dropped, bytes} under an output budget
+  std::atomic<uint64_t> dropped{0};
+  // uv_hrtime() of the last output
+  std::atomic<uint64_t> last_output{0};
+  std::atomic<uint64_t> exited_at{0};
+  std::atomic<bool> exited{false};
+
+  void reset() {
+    bytes = 0;
+    messages = 0;
+    dropped = 0;
+    last_output = 0;
+    exited_at = 0;
+    exited = false;
+  }
+};
+
+static sink_t sink;
+static std::string self_path;
+static std::string helper_path = EXPTY_SPAWN_HELPER;
+
+// counts what the reader and the waitpid thread send to the session's process
+static int on_send(const ErlNifPid *, ErlNifEnv *env, ERL_NIF_TERM msg) {
+  int arity = 0;
+  const ERL_NIF_TERM *items = nullptr;
+  std::string tag;
+  if (!enif_get_tuple(env, msg, &arity, &items) || arity < 2 || !nif::get_atom(env, items[0], tag)) {
+    return 1;
+  }
+
+  ErlNifBinary bin;
+  if (tag == "data" && enif_inspect_binary(env, items[arity - 1], &bin)) {
+    sink.bytes += bin.size;
+    sink.messages++;
+    sink.last_output = uv_hrtime();
+  } else if (tag == "lines") {
+    ERL_NIF_TERM list = items[arity - 1], head;
+    while (enif_get_list_cell(env, list, &head, &list)) {
+      if (enif_inspect_binary(env, head, &bin)) sink.bytes += bin.size;
+    }
+    sink.messages++;
+    sink.last_output = uv_hrtime();
+  } else if (tag == "dropped") {
+    ErlNifUInt64 n = 0;
+    if (enif_get_uint64(env, items[1], &n)) sink.dropped += n;
+  } else if (tag == "exit") {
+    sink.exited_at = uv_hrtime();
+    sink.exited = true;
+  }
+  return 1;
+}
+
+struct options {
+  std::map<std::string, std::string> values;
+
+  options(int argc, char **argv) {
+    for (int i = 0; i + 1 < argc; i += 2) {
+      if (strncmp(argv[i], "--", 2) == 0) values[argv[i] + 2] = argv[i + 1];
+    }
+  }
+
+  uint64_t get(const char *key, uint64_t value) const {
+    auto it = values.find(key);
+    return it == values.end() ? value : strtoull(it->second.c_str(), nullptr, 10);
+  }
+
+  std::string get(const char *key, const char *value) const {
+    auto it = values.find(key);
+    return it == values.end() ? value : it->second;
+  }
+};
+
+static ERL_NIF_TERM binary(ErlNifEnv *env, const std::string &value) {
+  ERL_NIF_TERM term;
+  memcpy(enif_make_new_binary(env, value.size(), &term), value.data(), value.size());
+  return term;
+}
+
+static ERL_NIF_TERM binary_list(ErlNifEnv *env, const std::vector<std::string> &values) {
+  std::vector<ERL_NIF_TERM> terms;
+  for (const auto &value : values) terms.push_back(binary(env, value));
+  return enif_make_list_from_array(env, terms.data(), (unsigned)terms.size());
+}
+
+static void sleep_ns(uint64_t ns) {
+  struct timespec ts;
+  ts.tv_sec = (time_t)(ns / 1000000000ULL);
+  ts.tv_nsec = (long)(ns % 1000000000ULL);
+  nanosleep(&ts, nullptr);
+}
+
+struct session {
+  ErlNifEnv *env = nullptr;
+  ERL_NIF_TERM resource = 0;
+  pty_pipesocket *pipesocket = nullptr;
+  pid_t pid = 0;
+  uint64_t openpty_ns = 0;
+  uint64_t spawn_ns = 0;
+  uint64_t handshake_ns = 0;
+
+  // expty_spawn() with the arguments ExPTY.spawn/3 would pass
+  bool spawn(const std::string &file, const std::vector<std::string> &args, ERL_NIF_TERM native_options = 0) {
+    env = enif_alloc_env();
+    const char *path = getenv("PATH");
+    ERL_NIF_TERM env_keys[] = {binary(env, "TERM"), binary(env, "PATH")};
+    ERL_NIF_TERM env_values[] = {binary(env, "xterm-256color"), binary(env, path ? path : "/usr/bin:/bin")};
+    ERL_NIF_TERM envs, empty;
+    enif_make_map_from_arrays(env, env_keys, env_values, 2, &envs);
+    enif_make_map_from_arrays(env, nullptr, nullptr, 0, &empty);
+
+    ERL_NIF_TERM argv[] = {
+      binary(env, file),
+      binary_list(env, args),
+      envs,
+      binary(env, "/"),
+      enif_make_int(env, 80),
+      enif_make_int(env, 24),
+      enif_make_int(env, 38400),
+      enif_make_int(env, 38400),
+      enif_make_int(env, -2),
+      enif_make_int(env, -2),
+      nif::atom(env, "true"),
+      nif::atom(env, "false"),
+      nif::atom(env, "false"),
+      binary(env, helper_path),
+      native_options ? native_options : empty,
+    };
+    ERL_NIF_TERM ret = expty_spawn(env, 15, argv);
+
+    int arity = 0;
+    const ERL_NIF_TERM *items = nullptr;
+    if (!enif_get_tuple(env, ret, &arity, &items) || arity != 4 ||
+        !enif_get_resource(env, items[0], pty_pipesocket::type, (void **)&pipesocket)) {
+      fprintf(stderr, "spawn of %s failed, is --helper %s right?\n", file.c_str(), helper_path.c_str());
+      return false;
+    }
+    resource = items[0];
+    int child = 0;
+    enif_get_int(env, items[1], &child);
+    pid = child;
+
+    ERL_NIF_TERM value;
+    ErlNifUInt64 ns = 0;
+    if (nif::get_opt(env, items[3], "openpty", &value) && enif_get_uint64(env, value, &ns)) openpty_ns = ns;
+    if (nif::get_opt(env, items[3], "posix_spawn", &value) && enif_get_uint64(env, value, &ns)) spawn_ns = ns;
+    if (nif::get_opt(env, items[3], "handshake", &value) && enif_get_uint64(env, value, &ns)) handshake_ns = ns;
+    return true;
+  }
+
+  /**
+   * Once the child has exited and the reader has drained the PTY. The
+   * reader only sees the end of the output once no process holds the
+   * slave side anymore, a descendant left running may keep it open, so
+   * the output also counts as drained after 50 ms without any.
+   */
+  void wait() {
+    while (!sink.exited) sleep_ns(100000);
+    for (;;) {
+      // both threads are done, our term keeps the resource alive
+      if (pipesocket->threads.load() == 0) return;
+      uint64_t last = std::max(sink.last_output.load(), sink.exited_at.load());
+      if (uv_hrtime() - last > 50000000ULL) return;
+      sleep_ns(100000);
+    }
+  }
+
+  ~session() {
+    if (env) enif_free_env(env);
+  }
+};
+
+static void print_histogram(const char *name, const pty_histogram &h) {
+  pty_histogram_view view;
+  view.add(h);
+  printf(",\"%s\":{\"count\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"max\":%llu}", name,
+         (unsigned long long)view.count, (unsigned long long)view.quantile(0.5),
+         (unsigned long long)view.quantile(0.9), (unsigned long long)view.quantile(0.99),
+         (unsigned long long)view.max);
+}
+
+/**
+ * Child side of `read`: writes `bytes` of text lines to the PTY in
+ * `chunk` sized writes, at most `rate` bytes per second (0 unlimited).
+ * In raw mode unless `cooked`, so that ONLCR does not add bytes. With
+ * `progress`, a progress bar redrawn with '\r' and ended every 100
+ * updates instead, like pip or cargo.
+ */
+static int produce(uint64_t bytes, uint64_t chunk, uint64_t rate, bool cooked, bool progress) {
+  if (!cooked) {
+    struct termios t;
+    tcgetattr(STDOUT_FILENO, &t);
+    cfmakeraw(&t);
+    tcsetattr(STDOUT_FILENO, TCSANOW, &t);
+  }
+
+  std::string buffer;
+  static const char line[] = "the quick brown fox jumps over the lazy dog 0123456789 abcdefghijklmnopqrstuvwxyz\n";
+  for (int i = 0; buffer.size() < chunk; i++) {
+    if (progress) {
+      char bar[64];
+      int percent = i % 101;
+      snprintf(bar, sizeof(bar), "\rDownloading [%-20s] %3d%%%s", std::string(percent / 5, '#').c_str(), percent,
+               percent == 100 ? "\n" : "");
+      buffer += bar;
+    } else {
+      buffer += line;
+    }
+  }
+  buffer.resize(chunk);
+
+  uint64_t started = uv_hrtime(), sent = 0;
+  while (sent < bytes) {
+    size_t len = (size_t)std::min<uint64_t>(chunk, bytes - sent);
+    ssize_t n = ::write(STDOUT_FILENO, buffer.data(), len);
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return 1;
+    }
+    sent += (uint64_t)n;
+    if (rate > 0) {
+      uint64_t due = started + sent * 1000000000ULL / rate, now = uv_hrtime();
+      if (due > now) sleep_ns(due - now);
+    }
+  }
+  // the master reads the rest after the slave is gone
+  return 0;
+}
+
+// child side of `write`: raw mode, reports ready and discards its input
+static int consume() {
+  struct termios t;
+  tcgetattr(STDIN_FILENO, &t);
+  cfmakeraw(&t);
+  tcsetattr(STDIN_FILENO, TCSANOW, &t);
+  (void)!::write(STDOUT_FILENO, "R", 1);
+
+  char buffer[65536];
+  for (;;) {
+    ssize_t n = ::read(STDIN_FILENO, buffer, sizeof(buffer));
+    if (n == 0 || (n < 0 && errno != EINTR)) return 0;
+  }
+}
+
+static void bench_read(const options &opts) {
+  uint64_t bytes = opts.get("bytes", 64ULL << 20);
+  uint64_t chunk = opts.get("chunk", 4096);
+  uint64_t rate = opts.get("rate", (uint64_t)0);
+  uint64_t runs = opts.get("runs", 5);
+  bool cooked = opts.get("cooked", (uint64_t)0) != 0;
+  std::string framing = opts.get("framing", "raw");
+  bool screen = opts.get("screen", (uint64_t)0) != 0;
+  // a profile set from the parent side, as with `termios: profile`
+  std::string termios_profile = opts.get("termios", "");
+  // an output budget in bytes per second, as with `output_budget: [...]`
+  uint64_t budget = opts.get("budget", (uint64_t)0);
+  std::string policy = opts.get("policy", "throttle");
+  // e.g. collapse_progress:50,strip_ansi,utf8 as with `filters: [...]`, with `--progress 1`
+  std::string filters = opts.get("filters", "");
+  bool progress = opts.get("progress", (uint64_t)0) != 0;
+
+  for (uint64_t run = 0; run < runs; run++) {
+    sink.reset();
+    session s;
+    ErlNifEnv *opts_env = enif_alloc_env();
+    std::vector<ERL_NIF_TERM> keys = {nif::atom(opts_env, "framing"), nif::atom(opts_env, "screen")};
+    std::vector<ERL_NIF_TERM> values = {nif::atom(opts_env, framing.c_str()),
+                                        nif::atom(opts_env, screen ? "true" : "false")};
+    if (!termios_profile.empty()) {
+      ERL_NIF_TERM profile_key = nif::atom(opts_env, "profile");
+      ERL_NIF_TERM profile = nif::atom(opts_env, termios_profile.c_str());
+      ERL_NIF_TERM termios;
+      enif_make_map_from_arrays(opts_env, &profile_key, &profile, 1, &termios);
+      keys.push_back(nif::atom(opts_env, "termios"));
+      values.push_back(termios);
+    }
+    if (budget > 0) {
+      ERL_NIF_TERM budget_keys[] = {nif::atom(opts_env, "rate"), nif::atom(opts_env, "policy")};
+      ERL_NIF_TERM budget_values[] = {enif_make_uint64(opts_env, budget), nif::atom(opts_env, policy.c_str())};
+      ERL_NIF_TERM output_budget;
+      enif_make_map_from_arrays(opts_env, budget_keys, budget_values, 2, &output_budget);
+      keys.push_back(nif::atom(opts_env, "output_budget"));
+      values.push_back(output_budget);
+    }
+    if (!filters.empty()) {
+      std::vector<ERL_NIF_TERM> stages;
+      std::stringstream list(filters);
+      std::string stage;
+      while (std::getline(list, stage, ',')) {
+        size_t colon = stage.find(':');
+        if (colon == std::string::npos) {
+          stages.push_back(nif::atom(opts_env, stage.c_str()));
+        } else {
+          stages.push_back(enif_make_tuple2(opts_env, nif::atom(opts_env, stage.substr(0, colon).c_str()),
+                                            enif_make_uint64(opts_env, strtoull(stage.c_str() + colon + 1, nullptr, 10))));
+        }
+      }
+      keys.push_back(nif::atom(opts_env, "filters"));
+      values.push_back(enif_make_list_from_array(opts_env, stages.data(), (unsigned)stages.size()));
+    }
+    ERL_NIF_TERM native_options;
+    enif_make_map_from_arrays(opts_env, keys.data(), values.data(), keys.size(), &native_options);
+
+    uint64_t started = uv_hrtime();
+    bool ok = s.spawn(self_path, {"produce", std::to_string(bytes), std::to_string(chunk), std::to_string(rate),
+                                  cooked ? "1" : "0", progress ? "1" : "0"}, native_options);
+    enif_free_env(opts_env);
+    if (!ok) return;
+    s.wait();
+    double seconds = (double)(sink.last_output - started) / 1e9;
+
+    printf("{\"bench\":\"read\",\"run\":%llu,\"bytes\":%llu,\"chunk\":%llu,\"rate\":%llu,\"framing\":\"%s\","
+           "\"screen\":%s,\"termios\":\"%s\",\"budget\":%llu,\"policy\":\"%s\",\"progress\":%s,\"filters\":\"%s\",\"received\":%llu,\"dropped\":%llu,\"messages\":%llu,\"reads\":%llu,\"seconds\":%.6f,\"mib_per_s\":%.2f",
+           (unsigned long long)run, (unsigned long long)bytes, (unsigned long long)chunk,
+           (unsigned long long)rate, framing.c_str(), screen ? "true" : "false",
+           termios_profile.c_str(), (unsigned long long)budget, budget > 0 ? policy.c_str() : "",
+           progress ? "true" : "false", filters.c_str(),
+           (unsigned long long)sink.bytes.load(), (unsigned long long)sink.dropped.load(),
+           (unsigned long long)sink.messages.load(),
+           (unsigned long long)s.pipesocket->stats.reads.load(), seconds,
+           (double)sink.bytes.load() / seconds / (1 << 20));
+    print_histogram("read_to_send_ns", s.pipesocket->stats.read_to_send);
+    printf("}\n");
+    fflush(stdout);
+  }
+}
+
+static void bench_write(const options &opts) {
+  uint64_t bytes = opts.get("bytes", 64ULL << 20);
+  uint64_t chunk = opts.get("chunk", 65536);
+  uint64_t runs = opts.get("runs", 5);
+
+  for (uint64_t run = 0; run < runs; run++) {
+    sink.reset();
+    session s;
+    if (!s.spawn(self_path, {"consume"})) return;
+    while (sink.bytes == 0) sleep_ns(100000);
+
+    ErlNifEnv *env = enif_alloc_env();
+    ERL_NIF_TERM argv[] = {s.resource, binary(env, std::string(chunk, 'x'))};
+    uint64_t started = uv_hrtime(), written = 0;
+    while (written < bytes) {
+      expty_write(s.env, 2, argv);
+      written += chunk;
+    }
+    double seconds = (double)(uv_hrtime() - started) / 1e9;
+    enif_free_env(env);
+
+    printf("{\"bench\":\"write\",\"run\":%llu,\"bytes\":%llu,\"chunk\":%llu,\"seconds\":%.6f,\"mib_per_s\":%.2f,"
+           "\"eagain\":%llu,\"partial_writes\":%llu",
+           (unsigned long long)run, (unsigned long long)written, (unsigned long long)chunk, seconds,
+           (double)written / seconds / (1 << 20), (unsigned long long)s.pipesocket->stats.eagain.load(),
+           (unsigned long long)s.pipesocket->stats.partial_writes.load());
+    print_histogram("write_ns", s.pipesocket->stats.write_duration);
+    printf("}\n");
+    fflush(stdout);
+
+    kill(s.pid, SIGKILL);
+    s.wait();
+  }
+}
+
+/**
+ * `read` through ExPTY.connect/3: a producer connected to a consumer
+ * session, the output going from master to master in the reader. What
+ * the producer wrote before the link was picked up reaches the sink.
+ */
+static void bench_link(const options &opts) {
+  uint64_t bytes = opts.get("bytes", 64ULL << 20);
+  uint64_t chunk = opts.get("chunk", 4096);
+  uint64_t runs = opts.get("runs", 5);
+
+  for (uint64_t run = 0; run < runs; run++) {
+    sink.reset();
+    session consumer;
+    if (!consumer.spawn(self_path, {"consume"})) return;
+    while (sink.bytes == 0) sleep_ns(100000);
+    sink.reset();
+
+    session producer;
+    uint64_t started = uv_hrtime();
+    if (!producer.spawn(self_path, {"produce", std::to_string(bytes), std::to_string(chunk), "0", "0", "0"})) return;
+    ERL_NIF_TERM argv[] = {producer.resource, consumer.resource, nif::atom(producer.env, "false")};
+    ERL_NIF_TERM ret = expty_connect(producer.env, 3, argv);
+    std::string ok;
+    if (!nif::get_atom(producer.env, ret, ok) || ok != "ok") {
+      fprintf(stderr, "connect failed\n");
+      return;
+    }
+    producer.wait();
+    while (producer.pipesocket->threads.load() > 0) sleep_ns(100000);
+    double seconds = (double)(uv_hrtime() - started) / 1e9;
+    uint64_t forwarded = producer.pipesocket->stats.bytes_forwarded.load();
+
+    printf("{\"bench\":\"link\",\"run\":%llu,\"bytes\":%llu,\"chunk\":%llu,\"forwarded\":%llu,"
+           "\"received\":%llu,\"written\":%llu,\"seconds\":%.6f,\"mib_per_s\":%.2f}\n",
+           (unsigned long long)run, (unsigned long long)bytes, (unsigned long long)chunk,
+           (unsigned long long)forwarded, (unsigned long long)sink.bytes.load(),
+           (unsigned long long)consumer.pipesocket->stats.bytes_written.load(), seconds,
+           (double)forwarded / seconds / (1 << 20));
+    fflush(stdout);
+
+    kill(consumer.pid, SIGKILL);
+    while (consumer.pipesocket->threads.load() > 0) sleep_ns(100000);
+  }
+}
+
+static void bench_spawn(const options &opts) {
+  uint64_t iterations = opts.get("iterations", 200);
+  std::string file = opts.get("file", "/bin/true");
+  pty_histogram spawn_call, spawn_to_exit;
+  uint64_t openpty_ns = 0, spawn_ns = 0, handshake_ns = 0;
+
+  // without the time spent making sure the reader is done
+  uint64_t busy = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    sink.reset();
+    session s;
+    uint64_t t0 = uv_hrtime();
+    if (!s.spawn(file, {})) return;
+    spawn_call.record(uv_hrtime() - t0);
+    s.wait();
+    spawn_to_exit.record(sink.exited_at - t0);
+    busy += sink.exited_at - t0;
+    openpty_ns += s.openpty_ns;
+    spawn_ns += s.spawn_ns;
+    handshake_ns += s.handshake_ns;
+  }
+  double seconds = (double)busy / 1e9;
+
+  printf("{\"bench\":\"spawn\",\"file\":\"%s\",\"iterations\":%llu,\"per_second\":%.1f,"
+         "\"openpty_mean_ns\":%llu,\"posix_spawn_mean_ns\":%llu,\"handshake_mean_ns\":%llu",
+         file.c_str(), (unsigned long long)iterations, (double)iterations / seconds,
+         (unsigned long long)(openpty_ns / iterations), (unsigned long long)(spawn_ns / iterations),
+         (unsigned long long)(handshake_ns / iterations));
+  print_histogram("spawn_ns", spawn_call);
+  print_histogram("spawn_to_exit_ns", spawn_to_exit);
+  // all of them torn down, anything left is a leak
+  printf(",\"live_sessions\":%lld,\"live_threads\":%lld}\n",
+         (long long)live_sessions.load(), (long long)live_threads.load());
+  fflush(stdout);
+}
+
+/**
+ * The nif_utils.h conversions of a spawn: the terms are the shim's,
+ * so this measures the copies and allocations of nif_utils.h itself
+ * rather than the cost of term access in the VM.
+ */
+static void bench_convert(const options &opts) {
+  uint64_t iterations = opts.get("iterations", 100000);
+  ErlNifEnv *env = enif_alloc_env();
+
+  std::vector<std::string> args;
+  for (int i = 0; i < 16; i++) args.push_back("--argument-" + std::to_string(i));
+  ERL_NIF_TERM list = binary_list(env, args);
+
+  std::vector<ERL_NIF_TERM> keys, values;
+  for (int i = 0; i < 32; i++) {
+    keys.push_back(binary(env, "VARIABLE_" + std::to_string(i)));
+    values.push_back(binary(env, "/some/reasonably/long/value/" + std::to_string(i)));
+  }
+  ERL_NIF_TERM envs;
+  enif_make_map_from_arrays(env, keys.data(), values.data(), keys.size(), &envs);
+
+  const char *names[] = {"idle_timeout", "framing", "max_line_length", "screen", "scrollback"};
+  ERL_NIF_TERM opt_keys[5], opt_values[5];
+  for (int i = 0; i < 5; i++) {
+    opt_keys[i] = nif::atom(env, names[i]);
+    opt_values[i] = enif_make_int(env, i);
+  }
+  ERL_NIF_TERM native_options;
+  enif_make_map_from_arrays(env, opt_keys, opt_values, 5, &native_options);
+
+  uint64_t sum = 0;
+  uint64_t t0 = uv_hrtime();
+  for (uint64_t i = 0; i < iterations; i++) {
+    std::vector<std::string> out;
+    nif::get_list(env, list, out);
+    sum += out.size();
+  }
+  uint64_t t1 = uv_hrtime();
+  for (uint64_t i = 0; i < iterations; i++) {
+    std::vector<std::string> out;
+    nif::get_env(env, envs, out);
+    sum += out.size();
+  }
+  uint64_t t2 = uv_hrtime();
+  ErlNifEnv *scratch = enif_alloc_env();
+  for (uint64_t i = 0; i < iterations; i++) {
+    ERL_NIF_TERM opt;
+    int value = 0;
+    for (const char *name : names) {
+      if (nif::get_opt(scratch, native_options, name, &opt) && nif::get(scratch, opt, &value)) sum += value;
+    }
+    enif_clear_env(scratch);
+  }
+  uint64_t t3 = uv_hrtime();
+  enif_free_env(scratch);
+  enif_free_env(env);
+
+  printf("{\"bench\":\"convert\",\"iterations\":%llu,\"get_list_16_ns\":%.1f,\"get_env_32_ns\":%.1f,"
+         "\"get_opt_5_ns\":%.1f,\"checksum\":%llu}\n",
+         (unsigned long long)iterations, (double)(t1 - t0) / iterations, (double)(t2 - t1) / iterations,
+         (double)(t3 - t2) / iterations, (unsigned long long)sum);
+  fflush(stdout);
+}
+
+static int usage(const char *name) {
+  fprintf(stderr,
+          "usage: %s read|write|link|spawn|convert|all [--option value]...\n"
+          "  read     --bytes N --chunk N --rate BYTES_PER_S --runs N --cooked 0|1 --framing raw|line --screen 0|1\n"
+          "           --termios cooked|raw|cbreak --budget BYTES_PER_S --policy throttle|drop|tail\n"
+          "           --progress 0|1 --filters collapse_progress:MS,strip_ansi,utf8\n"
+          "  write    --bytes N --chunk N --runs N\n"
+          "  link     --bytes N --chunk N --runs N\n"
+          "  spawn    --iterations N --file PATH\n"
+          "  convert  --iterations N\n"
+          "  --helper PATH  the spawn-helper to use, defaults to %s\n",
+          name, EXPTY_SPAWN_HELPER);
+  return 2;
+}
+
+}  // namespace microbench
+
+int main(int argc, char **argv) {
+  using namespace microbench;
+  if (argc < 2) return usage(argv[0]);
+  std::string command = argv[1];
+
+  if (command == "produce" && argc == 7) {
+    return produce(strtoull(argv[2], nullptr, 10), strtoull(argv[3], nullptr, 10), strtoull(argv[4], nullptr, 10),
+                   argv[5][0] == '1', argv[6][0] == '1');
+  }
+  if (command == "consume") {
+    return consume();
+  }
+
+  char resolved[PATH_MAX];
+  if (!realpath(argv[0], resolved)) {
+    perror("realpath");
+    return 1;
+  }
+  self_path = resolved;
+
+  options opts(argc - 2, argv + 2);
+  helper_path = opts.get("helper", helper_path.c_str());
+
+  ErlNifEnv *env = enif_alloc_env();
+  if (shim_nif_init()->load(env, nullptr, 0) != 0) {
+    fprintf(stderr, "on_load failed\n");
+    return 1;
+  }
+  shim_set_send_hook(on_send);
+
+  if (command == "read" || command == "all") bench_read(opts);
+  if (command == "write" || command == "all") bench_write(opts);
+  if (command == "link" || command == "all") bench_link(opts);
+  if (command == "spawn" || command == "all") bench_spawn(opts);
+  if (command == "convert" || command == "all") bench_convert(opts);
+  if (command != "read" && command != "write" && command != "link" && command != "spawn" && command != "convert" && command != "all") {
+    return usage(argv[0]);
+  }
+  return 0;
+}
@@ -0,0 +1,221 @@
+#pragma once
+
+#include <stdint.h>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "filters.h"
+
+/**
+ * Output filter pipelines
+ * The stages a session's output goes through between the reader and
+ * the framer, chosen at spawn with the `filters` option. A session
+ * without filters has no chain and pays nothing.
+ *
+ * A stage (see filters.h) rewrites a chunk in place, as a pointer into
+ * the read buffer when it passes a prefix through and into a buffer of
+ * its own otherwise, and may hold bytes back until its deadline or EOF:
+ *
+ *     bool apply(pty_chunk &chunk, uint64_t now);   // false: nothing goes on
+ *     bool flush(pty_chunk &chunk, uint64_t now, bool eof);
+ *     uint64_t deadline() const;                    // 0: nothing held
+ *
+ * The combinations in the documented order (collapse_progress,
+ * strip_ansi, utf8) are chains of concrete stages with every call
+ * inlined; anything else is a chain of boxed stages with one virtual
+ * call per stage and chunk. Either way the session makes a single
+ * virtual call per chunk.
+ */
+
+typedef void (*pty_chunk_sink)(void *, const pty_chunk &);
+
+struct pty_filter_chain {
+  virtual ~pty_filter_chain() {}
+  // false when nothing of `chunk` goes on for now
+  virtual bool apply(pty_chunk &chunk, uint64_t now) = 0;
+  // hands what the stages hold, once due or on EOF, to `sink`
+  virtual void flush(uint64_t now, bool eof, pty_chunk_sink sink, void *ctx) = 0;
+  // the earliest deadline of the stages, 0 if none holds anything
+  virtual uint64_t deadline() const = 0;
+};
+
+static inline void
+pty_earliest(uint64_t &deadline, uint64_t candidate) {
+  if (candidate > 0 && (deadline == 0 || candidate < deadline)) deadline = candidate;
+}
+
+template <class... Stages>
+struct pty_fused_chain final : pty_filter_chain {
+  static const size_t size = sizeof...(Stages);
+  std::tuple<Stages...> stages;
+
+  explicit pty_fused_chain(const std::vector<pty_filter_spec> &specs)
+    : pty_fused_chain(specs, std::index_sequence_for<Stages...>()) {}
+
+  bool apply(pty_chunk &chunk, uint64_t now) override {
+    return apply_from<0>(chunk, now);
+  }
+
+  void flush(uint64_t now, bool eof, pty_chunk_sink sink, void *ctx) override {
+    flush_from<0>(now, eof, sink, ctx);
+  }
+
+  uint64_t deadline() const override {
+    uint64_t deadline = 0;
+    deadline_from<0>(deadline);
+    return deadline;
+  }
+
+ private:
+  template <size_t... I>
+  pty_fused_chain(const std::vector<pty_filter_spec> &specs, std::index_sequence<I...>)
+    : stages(Stages(specs[I])...) {}
+
+  template <size_t I>
+  typename std::enable_if<(I < size), bool>::type
+  apply_from(pty_chunk &chunk, uint64_t now) {
+    return std::get<I>(stages).apply(chunk, now) && apply_from<I + 1>(chunk, now);
+  }
+
+  template <size_t I>
+  typename std::enable_if<(I == size), bool>::type
+  apply_from(pty_chunk &, uint64_t) {
+    return true;
+  }
+
+  // what a stage flushes goes through the stages after it
+  template <size_t I>
+  typename std::enable_if<(I < size)>::type
+  flush_from(uint64_t now, bool eof, pty_chunk_sink sink, void *ctx) {
+    pty_chunk chunk;
+    if (std::get<I>(stages).flush(chunk, now, eof) && apply_from<I + 1>(chunk, now)) {
+      sink(ctx, chunk);
+    }
+    flush_from<I + 1>(now, eof, sink, ctx);
+  }
+
+  template <size_t I>
+  typename std::enable_if<(I == size)>::type
+  flush_from(uint64_t, bool, pty_chunk_sink, void *) {}
+
+  template <size_t I>
+  typename std::enable_if<(I < size)>::type
+  deadline_from(uint64_t &deadline) const {
+    pty_earliest(deadline, std::get<I>(stages).deadline());
+    deadline_from<I + 1>(deadline);
+  }
+
+  template <size_t I>
+  typename std::enable_if<(I == size)>::type
+  deadline_from(uint64_t &) const {}
+};
+
+struct pty_boxed_stage {
+  virtual ~pty_boxed_stage() {}
+  virtual bool apply(pty_chunk &chunk, uint64_t now) = 0;
+  virtual bool flush(pty_chunk &chunk, uint64_t now, bool eof) = 0;
+  virtual uint64_t deadline() const = 0;
+};
+
+template <class Stage>
+struct pty_boxed final : pty_boxed_stage {
+  Stage stage;
+  explicit pty_boxed(const pty_filter_spec &spec) : stage(spec) {}
+  bool apply(pty_chunk &chunk, uint64_t now) override { return stage.apply(chunk, now); }
+  bool flush(pty_chunk &chunk, uint64_t now, bool eof) override { return stage.flush(chunk, now, eof); }
+  uint64_t deadline() const override { return stage.deadline(); }
+};
+
+// any order and repetition of stages
+struct pty_generic_chain final : pty_filter_chain {
+  std::vector<std::unique_ptr<pty_boxed_stage>> stages;
+
+  bool apply(pty_chunk &chunk, uint64_t now) override {
+    return apply_from(0, chunk, now);
+  }
+
+  void flush(uint64_t now, bool eof, pty_chunk_sink sink, void *ctx) override {
+    for (size_t i = 0; i < stages.size(); i++) {
+      pty_chunk chunk;
+      if (stages[i]->flush(chunk, now, eof) && apply_from(i + 1, chunk, now)) {
+        sink(ctx, chunk);
+      }
+    }
+  }
+
+  uint64_t deadline() const override {
+    uint64_t deadline = 0;
+    for (const auto &stage : stages) pty_earliest(deadline, stage->deadline());
+    return deadline;
+  }
+
+ private:
+  bool apply_from(size_t i, pty_chunk &chunk, uint64_t now) {
+    for (; i < stages.size(); i++) {
+      if (!stages[i]->apply(chunk, now)) return false;
+    }
+    return true;
+  }
+};
+
+template <pty_filter_kind... Kinds>
+static inline bool
+pty_filters_are(const std::vector<pty_filter_spec> &specs) {
+  const pty_filter_kind kinds[] = {Kinds...};
+  if (specs.size() != sizeof...(Kinds)) return false;
+  for (size_t i = 0; i < specs.size(); i++) {
+    if (specs[i].kind != kinds[i]) return false;
+  }
+  return true;
+}
+
+/**
+ * The chain for `specs`, null without filters. Collapsing goes before
+ * stripping, which would take the erase-line sequences away, and UTF-8
+ * alignment last, so that what is sent never ends mid-character.
+ */
+static inline std::unique_ptr<pty_filter_chain>
+pty_make_filter_chain(const std::vector<pty_filter_spec> &specs) {
+  typedef pty_collapse_stage C;
+  typedef pty_strip_ansi_stage S;
+  typedef pty_utf8_stage U;
+  std::unique_ptr<pty_filter_chain> chain;
+
+  if (specs.empty()) {
+    return chain;
+  } else if (pty_filters_are<PTY_FILTER_COLLAPSE>(specs)) {
+    chain.reset(new pty_fused_chain<C>(specs));
+  } else if (pty_filters_are<PTY_FILTER_STRIP_ANSI>(specs)) {
+    chain.reset(new pty_fused_chain<S>(specs));
+  } else if (pty_filters_are<PTY_FILTER_UTF8>(specs)) {
+    chain.reset(new pty_fused_chain<U>(specs));
+  } else if (pty_filters_are<PTY_FILTER_COLLAPSE, PTY_FILTER_UTF8>(specs)) {
+    chain.reset(new pty_fused_chain<C, U>(specs));
+  } else if (pty_filters_are<PTY_FILTER_STRIP_ANSI, PTY_FILTER_UTF8>(specs)) {
+    chain.reset(new pty_fused_chain<S, U>(specs));
+  } else if (pty_filters_are<PTY_FILTER_COLLAPSE, PTY_FILTER_STRIP_ANSI>(specs)) {
+    chain.reset(new pty_fused_chain<C, S>(specs));
+  } else if (pty_filters_are<PTY_FILTER_COLLAPSE, PTY_FILTER_STRIP_ANSI, PTY_FILTER_UTF8>(specs)) {
+    chain.reset(new pty_fused_chain<C, S, U>(specs));
+  } else {
+    pty_generic_chain *generic = new pty_generic_chain();
+    chain.reset(generic);
+    for (const auto &spec : specs) {
+      switch (spec.kind) {
+        case PTY_FILTER_COLLAPSE:
+          generic->stages.emplace_back(new pty_boxed<C>(spec));
+          break;
+        case PTY_FILTER_STRIP_ANSI:
+          generic->stages.emplace_back(new pty_boxed<S>(spec));
+          break;
+        case PTY_FILTER_UTF8:
+          generic->stages.emplace_back(new pty_boxed<U>(spec));
+          break;
+      }
+    }
+  }
+  return chain;
+}
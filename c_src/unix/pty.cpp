@@ -14,13 +14,32 @@
 #include <sys/ioctl.h>
 #include <sys/wait.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <signal.h>
 #include <spawn.h>
 
+#include <atomic>
+#include <memory>
+#include <new>
+
 #include <uv.h>
 
 #include <erl_nif.h>
 #include "nif_utils.h"
+#include "expect.h"
+#include "framing.h"
+#include "screen.h"
+#include "snapshot.h"
+#include "recorder.h"
+#include "recording.h"
+#include "replay.h"
+#include "stats.h"
+#include "tee.h"
+#include "link.h"
+#include "budget.h"
+#include "pipeline.h"
+#include "termios_profile.h"
 
 /* forkpty */
 /* http://www.gnu.org/software/gnulib/manual/html_node/forkpty.html */
@@ -86,11 +105,12 @@
 struct pty_baton {
   ErlNifEnv *env;
   ErlNifPid * process;
-  bool fd_closed;
+  std::atomic<bool> fd_closed;
+  // reaped, the pid may already belong to someone else
+  std::atomic<bool> exited;
   int exit_code;
   int signal_code;
   pid_t pid;
-  uv_async_t async;
   uv_thread_t tid;
 };
 
@@ -102,40 +122,155 @@ typedef struct pty_pipesocket_ {
   ErlNifEnv * env;
   ErlNifPid * process;
 
-  uv_async_t async;
+  // the reader and waitpid threads still running, they share the
+  // reference from enif_alloc_resource and the last one releases it
+  std::atomic<int> threads;
+
   uv_thread_t tid;
   uv_mutex_t mutex;
   uv_pipe_t handle_;
 
+  // wakes up the reader thread when its settings change,
+  // guarded by reader_mutex
+  int wakeup[2];
+  uv_mutex_t reader_mutex;
+
+  // idle detection, in nanoseconds (uv_hrtime)
+  std::atomic<uint64_t> idle_timeout;
+  uint64_t last_output;
+  bool idle;
+
+  // guarded by reader_mutex
+  pty_expect expect;
+
+  // framing: :line, guarded by reader_mutex
+  bool line_framing;
+  pty_line_framer framer;
+
+  // filters: [...], null without, guarded by reader_mutex
+  std::unique_ptr<pty_filter_chain> filters;
+
+  // timestamps: true, the erlang:monotonic_time(:nanosecond) of the
+  // last read and the reads the carried bytes came from, guarded by
+  // reader_mutex
+  bool timestamps;
+  ErlNifTime read_time;
+  ErlNifTime partial_since;
+  ErlNifTime partial_until;
+  ErlNifTime pending_since;
+
+  // headless terminal emulator, null unless screen: true,
+  // guarded by reader_mutex
+  std::unique_ptr<pty_screen> screen;
+  // {:frame, n} notifications at most every frame_interval ns,
+  // 0 when disabled; the rest is reader-only
+  uint64_t frame_interval;
+  uint64_t last_frame;
+  uint64_t notified_frame;
+  bool frame_dirty;
+
+  // record: path, null when not recording
+  std::unique_ptr<pty_recorder> recorder;
+  bool record_input;
+
+  // packet_mode: true, TIOCPKT on the master
+  bool packet_mode;
+
+  pty_stats stats;
+  pty_echo_probe echo_probe;
+
+  // output_budget: [...], see budget.h
+  pty_output_budget budget;
+  pty_rate_meter output_rate;
+
+  // ExPTY.tee/2 targets, see tee.h
+  pty_tee tee;
+
+  // ExPTY.connect/3, see link.h: the reader's link, null when not
+  // connected
+  std::unique_ptr<pty_link> link;
+  // the link for the reader to take when `relink` is set, null for
+  // disconnect/1, whether the session is connected, and the session
+  // linked back to this one (kept) when bidirectional, guarded by
+  // reader_mutex
+  std::unique_ptr<pty_link> next_link;
+  std::atomic<bool> relink{false};
+  bool connected = false;
+  struct pty_pipesocket_ *linked_back = nullptr;
+
   static ErlNifResourceType * type;
+  void wake();
   size_t write(void * data, size_t len);
+  ssize_t try_write(const void * data, size_t len);
 } pty_pipesocket;
 ErlNifResourceType * pty_pipesocket::type = NULL;
+ErlNifResourceType * pty_recording::type = NULL;
+ErlNifResourceType * pty_replay::type = NULL;
 
 static int pty_nonblock(int fd);
 static int pty_openpty(int *, int *, char *,
   const struct termios *,
   const struct winsize *);
 static void pty_waitpid(void *);
-static void pty_after_waitpid(uv_async_t *);
-static void pty_after_close(uv_handle_t *);
+static void pty_release_thread(pty_pipesocket *);
 
 static void pty_pipesocket_fn(void *data);
-static void pty_after_pipesocket(uv_async_t *);
-static void pty_after_close_pipesocket(uv_handle_t *);
+static void pty_send_data(pty_pipesocket *, const char *, size_t, ErlNifTime);
+static void pty_send_output(pty_pipesocket *, const char *, size_t, ErlNifTime);
+static void pty_link_close(pty_pipesocket *, const char *);
+static void pty_send_filtered(pty_pipesocket *, bool);
+static bool pty_filters_parse(ErlNifEnv *, ERL_NIF_TERM, std::vector<pty_filter_spec> &);
+static void pty_send_lines(pty_pipesocket *, const char *, size_t, bool);
+static void pty_send_match(pty_pipesocket *, int32_t, bool);
+static void pty_send_frame(pty_pipesocket *, uint64_t);
+static void pty_packet_status(pty_pipesocket *, unsigned char);
+static bool pty_budget_admit(pty_pipesocket *, const char *, size_t, uint64_t);
+static bool pty_budget_throttled(pty_pipesocket *, uint64_t);
+static void pty_budget_flush(pty_pipesocket *, uint64_t, bool);
+static bool pty_budget_parse(ErlNifEnv *, ERL_NIF_TERM, uint64_t &, uint64_t &, pty_budget_policy &, std::string &);
+static int pty_reader_timeout(pty_pipesocket *, uint64_t);
 
 static ERL_NIF_TERM throw_for_errno(ErlNifEnv *env, const char* message, int _errno);
+static bool pty_termios_update(ErlNifEnv *env, ERL_NIF_TERM spec, struct termios &t, std::string &error);
+
+static int pty_getproc(pid_t pgid, std::string &name, std::string &cwd);
 
+// guarded by processes_mutex
+static uv_mutex_t processes_mutex;
 static std::map<pid_t, pty_pipesocket *> processes;
 
+// sessions not yet destructed and their threads still running
+static std::atomic<int64_t> live_sessions(0);
+static std::atomic<int64_t> live_threads(0);
+
+/**
+ * Foreground process cache
+ * Tab titles poll the foreground process of every session, so the
+ * /proc (or sysctl) lookups are cached per pgid for a short TTL.
+ */
+
+struct pty_proc_entry {
+  std::string name;
+  std::string cwd;
+  uint64_t fetched_at;
+};
+
+static uv_mutex_t proc_cache_mutex;
+static std::map<pid_t, pty_proc_entry> proc_cache;
+static uint64_t proc_cache_ttl_ms = 1000;
+
+static pty_replay_scheduler replay_scheduler;
+
 static void __attribute__((destructor)) cleanup() {
+  uv_mutex_lock(&processes_mutex);
   for (auto p : processes) {
     kill(p.first, SIGTERM);
   }
+  uv_mutex_unlock(&processes_mutex);
 }
 
 static ERL_NIF_TERM expty_spawn(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-  // file, args, env, cwd, cols, rows, baudrate, uid, gid, is_utf8, closeFDs, helper_path
+  // file, args, env, cwd, cols, rows, baudrate, uid, gid, is_utf8, closeFDs, helper_path, opts
   ERL_NIF_TERM erl_ret = nif::error(env, "error");
   std::string file;
   std::vector<std::string> args;
@@ -146,7 +281,27 @@ static ERL_NIF_TERM expty_spawn(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
   int uid, gid;
   bool is_utf8, closeFDs;
   bool echo = false;
+  // phases of the spawn, in ns, reported to telemetry
+  uint64_t phase = 0, openpty_ns = 0, spawn_ns = 0, handshake_ns = 0;
   std::string helper_path;
+  int idle_timeout = 0;
+  std::string framing = "raw";
+  int max_line_length = 65536;
+  bool normalize_crlf = false;
+  bool timestamps = false;
+  bool screen = false;
+  int scrollback = 1000;
+  int frame_rate = 0;
+  int echo_probe = 0;
+  std::string record_path;
+  std::string record_format = "asciicast";
+  bool record_input = false;
+  bool packet_mode = false;
+  std::vector<pty_filter_spec> filter_specs;
+  uint64_t budget_rate = 0, budget_burst = 0;
+  pty_budget_policy budget_policy = PTY_BUDGET_THROTTLE;
+  ERL_NIF_TERM termios_spec = 0;
+  ERL_NIF_TERM opt;
   if (nif::get(env, argv[0], file) &&
       nif::get_list(env, argv[1], args) &&
       nif::get_env(env, argv[2], envs) &&
@@ -160,10 +315,94 @@ static ERL_NIF_TERM expty_spawn(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
       nif::get(env, argv[10], &is_utf8) &&
       nif::get(env, argv[11], &closeFDs) &&
       nif::get(env, argv[12], &echo) &&
-      nif::get(env, argv[13], helper_path)) {
+      nif::get(env, argv[13], helper_path) &&
+      enif_is_map(env, argv[14])) {
+
+    if (nif::get_opt(env, argv[14], "idle_timeout", &opt) &&
+        !(nif::get(env, opt, &idle_timeout) && idle_timeout >= 0)) {
+      return nif::error(env, "idle_timeout should be a non-negative integer");
+    }
+    if (nif::get_opt(env, argv[14], "framing", &opt) &&
+        !(nif::get_atom(env, opt, framing) && (framing == "raw" || framing == "line"))) {
+      return nif::error(env, "framing should be either :raw or :line");
+    }
+    if (nif::get_opt(env, argv[14], "max_line_length", &opt) &&
+        !(nif::get(env, opt, &max_line_length) && max_line_length > 0)) {
+      return nif::error(env, "max_line_length should be a positive integer");
+    }
+    if (nif::get_opt(env, argv[14], "normalize_crlf", &opt) &&
+        !nif::get(env, opt, &normalize_crlf)) {
+      return nif::error(env, "normalize_crlf should be a boolean");
+    }
+    if (nif::get_opt(env, argv[14], "filters", &opt) &&
+        !pty_filters_parse(env, opt, filter_specs)) {
+      return nif::error(env, "filters should be a list of :strip_ansi, :utf8 and {:collapse_progress, ms}");
+    }
+    if (nif::get_opt(env, argv[14], "timestamps", &opt) &&
+        !nif::get(env, opt, &timestamps)) {
+      return nif::error(env, "timestamps should be a boolean");
+    }
+    if (nif::get_opt(env, argv[14], "screen", &opt) &&
+        !nif::get(env, opt, &screen)) {
+      return nif::error(env, "screen should be a boolean");
+    }
+    if (cols > PTY_SCREEN_MAX_SIZE || rows > PTY_SCREEN_MAX_SIZE) {
+      return nif::error(env, "cols and rows should be at most 65535");
+    }
+    if (screen && (int64_t)cols * rows > PTY_SCREEN_MAX_CELLS) {
+      return nif::error(env, "screen: true supports at most 16777216 cells (cols * rows)");
+    }
+    if (nif::get_opt(env, argv[14], "scrollback", &opt) &&
+        !(nif::get(env, opt, &scrollback) && scrollback >= 0)) {
+      return nif::error(env, "scrollback should be a non-negative integer");
+    }
+    if (nif::get_opt(env, argv[14], "frame_rate", &opt) &&
+        !(nif::get(env, opt, &frame_rate) && frame_rate >= 0 && (frame_rate == 0 || screen))) {
+      return nif::error(env, "frame_rate should be a non-negative integer and requires screen: true");
+    }
+    if (nif::get_opt(env, argv[14], "echo_probe", &opt) &&
+        !(nif::get(env, opt, &echo_probe) && echo_probe >= 0)) {
+      return nif::error(env, "echo_probe should be a non-negative integer");
+    }
+    if (nif::get_opt(env, argv[14], "record", &opt) &&
+        !(nif::get(env, opt, record_path) && !record_path.empty())) {
+      return nif::error(env, "record should be a path");
+    }
+    if (nif::get_opt(env, argv[14], "record_format", &opt) &&
+        !(nif::get_atom(env, opt, record_format) && (record_format == "asciicast" || record_format == "indexed"))) {
+      return nif::error(env, "record_format should be either :asciicast or :indexed");
+    }
+    if (nif::get_opt(env, argv[14], "record_input", &opt) &&
+        !nif::get(env, opt, &record_input)) {
+      return nif::error(env, "record_input should be a boolean");
+    }
+    if (nif::get_opt(env, argv[14], "packet_mode", &opt) &&
+        !nif::get(env, opt, &packet_mode)) {
+      return nif::error(env, "packet_mode should be a boolean");
+    }
+    if (nif::get_opt(env, argv[14], "output_budget", &opt)) {
+      std::string budget_error;
+      if (!pty_budget_parse(env, opt, budget_rate, budget_burst, budget_policy, budget_error)) {
+        return nif::error(env, budget_error.c_str());
+      }
+    }
+    if (nif::get_opt(env, argv[14], "termios", &opt)) {
+      // checked here, applied once the defaults are in place
+      struct termios scratch = termios();
+      std::string termios_error = "termios should be a map";
+      if (!enif_is_map(env, opt) || !pty_termios_update(env, opt, scratch, termios_error)) {
+        return nif::error(env, termios_error.c_str());
+      }
+      termios_spec = opt;
+    }
 
     pty_pipesocket * pipesocket = NULL;
     ErlNifPid* process = NULL;
+    // everything below is undone at done: unless the session started
+    int master = -1, slave = -1;
+    int comms_pipe[2] = {-1, -1};
+    pid_t pid = -1;
+    bool started = false;
     int ret = 0;
     int flags = POSIX_SPAWN_USEVFORK;
 
@@ -223,6 +462,16 @@ static ERL_NIF_TERM expty_spawn(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
     term->c_cc[VSTATUS] = 20;
 #endif
 
+    if (termios_spec) {
+      std::string termios_error;
+      pty_termios_update(env, termios_spec, *term, termios_error);
+    }
+
+    posix_spawn_file_actions_t acts;
+    posix_spawn_file_actions_init(&acts);
+    posix_spawnattr_t attrs;
+    posix_spawnattr_init(&attrs);
+
     // closeFDs
     bool explicitlyCloseFDs = closeFDs && !HAVE_POSIX_SPAWN_CLOEXEC_DEFAULT;
 
@@ -263,29 +512,29 @@ static ERL_NIF_TERM expty_spawn(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
     sigfillset(&newmask);
     pthread_sigmask(SIG_SETMASK, &newmask, &oldmask);
 
-    int master, slave;
+    phase = uv_hrtime();
     ret = pty_openpty(&master, &slave, nullptr, term, &winp);
+    openpty_ns = uv_hrtime() - phase;
     if (ret == -1) {
+      master = slave = -1;
+      pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
       erl_ret = nif::error(env, "openpty() failed.");
       goto done;
     }
 
-    int comms_pipe[2];
     if (pipe(comms_pipe)) {
+      comms_pipe[0] = comms_pipe[1] = -1;
+      pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
       erl_ret = nif::error(env, "pipe() failed.");
       goto done;
     }
 
-    posix_spawn_file_actions_t acts;
-    posix_spawn_file_actions_init(&acts);
     posix_spawn_file_actions_adddup2(&acts, slave, STDIN_FILENO);
     posix_spawn_file_actions_adddup2(&acts, slave, STDOUT_FILENO);
     posix_spawn_file_actions_adddup2(&acts, slave, STDERR_FILENO);
     posix_spawn_file_actions_adddup2(&acts, comms_pipe[1], COMM_PIPE_FD);
     posix_spawn_file_actions_addclose(&acts, comms_pipe[1]);
 
-    posix_spawnattr_t attrs;
-    posix_spawnattr_init(&attrs);
     if (closeFDs) {
       flags |= POSIX_SPAWN_CLOEXEC_DEFAULT;
     }
@@ -293,34 +542,56 @@ static ERL_NIF_TERM expty_spawn(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
 
     pipesocket = (pty_pipesocket *)enif_alloc_resource(pty_pipesocket::type, sizeof(pty_pipesocket));
     if (pipesocket == NULL) {
+      pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
       erl_ret = nif::error(env, "Could not allocate memory for pipesocket resource.");
       goto done;
     }
+    new (pipesocket) pty_pipesocket();
+    // the destructor runs for a failed spawn as well
+    live_sessions++;
+    pipesocket->fd = -1;
+    pipesocket->wakeup[0] = pipesocket->wakeup[1] = -1;
+    uv_mutex_init(&pipesocket->mutex);
+    uv_mutex_init(&pipesocket->reader_mutex);
 
     process = (ErlNifPid *)enif_alloc(sizeof(ErlNifPid));
     if (process == NULL) {
+      pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
       erl_ret = nif::error(env, "cannot allocate memory for ErlNifPid.");
       goto done;
     }
     process = enif_self(env, process);
+    pipesocket->process = process;
 
-    pid_t pid;
     { // suppresses "jump bypasses variable initialization" errors
+      phase = uv_hrtime();
       auto error = posix_spawn(&pid, argv[0], &acts, &attrs, argv, envs_c);
+      spawn_ns = uv_hrtime() - phase;
 
       close(comms_pipe[1]);
+      comms_pipe[1] = -1;
 
       // reenable signals
       pthread_sigmask(SIG_SETMASK, &oldmask, NULL);
 
       if (error) {
+        pid = -1;
         erl_ret = throw_for_errno(env, "posix_spawn failed: ", error);
         goto done;
       }
 
+      // only the child holds the slave side from now on, so that the
+      // reader sees EIO once it and its descendants have closed it
+      close(slave);
+      slave = -1;
+
+      // the helper reports an error, or the pipe is closed on exec
+      phase = uv_hrtime();
       int helper_error[2];
       auto bytes_read = read(comms_pipe[0], &helper_error, sizeof(helper_error));
       close(comms_pipe[0]);
+      comms_pipe[0] = -1;
+      handshake_ns = uv_hrtime() - phase;
 
       if (bytes_read == sizeof(helper_error)) {
         if (helper_error[0] == COMM_ERR_EXEC) {
@@ -341,46 +612,153 @@ static ERL_NIF_TERM expty_spawn(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
       if (success) {
         pipesocket->fd = master;
         pipesocket->env = env;
-        pipesocket->process = process;
 
         ERL_NIF_TERM pipe_socket = enif_make_resource(env, (void *)pipesocket);
-        erl_ret = enif_make_tuple3(env,
+        ERL_NIF_TERM timing_keys[] = {
+          nif::atom(env, "openpty"),
+          nif::atom(env, "posix_spawn"),
+          nif::atom(env, "handshake"),
+        };
+        ERL_NIF_TERM timing_values[] = {
+          enif_make_uint64(env, openpty_ns),
+          enif_make_uint64(env, spawn_ns),
+          enif_make_uint64(env, handshake_ns),
+        };
+        ERL_NIF_TERM timings;
+        enif_make_map_from_arrays(env, timing_keys, timing_values, 3, &timings);
+        erl_ret = enif_make_tuple4(env,
           pipe_socket,
           enif_make_int(env, pid),
-          ptsname_
+          ptsname_,
+          timings
         );
       } else {
         erl_ret = nif::error(env, "Could not allocate memory for ptsname.");
-        kill(pid, SIGKILL);
         goto done;
       }
 
       if (pty_nonblock(master) == -1) {
         erl_ret = nif::error(env, "Could not set master fd to nonblocking.");
-        kill(pid, SIGKILL);
         goto done;
       }
 
+      if (packet_mode) {
+        int on = 1;
+        if (ioctl(master, TIOCPKT, &on) == -1) {
+          erl_ret = throw_for_errno(env, "ioctl(TIOCPKT) failed: ", errno);
+          goto done;
+        }
+      }
+
       pty_baton *baton = new pty_baton();
       baton->exit_code = 0;
       baton->signal_code = 0;
       baton->env = env;
       baton->process = process;
       baton->pid = pid;
-      baton->async.data = baton;
       baton->fd_closed = false;
-
+      baton->exited = false;
       pipesocket->baton = baton;
-      pipesocket->async.data = pipesocket;
-      uv_mutex_init(&pipesocket->mutex);
-      uv_async_init(uv_default_loop(), &pipesocket->async, pty_after_pipesocket);
 
-      uv_async_init(uv_default_loop(), &baton->async, pty_after_waitpid);
-      uv_thread_create(&baton->tid, pty_waitpid, static_cast<void*>(baton));
-      uv_thread_create(&pipesocket->tid, pty_pipesocket_fn, static_cast<void*>(pipesocket));
+      if (pipe(pipesocket->wakeup) == -1) {
+        pipesocket->wakeup[0] = pipesocket->wakeup[1] = -1;
+        erl_ret = throw_for_errno(env, "pipe() failed: ", errno);
+        goto done;
+      }
+      pty_nonblock(pipesocket->wakeup[0]);
+      pty_nonblock(pipesocket->wakeup[1]);
+      fcntl(pipesocket->wakeup[0], F_SETFD, FD_CLOEXEC);
+      fcntl(pipesocket->wakeup[1], F_SETFD, FD_CLOEXEC);
+
+      pipesocket->idle_timeout = (uint64_t)idle_timeout * 1000000;
+      pipesocket->last_output = uv_hrtime();
+      pipesocket->idle = false;
+      pipesocket->line_framing = (framing == "line");
+      pipesocket->framer.max_line = (size_t)max_line_length;
+      pipesocket->framer.normalize_crlf = normalize_crlf;
+      // the counters are the session's, now that there is one
+      for (auto &spec : filter_specs) {
+        if (spec.kind == PTY_FILTER_COLLAPSE) spec.counter = &pipesocket->stats.bytes_collapsed;
+      }
+      pipesocket->filters = pty_make_filter_chain(filter_specs);
+      pipesocket->timestamps = timestamps;
+      pipesocket->read_time = 0;
+      pipesocket->partial_since = 0;
+      pipesocket->partial_until = 0;
+      pipesocket->pending_since = 0;
+      if (screen) {
+        pipesocket->screen.reset(new pty_screen(cols, rows));
+        pipesocket->screen->max_scrollback = (size_t)scrollback;
+      }
+      pipesocket->frame_interval = frame_rate > 0 ? 1000000000ULL / (uint64_t)frame_rate : 0;
+      pipesocket->last_frame = 0;
+      pipesocket->notified_frame = 0;
+      pipesocket->frame_dirty = false;
+      pipesocket->echo_probe.every = (uint32_t)echo_probe;
+      pipesocket->packet_mode = packet_mode;
+      pipesocket->budget.cols = (uint32_t)cols;
+      pipesocket->budget.rows = (uint32_t)rows;
+      if (budget_rate > 0) {
+        pipesocket->budget.set(budget_rate, budget_burst, budget_policy);
+      }
+
+      pipesocket->record_input = record_input;
+      if (!record_path.empty()) {
+        std::string command = file;
+        for (auto &arg : args) {
+          command += " ";
+          command += arg;
+        }
+        std::string term_name;
+        for (auto &e : envs) {
+          if (e.compare(0, 5, "TERM=") == 0) term_name = e.substr(5);
+        }
+
+        if (record_format == "indexed") {
+          pipesocket->recorder.reset(new pty_indexed_recorder(cols, rows));
+        } else {
+          pipesocket->recorder.reset(new pty_asciicast(cols, rows, command, term_name));
+        }
+        int err = pipesocket->recorder->open(record_path.c_str(), *process);
+        if (err != 0) {
+          erl_ret = throw_for_errno(env, "cannot open the recording: ", err);
+          goto done;
+        }
+      }
+
+      uv_mutex_lock(&processes_mutex);
       processes[pid] = pipesocket;
+      uv_mutex_unlock(&processes_mutex);
+
+      // nobody joins them, the last one to finish releases the resource
+      pipesocket->threads = 2;
+      live_threads += 2;
+      uv_thread_create(&baton->tid, pty_waitpid, static_cast<void*>(pipesocket));
+      pthread_detach(baton->tid);
+      uv_thread_create(&pipesocket->tid, pty_pipesocket_fn, static_cast<void*>(pipesocket));
+      pthread_detach(pipesocket->tid);
+      started = true;
     }
 done:
+    if (!started) {
+      if (pid > 0) {
+        // never leave a zombie behind
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+      }
+      if (master != -1) close(master);
+      if (slave != -1) close(slave);
+      if (comms_pipe[0] != -1) close(comms_pipe[0]);
+      if (comms_pipe[1] != -1) close(comms_pipe[1]);
+      if (pipesocket) {
+        if (pipesocket->wakeup[0] != -1) close(pipesocket->wakeup[0]);
+        if (pipesocket->wakeup[1] != -1) close(pipesocket->wakeup[1]);
+        // frees process along with the rest
+        enif_release_resource((void *)pipesocket);
+      } else if (process) {
+        enif_free(process);
+      }
+    }
     posix_spawn_file_actions_destroy(&acts);
     posix_spawnattr_destroy(&attrs);
 
@@ -411,6 +789,10 @@ static ERL_NIF_TERM expty_write(ErlNifEnv *env, int argc, const ERL_NIF_TERM arg
       return nif::error(env, "ExPTY.write/2 expects the second argument to be binary or iovec(s)");
     }
 
+    if (nbytes > 0 && pipesocket->recorder && pipesocket->record_input) {
+      pipesocket->recorder->record('i', erl_bin.data, nbytes, uv_hrtime());
+    }
+
     if (nbytes == erl_bin.size) {
       erl_ret = nif::atom(env, "ok");
     } else {
@@ -428,8 +810,9 @@ static ERL_NIF_TERM expty_kill(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv
   int signal = 0;
   if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
       nif::get(env, argv[1], &signal) && signal > 0) {
-    kill(pipesocket->baton->pid, signal);
-    processes.erase(pipesocket->baton->pid);
+    if (!pipesocket->baton->exited) {
+      kill(pipesocket->baton->pid, signal);
+    }
     erl_ret = nif::atom(env, "ok");
   } else {
     erl_ret = nif::error(env, "Cannot get pipesocket resource");
@@ -445,6 +828,13 @@ static ERL_NIF_TERM expty_resize(ErlNifEnv *env, int argc, const ERL_NIF_TERM ar
   if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
       nif::get(env, argv[1], &cols) && cols > 0 &&
       nif::get(env, argv[2], &rows) && rows > 0) {
+    if (cols > PTY_SCREEN_MAX_SIZE || rows > PTY_SCREEN_MAX_SIZE) {
+      return nif::error(env, "cols and rows should be at most 65535");
+    }
+    // the screen is only set at spawn, no need for the lock to check
+    if (pipesocket->screen && (int64_t)cols * rows > PTY_SCREEN_MAX_CELLS) {
+      return nif::error(env, "screen: true supports at most 16777216 cells (cols * rows)");
+    }
 
     struct winsize winp;
     winp.ws_col = cols;
@@ -461,6 +851,22 @@ static ERL_NIF_TERM expty_resize(ErlNifEnv *env, int argc, const ERL_NIF_TERM ar
       }
       return nif::error(env, "ioctl(2) failed");
     }
+
+    if (pipesocket->recorder) {
+      pipesocket->recorder->resize(cols, rows, uv_hrtime());
+    }
+
+    uv_mutex_lock(&pipesocket->reader_mutex);
+    if (pipesocket->screen) {
+      pipesocket->screen->resize(cols, rows);
+    }
+    uv_mutex_unlock(&pipesocket->reader_mutex);
+    pipesocket->budget.cols = (uint32_t)cols;
+    pipesocket->budget.rows = (uint32_t)rows;
+    if (pipesocket->frame_interval > 0) {
+      // let viewers know about the repaint
+      pipesocket->wake();
+    }
     return nif::atom(env, "ok");
   } else {
     return nif::error(env, "Cannot get pipesocket resource");
@@ -529,9 +935,9 @@ static ERL_NIF_TERM expty_set_echo(ErlNifEnv *env, int argc, const ERL_NIF_TERM
     }
 
     if (echo) {
-      settings.c_lflag |= ECHO | ECHOE | ECHOK | ECHOKE | ECHOCTL;
+      settings.c_lflag |= pty_termios_echo;
     } else {
-      settings.c_lflag &= ~(ECHO | ECHOE | ECHOK | ECHOKE | ECHOCTL);
+      settings.c_lflag &= ~pty_termios_echo;
     }
     
     if (tcsetattr(pipesocket->fd, TCSANOW, &settings) < 0) {
@@ -544,201 +950,2228 @@ static ERL_NIF_TERM expty_set_echo(ErlNifEnv *env, int argc, const ERL_NIF_TERM
   }
 }
 
-static ERL_NIF_TERM throw_for_errno(ErlNifEnv *env, const char* message, int _errno) {
-  return nif::error(env, (
-    message + std::string(strerror(_errno))
-  ).c_str());
-}
+/**
+ * The flags of `names`, a list of atoms, set in `set` or cleared.
+ */
 
-static ERL_NIF_TERM expty_stub(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
-  return nif::error(env, "invalid NIF call to platform-specific implementation");
+static bool
+pty_termios_flag_list(ErlNifEnv *env, ERL_NIF_TERM names, struct termios &t, bool set, std::string &error) {
+  ERL_NIF_TERM head, tail = names;
+  std::string name;
+  while (enif_get_list_cell(env, tail, &head, &tail)) {
+    const pty_termios_flag *flag = nullptr;
+    if (!nif::get_atom(env, head, name) || !(flag = pty_termios_find(name))) {
+      error = "unknown termios flag " + name;
+      return false;
+    }
+    tcflag_t &flags = pty_termios_flags_of(t, flag->field);
+    if (set) {
+      flags |= flag->bit;
+    } else {
+      flags &= ~flag->bit;
+    }
+  }
+  if (!enif_is_empty_list(env, tail)) {
+    error = "termios flags should be a list of atoms";
+    return false;
+  }
+  return true;
 }
 
 /**
- * Nonblocking FD
+ * Applies a termios spec, a map of `profile`, `clear`, `set`, `vmin`
+ * and `vtime`, in that order, so that a profile can be adjusted.
  */
 
-static int
-pty_nonblock(int fd) {
-  int flags = fcntl(fd, F_GETFL, 0);
-  if (flags == -1) return -1;
-  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+static bool
+pty_termios_update(ErlNifEnv *env, ERL_NIF_TERM spec, struct termios &t, std::string &error) {
+  ERL_NIF_TERM opt;
+  std::string profile;
+  int vmin = 0, vtime = 0;
+  if (nif::get_opt(env, spec, "profile", &opt) &&
+      !(nif::get_atom(env, opt, profile) && pty_termios_profile(t, profile))) {
+    error = "termios profile should be one of :cooked, :raw or :cbreak";
+    return false;
+  }
+  if (nif::get_opt(env, spec, "clear", &opt) && !pty_termios_flag_list(env, opt, t, false, error)) {
+    return false;
+  }
+  if (nif::get_opt(env, spec, "set", &opt) && !pty_termios_flag_list(env, opt, t, true, error)) {
+    return false;
+  }
+  if (nif::get_opt(env, spec, "vmin", &opt)) {
+    if (!(nif::get(env, opt, &vmin) && vmin >= 0 && vmin <= 255)) {
+      error = "vmin should be an integer between 0 and 255";
+      return false;
+    }
+    t.c_cc[VMIN] = (cc_t)vmin;
+  }
+  if (nif::get_opt(env, spec, "vtime", &opt)) {
+    if (!(nif::get(env, opt, &vtime) && vtime >= 0 && vtime <= 255)) {
+      error = "vtime should be an integer between 0 and 255";
+      return false;
+    }
+    t.c_cc[VTIME] = (cc_t)vtime;
+  }
+  return true;
 }
 
-static void
-pty_pipesocket_fn(void *data) {
-  pty_pipesocket *pipesocket = static_cast<pty_pipesocket*>(data);
-
-  int fd = pipesocket->fd;
-  int activity;
+/**
+ * One tcgetattr/tcsetattr for the whole spec; TCSADRAIN so that output
+ * already written is processed with the settings it was written for.
+ */
 
-  while (!pipesocket->baton->fd_closed) {
-    fd_set readfds;
-    FD_ZERO(&readfds);
-    FD_SET(fd, &readfds);
-    activity = select(fd + 1, &readfds, NULL, NULL, NULL);
+static ERL_NIF_TERM expty_set_termios(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
 
-    if ((activity < 0) && (errno != EINTR)) {
-      continue;
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
+      enif_is_map(env, argv[1])) {
+    if (pipesocket->baton->fd_closed) {
+      return nif::error(env, "pseudoterminal closed");
     }
 
-    if (FD_ISSET(fd, &readfds)) {
-      size_t bytes_read = 0;
-      const size_t buf_size = 1024;
-      char buffer[buf_size] = {'\0'};
-      bytes_read = read(fd, buffer, buf_size);
-      if (bytes_read == 0) {
-        pipesocket->baton->fd_closed = true;
-        close(fd);
-        kill(pipesocket->baton->pid, SIGHUP);
-        break;
-      }
-
-      ERL_NIF_TERM dataread;
-      unsigned char * ptr;
+    struct termios settings;
+    if (tcgetattr(pipesocket->fd, &settings) < 0) {
+      return throw_for_errno(env, "tcgetattr failed: ", errno);
+    }
 
-      ErlNifEnv * msg_env = enif_alloc_env();
-      if ((ptr = enif_make_new_binary(msg_env, bytes_read, &dataread)) != nullptr) {
-        memcpy(ptr, buffer, bytes_read);
-        enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple2(msg_env,
-          nif::atom(msg_env, "data"),
-          dataread
-        ));
-        enif_free_env(msg_env);
-      }
+    std::string error;
+    if (!pty_termios_update(env, argv[1], settings, error)) {
+      return nif::error(env, error.c_str());
     }
-  }
 
-  uv_async_send(&pipesocket->async);
-}
+    if (tcsetattr(pipesocket->fd, TCSADRAIN, &settings) < 0) {
+      return throw_for_errno(env, "tcsetattr failed: ", errno);
+    }
 
-size_t pty_pipesocket::write(void * data, size_t len) {
-  if (this->baton->fd_closed) {
-    return 0;
+    return nif::atom(env, "ok");
+  } else {
+    return nif::error(env, "Cannot get pipesocket resource");
   }
+}
 
-  uv_mutex_lock(&this->mutex);
-  size_t bytes_to_write = len, bytes_written = 0, buffer_size = 1024, nbytes = 0;
-  size_t retry = 3;
+static ERL_NIF_TERM expty_get_termios(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
 
-  while (true) {
-    nbytes = buffer_size;
-    if (buffer_size > bytes_to_write) {
-      nbytes = bytes_to_write;
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket) {
+    if (pipesocket->baton->fd_closed) {
+      return nif::error(env, "pseudoterminal closed");
     }
 
-    if (this->baton->fd_closed) {
-      break;
+    struct termios settings;
+    if (tcgetattr(pipesocket->fd, &settings) < 0) {
+      return throw_for_errno(env, "tcgetattr failed: ", errno);
     }
 
-    ssize_t bytes_written_cur = ::write(this->fd, ((void *)(int64_t *)(((size_t)(char *)data) + bytes_written)), nbytes);
-    if (bytes_written_cur > 0) {
-      bytes_written += bytes_written_cur;
-      bytes_to_write -= bytes_written_cur;
-      if (bytes_written == len) {
-        break;
-      }
-    } else {
-      if (retry-- > 0) {
-        usleep(10);
+    // the names of the flags that are set, per field
+    ERL_NIF_TERM lists[4];
+    for (int field = PTY_LFLAG; field >= PTY_IFLAG; field--) {
+      lists[field] = enif_make_list(env, 0);
+    }
+    for (size_t i = pty_termios_nflags; i-- > 0;) {
+      const pty_termios_flag &flag = pty_termios_flags[i];
+      if (pty_termios_flags_of(settings, flag.field) & flag.bit) {
+        lists[flag.field] = enif_make_list_cell(env, nif::atom(env, flag.name), lists[flag.field]);
       }
     }
-  }
 
-  uv_mutex_unlock(&this->mutex);
-  return bytes_written;
+    ERL_NIF_TERM keys[] = {
+      nif::atom(env, "iflag"),
+      nif::atom(env, "oflag"),
+      nif::atom(env, "cflag"),
+      nif::atom(env, "lflag"),
+      nif::atom(env, "vmin"),
+      nif::atom(env, "vtime"),
+    };
+    ERL_NIF_TERM values[] = {
+      lists[PTY_IFLAG],
+      lists[PTY_OFLAG],
+      lists[PTY_CFLAG],
+      lists[PTY_LFLAG],
+      enif_make_int(env, settings.c_cc[VMIN]),
+      enif_make_int(env, settings.c_cc[VTIME]),
+    };
+    ERL_NIF_TERM map;
+    enif_make_map_from_arrays(env, keys, values, 6, &map);
+    return enif_make_tuple2(env, nif::atom(env, "ok"), map);
+  } else {
+    return nif::error(env, "Cannot get pipesocket resource");
+  }
 }
 
 /**
- * pty_waitpid
- * Wait for SIGCHLD to read exit status.
+ * The `filters` from ExPTY, in order: :strip_ansi, :utf8 and
+ * {:collapse_progress, ms}.
  */
 
-static void pty_waitpid(void *data) {
-  int ret;
-  int stat_loc;
+static bool
+pty_filters_parse(ErlNifEnv *env, ERL_NIF_TERM list, std::vector<pty_filter_spec> &specs) {
+  ERL_NIF_TERM head;
+  std::string name;
+  while (enif_get_list_cell(env, list, &head, &list)) {
+    pty_filter_spec spec{PTY_FILTER_UTF8, 0, nullptr};
+    int arity = 0;
+    const ERL_NIF_TERM *items = nullptr;
+    int64_t ms = 0;
+    if (nif::get_atom(env, head, name) && name == "strip_ansi") {
+      spec.kind = PTY_FILTER_STRIP_ANSI;
+    } else if (nif::get_atom(env, head, name) && name == "utf8") {
+      spec.kind = PTY_FILTER_UTF8;
+    } else if (enif_get_tuple(env, head, &arity, &items) && arity == 2 &&
+               nif::get_atom(env, items[0], name) && name == "collapse_progress" &&
+               nif::get(env, items[1], &ms) && ms > 0) {
+      spec.kind = PTY_FILTER_COLLAPSE;
+      spec.window = (uint64_t)ms * 1000000;
+    } else {
+      return false;
+    }
+    specs.push_back(spec);
+  }
+  return enif_is_empty_list(env, list);
+}
 
-  pty_baton *baton = static_cast<pty_baton*>(data);
+/**
+ * An output budget from ExPTY, a map of `rate` (bytes per second, 0
+ * lifts the budget), `burst` (bytes, defaults to a second's worth and
+ * at least 4 KiB so a few reads fit) and `policy`.
+ */
 
-  errno = 0;
+static bool
+pty_budget_parse(ErlNifEnv *env, ERL_NIF_TERM spec, uint64_t &rate, uint64_t &burst,
+                 pty_budget_policy &policy, std::string &error) {
+  ERL_NIF_TERM opt;
+  int64_t value = 0;
+  std::string name = "throttle";
+  if (!enif_is_map(env, spec)) {
+    error = "output_budget should be a map";
+    return false;
+  }
+  if (!(nif::get_opt(env, spec, "rate", &opt) && nif::get(env, opt, &value) && value >= 0)) {
+    error = "output_budget rate should be a non-negative integer";
+    return false;
+  }
+  rate = (uint64_t)value;
+  burst = rate;
+  if (nif::get_opt(env, spec, "burst", &opt)) {
+    if (!(nif::get(env, opt, &value) && value > 0)) {
+      error = "output_budget burst should be a positive integer";
+      return false;
+    }
+    burst = (uint64_t)value;
+  }
+  burst = std::max<uint64_t>(burst, 4096);
+  if (nif::get_opt(env, spec, "policy", &opt) &&
+      !(nif::get_atom(env, opt, name) && (name == "throttle" || name == "drop" || name == "tail"))) {
+    error = "output_budget policy should be one of :throttle, :drop or :tail";
+    return false;
+  }
+  policy = name == "drop" ? PTY_BUDGET_DROP : name == "tail" ? PTY_BUDGET_TAIL : PTY_BUDGET_THROTTLE;
+  return true;
+}
 
-  signal(SIGCHLD, SIG_DFL);
-  if ((ret = waitpid(baton->pid, &stat_loc, 0)) != baton->pid) {
-    if (ret == -1 && errno == EINTR) {
-      return pty_waitpid(baton);
+static ERL_NIF_TERM expty_set_output_budget(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  uint64_t rate = 0, burst = 0;
+  pty_budget_policy policy = PTY_BUDGET_THROTTLE;
+  std::string error;
+
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket) {
+    if (!pty_budget_parse(env, argv[1], rate, burst, policy, error)) {
+      return nif::error(env, error.c_str());
     }
+    pipesocket->budget.set(rate, burst, policy);
+    // a throttled reader waits for the old rate otherwise
+    pipesocket->wake();
+    return nif::atom(env, "ok");
+  } else {
+    return nif::error(env, "Cannot get pipesocket resource");
   }
+}
 
-  if (WIFEXITED(stat_loc)) {
-    baton->exit_code = WEXITSTATUS(stat_loc); // errno?
+/**
+ * Starts copying the output to a file, appended to and created if need
+ * be, or to a listening Unix socket: `{:file, path}` or
+ * `{:socket, path}`. Returns {:ok, id} for untee/2.
+ */
+static ERL_NIF_TERM expty_tee(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  const ERL_NIF_TERM *target;
+  int arity = 0;
+  std::string kind, path;
+
+  if (!(enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket)) {
+    return nif::error(env, "Cannot get pipesocket resource");
+  }
+  if (!(enif_get_tuple(env, argv[1], &arity, &target) && arity == 2 &&
+        nif::get_atom(env, target[0], kind) && (kind == "file" || kind == "socket") &&
+        nif::get(env, target[1], path) && !path.empty())) {
+    return nif::error(env, "tee target should be {:file, path} or {:socket, path}");
   }
 
-  if (WIFSIGNALED(stat_loc)) {
-    baton->signal_code = WTERMSIG(stat_loc);
+  int id = pipesocket->tee.add(path, kind == "socket", *pipesocket->process);
+  if (id < 0) {
+    return nif::error(env, id == -EPIPE ? "the output has ended" : strerror(-id));
   }
+  return enif_make_tuple2(env, nif::atom(env, "ok"), enif_make_int(env, id));
+}
 
-  ErlNifEnv * msg_env = enif_alloc_env();
-  enif_send(NULL, baton->process, msg_env, enif_make_tuple3(msg_env,
-    nif::atom(msg_env, "exit"),
-    enif_make_int(msg_env, baton->exit_code),
-    enif_make_int(msg_env, baton->signal_code)
-  ));
-  enif_free_env(msg_env);
-  enif_free(baton->process);
-  baton->process = NULL;
+static ERL_NIF_TERM expty_untee(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  int id = 0;
 
-  uv_async_send(&baton->async);
-  processes.erase(baton->pid);
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
+      nif::get(env, argv[1], &id)) {
+    return pipesocket->tee.remove(id) ? nif::atom(env, "ok") : nif::error(env, "no such tee");
+  } else {
+    return nif::error(env, "Cannot get pipesocket resource");
+  }
 }
 
 /**
- * pty_after_waitpid
- * Callback after exit status has been read.
+ * Claims `pipesocket` for a link, false when it is already connected or
+ * its output has ended.
  */
 
-static void
-pty_after_waitpid(uv_async_t *async) {
-  uv_close((uv_handle_t *)async, pty_after_close);
+static bool
+pty_link_claim(pty_pipesocket *pipesocket) {
+  uv_mutex_lock(&pipesocket->reader_mutex);
+  bool free = !pipesocket->connected && !pipesocket->baton->fd_closed;
+  if (free) pipesocket->connected = true;
+  uv_mutex_unlock(&pipesocket->reader_mutex);
+  return free;
 }
 
+// hands `link` to the reader of `pipesocket`, claimed beforehand
 static void
-pty_after_pipesocket(uv_async_t *async) {
-  uv_close((uv_handle_t *)async, pty_after_close_pipesocket);
+pty_link_install(pty_pipesocket *pipesocket, std::unique_ptr<pty_link> link, pty_pipesocket *back) {
+  uv_mutex_lock(&pipesocket->reader_mutex);
+  pipesocket->next_link = std::move(link);
+  pipesocket->relink = true;
+  if (back) {
+    enif_keep_resource(back);
+    pipesocket->linked_back = back;
+  }
+  uv_mutex_unlock(&pipesocket->reader_mutex);
+  pipesocket->wake();
+}
+
+// a link to the master of `peer`
+static std::unique_ptr<pty_link>
+pty_link_to(pty_pipesocket *peer) {
+  std::unique_ptr<pty_link> link(new pty_link());
+  // shares the O_NONBLOCK of the master, and stays valid once it is closed
+  link->fd = fcntl(peer->fd, F_DUPFD_CLOEXEC, 0);
+  if (link->fd == -1) return nullptr;
+  enif_keep_resource(peer);
+  link->peer = peer;
+  return link;
 }
 
 /**
- * pty_after_close
- * uv_close() callback - free handle data
+ * Connects the output of a session to the master of another session,
+ * or to `{:socket, path}`; with `bidirectional`, the other way round
+ * too. The readers pick the links up on their next turn.
  */
+static ERL_NIF_TERM expty_connect(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  pty_pipesocket * peer = nullptr;
+  const ERL_NIF_TERM *target;
+  int arity = 0;
+  bool bidirectional = false;
+  std::string kind, path;
+  std::unique_ptr<pty_link> link, back;
+
+  if (!(enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
+        nif::get(env, argv[2], &bidirectional))) {
+    return nif::error(env, "Cannot get pipesocket resource");
+  }
 
-static void
-pty_after_close(uv_handle_t *handle) {
-  uv_async_t *async = (uv_async_t *)handle;
-  pty_baton *baton = static_cast<pty_baton*>(async->data);
-  delete baton;
-}
+  if (enif_get_resource(env, argv[1], pty_pipesocket::type, (void **)&peer) && peer) {
+    if (peer == pipesocket) {
+      return nif::error(env, "cannot connect a pseudoterminal to itself");
+    }
+    if (peer->baton->fd_closed || pipesocket->baton->fd_closed) {
+      return nif::error(env, "the output has ended");
+    }
+    link = pty_link_to(peer);
+    if (link && bidirectional) back = pty_link_to(pipesocket);
+    if (!link || (bidirectional && !back)) {
+      return throw_for_errno(env, "cannot duplicate the master: ", errno);
+    }
+  } else if (enif_get_tuple(env, argv[1], &arity, &target) && arity == 2 &&
+             nif::get_atom(env, target[0], kind) && kind == "socket" &&
+             nif::get(env, target[1], path) && !path.empty()) {
+    link.reset(new pty_link());
+    link->fd = pty_unix_connect(path);
+    if (link->fd == -1) {
+      return nif::error(env, strerror(errno));
+    }
+    pty_nonblock(link->fd);
+    link->socket = true;
+    link->bidirectional = bidirectional;
+  } else {
+    return nif::error(env, "connect target should be a pseudoterminal or {:socket, path}");
+  }
 
-static void
-pty_after_close_pipesocket(uv_handle_t *handle) {
-  uv_async_t *async = (uv_async_t *)handle;
-  pty_pipesocket *pipesocket = static_cast<pty_pipesocket*>(async->data);
-  enif_free(pipesocket->process);
-  pipesocket->process = NULL;
-  uv_mutex_destroy(&pipesocket->mutex);
-  enif_release_resource((void *)pipesocket);
+  if (!pty_link_claim(pipesocket)) {
+    return nif::error(env, "already connected");
+  }
+  if (back) {
+    if (!pty_link_claim(peer)) {
+      uv_mutex_lock(&pipesocket->reader_mutex);
+      pipesocket->connected = false;
+      uv_mutex_unlock(&pipesocket->reader_mutex);
+      return nif::error(env, "already connected");
+    }
+    pty_link_install(peer, std::move(back), pipesocket);
+  }
+  pty_link_install(pipesocket, std::move(link), back ? peer : nullptr);
+  return nif::atom(env, "ok");
 }
 
 /**
- * openpty(3) / forkpty(3)
+ * Ends the link of a session, and the one back to it when it was
+ * connected with `bidirectional`; the output goes to the owner again
+ * from the next read.
  */
+static ERL_NIF_TERM expty_disconnect(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  if (!(enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket)) {
+    return nif::error(env, "Cannot get pipesocket resource");
+  }
 
-static int
-pty_openpty(int *amaster,
-            int *aslave,
-            char *name,
-            const struct termios *termp,
-            const struct winsize *winp) {
-#if defined(__sun)
+  uv_mutex_lock(&pipesocket->reader_mutex);
+  bool connected = pipesocket->connected;
+  pty_pipesocket *back = pipesocket->linked_back;
+  if (connected) {
+    pipesocket->connected = false;
+    pipesocket->linked_back = nullptr;
+    pipesocket->next_link.reset();
+    pipesocket->relink = true;
+  }
+  uv_mutex_unlock(&pipesocket->reader_mutex);
+  if (!connected) {
+    return nif::error(env, "not connected");
+  }
+  pipesocket->wake();
+
+  if (back) {
+    uv_mutex_lock(&back->reader_mutex);
+    if (back->connected && back->linked_back == pipesocket) {
+      back->connected = false;
+      back->linked_back = nullptr;
+      back->next_link.reset();
+      back->relink = true;
+      enif_release_resource(pipesocket);
+    }
+    uv_mutex_unlock(&back->reader_mutex);
+    back->wake();
+    enif_release_resource(back);
+  }
+  return nif::atom(env, "ok");
+}
+
+static ERL_NIF_TERM expty_set_idle_timeout(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  int idle_timeout = 0;
+
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
+      nif::get(env, argv[1], &idle_timeout) && idle_timeout >= 0) {
+    pipesocket->idle_timeout = (uint64_t)idle_timeout * 1000000;
+    pipesocket->wake();
+    return nif::atom(env, "ok");
+  } else {
+    return nif::error(env, "Cannot get pipesocket resource");
+  }
+}
+
+static ERL_NIF_TERM expty_probe_echo(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket) {
+    pipesocket->echo_probe.requested = true;
+    return nif::atom(env, "ok");
+  } else {
+    return nif::error(env, "Cannot get pipesocket resource");
+  }
+}
+
+static ERL_NIF_TERM expty_expect(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  std::vector<std::string> patterns;
+  bool suppress = false;
+
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
+      nif::get_list(env, argv[1], patterns) && !patterns.empty() &&
+      nif::get(env, argv[2], &suppress)) {
+    pty_aho_corasick matcher;
+    if (!matcher.compile(patterns)) {
+      return nif::error(env, "patterns should be non-empty binaries");
+    }
+
+    uv_mutex_lock(&pipesocket->reader_mutex);
+    pipesocket->expect.regex = false;
+    pipesocket->expect.matcher = std::move(matcher);
+    pipesocket->expect.arm(suppress);
+    uv_mutex_unlock(&pipesocket->reader_mutex);
+    return nif::atom(env, "ok");
+  } else {
+    return nif::error(env, "expecting a pipesocket resource, a list of binaries and a boolean");
+  }
+}
+
+static ERL_NIF_TERM expty_expect_regex(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  std::vector<std::string> patterns;
+  bool suppress = false;
+  int lookbehind = 0;
+  int max_states = 0;
+
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
+      nif::get_list(env, argv[1], patterns) && !patterns.empty() &&
+      nif::get(env, argv[2], &suppress) &&
+      nif::get(env, argv[3], &lookbehind) && lookbehind > 0 &&
+      nif::get(env, argv[4], &max_states) && max_states > 0) {
+    pty_regex_set matcher;
+    std::string error;
+    matcher.max_states = (size_t)max_states;
+    if (!matcher.compile(patterns, error)) {
+      return nif::error(env, error.c_str());
+    }
+
+    uv_mutex_lock(&pipesocket->reader_mutex);
+    pipesocket->expect.regex = true;
+    pipesocket->expect.regex_matcher = std::move(matcher);
+    pipesocket->expect.lookbehind = (size_t)lookbehind;
+    pipesocket->expect.arm(suppress);
+    uv_mutex_unlock(&pipesocket->reader_mutex);
+    return nif::atom(env, "ok");
+  } else {
+    return nif::error(env, "expecting a pipesocket resource, a list of binaries, a boolean and two positive integers");
+  }
+}
+
+static ERL_NIF_TERM expty_cancel_expect(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket) {
+    uv_mutex_lock(&pipesocket->reader_mutex);
+    pty_expect &expect = pipesocket->expect;
+    // data held back by a suppressing expect is delivered as usual
+    if (expect.armed && expect.suppress && !expect.pending.empty()) {
+      pty_send_data(pipesocket, expect.pending.data(), expect.pending.size(), pipesocket->pending_since);
+    }
+    expect.disarm();
+    uv_mutex_unlock(&pipesocket->reader_mutex);
+    if (pipesocket->filters) {
+      // for the deadline of what the filters may now hold
+      pipesocket->wake();
+    }
+    return nif::atom(env, "ok");
+  } else {
+    return nif::error(env, "Cannot get pipesocket resource");
+  }
+}
+
+static ERL_NIF_TERM pty_make_color(ErlNifEnv *env, uint32_t color) {
+  if (color & PTY_COLOR_RGB) {
+    return enif_make_tuple3(env,
+      enif_make_uint(env, (color >> 16) & 0xFF),
+      enif_make_uint(env, (color >> 8) & 0xFF),
+      enif_make_uint(env, color & 0xFF)
+    );
+  } else if (color & PTY_COLOR_INDEXED) {
+    return enif_make_uint(env, color & 0xFF);
+  }
+  return nif::atom(env, "default");
+}
+
+static ERL_NIF_TERM pty_make_flags(ErlNifEnv *env, uint16_t flags) {
+  static const char *names[] = {
+    "bold", "dim", "italic", "underline", "blink", "inverse", "hidden", "strike"
+  };
+  ERL_NIF_TERM list = enif_make_list(env, 0);
+  for (int i = 7; i >= 0; i--) {
+    if (flags & (1 << i)) {
+      list = enif_make_list_cell(env, nif::atom(env, names[i]), list);
+    }
+  }
+  return list;
+}
+
+static ERL_NIF_TERM pty_make_binary(ErlNifEnv *env, const std::string &str) {
+  ERL_NIF_TERM term;
+  unsigned char * ptr = enif_make_new_binary(env, str.size(), &term);
+  if (ptr) memcpy(ptr, str.data(), str.size());
+  return term;
+}
+
+// columns [from, to) of a line as a list of {text, fg, bg, flags} runs of equal attributes
+static ERL_NIF_TERM pty_make_runs(ErlNifEnv *env, const pty_line &line, size_t from, size_t to) {
+  std::vector<ERL_NIF_TERM> runs;
+  std::string text;
+  size_t x = from;
+  while (x < to) {
+    pty_attr attr = line.cells[x].attr;
+    text.clear();
+    for (; x < to && line.cells[x].attr == attr; x++) {
+      if (line.cells[x].ch != 0) pty_utf8_encode(line.cells[x].ch, text);
+    }
+    runs.push_back(enif_make_tuple4(env,
+      pty_make_binary(env, text),
+      pty_make_color(env, attr.fg),
+      pty_make_color(env, attr.bg),
+      pty_make_flags(env, attr.flags)
+    ));
+  }
+  return enif_make_list_from_array(env, runs.data(), (unsigned)runs.size());
+}
+
+static ERL_NIF_TERM expty_screen(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  std::string format;
+
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
+      nif::get_atom(env, argv[1], format) && (format == "text" || format == "cells")) {
+    uv_mutex_lock(&pipesocket->reader_mutex);
+    if (!pipesocket->screen) {
+      uv_mutex_unlock(&pipesocket->reader_mutex);
+      return nif::error(env, "screen is not enabled, spawn with screen: true");
+    }
+
+    const pty_screen &screen = *pipesocket->screen;
+    std::vector<ERL_NIF_TERM> lines;
+    lines.reserve(screen.rows);
+    for (const pty_line &line : screen.lines()) {
+      if (format == "text") {
+        lines.push_back(pty_make_binary(env, screen.row_text(line)));
+      } else {
+        lines.push_back(pty_make_runs(env, line, 0, line.cells.size()));
+      }
+    }
+
+    ERL_NIF_TERM keys[7] = {
+      nif::atom(env, "cols"),
+      nif::atom(env, "rows"),
+      nif::atom(env, "cursor"),
+      nif::atom(env, "cursor_visible"),
+      nif::atom(env, "alternate_screen"),
+      nif::atom(env, "title"),
+      nif::atom(env, "lines")
+    };
+    ERL_NIF_TERM values[7] = {
+      enif_make_int(env, screen.cols),
+      enif_make_int(env, screen.rows),
+      enif_make_tuple2(env, enif_make_int(env, screen.cursor.y), enif_make_int(env, screen.cursor.x)),
+      nif::atom(env, screen.cursor_visible ? "true" : "false"),
+      nif::atom(env, screen.alternate ? "true" : "false"),
+      pty_make_binary(env, screen.title),
+      enif_make_list_from_array(env, lines.data(), (unsigned)lines.size())
+    };
+    uv_mutex_unlock(&pipesocket->reader_mutex);
+
+    ERL_NIF_TERM result;
+    enif_make_map_from_arrays(env, keys, values, 7, &result);
+    return enif_make_tuple2(env, nif::atom(env, "ok"), result);
+  } else {
+    return nif::error(env, "expecting a pipesocket resource and either :text or :cells");
+  }
+}
+
+static ERL_NIF_TERM expty_screen_diff(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  ErlNifUInt64 since = 0;
+  std::string format;
+
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
+      enif_get_uint64(env, argv[1], &since) &&
+      nif::get_atom(env, argv[2], format) && (format == "cells" || format == "ansi")) {
+    uv_mutex_lock(&pipesocket->reader_mutex);
+    if (!pipesocket->screen) {
+      uv_mutex_unlock(&pipesocket->reader_mutex);
+      return nif::error(env, "screen is not enabled, spawn with screen: true");
+    }
+
+    pty_screen &screen = *pipesocket->screen;
+    uint64_t frame = screen.commit();
+    // a frame from the future, e.g. of a previous session, means a full repaint
+    if (since > frame) since = 0;
+
+    ERL_NIF_TERM changes;
+    if (format == "ansi") {
+      std::string data;
+      if (since != frame) screen.render_diff(since, data);
+      changes = pty_make_binary(env, data);
+    } else {
+      std::vector<ERL_NIF_TERM> rows;
+      const auto &lines = screen.lines();
+      for (int y = 0; y < screen.rows; y++) {
+        int from, to;
+        if (!screen.changed(lines[y], since, from, to)) continue;
+        rows.push_back(enif_make_tuple3(env,
+          enif_make_int(env, y),
+          enif_make_int(env, from),
+          pty_make_runs(env, lines[y], from, to)
+        ));
+      }
+      changes = enif_make_list_from_array(env, rows.data(), (unsigned)rows.size());
+    }
+
+    ERL_NIF_TERM keys[9] = {
+      nif::atom(env, "frame"),
+      nif::atom(env, "full"),
+      nif::atom(env, "cols"),
+      nif::atom(env, "rows"),
+      nif::atom(env, "cursor"),
+      nif::atom(env, "cursor_visible"),
+      nif::atom(env, "alternate_screen"),
+      nif::atom(env, "title"),
+      nif::atom(env, format == "ansi" ? "data" : "changes")
+    };
+    ERL_NIF_TERM values[9] = {
+      enif_make_uint64(env, frame),
+      nif::atom(env, since == 0 ? "true" : "false"),
+      enif_make_int(env, screen.cols),
+      enif_make_int(env, screen.rows),
+      enif_make_tuple2(env, enif_make_int(env, screen.cursor.y), enif_make_int(env, screen.cursor.x)),
+      nif::atom(env, screen.cursor_visible ? "true" : "false"),
+      nif::atom(env, screen.alternate ? "true" : "false"),
+      pty_make_binary(env, screen.title),
+      changes
+    };
+    uv_mutex_unlock(&pipesocket->reader_mutex);
+
+    ERL_NIF_TERM result;
+    enif_make_map_from_arrays(env, keys, values, 9, &result);
+    return enif_make_tuple2(env, nif::atom(env, "ok"), result);
+  } else {
+    return nif::error(env, "expecting a pipesocket resource, a frame number and either :cells or :ansi");
+  }
+}
+
+static ERL_NIF_TERM expty_snapshot(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  std::string format;
+  std::string all;
+  ErlNifUInt64 scrollback = 0;
+
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket &&
+      nif::get_atom(env, argv[1], format) && (format == "binary" || format == "ansi") &&
+      (enif_get_uint64(env, argv[2], &scrollback) || (nif::get_atom(env, argv[2], all) && all == "all"))) {
+    if (!all.empty()) scrollback = SIZE_MAX;
+
+    std::string data;
+    uv_mutex_lock(&pipesocket->reader_mutex);
+    if (!pipesocket->screen) {
+      uv_mutex_unlock(&pipesocket->reader_mutex);
+      return nif::error(env, "screen is not enabled, spawn with screen: true");
+    }
+    if (format == "binary") {
+      pty_snapshot_encode(*pipesocket->screen, (size_t)scrollback, data);
+    } else {
+      pty_snapshot_ansi(*pipesocket->screen, (size_t)scrollback, data);
+    }
+    uv_mutex_unlock(&pipesocket->reader_mutex);
+
+    return enif_make_tuple2(env, nif::atom(env, "ok"), pty_make_binary(env, data));
+  } else {
+    return nif::error(env, "expecting a pipesocket resource, either :binary or :ansi, and a number of lines or :all");
+  }
+}
+
+/**
+ * Indexed recordings
+ * recording_open/1 maps the file once, the other functions only read
+ * the mapping so any number of processes can share a recording.
+ * Timestamps are in microseconds since the start of the recording.
+ */
+
+static ERL_NIF_TERM expty_recording_open(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  std::string path;
+  if (!nif::get(env, argv[0], path)) {
+    return nif::error(env, "expecting a path");
+  }
+
+  void *mem = enif_alloc_resource(pty_recording::type, sizeof(pty_recording));
+  if (!mem) return nif::error(env, "cannot allocate the recording");
+  pty_recording *recording = new (mem) pty_recording();
+
+  ERL_NIF_TERM ret;
+  int err = recording->open(path.c_str());
+  if (err == 0) {
+    ret = enif_make_tuple2(env, nif::atom(env, "ok"), enif_make_resource(env, recording));
+  } else if (err == -1) {
+    ret = nif::error(env, "not an indexed recording");
+  } else {
+    ret = throw_for_errno(env, "cannot open the recording: ", err);
+  }
+  enif_release_resource(recording);
+  return ret;
+}
+
+static ERL_NIF_TERM expty_recording_info(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_recording *recording = nullptr;
+  if (!enif_get_resource(env, argv[0], pty_recording::type, (void **)&recording) || !recording) {
+    return nif::error(env, "expecting a recording resource");
+  }
+
+  ERL_NIF_TERM keys[] = {
+    nif::atom(env, "cols"),
+    nif::atom(env, "rows"),
+    nif::atom(env, "started_at"),
+    nif::atom(env, "duration"),
+    nif::atom(env, "keyframes"),
+  };
+  ERL_NIF_TERM values[] = {
+    enif_make_int(env, recording->cols),
+    enif_make_int(env, recording->rows),
+    enif_make_uint64(env, recording->started_at),
+    enif_make_uint64(env, recording->duration),
+    enif_make_uint64(env, recording->index.size()),
+  };
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, 5, &map);
+  return enif_make_tuple2(env, nif::atom(env, "ok"), map);
+}
+
+static ERL_NIF_TERM expty_recording_seek(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_recording *recording = nullptr;
+  ErlNifUInt64 ts = 0;
+  std::string format;
+  if (!(enif_get_resource(env, argv[0], pty_recording::type, (void **)&recording) && recording &&
+        enif_get_uint64(env, argv[1], &ts) &&
+        nif::get_atom(env, argv[2], format) && (format == "binary" || format == "ansi"))) {
+    return nif::error(env, "expecting a recording resource, a timestamp and either :binary or :ansi");
+  }
+
+  pty_screen screen(recording->cols, recording->rows);
+  size_t cursor = recording->seek(ts, screen);
+
+  std::string data;
+  if (format == "binary") {
+    pty_snapshot_encode(screen, 0, data);
+  } else {
+    pty_snapshot_ansi(screen, 0, data);
+  }
+  return enif_make_tuple3(env, nif::atom(env, "ok"), pty_make_binary(env, data),
+    enif_make_uint64(env, cursor));
+}
+
+static ERL_NIF_TERM expty_recording_read(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_recording *recording = nullptr;
+  ErlNifUInt64 cursor = 0;
+  unsigned int max = 0;
+  if (!(enif_get_resource(env, argv[0], pty_recording::type, (void **)&recording) && recording &&
+        enif_get_uint64(env, argv[1], &cursor) && cursor >= PTY_RECORDING_HEADER &&
+        enif_get_uint(env, argv[2], &max) && max > 0)) {
+    return nif::error(env, "expecting a recording resource, a cursor and a positive count");
+  }
+
+  std::vector<ERL_NIF_TERM> events;
+  size_t offset = (size_t)cursor;
+  pty_recording::record rec;
+  while (events.size() < max && recording->at(offset, rec)) {
+    ERL_NIF_TERM type;
+    ERL_NIF_TERM data;
+    int cols = 0, rows = 0;
+    switch (rec.type) {
+      case 'o':
+      case 'i':
+        type = nif::atom(env, rec.type == 'o' ? "output" : "input");
+        // sub-binary of the mapping, it keeps the recording alive
+        data = enif_make_resource_binary(env, recording, rec.data, rec.len);
+        break;
+      case 'r':
+        pty_parse_resize((const char *)rec.data, rec.len, cols, rows);
+        type = nif::atom(env, "resize");
+        data = enif_make_tuple2(env, enif_make_int(env, cols), enif_make_int(env, rows));
+        break;
+      default:
+        // keyframes are only used by seek
+        offset = recording->next(offset, rec);
+        continue;
+    }
+    events.push_back(enif_make_tuple3(env, enif_make_uint64(env, rec.ts), type, data));
+    offset = recording->next(offset, rec);
+  }
+
+  ERL_NIF_TERM next = recording->at(offset, rec) ?
+    enif_make_uint64(env, offset) : nif::atom(env, "eof");
+  return enif_make_tuple3(env, nif::atom(env, "ok"),
+    enif_make_list_from_array(env, events.data(), (unsigned)events.size()), next);
+}
+
+/**
+ * Replays
+ * replay_start/6 takes the recording, the process that gets the
+ * messages, the pipesocket to write the output into or nil, the speed
+ * (0.0 for as fast as possible), where to start and the longest pause
+ * to keep, both in microseconds.
+ */
+
+// never waits on the PTY, the worker retries what it did not take on the next tick
+static ssize_t pty_replay_write(void *into, const void *data, size_t len) {
+  return static_cast<pty_pipesocket *>(into)->try_write(data, len);
+}
+
+static ERL_NIF_TERM expty_replay_start(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_recording *recording = nullptr;
+  pty_pipesocket *into = nullptr;
+  ErlNifPid target;
+  double speed = 0;
+  ErlNifUInt64 from = 0;
+  ErlNifUInt64 idle_limit = 0;
+  if (!(enif_get_resource(env, argv[0], pty_recording::type, (void **)&recording) && recording &&
+        enif_get_local_pid(env, argv[1], &target) &&
+        (enif_get_resource(env, argv[2], pty_pipesocket::type, (void **)&into) || enif_is_atom(env, argv[2])) &&
+        enif_get_double(env, argv[3], &speed) && speed >= 0 &&
+        enif_get_uint64(env, argv[4], &from) &&
+        enif_get_uint64(env, argv[5], &idle_limit))) {
+    return nif::error(env, "expecting a recording, a pid, a pipesocket or nil, a speed, a start and an idle limit");
+  }
+
+  void *mem = enif_alloc_resource(pty_replay::type, sizeof(pty_replay));
+  if (!mem) return nif::error(env, "cannot allocate the replay");
+  pty_replay *replay = new (mem) pty_replay();
+  enif_keep_resource(recording);
+  replay->recording = recording;
+  replay->target = target;
+  if (into) {
+    enif_keep_resource(into);
+    replay->into = into;
+    replay->write_into = pty_replay_write;
+  }
+  replay->speed = speed;
+  replay->idle_limit = idle_limit;
+  replay->offset = PTY_RECORDING_HEADER;
+
+  if (from > 0) {
+    // the screen as it was at `from` goes first
+    pty_screen screen(recording->cols, recording->rows);
+    replay->offset = recording->seek(from, screen);
+    replay->last_ts = from;
+
+    pty_snapshot_ansi(screen, 0, replay->prefix);
+  }
+
+  replay_scheduler.add(replay);
+  ERL_NIF_TERM ret = enif_make_tuple2(env, nif::atom(env, "ok"), enif_make_resource(env, replay));
+  enif_release_resource(replay);
+  return ret;
+}
+
+static ERL_NIF_TERM expty_replay_stop(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_replay *replay = nullptr;
+  if (!enif_get_resource(env, argv[0], pty_replay::type, (void **)&replay) || !replay) {
+    return nif::error(env, "expecting a replay resource");
+  }
+  replay_scheduler.remove(replay);
+  return nif::atom(env, "ok");
+}
+
+static ERL_NIF_TERM expty_set_replay_threads(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  int threads = 0;
+  if (!(nif::get(env, argv[0], &threads) && threads > 0)) {
+    return nif::error(env, "expecting a positive integer");
+  }
+  if (!replay_scheduler.set_threads((size_t)threads)) {
+    return nif::error(env, "replays have already started");
+  }
+  return nif::atom(env, "ok");
+}
+
+static ERL_NIF_TERM pty_foreground_process(ErlNifEnv *env, pty_pipesocket *pipesocket, uint64_t now) {
+  if (pipesocket->baton->fd_closed) {
+    return nif::error(env, "pty closed");
+  }
+
+  pid_t pgid = tcgetpgrp(pipesocket->fd);
+  if (pgid == -1) {
+    return throw_for_errno(env, "tcgetpgrp failed: ", errno);
+  }
+
+  pty_proc_entry entry;
+  bool cached = false;
+  uv_mutex_lock(&proc_cache_mutex);
+  auto it = proc_cache.find(pgid);
+  if (it != proc_cache.end() && now - it->second.fetched_at < proc_cache_ttl_ms) {
+    entry = it->second;
+    cached = true;
+  }
+  uv_mutex_unlock(&proc_cache_mutex);
+
+  if (!cached) {
+    if (pty_getproc(pgid, entry.name, entry.cwd) != 0) {
+      return throw_for_errno(env, "pty_getproc failed: ", errno);
+    }
+    entry.fetched_at = now;
+
+    uv_mutex_lock(&proc_cache_mutex);
+    proc_cache[pgid] = entry;
+    uv_mutex_unlock(&proc_cache_mutex);
+  }
+
+  bool success = false;
+  ERL_NIF_TERM keys[3] = {
+    nif::atom(env, "pgid"),
+    nif::atom(env, "name"),
+    nif::atom(env, "cwd")
+  };
+  ERL_NIF_TERM values[3] = {
+    enif_make_int(env, pgid),
+    nif::make_string(env, entry.name.c_str(), success),
+    nif::atom(env, "nil")
+  };
+  if (!success) {
+    return nif::error(env, "Could not allocate memory for process name.");
+  }
+  if (!entry.cwd.empty()) {
+    values[2] = nif::make_string(env, entry.cwd.c_str(), success);
+    if (!success) {
+      return nif::error(env, "Could not allocate memory for process cwd.");
+    }
+  }
+
+  ERL_NIF_TERM info;
+  enif_make_map_from_arrays(env, keys, values, 3, &info);
+  return enif_make_tuple2(env, nif::atom(env, "ok"), info);
+}
+
+static void pty_sweep_proc_cache(uint64_t now) {
+  uv_mutex_lock(&proc_cache_mutex);
+  for (auto it = proc_cache.begin(); it != proc_cache.end();) {
+    if (now - it->second.fetched_at >= proc_cache_ttl_ms) {
+      it = proc_cache.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  uv_mutex_unlock(&proc_cache_mutex);
+}
+
+static ERL_NIF_TERM expty_foreground_process(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  pty_pipesocket * pipesocket = nullptr;
+  if (enif_get_resource(env, argv[0], pty_pipesocket::type, (void **)&pipesocket) && pipesocket) {
+    return pty_foreground_process(env, pipesocket, uv_hrtime() / 1000000);
+  } else {
+    return nif::error(env, "Cannot get pipesocket resource");
+  }
+}
+
+static ERL_NIF_TERM expty_foreground_processes(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  unsigned int length = 0;
+  if (!enif_get_list_length(env, argv[0], &length)) {
+    return nif::error(env, "expecting a list of pipesocket resources");
+  }
+
+  uint64_t now = uv_hrtime() / 1000000;
+  pty_sweep_proc_cache(now);
+
+  std::vector<ERL_NIF_TERM> results;
+  results.reserve(length);
+
+  ERL_NIF_TERM list = argv[0], head, tail;
+  while (enif_get_list_cell(env, list, &head, &tail)) {
+    pty_pipesocket * pipesocket = nullptr;
+    if (enif_get_resource(env, head, pty_pipesocket::type, (void **)&pipesocket) && pipesocket) {
+      results.push_back(pty_foreground_process(env, pipesocket, now));
+    } else {
+      results.push_back(nif::error(env, "Cannot get pipesocket resource"));
+    }
+    list = tail;
+  }
+
+  return enif_make_list_from_array(env, results.data(), (unsigned)results.size());
+}
+
+/**
+ * Statistics
+ * stats/1 sums the counters and merges the histograms of a list of
+ * pipesockets, ExPTY.stats/0 passes every live session.
+ */
+
+static ERL_NIF_TERM pty_make_histogram(ErlNifEnv *env, const pty_histogram_view &view) {
+  ERL_NIF_TERM keys[] = {
+    nif::atom(env, "count"),
+    nif::atom(env, "mean"),
+    nif::atom(env, "p50"),
+    nif::atom(env, "p90"),
+    nif::atom(env, "p99"),
+    nif::atom(env, "p999"),
+    nif::atom(env, "max"),
+  };
+  ERL_NIF_TERM values[] = {
+    enif_make_uint64(env, view.count),
+    enif_make_uint64(env, view.count > 0 ? view.sum / view.count : 0),
+    enif_make_uint64(env, view.quantile(0.5)),
+    enif_make_uint64(env, view.quantile(0.9)),
+    enif_make_uint64(env, view.quantile(0.99)),
+    enif_make_uint64(env, view.quantile(0.999)),
+    enif_make_uint64(env, view.max),
+  };
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, 7, &map);
+  return map;
+}
+
+static ERL_NIF_TERM expty_stats(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  unsigned int length = 0;
+  if (!enif_get_list_length(env, argv[0], &length)) {
+    return nif::error(env, "expecting a list of pipesocket resources");
+  }
+
+  uint64_t sessions = 0;
+  uint64_t counters[15] = {};
+  uint64_t output_rate = 0, now = uv_hrtime();
+  std::unique_ptr<pty_histogram_view> read_to_send(new pty_histogram_view());
+  std::unique_ptr<pty_histogram_view> write_duration(new pty_histogram_view());
+  std::unique_ptr<pty_histogram_view> echo_latency(new pty_histogram_view());
+
+  ERL_NIF_TERM list = argv[0], head, tail;
+  while (enif_get_list_cell(env, list, &head, &tail)) {
+    pty_pipesocket * pipesocket = nullptr;
+    if (enif_get_resource(env, head, pty_pipesocket::type, (void **)&pipesocket) && pipesocket) {
+      const pty_stats &stats = pipesocket->stats;
+      sessions++;
+      counters[0] += stats.reads;
+      counters[1] += stats.bytes_read;
+      counters[2] += stats.messages;
+      counters[3] += stats.writes;
+      counters[4] += stats.bytes_written;
+      counters[5] += stats.partial_writes;
+      counters[6] += stats.write_retries;
+      counters[7] += stats.eagain;
+      counters[8] += stats.echo_probes;
+      counters[9] += stats.echo_timeouts;
+      counters[10] += stats.bytes_dropped;
+      counters[11] += stats.bytes_collapsed;
+      counters[12] += pipesocket->tee.bytes;
+      counters[13] += pipesocket->tee.dropped;
+      counters[14] += stats.bytes_forwarded;
+      output_rate += pipesocket->output_rate.get(now);
+      read_to_send->add(stats.read_to_send);
+      write_duration->add(stats.write_duration);
+      echo_latency->add(stats.echo_latency);
+    }
+    list = tail;
+  }
+
+  ERL_NIF_TERM keys[] = {
+    nif::atom(env, "sessions"),
+    nif::atom(env, "reads"),
+    nif::atom(env, "bytes_read"),
+    nif::atom(env, "messages"),
+    nif::atom(env, "writes"),
+    nif::atom(env, "bytes_written"),
+    nif::atom(env, "partial_writes"),
+    nif::atom(env, "write_retries"),
+    nif::atom(env, "eagain"),
+    nif::atom(env, "echo_probes"),
+    nif::atom(env, "echo_timeouts"),
+    nif::atom(env, "bytes_dropped"),
+    nif::atom(env, "bytes_collapsed"),
+    nif::atom(env, "bytes_teed"),
+    nif::atom(env, "tee_dropped"),
+    nif::atom(env, "bytes_forwarded"),
+    nif::atom(env, "output_rate"),
+    nif::atom(env, "read_to_send"),
+    nif::atom(env, "write_duration"),
+    nif::atom(env, "echo_latency"),
+  };
+  ERL_NIF_TERM values[20];
+  values[0] = enif_make_uint64(env, sessions);
+  for (int i = 0; i < 15; i++) values[i + 1] = enif_make_uint64(env, counters[i]);
+  values[16] = enif_make_uint64(env, output_rate);
+  values[17] = pty_make_histogram(env, *read_to_send);
+  values[18] = pty_make_histogram(env, *write_duration);
+  values[19] = pty_make_histogram(env, *echo_latency);
+
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, 20, &map);
+  return map;
+}
+
+/**
+ * Sessions not yet destructed, their threads still running and the
+ * children not yet reaped; what a leak check compares to its baseline.
+ */
+static ERL_NIF_TERM expty_live(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  uv_mutex_lock(&processes_mutex);
+  size_t children = processes.size();
+  uv_mutex_unlock(&processes_mutex);
+
+  ERL_NIF_TERM keys[] = {
+    nif::atom(env, "sessions"),
+    nif::atom(env, "threads"),
+    nif::atom(env, "children"),
+  };
+  ERL_NIF_TERM values[] = {
+    enif_make_int64(env, live_sessions.load()),
+    enif_make_int64(env, live_threads.load()),
+    enif_make_uint64(env, children),
+  };
+  ERL_NIF_TERM map;
+  enif_make_map_from_arrays(env, keys, values, 3, &map);
+  return map;
+}
+
+static ERL_NIF_TERM expty_set_proc_cache_ttl(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  int ttl = 0;
+  if (nif::get(env, argv[0], &ttl) && ttl >= 0) {
+    uv_mutex_lock(&proc_cache_mutex);
+    proc_cache_ttl_ms = (uint64_t)ttl;
+    uv_mutex_unlock(&proc_cache_mutex);
+    return nif::atom(env, "ok");
+  } else {
+    return nif::error(env, "expecting a non-negative integer");
+  }
+}
+
+static ERL_NIF_TERM throw_for_errno(ErlNifEnv *env, const char* message, int _errno) {
+  return nif::error(env, (
+    message + std::string(strerror(_errno))
+  ).c_str());
+}
+
+static ERL_NIF_TERM expty_stub(ErlNifEnv *env, int argc, const ERL_NIF_TERM argv[]) {
+  return nif::error(env, "invalid NIF call to platform-specific implementation");
+}
+
+/**
+ * Nonblocking FD
+ */
+
+static int
+pty_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags == -1) return -1;
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static void
+pty_reader_deadline(int &timeout, uint64_t deadline, uint64_t now) {
+  int ms = deadline > now ? (int)((deadline - now + 999999) / 1000000) : 0;
+  if (timeout < 0 || ms < timeout) {
+    timeout = ms;
+  }
+}
+
+/**
+ * Tells the owner that the screen has changed, at most once per
+ * frame_interval; viewers then pull the diff from the frame they
+ * have seen with screen_diff/3, so nothing piles up for slow ones.
+ */
+static void
+pty_send_frame(pty_pipesocket *pipesocket, uint64_t now) {
+  if (!pipesocket->frame_dirty || now - pipesocket->last_frame < pipesocket->frame_interval) {
+    return;
+  }
+
+  uv_mutex_lock(&pipesocket->reader_mutex);
+  uint64_t frame = pipesocket->screen->commit();
+  uv_mutex_unlock(&pipesocket->reader_mutex);
+
+  pipesocket->frame_dirty = false;
+  if (frame != pipesocket->notified_frame) {
+    pipesocket->notified_frame = frame;
+    pipesocket->last_frame = now;
+    ErlNifEnv * msg_env = enif_alloc_env();
+    enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple2(msg_env,
+      nif::atom(msg_env, "frame"),
+      enif_make_uint64(msg_env, frame)
+    ));
+    enif_free_env(msg_env);
+  }
+}
+
+static int
+pty_reader_timeout(pty_pipesocket *pipesocket, uint64_t now) {
+  int timeout = -1;
+  uint64_t idle_timeout = pipesocket->idle_timeout;
+  if (idle_timeout > 0 && !pipesocket->idle) {
+    pty_reader_deadline(timeout, pipesocket->last_output + idle_timeout, now);
+  }
+  if (pipesocket->frame_interval > 0 && pipesocket->frame_dirty) {
+    pty_reader_deadline(timeout, pipesocket->last_frame + pipesocket->frame_interval, now);
+  }
+  if (pipesocket->filters) {
+    uv_mutex_lock(&pipesocket->reader_mutex);
+    uint64_t deadline = pipesocket->filters->deadline();
+    uv_mutex_unlock(&pipesocket->reader_mutex);
+    if (deadline > 0) pty_reader_deadline(timeout, deadline, now);
+  }
+  pty_output_budget &budget = pipesocket->budget;
+  if (budget.enabled()) {
+    // a report to deliver, or reads to resume once refilled
+    if (budget.dropped > 0) {
+      pty_reader_deadline(timeout, now + budget.wait_for(budget.report_cost()), now);
+    } else if (budget.policy == PTY_BUDGET_THROTTLE && budget.tokens <= 0) {
+      pty_reader_deadline(timeout, now + budget.wait_for(1), now);
+    }
+  }
+  return timeout;
+}
+
+/**
+ * Whether a chunk read off the PTY goes out, under an output budget.
+ * Throttling lets it through and makes the reader wait for the bucket
+ * before the next read; otherwise it is dropped when the bucket cannot
+ * take it, and so is anything after it until the drop is reported.
+ */
+
+static bool
+pty_budget_admit(pty_pipesocket *pipesocket, const char *data, size_t len, uint64_t now) {
+  pty_output_budget &budget = pipesocket->budget;
+  if (!budget.enabled()) return true;
+
+  budget.refill(now);
+  if (budget.policy == PTY_BUDGET_THROTTLE) {
+    budget.tokens -= (double)len;
+    return true;
+  }
+  if (budget.dropped == 0 && budget.tokens >= (double)len) {
+    budget.tokens -= (double)len;
+    return true;
+  }
+
+  budget.dropped += len;
+  if (budget.policy == PTY_BUDGET_TAIL) {
+    budget.keep_tail(data, len);
+  }
+  return false;
+}
+
+static bool
+pty_budget_throttled(pty_pipesocket *pipesocket, uint64_t now) {
+  pty_output_budget &budget = pipesocket->budget;
+  if (!budget.enabled() || budget.policy != PTY_BUDGET_THROTTLE) return false;
+  budget.refill(now);
+  return budget.tokens <= 0;
+}
+
+/**
+ * Sends {:dropped, bytes} and then the tail once the bucket allows it,
+ * or right away when `force`d at the end of the output or the budget
+ * has been lifted.
+ */
+
+static void
+pty_budget_flush(pty_pipesocket *pipesocket, uint64_t now, bool force) {
+  pty_output_budget &budget = pipesocket->budget;
+  if (budget.dropped == 0) return;
+
+  if (budget.enabled() && !force) {
+    budget.refill(now);
+    if (budget.tokens < budget.report_cost()) return;
+    budget.tokens -= (double)budget.tail.size();
+  }
+
+  uint64_t lost = budget.dropped - budget.tail.size();
+  pty_stats::bump(pipesocket->stats.bytes_dropped, lost);
+  ErlNifEnv * msg_env = enif_alloc_env();
+  enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple2(msg_env,
+    nif::atom(msg_env, "dropped"),
+    enif_make_uint64(msg_env, lost)
+  ));
+  enif_free_env(msg_env);
+
+  if (!budget.tail.empty()) {
+    uv_mutex_lock(&pipesocket->reader_mutex);
+    pty_send_data(pipesocket, budget.tail.data(), budget.tail.size(), pipesocket->read_time);
+    uv_mutex_unlock(&pipesocket->reader_mutex);
+  }
+  budget.dropped = 0;
+  budget.tail.clear();
+}
+
+/**
+ * Writes what the link holds for the peer or the socket, as much as it
+ * takes; null or why the link cannot go on. The reader never waits for
+ * a write mutex: while ExPTY.write/2 holds it the bytes stay in the
+ * buffer, which is polled for POLLOUT and flushed on the next tick.
+ */
+
+static const char *
+pty_link_flush_out(pty_pipesocket *pipesocket) {
+  pty_link &link = *pipesocket->link;
+  pty_pipesocket *peer = link.peer;
+  const char *start = link.out.data.data() + link.out.offset;
+  uint64_t written = 0;
+  bool ok;
+
+  if (peer) {
+    // not interleaved with ExPTY.write/2 to the peer
+    if (uv_mutex_trylock(&peer->mutex) != 0) return nullptr;
+    ok = link.out.flush(link.fd, false, written);
+    uv_mutex_unlock(&peer->mutex);
+    if (written > 0) {
+      pty_stats::bump(peer->stats.writes);
+      pty_stats::bump(peer->stats.bytes_written, written);
+      if (peer->recorder && peer->record_input) {
+        peer->recorder->record('i', start, (size_t)written, uv_hrtime());
+      }
+    }
+  } else {
+    ok = link.out.flush(link.fd, true, written);
+  }
+  pty_stats::bump(pipesocket->stats.bytes_forwarded, written);
+  if (ok) return nullptr;
+  // EIO: the peer's child has exited
+  return peer && errno == EIO ? "peer exited" : strerror(errno);
+}
+
+// what came from the socket, to the master of the session
+static const char *
+pty_link_flush_in(pty_pipesocket *pipesocket) {
+  pty_link &link = *pipesocket->link;
+  const char *start = link.in.data.data() + link.in.offset;
+  uint64_t written = 0;
+
+  if (uv_mutex_trylock(&pipesocket->mutex) != 0) return nullptr;
+  bool ok = link.in.flush(pipesocket->fd, false, written);
+  uv_mutex_unlock(&pipesocket->mutex);
+  if (written > 0) {
+    pty_stats::bump(pipesocket->stats.writes);
+    pty_stats::bump(pipesocket->stats.bytes_written, written);
+    if (pipesocket->recorder && pipesocket->record_input) {
+      pipesocket->recorder->record('i', start, (size_t)written, uv_hrtime());
+    }
+  }
+  return ok ? nullptr : strerror(errno);
+}
+
+/**
+ * What the reader polls for: the master only once the peer or the
+ * socket has taken the last read, and for the socket to send more only
+ * once the master has taken what it sent last.
+ */
+
+static void
+pty_link_events(pty_link &link, struct pollfd &master, struct pollfd &other) {
+  other.fd = link.fd;
+  other.events = 0;
+  if (!link.out.empty()) {
+    master.events = 0;
+    other.events |= POLLOUT;
+  }
+  if (link.socket && link.bidirectional) {
+    if (link.in.empty()) {
+      other.events |= POLLIN;
+    } else {
+      master.events |= POLLOUT;
+    }
+  }
+}
+
+static const char *
+pty_link_service(pty_pipesocket *pipesocket, short master_events, short other_events) {
+  pty_link &link = *pipesocket->link;
+  const char *reason = nullptr;
+
+  if ((master_events & POLLOUT) && (reason = pty_link_flush_in(pipesocket))) return reason;
+  if ((other_events & POLLOUT) && (reason = pty_link_flush_out(pipesocket))) return reason;
+  if (other_events & POLLIN) {
+    char buffer[4096];
+    ssize_t n = read(link.fd, buffer, sizeof(buffer));
+    if (n == 0) return "closed";
+    if (n < 0) return errno == EAGAIN || errno == EINTR ? nullptr : strerror(errno);
+    link.in.append(buffer, (size_t)n);
+    return pty_link_flush_in(pipesocket);
+  }
+  if (other_events & (POLLHUP | POLLERR)) {
+    return link.peer ? "peer exited" : "closed";
+  }
+  return nullptr;
+}
+
+// the reader takes the link connect/3 or disconnect/1 left for it
+static void
+pty_link_update(pty_pipesocket *pipesocket) {
+  uv_mutex_lock(&pipesocket->reader_mutex);
+  std::unique_ptr<pty_link> next = std::move(pipesocket->next_link);
+  pipesocket->relink = false;
+  uv_mutex_unlock(&pipesocket->reader_mutex);
+
+  pty_link_close(pipesocket, nullptr);
+  pipesocket->link = std::move(next);
+}
+
+/**
+ * Ends the link, what the peer or the socket has not taken goes to the
+ * owner. With a `reason` the link has ended by itself: the session is
+ * no longer connected and {:disconnected, reason} is reported, unless
+ * connect/3 or disconnect/1 has been called meanwhile.
+ */
+
+static void
+pty_link_close(pty_pipesocket *pipesocket, const char *reason) {
+  if (!pipesocket->link) return;
+  std::string rest = pipesocket->link->out.take();
+  pipesocket->link.reset();
+
+  uv_mutex_lock(&pipesocket->reader_mutex);
+  if (!rest.empty()) {
+    pty_send_data(pipesocket, rest.data(), rest.size(), pipesocket->read_time);
+  }
+  pty_pipesocket *back = nullptr;
+  bool report = reason && !pipesocket->relink;
+  if (report) {
+    pipesocket->connected = false;
+    back = pipesocket->linked_back;
+    pipesocket->linked_back = nullptr;
+  }
+  uv_mutex_unlock(&pipesocket->reader_mutex);
+  if (back) enif_release_resource(back);
+
+  if (report) {
+    ErlNifEnv * msg_env = enif_alloc_env();
+    ERL_NIF_TERM term;
+    unsigned char * ptr = enif_make_new_binary(msg_env, strlen(reason), &term);
+    if (ptr) {
+      memcpy(ptr, reason, strlen(reason));
+      enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple2(msg_env,
+        nif::atom(msg_env, "disconnected"),
+        term
+      ));
+    }
+    enif_free_env(msg_env);
+  }
+}
+
+static void
+pty_pipesocket_fn(void *data) {
+  pty_pipesocket *pipesocket = static_cast<pty_pipesocket*>(data);
+
+  int fd = pipesocket->fd;
+  int activity;
+
+  // the master, the wakeup pipe and the peer or the socket when connected
+  struct pollfd fds[3];
+  fds[0].fd = fd;
+  fds[0].events = POLLIN;
+  fds[1].fd = pipesocket->wakeup[0];
+  fds[1].events = POLLIN;
+  fds[2].fd = -1;
+  fds[2].events = 0;
+
+  while (!pipesocket->baton->fd_closed) {
+    uint64_t now = uv_hrtime();
+    if (pipesocket->relink) {
+      pty_link_update(pipesocket);
+    }
+    pty_link *link = pipesocket->link.get();
+    pty_budget_flush(pipesocket, now, false);
+    // throttled: the output waits in the kernel, the child blocks
+    fds[0].events = pty_budget_throttled(pipesocket, now) ? 0 : POLLIN;
+    fds[2].fd = -1;
+    if (link) {
+      pty_link_events(*link, fds[0], fds[2]);
+    }
+    activity = poll(fds, 3, pty_reader_timeout(pipesocket, now));
+
+    if (activity < 0) {
+      continue;
+    }
+
+    if (link && ((fds[0].revents & POLLOUT) || fds[2].revents)) {
+      const char *reason = pty_link_service(pipesocket, fds[0].revents, fds[2].revents);
+      if (reason) {
+        pty_link_close(pipesocket, reason);
+        link = nullptr;
+      }
+    }
+
+    if (fds[1].revents & POLLIN) {
+      char drain[64];
+      while (read(fds[1].fd, drain, sizeof(drain)) > 0) {}
+      // e.g. resized, the screen may have changed
+      pipesocket->frame_dirty = true;
+    }
+
+    if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+      const size_t buf_size = 1024;
+      // one more for the control byte in packet mode
+      char packet[buf_size + 1];
+      char *buffer = packet;
+      ssize_t bytes_read = read(fd, packet, pipesocket->packet_mode ? buf_size + 1 : buf_size);
+      // one clock read per read(), not per message
+      ErlNifTime read_time = pipesocket->timestamps ? enif_monotonic_time(ERL_NIF_NSEC) : 0;
+      pty_stats::bump(pipesocket->stats.reads);
+      if (bytes_read < 0 && errno == EAGAIN) {
+        pty_stats::bump(pipesocket->stats.eagain);
+      }
+      if (bytes_read == 0 || (bytes_read < 0 && errno != EAGAIN && errno != EINTR)) {
+        // EIO: the slave side has been closed
+        pty_budget_flush(pipesocket, uv_hrtime(), true);
+        uv_mutex_lock(&pipesocket->reader_mutex);
+        pty_send_filtered(pipesocket, true);
+        if (pipesocket->line_framing) {
+          pty_send_lines(pipesocket, nullptr, 0, true);
+        }
+        uv_mutex_unlock(&pipesocket->reader_mutex);
+
+        pipesocket->baton->fd_closed = true;
+        close(fd);
+        if (!pipesocket->baton->exited) {
+          kill(pipesocket->baton->pid, SIGHUP);
+        }
+        break;
+      }
+
+      if (bytes_read > 0 && pipesocket->packet_mode) {
+        if (packet[0] == TIOCPKT_DATA) {
+          buffer = packet + 1;
+          bytes_read--;
+        } else {
+          // a status change alone, no data
+          pty_packet_status(pipesocket, (unsigned char)packet[0]);
+          bytes_read = 0;
+        }
+      }
+
+      if (bytes_read > 0) {
+        pipesocket->last_output = uv_hrtime();
+        pipesocket->frame_dirty = true;
+        pty_stats::bump(pipesocket->stats.bytes_read, (uint64_t)bytes_read);
+        pipesocket->output_rate.add((uint64_t)bytes_read, pipesocket->last_output);
+        if (pipesocket->recorder) {
+          pipesocket->recorder->record('o', buffer, (size_t)bytes_read, pipesocket->last_output);
+        }
+        pipesocket->tee.feed(buffer, (size_t)bytes_read);
+        if (pipesocket->idle) {
+          pipesocket->idle = false;
+          ErlNifEnv * msg_env = enif_alloc_env();
+          enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple1(msg_env,
+            nif::atom(msg_env, "active")
+          ));
+          enif_free_env(msg_env);
+        }
+
+        uv_mutex_lock(&pipesocket->reader_mutex);
+        pipesocket->read_time = read_time;
+        pty_echo_probe &probe = pipesocket->echo_probe;
+        // output read before the probed write started cannot be its echo
+        if (probe.armed && pipesocket->last_output >= probe.sent) {
+          if (probe.expire(pipesocket->last_output)) {
+            pty_stats::bump(pipesocket->stats.echo_timeouts);
+          } else if (probe.feed(buffer, bytes_read)) {
+            uint64_t latency = pipesocket->last_output - probe.sent;
+            pipesocket->stats.echo_latency.record(latency);
+            ErlNifEnv * msg_env = enif_alloc_env();
+            enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple2(msg_env,
+              nif::atom(msg_env, "echo"),
+              enif_make_uint64(msg_env, latency)
+            ));
+            enif_free_env(msg_env);
+          }
+        }
+        if (pipesocket->screen) {
+          pipesocket->screen->feed((const unsigned char *)buffer, bytes_read);
+        }
+
+        pty_expect &expect = pipesocket->expect;
+        if (link) {
+          // connected, forwarded once the lock is released
+        } else if (!pty_budget_admit(pipesocket, buffer, bytes_read, pipesocket->last_output)) {
+          // over budget, dropped or kept for the tail
+        } else if (expect.armed) {
+          size_t end = 0;
+          int32_t id = expect.feed((const unsigned char *)buffer, bytes_read, end);
+          if (expect.pending.empty()) {
+            pipesocket->pending_since = read_time;
+          }
+          std::string evicted;
+          if (id < 0) {
+            expect.append(buffer, bytes_read, evicted);
+            if (!evicted.empty()) {
+              pty_send_data(pipesocket, evicted.data(), evicted.size(), read_time);
+            }
+            if (!expect.suppress) {
+              pty_send_data(pipesocket, buffer, bytes_read, read_time);
+            }
+          } else {
+            if (!expect.suppress) {
+              pty_send_data(pipesocket, buffer, bytes_read, read_time);
+            }
+
+            expect.append(buffer, end, evicted);
+            if (!evicted.empty()) {
+              pty_send_data(pipesocket, evicted.data(), evicted.size(), read_time);
+            }
+            pty_send_match(pipesocket, id, end == (size_t)bytes_read || buffer[end] == '\n');
+
+            if (expect.suppress && end < (size_t)bytes_read) {
+              pty_send_data(pipesocket, buffer + end, bytes_read - end, read_time);
+            }
+            expect.disarm();
+          }
+        } else {
+          pty_send_data(pipesocket, buffer, bytes_read, read_time);
+        }
+        uv_mutex_unlock(&pipesocket->reader_mutex);
+        if (link) {
+          link->out.append(buffer, (size_t)bytes_read);
+          const char *reason = pty_link_flush_out(pipesocket);
+          if (reason) {
+            pty_link_close(pipesocket, reason);
+            link = nullptr;
+          }
+        }
+        pipesocket->stats.read_to_send.record(uv_hrtime() - pipesocket->last_output);
+      }
+    }
+
+    if (pipesocket->filters) {
+      uv_mutex_lock(&pipesocket->reader_mutex);
+      pty_send_filtered(pipesocket, false);
+      uv_mutex_unlock(&pipesocket->reader_mutex);
+    }
+
+    uint64_t idle_timeout = pipesocket->idle_timeout;
+    if (idle_timeout > 0 && !pipesocket->idle) {
+      uint64_t quiet = uv_hrtime() - pipesocket->last_output;
+      if (quiet >= idle_timeout) {
+        pipesocket->idle = true;
+
+        // a prompt does not end with a newline, hand it out once quiet
+        uv_mutex_lock(&pipesocket->reader_mutex);
+        if (pipesocket->line_framing) {
+          pty_send_lines(pipesocket, nullptr, 0, true);
+        }
+        uv_mutex_unlock(&pipesocket->reader_mutex);
+
+        ErlNifEnv * msg_env = enif_alloc_env();
+        enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple2(msg_env,
+          nif::atom(msg_env, "idle"),
+          enif_make_uint64(msg_env, quiet / 1000000)
+        ));
+        enif_free_env(msg_env);
+      }
+    }
+
+    if (pipesocket->frame_interval > 0) {
+      pty_send_frame(pipesocket, uv_hrtime());
+    }
+  }
+
+  if (pipesocket->recorder) {
+    // flushes and syncs the rest of the recording
+    pipesocket->recorder->close();
+  }
+  // writes out what the targets have not had yet
+  pipesocket->tee.close();
+
+  pty_link_close(pipesocket, nullptr);
+  uv_mutex_lock(&pipesocket->reader_mutex);
+  pty_pipesocket *back = pipesocket->linked_back;
+  pipesocket->next_link.reset();
+  pipesocket->connected = false;
+  pipesocket->linked_back = nullptr;
+  uv_mutex_unlock(&pipesocket->reader_mutex);
+  if (back) enif_release_resource(back);
+
+  uv_mutex_lock(&pipesocket->reader_mutex);
+  close(pipesocket->wakeup[0]);
+  close(pipesocket->wakeup[1]);
+  pipesocket->wakeup[0] = pipesocket->wakeup[1] = -1;
+  uv_mutex_unlock(&pipesocket->reader_mutex);
+
+  pty_release_thread(pipesocket);
+}
+
+/**
+ * Reports the control byte of packet mode: {:flow, :stopped | :started}
+ * when the line discipline stops or restarts the output (XOFF/XON with
+ * IXON), {:flush, :read | :write} when a queue is flushed and
+ * {:flow_control, boolean} when XON/XOFF handling is turned on or off.
+ * While stopped the child blocks in write(), so nothing new reaches the
+ * reader until it is started again.
+ */
+
+static void
+pty_packet_status(pty_pipesocket *pipesocket, unsigned char status) {
+  static const struct { unsigned char bit; const char *tag; const char *value; } events[] = {
+    {TIOCPKT_FLUSHREAD, "flush", "read"},
+    {TIOCPKT_FLUSHWRITE, "flush", "write"},
+    {TIOCPKT_STOP, "flow", "stopped"},
+    {TIOCPKT_START, "flow", "started"},
+    {TIOCPKT_NOSTOP, "flow_control", "false"},
+    {TIOCPKT_DOSTOP, "flow_control", "true"},
+  };
+
+  ErlNifEnv * msg_env = enif_alloc_env();
+  for (auto &event : events) {
+    if (status & event.bit) {
+      enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple2(msg_env,
+        nif::atom(msg_env, event.tag),
+        nif::atom(msg_env, event.value)
+      ));
+    }
+  }
+  enif_free_env(msg_env);
+}
+
+/**
+ * The read time of a chunk for timestamps: true, an integer when it
+ * came from a single read, {first, last} when coalesced from several.
+ */
+
+static ERL_NIF_TERM
+pty_make_timestamp(ErlNifEnv *env, ErlNifTime first, ErlNifTime last) {
+  if (first == last) return enif_make_int64(env, first);
+  return enif_make_tuple2(env, enif_make_int64(env, first), enif_make_int64(env, last));
+}
+
+/**
+ * Sends output read from the PTY, through the filters of the session
+ * if it has any, see pipeline.h.
+ */
+
+static void
+pty_send_data(pty_pipesocket *pipesocket, const char *data, size_t len, ErlNifTime since) {
+  if (!pipesocket->filters) {
+    pty_send_output(pipesocket, data, len, since);
+    return;
+  }
+
+  pty_chunk chunk{data, len, since};
+  if (pipesocket->filters->apply(chunk, uv_hrtime())) {
+    pty_send_output(pipesocket, chunk.data, chunk.len, chunk.since);
+  }
+}
+
+static void
+pty_send_chunk(void *pipesocket, const pty_chunk &chunk) {
+  pty_send_output((pty_pipesocket *)pipesocket, chunk.data, chunk.len, chunk.since);
+}
+
+// what the filters hold back, once due or on EOF
+static void
+pty_send_filtered(pty_pipesocket *pipesocket, bool eof) {
+  if (pipesocket->filters) {
+    pipesocket->filters->flush(uv_hrtime(), eof, pty_send_chunk, pipesocket);
+  }
+}
+
+/**
+ * Sends {:data, binary}, or {:data, ts, binary} with timestamps: true,
+ * `since` being the read time of the first byte of `data`.
+ */
+
+static void
+pty_send_output(pty_pipesocket *pipesocket, const char *data, size_t len, ErlNifTime since) {
+  if (pipesocket->line_framing) {
+    pty_send_lines(pipesocket, data, len, false);
+    return;
+  }
+
+  ERL_NIF_TERM dataread;
+  unsigned char * ptr;
+
+  ErlNifEnv * msg_env = enif_alloc_env();
+  if ((ptr = enif_make_new_binary(msg_env, len, &dataread)) != nullptr) {
+    memcpy(ptr, data, len);
+    ERL_NIF_TERM msg;
+    if (pipesocket->timestamps) {
+      msg = enif_make_tuple3(msg_env,
+        nif::atom(msg_env, "data"),
+        pty_make_timestamp(msg_env, since, pipesocket->read_time),
+        dataread
+      );
+    } else {
+      msg = enif_make_tuple2(msg_env, nif::atom(msg_env, "data"), dataread);
+    }
+    enif_send(NULL, pipesocket->process, msg_env, msg);
+    pty_stats::bump(pipesocket->stats.messages);
+  }
+  enif_free_env(msg_env);
+}
+
+/**
+ * Sends the complete lines in `data` as {:lines, [binary]}, lines within
+ * the chunk are sub-binaries of a single binary. With timestamps: true,
+ * {:lines, ts, [binary]} where ts spans the reads of the first and the
+ * last byte, lines may be carried over from earlier reads.
+ */
+
+static void
+pty_send_lines(pty_pipesocket *pipesocket, const char *data, size_t len, bool flush) {
+  std::vector<pty_line_framer::line> lines;
+  pty_line_framer &framer = pipesocket->framer;
+  bool carried = !framer.partial.empty();
+  ErlNifTime first = carried ? pipesocket->partial_since : pipesocket->read_time;
+  ErlNifTime last = flush ? pipesocket->partial_until : pipesocket->read_time;
+  framer.feed(data, len, lines);
+  if (!framer.partial.empty()) {
+    // the carried bytes now start in this read
+    if (!carried || !lines.empty()) pipesocket->partial_since = pipesocket->read_time;
+    pipesocket->partial_until = pipesocket->read_time;
+  }
+  if (flush) {
+    framer.flush(lines);
+  }
+  if (lines.empty()) return;
+
+  ErlNifEnv * msg_env = enif_alloc_env();
+  ERL_NIF_TERM chunk = 0;
+  unsigned char * ptr = nullptr;
+  std::vector<ERL_NIF_TERM> terms;
+  terms.reserve(lines.size());
+
+  for (const auto &line : lines) {
+    ERL_NIF_TERM term;
+    if (line.offset >= 0) {
+      if (chunk == 0) {
+        if ((ptr = enif_make_new_binary(msg_env, len, &chunk)) == nullptr) break;
+        memcpy(ptr, data, len);
+      }
+      term = enif_make_sub_binary(msg_env, chunk, line.offset, line.len);
+    } else {
+      if ((ptr = enif_make_new_binary(msg_env, line.len, &term)) == nullptr) break;
+      memcpy(ptr, line.text.data(), line.len);
+    }
+    terms.push_back(term);
+  }
+
+  ERL_NIF_TERM list = enif_make_list_from_array(msg_env, terms.data(), (unsigned)terms.size());
+  if (pipesocket->timestamps) {
+    enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple3(msg_env,
+      nif::atom(msg_env, "lines"),
+      pty_make_timestamp(msg_env, first, last),
+      list
+    ));
+  } else {
+    enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple2(msg_env, nif::atom(msg_env, "lines"), list));
+  }
+  enif_free_env(msg_env);
+  pty_stats::bump(pipesocket->stats.messages);
+}
+
+/**
+ * Reports a match of the armed expect, `pending` ends with the match.
+ * Literal matches are sent as {:match, id, before, matched}, regex
+ * matches as {:match, id, before, matched, captures}.
+ */
+
+static void
+pty_send_match(pty_pipesocket *pipesocket, int32_t id, bool eol_at_end) {
+  pty_expect &expect = pipesocket->expect;
+  const std::string &pending = expect.pending;
+  size_t matched_len = 0;
+  std::vector<int> caps;
+
+  if (expect.regex) {
+    size_t window = std::min(pending.size(), expect.lookbehind);
+    size_t offset = pending.size() - window;
+    bool line_start = offset == 0 || pending[offset - 1] == '\n';
+    if (expect.regex_matcher.captures(id, (const unsigned char *)pending.data() + offset, window,
+                                      line_start, eol_at_end, caps)) {
+      matched_len = window - caps[0];
+    } else {
+      // the match is longer than the lookbehind window
+      matched_len = window;
+      caps.assign(2, 0);
+    }
+  } else {
+    matched_len = std::min(pending.size(), expect.matcher.patterns[id].size());
+  }
+  size_t before_len = pending.size() - matched_len;
+
+  ERL_NIF_TERM before, match;
+  unsigned char * ptr;
+  ErlNifEnv * msg_env = enif_alloc_env();
+  if ((ptr = enif_make_new_binary(msg_env, before_len, &before)) != nullptr) {
+    memcpy(ptr, pending.data(), before_len);
+    if ((ptr = enif_make_new_binary(msg_env, matched_len, &match)) != nullptr) {
+      memcpy(ptr, pending.data() + before_len, matched_len);
+      if (expect.regex) {
+        // offsets relative to the start of the match, like Regex.run(..., return: :index)
+        std::vector<ERL_NIF_TERM> groups;
+        int start = caps[0];
+        for (size_t i = 0; i + 1 < caps.size(); i += 2) {
+          if (caps[i] < 0 || caps[i + 1] < 0) {
+            groups.push_back(enif_make_tuple2(msg_env, enif_make_int(msg_env, -1), enif_make_int(msg_env, 0)));
+          } else {
+            groups.push_back(enif_make_tuple2(msg_env,
+              enif_make_int(msg_env, caps[i] - start),
+              enif_make_int(msg_env, caps[i + 1] - caps[i])
+            ));
+          }
+        }
+        enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple5(msg_env,
+          nif::atom(msg_env, "match"),
+          enif_make_int(msg_env, id),
+          before,
+          match,
+          enif_make_list_from_array(msg_env, groups.data(), (unsigned)groups.size())
+        ));
+      } else {
+        enif_send(NULL, pipesocket->process, msg_env, enif_make_tuple4(msg_env,
+          nif::atom(msg_env, "match"),
+          enif_make_int(msg_env, id),
+          before,
+          match
+        ));
+      }
+    }
+  }
+  enif_free_env(msg_env);
+}
+
+void pty_pipesocket::wake() {
+  uv_mutex_lock(&this->reader_mutex);
+  if (this->wakeup[1] != -1) {
+    const char c = 0;
+    (void)! ::write(this->wakeup[1], &c, 1);
+  }
+  uv_mutex_unlock(&this->reader_mutex);
+}
+
+size_t pty_pipesocket::write(void * data, size_t len) {
+  if (this->baton->fd_closed) {
+    return 0;
+  }
+
+  uv_mutex_lock(&this->mutex);
+  uint64_t started = uv_hrtime();
+  if (this->echo_probe.wanted()) {
+    // armed before the bytes go out, the echo may be read before write() returns
+    uv_mutex_lock(&this->reader_mutex);
+    if (this->echo_probe.expire(started)) {
+      pty_stats::bump(this->stats.echo_timeouts);
+    }
+    if (this->echo_probe.arm((const char *)data, len, started)) {
+      pty_stats::bump(this->stats.echo_probes);
+    }
+    uv_mutex_unlock(&this->reader_mutex);
+  }
+  size_t bytes_to_write = len, bytes_written = 0, buffer_size = 1024, nbytes = 0;
+
+  // blocks until the child has taken everything, as long as the PTY is
+  // open: while its input buffer is full, waits for it to become
+  // writable again, looking at fd_closed every 100 ms
+  while (true) {
+    nbytes = buffer_size;
+    if (buffer_size > bytes_to_write) {
+      nbytes = bytes_to_write;
+    }
+
+    if (this->baton->fd_closed) {
+      break;
+    }
+
+    ssize_t bytes_written_cur = ::write(this->fd, ((void *)(int64_t *)(((size_t)(char *)data) + bytes_written)), nbytes);
+    if (bytes_written_cur > 0) {
+      bytes_written += bytes_written_cur;
+      bytes_to_write -= bytes_written_cur;
+      if (bytes_written == len) {
+        break;
+      }
+    } else if (bytes_written_cur == -1 && errno == EINTR) {
+      continue;
+    } else if (bytes_written_cur == -1 && errno == EAGAIN) {
+      pty_stats::bump(this->stats.eagain);
+      pty_stats::bump(this->stats.write_retries);
+      struct pollfd pfd = {this->fd, POLLOUT, 0};
+      poll(&pfd, 1, 100);
+    } else if (bytes_written_cur == 0) {
+      pty_stats::bump(this->stats.write_retries);
+      usleep(1000);
+    } else {
+      // EIO once the child side is gone, it will take nothing more
+      break;
+    }
+  }
+
+  pty_stats::bump(this->stats.writes);
+  pty_stats::bump(this->stats.bytes_written, bytes_written);
+  if (bytes_written < len) {
+    pty_stats::bump(this->stats.partial_writes);
+  }
+  this->stats.write_duration.record(uv_hrtime() - started);
+
+  uv_mutex_unlock(&this->mutex);
+  return bytes_written;
+}
+
+/**
+ * A single attempt for the threads that must not wait for the child or
+ * for ExPTY.write/2, such as the replay workers: the bytes taken, 0 when
+ * the PTY is full or a write is in progress, -1 once it takes no more.
+ */
+ssize_t pty_pipesocket::try_write(const void * data, size_t len) {
+  if (this->baton->fd_closed) {
+    return -1;
+  }
+  if (uv_mutex_trylock(&this->mutex) != 0) {
+    return 0;
+  }
+
+  ssize_t nbytes;
+  do {
+    nbytes = ::write(this->fd, data, len);
+  } while (nbytes == -1 && errno == EINTR);
+
+  if (nbytes > 0) {
+    pty_stats::bump(this->stats.writes);
+    pty_stats::bump(this->stats.bytes_written, (uint64_t)nbytes);
+    if ((size_t)nbytes < len) {
+      pty_stats::bump(this->stats.partial_writes);
+    }
+  } else if (nbytes == -1 && errno == EAGAIN) {
+    pty_stats::bump(this->stats.eagain);
+    nbytes = 0;
+  }
+
+  uv_mutex_unlock(&this->mutex);
+  return nbytes;
+}
+
+/**
+ * pty_waitpid
+ * Wait for SIGCHLD to read exit status.
+ */
+
+static void pty_waitpid(void *data) {
+  int ret;
+  int stat_loc;
+
+  pty_pipesocket *pipesocket = static_cast<pty_pipesocket*>(data);
+  pty_baton *baton = pipesocket->baton;
+
+  errno = 0;
+
+  signal(SIGCHLD, SIG_DFL);
+  if ((ret = waitpid(baton->pid, &stat_loc, 0)) != baton->pid) {
+    if (ret == -1 && errno == EINTR) {
+      return pty_waitpid(pipesocket);
+    }
+  }
+
+  baton->exited = true;
+  uv_mutex_lock(&processes_mutex);
+  processes.erase(baton->pid);
+  uv_mutex_unlock(&processes_mutex);
+
+  if (WIFEXITED(stat_loc)) {
+    baton->exit_code = WEXITSTATUS(stat_loc); // errno?
+  }
+
+  if (WIFSIGNALED(stat_loc)) {
+    baton->signal_code = WTERMSIG(stat_loc);
+  }
+
+  ErlNifEnv * msg_env = enif_alloc_env();
+  enif_send(NULL, baton->process, msg_env, enif_make_tuple3(msg_env,
+    nif::atom(msg_env, "exit"),
+    enif_make_int(msg_env, baton->exit_code),
+    enif_make_int(msg_env, baton->signal_code)
+  ));
+  enif_free_env(msg_env);
+
+  pty_release_thread(pipesocket);
+}
+
+/**
+ * pty_release_thread
+ * Called by the reader and waitpid threads on their way out, the last
+ * one drops their reference; the session is destructed once Elixir
+ * has let go of it as well.
+ */
+
+static void
+pty_release_thread(pty_pipesocket *pipesocket) {
+  live_threads--;
+  if (--pipesocket->threads == 0) {
+    enif_release_resource((void *)pipesocket);
+  }
+}
+
+/**
+ * pty_getproc
+ * Name and working directory of a (foreground) process.
+ */
+
+#if defined(__linux__)
+
+static int
+pty_getproc(pid_t pgid, std::string &name, std::string &cwd) {
+  char path[64];
+  char buf[512];
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pgid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) return -1;
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) return -1;
+  buf[len] = '\0';
+
+  // "pid (comm) state ...", comm itself may contain ')'
+  char *start = strchr(buf, '(');
+  char *end = strrchr(buf, ')');
+  if (start == NULL || end == NULL || end < start) {
+    errno = EINVAL;
+    return -1;
+  }
+  name.assign(start + 1, end - start - 1);
+
+  snprintf(path, sizeof(path), "/proc/%d/cwd", (int)pgid);
+  char link[PATH_MAX];
+  len = readlink(path, link, sizeof(link));
+  if (len > 0 && (size_t)len < sizeof(link)) {
+    cwd.assign(link, len);
+  } else {
+    // not permitted to look at other users' processes, or a path
+    // readlink(2) had to truncate, which would name another directory
+    cwd.clear();
+  }
+  return 0;
+}
+
+#elif defined(__APPLE__)
+
+static int
+pty_getproc(pid_t pgid, std::string &name, std::string &cwd) {
+  int mib[4] = { CTL_KERN, KERN_PROC, KERN_PROC_PID, (int)pgid };
+  struct kinfo_proc kp;
+  size_t size = sizeof(kp);
+
+  if (sysctl(mib, 4, &kp, &size, NULL, 0) == -1) return -1;
+  if (size == 0) {
+    errno = ESRCH;
+    return -1;
+  }
+  name = kp.kp_proc.p_comm;
+
+  struct proc_vnodepathinfo vpi;
+  if (proc_pidinfo(pgid, PROC_PIDVNODEPATHINFO, 0, &vpi, sizeof(vpi)) == sizeof(vpi)) {
+    cwd = vpi.pvi_cdir.vip_path;
+  } else {
+    cwd.clear();
+  }
+  return 0;
+}
+
+#else
+
+static int
+pty_getproc(pid_t pgid, std::string &name, std::string &cwd) {
+  errno = ENOSYS;
+  return -1;
+}
+
+#endif
+
+/**
+ * openpty(3) / forkpty(3)
+ */
+
+static int
+pty_openpty(int *amaster,
+            int *aslave,
+            char *name,
+            const struct termios *termp,
+            const struct winsize *winp) {
+#if defined(__sun)
   char *slave_name;
   int slave;
   int master = open("/dev/ptmx", O_RDWR | O_NOCTTY);
@@ -773,11 +3206,42 @@ err:
 #endif
 }
 
+static void pty_pipesocket_dtor(ErlNifEnv *, void *obj) {
+  pty_pipesocket *pipesocket = static_cast<pty_pipesocket *>(obj);
+  // baton->process is the same pid
+  if (pipesocket->process) enif_free(pipesocket->process);
+  delete pipesocket->baton;
+  uv_mutex_destroy(&pipesocket->mutex);
+  uv_mutex_destroy(&pipesocket->reader_mutex);
+  // connected before the reader started, or after it ended
+  if (pipesocket->linked_back) enif_release_resource(pipesocket->linked_back);
+  pipesocket->~pty_pipesocket_();
+  live_sessions--;
+}
+
+static void pty_recording_dtor(ErlNifEnv *, void *obj) {
+  pty_recording *recording = static_cast<pty_recording *>(obj);
+  recording->~pty_recording();
+}
+
+static void pty_replay_dtor(ErlNifEnv *, void *obj) {
+  pty_replay *replay = static_cast<pty_replay *>(obj);
+  replay->~pty_replay();
+}
+
 static int on_load(ErlNifEnv * env, void **, ERL_NIF_TERM) {
   ErlNifResourceType *rt;
-  rt = enif_open_resource_type(env, "Elixir.ExPTY.Nif", "pty_pipesocket", NULL, ERL_NIF_RT_CREATE, NULL);
+  rt = enif_open_resource_type(env, "Elixir.ExPTY.Nif", "pty_pipesocket", pty_pipesocket_dtor, ERL_NIF_RT_CREATE, NULL);
   if (!rt) return -1;
   pty_pipesocket::type = rt;
+  rt = enif_open_resource_type(env, "Elixir.ExPTY.Nif", "pty_recording", pty_recording_dtor, ERL_NIF_RT_CREATE, NULL);
+  if (!rt) return -1;
+  pty_recording::type = rt;
+  rt = enif_open_resource_type(env, "Elixir.ExPTY.Nif", "pty_replay", pty_replay_dtor, ERL_NIF_RT_CREATE, NULL);
+  if (!rt) return -1;
+  pty_replay::type = rt;
+  uv_mutex_init(&proc_cache_mutex);
+  uv_mutex_init(&processes_mutex);
   return 0;
 }
 
@@ -790,13 +3254,40 @@ static int on_upgrade(ErlNifEnv *, void **, void **, ERL_NIF_TERM) {
 }
 
 static ErlNifFunc nif_functions[] = {
-  {"spawn_unix", 14, expty_spawn, ERL_NIF_DIRTY_JOB_IO_BOUND},
+  {"spawn_unix", 15, expty_spawn, ERL_NIF_DIRTY_JOB_IO_BOUND},
   {"write", 2, expty_write, ERL_NIF_DIRTY_JOB_IO_BOUND},
   {"kill", 2, expty_kill, ERL_NIF_DIRTY_JOB_IO_BOUND},
   {"resize", 3, expty_resize, ERL_NIF_DIRTY_JOB_IO_BOUND},
   {"pause", 1, expty_pause, ERL_DIRTY_JOB_IO_BOUND},
   {"resume", 1, expty_resume, ERL_DIRTY_JOB_IO_BOUND},
   {"set_echo", 2, expty_set_echo, ERL_DIRTY_JOB_IO_BOUND},
+  {"set_termios", 2, expty_set_termios, ERL_DIRTY_JOB_IO_BOUND},
+  {"get_termios", 1, expty_get_termios, ERL_DIRTY_JOB_IO_BOUND},
+  {"set_idle_timeout", 2, expty_set_idle_timeout, ERL_DIRTY_JOB_IO_BOUND},
+  {"set_output_budget", 2, expty_set_output_budget, ERL_DIRTY_JOB_IO_BOUND},
+  {"tee", 2, expty_tee, ERL_DIRTY_JOB_IO_BOUND},
+  {"untee", 2, expty_untee, ERL_DIRTY_JOB_IO_BOUND},
+  {"connect", 3, expty_connect, ERL_DIRTY_JOB_IO_BOUND},
+  {"disconnect", 1, expty_disconnect, ERL_DIRTY_JOB_IO_BOUND},
+  {"probe_echo", 1, expty_probe_echo, ERL_DIRTY_JOB_IO_BOUND},
+  {"expect", 3, expty_expect, ERL_DIRTY_JOB_IO_BOUND},
+  {"expect_regex", 5, expty_expect_regex, ERL_DIRTY_JOB_IO_BOUND},
+  {"cancel_expect", 1, expty_cancel_expect, ERL_DIRTY_JOB_IO_BOUND},
+  {"screen", 2, expty_screen, ERL_DIRTY_JOB_IO_BOUND},
+  {"screen_diff", 3, expty_screen_diff, ERL_DIRTY_JOB_IO_BOUND},
+  {"snapshot", 3, expty_snapshot, ERL_DIRTY_JOB_IO_BOUND},
+  {"recording_open", 1, expty_recording_open, ERL_DIRTY_JOB_IO_BOUND},
+  {"recording_info", 1, expty_recording_info, ERL_DIRTY_JOB_IO_BOUND},
+  {"recording_seek", 3, expty_recording_seek, ERL_DIRTY_JOB_CPU_BOUND},
+  {"recording_read", 3, expty_recording_read, ERL_DIRTY_JOB_IO_BOUND},
+  {"replay_start", 6, expty_replay_start, ERL_DIRTY_JOB_CPU_BOUND},
+  {"replay_stop", 1, expty_replay_stop, ERL_DIRTY_JOB_IO_BOUND},
+  {"set_replay_threads", 1, expty_set_replay_threads, ERL_DIRTY_JOB_IO_BOUND},
+  {"foreground_process", 1, expty_foreground_process, ERL_DIRTY_JOB_IO_BOUND},
+  {"foreground_processes", 1, expty_foreground_processes, ERL_DIRTY_JOB_IO_BOUND},
+  {"set_proc_cache_ttl", 1, expty_set_proc_cache_ttl, ERL_DIRTY_JOB_IO_BOUND},
+  {"stats", 1, expty_stats, ERL_DIRTY_JOB_CPU_BOUND},
+  {"live", 0, expty_live, ERL_DIRTY_JOB_IO_BOUND},
 
   // stubs
   {"spawn_win32", 6, expty_stub, ERL_NIF_DIRTY_JOB_IO_BOUND},
@@ -0,0 +1,371 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <erl_nif.h>
+#include <uv.h>
+#include "nif_utils.h"
+
+/**
+ * pty_recorder
+ * Records a session to a file without involving the BEAM per chunk.
+ * Producers (the reader thread, write/2 and resize/3) only copy the
+ * bytes into the pending batch with their uv_hrtime timestamp; a
+ * background thread swaps the batch out, encodes it, writes it with
+ * one large write and calls fdatasync(2) every `sync_interval`.
+ *
+ * The pending batch is bounded, producers wait for the writer when it
+ * is full so that nothing is dropped from the recording.
+ */
+
+struct pty_record_event {
+  // 'o' output, 'i' input, 'r' resize
+  char type;
+  uint64_t ts;
+  size_t offset;
+  size_t len;
+};
+
+struct pty_record_batch {
+  std::vector<pty_record_event> events;
+  std::string data;
+
+  void clear() {
+    events.clear();
+    data.clear();
+  }
+};
+
+struct pty_recorder {
+  int fd = -1;
+  uint64_t start = 0;
+  ErlNifPid owner;
+
+  // the writer wakes up when a batch reaches flush_bytes or every flush_interval
+  size_t flush_bytes = 1 << 20;
+  size_t max_pending = 64 << 20;
+  uint64_t flush_interval = 100000000ULL;
+  uint64_t sync_interval = 1000000000ULL;
+
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  uv_thread_t tid;
+  bool running = false;
+  bool closing = false;
+  pty_record_batch pending;
+
+  // writer thread only
+  pty_record_batch writing;
+  std::string out;
+  int error = 0;
+
+  pty_recorder() {
+    uv_mutex_init(&mutex);
+    uv_cond_init(&cond);
+  }
+
+  virtual ~pty_recorder() {
+    close();
+    uv_cond_destroy(&cond);
+    uv_mutex_destroy(&mutex);
+  }
+
+  // file header, written before any event
+  virtual void header(std::string &out) = 0;
+  // appends the encoding of `batch` to `out`
+  virtual void encode(const pty_record_batch &batch, std::string &out) = 0;
+  // anything held back by encode(), called once when closing
+  virtual void finish(std::string &out) {}
+
+  /**
+   * Creates (or truncates) `path` and starts the writer thread,
+   * returns 0 or an errno value.
+   */
+  int open(const char *path, const ErlNifPid &pid) {
+    fd = ::open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd == -1) return errno;
+
+    owner = pid;
+    start = uv_hrtime();
+    header(out);
+    running = true;
+    uv_thread_create(&tid, writer_fn, this);
+    return 0;
+  }
+
+  void record(char type, const void *data, size_t len, uint64_t ts) {
+    uv_mutex_lock(&mutex);
+    while (running && !closing && pending.data.size() >= max_pending) {
+      uv_cond_wait(&cond, &mutex);
+    }
+    if (running && !closing) {
+      pending.events.push_back(pty_record_event{type, ts, pending.data.size(), len});
+      pending.data.append((const char *)data, len);
+      if (pending.data.size() >= flush_bytes) uv_cond_broadcast(&cond);
+    }
+    uv_mutex_unlock(&mutex);
+  }
+
+  void resize(int cols, int rows, uint64_t ts) {
+    char size[32];
+    int len = snprintf(size, sizeof(size), "%dx%d", cols, rows);
+    record('r', size, (size_t)len, ts);
+  }
+
+  // flushes everything recorded so far and waits for the writer
+  void close() {
+    uv_mutex_lock(&mutex);
+    bool join = running && !closing;
+    closing = true;
+    uv_cond_broadcast(&cond);
+    uv_mutex_unlock(&mutex);
+
+    if (join) {
+      uv_thread_join(&tid);
+    }
+    if (fd != -1) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  void write_out() {
+    size_t pos = 0;
+    while (error == 0 && pos < out.size()) {
+      ssize_t n = ::write(fd, out.data() + pos, out.size() - pos);
+      if (n > 0) {
+        pos += (size_t)n;
+      } else if (n == -1 && errno != EINTR) {
+        failed(errno);
+      }
+    }
+    out.clear();
+  }
+
+  void sync() {
+    if (error != 0) return;
+#if defined(__APPLE__)
+    if (fsync(fd) == -1) failed(errno);
+#else
+    if (fdatasync(fd) == -1) failed(errno);
+#endif
+  }
+
+  // reports the first error to the owner as {:record_error, reason}, later events are dropped
+  void failed(int err) {
+    error = err;
+    ErlNifEnv * msg_env = enif_alloc_env();
+    const char *reason = strerror(err);
+    ERL_NIF_TERM term;
+    unsigned char * ptr = enif_make_new_binary(msg_env, strlen(reason), &term);
+    if (ptr) {
+      memcpy(ptr, reason, strlen(reason));
+      enif_send(NULL, &owner, msg_env, enif_make_tuple2(msg_env,
+        nif::atom(msg_env, "record_error"),
+        term
+      ));
+    }
+    enif_free_env(msg_env);
+  }
+
+  static void writer_fn(void *data) {
+    pty_recorder *recorder = static_cast<pty_recorder *>(data);
+    recorder->write_out();
+    uint64_t last_sync = uv_hrtime();
+
+    uv_mutex_lock(&recorder->mutex);
+    for (;;) {
+      uint64_t deadline = uv_hrtime() + recorder->flush_interval;
+      while (!recorder->closing && recorder->pending.data.size() < recorder->flush_bytes) {
+        uint64_t now = uv_hrtime();
+        if (now >= deadline || uv_cond_timedwait(&recorder->cond, &recorder->mutex, deadline - now) != 0) {
+          break;
+        }
+      }
+      bool done = recorder->closing;
+      std::swap(recorder->pending, recorder->writing);
+      // producers waiting for room can go on
+      uv_cond_broadcast(&recorder->cond);
+      uv_mutex_unlock(&recorder->mutex);
+
+      if (!recorder->writing.events.empty()) {
+        recorder->encode(recorder->writing, recorder->out);
+        recorder->writing.clear();
+      }
+      if (done) {
+        recorder->finish(recorder->out);
+      }
+      recorder->write_out();
+
+      uint64_t now = uv_hrtime();
+      if (done || now - last_sync >= recorder->sync_interval) {
+        recorder->sync();
+        last_sync = now;
+      }
+
+      uv_mutex_lock(&recorder->mutex);
+      if (done) break;
+    }
+    uv_mutex_unlock(&recorder->mutex);
+  }
+};
+
+/**
+ * pty_asciicast
+ * asciicast v2: a JSON header line, then one [time, type, data] line
+ * per event. Output and input are split at arbitrary bytes, so an
+ * incomplete UTF-8 sequence at the end of an event is carried over
+ * to the next one of the same type; invalid bytes become U+FFFD.
+ */
+
+struct pty_asciicast : pty_recorder {
+  int cols;
+  int rows;
+  std::string command;
+  std::string term;
+  // incomplete UTF-8 sequence of the last output and input event
+  std::string carry_output;
+  std::string carry_input;
+
+  pty_asciicast(int c, int r, const std::string &cmd, const std::string &t)
+    : cols(c), rows(r), command(cmd), term(t) {}
+
+  ~pty_asciicast() {
+    close();
+  }
+
+  static void json_escape(const char *data, size_t len, std::string &out) {
+    static const char hex[] = "0123456789abcdef";
+    for (size_t i = 0; i < len; i++) {
+      unsigned char c = (unsigned char)data[i];
+      if (c == '"' || c == '\\') {
+        out.push_back('\\');
+        out.push_back((char)c);
+      } else if (c == '\n') {
+        out += "\\n";
+      } else if (c == '\r') {
+        out += "\\r";
+      } else if (c < 0x20 || c == 0x7F) {
+        out += "\\u00";
+        out.push_back(hex[c >> 4]);
+        out.push_back(hex[c & 0xF]);
+      } else {
+        out.push_back((char)c);
+      }
+    }
+  }
+
+  // length of the valid UTF-8 sequence at data[0], 0 if invalid, -1 if incomplete
+  static int utf8_length(const unsigned char *data, size_t len) {
+    unsigned char c = data[0];
+    int need;
+    if (c < 0x80) return 1;
+    else if (c >= 0xC2 && c <= 0xDF) need = 2;
+    else if (c >= 0xE0 && c <= 0xEF) need = 3;
+    else if (c >= 0xF0 && c <= 0xF4) need = 4;
+    else return 0;
+
+    for (int i = 1; i < need; i++) {
+      if ((size_t)i >= len) return -1;
+      unsigned char b = data[i];
+      if ((b & 0xC0) != 0x80) return 0;
+      // overlong, surrogate and out of range forms
+      if (i == 1 && ((c == 0xE0 && b < 0xA0) || (c == 0xED && b > 0x9F) ||
+                     (c == 0xF0 && b < 0x90) || (c == 0xF4 && b > 0x8F))) {
+        return 0;
+      }
+    }
+    return need;
+  }
+
+  static void utf8_escape(const char *data, size_t len, std::string &carry, std::string &out) {
+    std::string joined;
+    if (!carry.empty()) {
+      joined.swap(carry);
+      joined.append(data, len);
+      data = joined.data();
+      len = joined.size();
+    }
+
+    const unsigned char *p = (const unsigned char *)data;
+    size_t i = 0, run = 0;
+    while (i < len) {
+      int n = utf8_length(p + i, len - i);
+      if (n > 0) {
+        i += (size_t)n;
+        continue;
+      }
+      json_escape(data + run, i - run, out);
+      if (n == -1) {
+        carry.assign(data + i, len - i);
+        return;
+      }
+      out += "\\ufffd";
+      run = ++i;
+    }
+    json_escape(data + run, len - run, out);
+  }
+
+  void stamp(uint64_t ts, std::string &out) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "[%.6f, \"", ts > start ? (double)(ts - start) / 1e9 : 0.0);
+    out += buf;
+  }
+
+  void header(std::string &out) override {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "{\"version\": 2, \"width\": %d, \"height\": %d, \"timestamp\": %lld",
+             cols, rows, (long long)::time(NULL));
+    out += buf;
+    out += ", \"command\": \"";
+    json_escape(command.data(), command.size(), out);
+    out += "\", \"env\": {\"TERM\": \"";
+    json_escape(term.data(), term.size(), out);
+    out += "\"}}\n";
+  }
+
+  void encode(const pty_record_batch &batch, std::string &out) override {
+    for (const pty_record_event &event : batch.events) {
+      const char *data = batch.data.data() + event.offset;
+      size_t rollback = out.size();
+      stamp(event.ts, out);
+      out.push_back(event.type);
+      out += "\", \"";
+      size_t text = out.size();
+      if (event.type == 'o') {
+        utf8_escape(data, event.len, carry_output, out);
+      } else if (event.type == 'i') {
+        utf8_escape(data, event.len, carry_input, out);
+      } else {
+        json_escape(data, event.len, out);
+      }
+      if (out.size() == text) {
+        // only part of a UTF-8 sequence, it goes out with the next event
+        out.resize(rollback);
+        continue;
+      }
+      out += "\"]\n";
+    }
+  }
+
+  void finish(std::string &out) override {
+    // a truncated sequence at the very end
+    uint64_t ts = uv_hrtime();
+    if (!carry_output.empty()) {
+      stamp(ts, out);
+      out += "o\", \"\\ufffd\"]\n";
+    }
+    if (!carry_input.empty()) {
+      stamp(ts, out);
+      out += "i\", \"\\ufffd\"]\n";
+    }
+  }
+};
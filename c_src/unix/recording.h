@@ -0,0 +1,320 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "recorder.h"
+#include "screen.h"
+#include "snapshot.h"
+
+/**
+ * Indexed recordings
+ * An append-only format for long sessions that can be scrubbed
+ * without decoding everything before the point of interest. The
+ * writer keeps its own screen model and appends a keyframe (a
+ * screen snapshot) every few seconds of output, and a time to
+ * offset index of the keyframes when the recording is closed.
+ *
+ * All integers are little-endian:
+ *
+ *   header   "EXPR" version(u8) pad(3) cols(u32) rows(u32) started_at(u64, unix ms)
+ *   record   type(u8) pad(3) len(u32) ts(u64, us since start) data[len]
+ *            'o' output, 'i' input, 'r' resize ("COLSxROWS"), 'k' keyframe
+ *   index    (ts(u64) offset(u64))* of the keyframes
+ *   trailer  index_offset(u64) count(u64) duration(u64, us) "EXPI" version(u32)
+ *
+ * A recording that was not closed has no index, the reader rebuilds
+ * it by walking the records once.
+ */
+
+#define PTY_RECORDING_VERSION 1
+#define PTY_RECORDING_HEADER 24
+#define PTY_RECORDING_RECORD 16
+#define PTY_RECORDING_TRAILER 32
+
+static inline void pty_put_u32(std::string &out, uint32_t v) {
+  for (int i = 0; i < 4; i++) out.push_back((char)(v >> (8 * i)));
+}
+
+static inline void pty_put_u64(std::string &out, uint64_t v) {
+  for (int i = 0; i < 8; i++) out.push_back((char)(v >> (8 * i)));
+}
+
+static inline uint32_t pty_get_u32(const unsigned char *p) {
+  uint32_t v = 0;
+  for (int i = 3; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+static inline uint64_t pty_get_u64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; i--) v = (v << 8) | p[i];
+  return v;
+}
+
+// parses the data of an 'r' record, false if malformed or too large for a screen
+static inline bool pty_parse_resize(const char *data, size_t len, int &cols, int &rows) {
+  std::string size(data, len);
+  if (sscanf(size.c_str(), "%dx%d", &cols, &rows) == 2 && cols > 0 && rows > 0 &&
+      cols <= PTY_SCREEN_MAX_SIZE && rows <= PTY_SCREEN_MAX_SIZE &&
+      (int64_t)cols * rows <= PTY_SCREEN_MAX_CELLS) {
+    return true;
+  }
+  cols = rows = 0;
+  return false;
+}
+
+struct pty_indexed_recorder : pty_recorder {
+  // a keyframe is written after this much time or output since the last one
+  uint64_t keyframe_interval = 5000000;
+  size_t keyframe_bytes = 256 << 10;
+
+  // writer thread only
+  pty_screen screen;
+  uint64_t offset = 0;
+  uint64_t last_ts = 0;
+  uint64_t last_keyframe = 0;
+  size_t since_keyframe = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> index;
+
+  pty_indexed_recorder(int cols, int rows) : screen(cols, rows) {}
+
+  ~pty_indexed_recorder() {
+    close();
+  }
+
+  void append(char type, uint64_t ts, const char *data, size_t len, std::string &out) {
+    out.push_back(type);
+    out.append(3, '\0');
+    pty_put_u32(out, (uint32_t)len);
+    pty_put_u64(out, ts);
+    out.append(data, len);
+    offset += PTY_RECORDING_RECORD + len;
+  }
+
+  void keyframe(uint64_t ts, std::string &out) {
+    std::string snapshot;
+    pty_snapshot_encode(screen, 0, snapshot);
+    index.emplace_back(ts, offset);
+    append('k', ts, snapshot.data(), snapshot.size(), out);
+    last_keyframe = ts;
+    since_keyframe = 0;
+  }
+
+  void header(std::string &out) override {
+    out.append("EXPR", 4);
+    out.push_back(PTY_RECORDING_VERSION);
+    out.append(3, '\0');
+    pty_put_u32(out, (uint32_t)screen.cols);
+    pty_put_u32(out, (uint32_t)screen.rows);
+    pty_put_u64(out, (uint64_t)::time(NULL) * 1000);
+    offset = PTY_RECORDING_HEADER;
+    keyframe(0, out);
+  }
+
+  void encode(const pty_record_batch &batch, std::string &out) override {
+    for (const pty_record_event &event : batch.events) {
+      const char *data = batch.data.data() + event.offset;
+      uint64_t ts = event.ts > start ? (event.ts - start) / 1000 : 0;
+      // producers on different threads may be slightly out of order
+      ts = std::max(ts, last_ts);
+      last_ts = ts;
+
+      append(event.type, ts, data, event.len, out);
+      if (event.type == 'o') {
+        screen.feed((const unsigned char *)data, event.len);
+        since_keyframe += event.len;
+      } else if (event.type == 'r') {
+        int cols = 0, rows = 0;
+        if (pty_parse_resize(data, event.len, cols, rows)) {
+          screen.resize(cols, rows);
+          since_keyframe++;
+        }
+      }
+
+      // a keyframe taken in the middle of an escape or UTF-8 sequence
+      // would lose the part that was already parsed
+      bool ground = screen.state == pty_screen::GROUND && screen.utf8_need == 0;
+      if (since_keyframe > 0 && ground &&
+          (since_keyframe >= keyframe_bytes || ts - last_keyframe >= keyframe_interval)) {
+        keyframe(ts, out);
+      }
+    }
+  }
+
+  void finish(std::string &out) override {
+    uint64_t index_offset = offset;
+    for (auto &entry : index) {
+      pty_put_u64(out, entry.first);
+      pty_put_u64(out, entry.second);
+    }
+    pty_put_u64(out, index_offset);
+    pty_put_u64(out, index.size());
+    pty_put_u64(out, last_ts);
+    out.append("EXPI", 4);
+    pty_put_u32(out, PTY_RECORDING_VERSION);
+  }
+};
+
+/**
+ * pty_recording
+ * Read side of an indexed recording, the file is mapped into memory
+ * so that seeking costs a binary search over the keyframes plus
+ * decoding the output since the nearest one.
+ */
+
+struct pty_recording {
+  struct record {
+    char type;
+    uint64_t ts;
+    const unsigned char *data;
+    size_t len;
+  };
+
+  const unsigned char *map = nullptr;
+  size_t size = 0;
+  // end of the last complete record
+  size_t data_end = 0;
+  int cols = 0;
+  int rows = 0;
+  uint64_t started_at = 0;
+  uint64_t duration = 0;
+  std::vector<std::pair<uint64_t, uint64_t>> index;
+
+  static ErlNifResourceType * type;
+
+  ~pty_recording() {
+    if (map) munmap((void *)map, size);
+  }
+
+  // the record at `offset`, false past the last complete one
+  bool at(size_t offset, record &rec) const {
+    if (offset + PTY_RECORDING_RECORD > data_end) return false;
+    const unsigned char *p = map + offset;
+    rec.type = (char)p[0];
+    rec.len = pty_get_u32(p + 4);
+    rec.ts = pty_get_u64(p + 8);
+    rec.data = p + PTY_RECORDING_RECORD;
+    return offset + PTY_RECORDING_RECORD + rec.len <= data_end;
+  }
+
+  /**
+   * Maps `path` and loads or rebuilds the index, returns 0, an errno
+   * value, or -1 if the file is not an indexed recording.
+   */
+  int open(const char *path) {
+    int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return errno;
+
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      int err = errno;
+      ::close(fd);
+      return err;
+    }
+    size = (size_t)st.st_size;
+    if (size < PTY_RECORDING_HEADER) {
+      ::close(fd);
+      return -1;
+    }
+
+    void *addr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (addr == MAP_FAILED) return errno;
+    map = (const unsigned char *)addr;
+
+    if (memcmp(map, "EXPR", 4) != 0 || map[4] != PTY_RECORDING_VERSION) return -1;
+    cols = (int)pty_get_u32(map + 8);
+    rows = (int)pty_get_u32(map + 12);
+    started_at = pty_get_u64(map + 16);
+    if (cols <= 0 || rows <= 0 || cols > PTY_SCREEN_MAX_SIZE || rows > PTY_SCREEN_MAX_SIZE ||
+        (int64_t)cols * rows > PTY_SCREEN_MAX_CELLS) {
+      return -1;
+    }
+
+    if (!load_index()) rebuild_index();
+    return index.empty() ? -1 : 0;
+  }
+
+  bool load_index() {
+    if (size < PTY_RECORDING_HEADER + PTY_RECORDING_TRAILER) return false;
+    const unsigned char *trailer = map + size - PTY_RECORDING_TRAILER;
+    if (memcmp(trailer + 24, "EXPI", 4) != 0) return false;
+
+    uint64_t index_offset = pty_get_u64(trailer);
+    uint64_t count = pty_get_u64(trailer + 8);
+    if (index_offset < PTY_RECORDING_HEADER || index_offset > size ||
+        count > (size - index_offset) / 16 ||
+        index_offset + count * 16 != size - PTY_RECORDING_TRAILER) {
+      return false;
+    }
+
+    data_end = (size_t)index_offset;
+    duration = pty_get_u64(trailer + 16);
+    index.resize((size_t)count);
+    for (size_t i = 0; i < index.size(); i++) {
+      index[i].first = pty_get_u64(map + index_offset + i * 16);
+      index[i].second = pty_get_u64(map + index_offset + i * 16 + 8);
+      if (index[i].second >= data_end) return false;
+    }
+    return true;
+  }
+
+  // walks the records of a recording that was not closed
+  void rebuild_index() {
+    index.clear();
+    duration = 0;
+    data_end = size;
+    size_t offset = PTY_RECORDING_HEADER;
+    record rec;
+    while (at(offset, rec)) {
+      if (rec.type == 'k') index.emplace_back(rec.ts, offset);
+      duration = rec.ts;
+      offset += PTY_RECORDING_RECORD + rec.len;
+    }
+    data_end = offset;
+  }
+
+  size_t next(size_t offset, const record &rec) const {
+    return offset + PTY_RECORDING_RECORD + rec.len;
+  }
+
+  /**
+   * Restores the screen as it was at `ts` (us) into `screen`, a blank
+   * screen of the recording's size, and returns the offset of the first
+   * record after it. A keyframe that does not decode is replayed over
+   * from the one before it, or from the start of the recording.
+   */
+  size_t seek(uint64_t ts, pty_screen &screen) const {
+    auto it = std::upper_bound(index.begin(), index.end(), std::make_pair(ts, UINT64_MAX));
+    size_t offset = PTY_RECORDING_HEADER;
+    record rec;
+    while (it != index.begin()) {
+      --it;
+      if (at((size_t)it->second, rec) && rec.type == 'k' &&
+          pty_snapshot_decode(rec.data, rec.len, screen)) {
+        offset = next((size_t)it->second, rec);
+        break;
+      }
+    }
+
+    while (at(offset, rec) && rec.ts <= ts) {
+      int c = 0, r = 0;
+      if (rec.type == 'o') {
+        screen.feed(rec.data, rec.len);
+      } else if (rec.type == 'r' && pty_parse_resize((const char *)rec.data, rec.len, c, r)) {
+        screen.resize(c, r);
+      }
+      offset = next(offset, rec);
+    }
+    return offset;
+  }
+};
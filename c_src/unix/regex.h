@@ -0,0 +1,757 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <algorithm>
+#include <bitset>
+#include <map>
+#include <string>
+#include <vector>
+
+/**
+ * pty_regex
+ * Byte-oriented regular expressions for expect-style matching on
+ * terminal output.
+ *
+ * Patterns are parsed into a Thompson NFA. The NFA is run over the
+ * stream as a lazily built DFA with a bounded state cache, so that
+ * the reader thread does one table lookup per byte in the common case
+ * and the automaton state is carried across reads. Once the DFA has
+ * found the end of the earliest match, a Pike VM is run over a
+ * bounded lookbehind window ending there to recover the start of the
+ * match and the capture groups.
+ *
+ * Supported syntax: literals, `.`, `[...]` / `[^...]` with ranges,
+ * `\d \w \s \D \W \S`, `\n \r \t \f \v \e \0 \xHH`, escaped
+ * punctuation, `(...)`, `(?:...)`, `|`, `* + ? {m} {m,} {m,n}` and
+ * their lazy forms, `^` (start of line) and `$` (before a newline or
+ * at the end of the output read so far). Groups and repeats nest at
+ * most 256 levels deep.
+ */
+
+struct pty_regex_node {
+  enum kind_t : uint8_t { CHAR, SPLIT, JMP, SAVE, BOL, EOL, MATCH };
+  kind_t kind;
+  int32_t out;
+  int32_t out1;
+  // class index for CHAR, slot for SAVE, pattern index for MATCH
+  int32_t arg;
+};
+
+struct pty_regex_ast {
+  enum kind_t { EMPTY, CLASS, CAT, ALT, REPEAT, GROUP, BOL, EOL };
+  kind_t kind = EMPTY;
+  std::vector<pty_regex_ast> kids;
+  int32_t arg = -1;
+  int min = 0;
+  // -1 for unbounded
+  int max = 0;
+  bool greedy = true;
+  // groups and repeats on the deepest path down from here
+  int nesting = 0;
+};
+
+struct pty_regex_parser {
+  const std::string &src;
+  size_t pos = 0;
+  int ngroups = 1;
+  // parsing and compiling recurse once per level, bounds both
+  int max_nesting = 256;
+  // open groups
+  int depth = 0;
+  std::vector<std::bitset<256>> &classes;
+  std::string error;
+
+  pty_regex_parser(const std::string &s, std::vector<std::bitset<256>> &c) : src(s), classes(c) {}
+
+  bool fail(const char *msg) {
+    if (error.empty()) {
+      error = std::string(msg) + " at position " + std::to_string(pos);
+    }
+    return false;
+  }
+
+  bool eof() const { return pos >= src.size(); }
+  unsigned char peek() const { return (unsigned char)src[pos]; }
+
+  int32_t add_class(const std::bitset<256> &cls) {
+    classes.push_back(cls);
+    return (int32_t)classes.size() - 1;
+  }
+
+  static void perl_class(char c, std::bitset<256> &cls) {
+    std::bitset<256> set;
+    switch (c | 0x20) {
+      case 'd':
+        for (int i = '0'; i <= '9'; i++) set.set(i);
+        break;
+      case 'w':
+        for (int i = '0'; i <= '9'; i++) set.set(i);
+        for (int i = 'a'; i <= 'z'; i++) set.set(i);
+        for (int i = 'A'; i <= 'Z'; i++) set.set(i);
+        set.set('_');
+        break;
+      case 's':
+        set.set(' '); set.set('\t'); set.set('\n');
+        set.set('\r'); set.set('\f'); set.set('\v');
+        break;
+    }
+    // upper case is the negation
+    if (c >= 'A' && c <= 'Z') set.flip();
+    cls |= set;
+  }
+
+  static int hex(unsigned char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+  }
+
+  // parses the escape after '\', either a single byte or a perl class
+  bool escape(int &byte, std::bitset<256> &cls, bool &is_class) {
+    if (eof()) return fail("trailing backslash");
+    unsigned char c = src[pos++];
+    is_class = false;
+    switch (c) {
+      case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+        is_class = true;
+        perl_class((char)c, cls);
+        return true;
+      case 'n': byte = '\n'; return true;
+      case 'r': byte = '\r'; return true;
+      case 't': byte = '\t'; return true;
+      case 'f': byte = '\f'; return true;
+      case 'v': byte = '\v'; return true;
+      case 'e': byte = 0x1b; return true;
+      case '0': byte = 0; return true;
+      case 'x': {
+        if (pos + 2 > src.size() || hex(src[pos]) < 0 || hex(src[pos + 1]) < 0) {
+          return fail("invalid \\x escape");
+        }
+        byte = hex(src[pos]) * 16 + hex(src[pos + 1]);
+        pos += 2;
+        return true;
+      }
+      default:
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) {
+          pos--;
+          return fail("unsupported escape");
+        }
+        byte = c;
+        return true;
+    }
+  }
+
+  bool bracket(pty_regex_ast &node) {
+    std::bitset<256> cls;
+    bool negate = false;
+    if (!eof() && peek() == '^') {
+      negate = true;
+      pos++;
+    }
+
+    bool first = true;
+    while (true) {
+      if (eof()) return fail("missing ]");
+      unsigned char c = src[pos];
+      if (c == ']' && !first) {
+        pos++;
+        break;
+      }
+      first = false;
+
+      int lo;
+      if (c == '\\') {
+        pos++;
+        bool is_class = false;
+        if (!escape(lo, cls, is_class)) return false;
+        if (is_class) continue;
+      } else {
+        lo = c;
+        pos++;
+      }
+
+      int hi = lo;
+      if (pos + 1 < src.size() && src[pos] == '-' && src[pos + 1] != ']') {
+        pos++;
+        unsigned char d = src[pos];
+        if (d == '\\') {
+          pos++;
+          bool is_class = false;
+          std::bitset<256> unused;
+          if (!escape(hi, unused, is_class)) return false;
+          if (is_class) return fail("invalid range");
+        } else {
+          hi = d;
+          pos++;
+        }
+        if (hi < lo) return fail("invalid range");
+      }
+      for (int i = lo; i <= hi; i++) cls.set(i);
+    }
+
+    if (negate) cls.flip();
+    node.kind = pty_regex_ast::CLASS;
+    node.arg = add_class(cls);
+    return true;
+  }
+
+  bool number(int &n) {
+    size_t start = pos;
+    n = 0;
+    while (!eof() && peek() >= '0' && peek() <= '9') {
+      n = n * 10 + (peek() - '0');
+      if (n > 1000) return false;
+      pos++;
+    }
+    return pos > start;
+  }
+
+  // `{m}`, `{m,}` or `{m,n}`, anything else is a literal '{'
+  bool braces(int &min, int &max) {
+    size_t save = pos;
+    pos++;
+    if (!number(min)) {
+      pos = save;
+      return false;
+    }
+    max = min;
+    if (!eof() && peek() == ',') {
+      pos++;
+      if (!eof() && peek() == '}') {
+        max = -1;
+      } else if (!number(max) || max < min) {
+        pos = save;
+        return false;
+      }
+    }
+    if (eof() || peek() != '}') {
+      pos = save;
+      return false;
+    }
+    pos++;
+    return true;
+  }
+
+  bool atom(pty_regex_ast &node) {
+    unsigned char c = src[pos++];
+    switch (c) {
+      case '(': {
+        if (++depth > max_nesting) return fail("pattern too deep");
+        pty_regex_ast inner;
+        int group = -1;
+        if (pos + 1 < src.size() && src[pos] == '?') {
+          if (src[pos + 1] != ':') return fail("unsupported group");
+          pos += 2;
+        } else {
+          group = ngroups++;
+        }
+        if (!alternation(inner)) return false;
+        if (eof() || peek() != ')') return fail("missing )");
+        pos++;
+        depth--;
+        int nesting = inner.nesting + 1;
+        if (group < 0) {
+          node = std::move(inner);
+        } else {
+          node.kind = pty_regex_ast::GROUP;
+          node.arg = group;
+          node.kids.push_back(std::move(inner));
+        }
+        node.nesting = nesting;
+        return true;
+      }
+      case '[':
+        return bracket(node);
+      case '.': {
+        std::bitset<256> cls;
+        cls.set();
+        cls.reset('\n');
+        node.kind = pty_regex_ast::CLASS;
+        node.arg = add_class(cls);
+        return true;
+      }
+      case '^':
+        node.kind = pty_regex_ast::BOL;
+        return true;
+      case '$':
+        node.kind = pty_regex_ast::EOL;
+        return true;
+      case '\\': {
+        std::bitset<256> cls;
+        int byte = 0;
+        bool is_class = false;
+        if (!escape(byte, cls, is_class)) return false;
+        if (!is_class) cls.set(byte);
+        node.kind = pty_regex_ast::CLASS;
+        node.arg = add_class(cls);
+        return true;
+      }
+      case '*': case '+': case '?':
+        pos--;
+        return fail("nothing to repeat");
+      default: {
+        std::bitset<256> cls;
+        cls.set(c);
+        node.kind = pty_regex_ast::CLASS;
+        node.arg = add_class(cls);
+        return true;
+      }
+    }
+  }
+
+  bool repeat(pty_regex_ast &node) {
+    if (!atom(node)) return false;
+    while (!eof()) {
+      int min, max;
+      unsigned char c = peek();
+      if (c == '*') {
+        min = 0; max = -1; pos++;
+      } else if (c == '+') {
+        min = 1; max = -1; pos++;
+      } else if (c == '?') {
+        min = 0; max = 1; pos++;
+      } else if (c == '{' && braces(min, max)) {
+      } else {
+        break;
+      }
+
+      pty_regex_ast rep;
+      rep.kind = pty_regex_ast::REPEAT;
+      rep.min = min;
+      rep.max = max;
+      if (!eof() && peek() == '?') {
+        rep.greedy = false;
+        pos++;
+      }
+      rep.nesting = node.nesting + 1;
+      if (rep.nesting > max_nesting) return fail("pattern too deep");
+      rep.kids.push_back(std::move(node));
+      node = std::move(rep);
+    }
+    return true;
+  }
+
+  bool concat(pty_regex_ast &node) {
+    node.kind = pty_regex_ast::CAT;
+    while (!eof() && peek() != '|' && peek() != ')') {
+      pty_regex_ast kid;
+      if (!repeat(kid)) return false;
+      node.nesting = std::max(node.nesting, kid.nesting);
+      node.kids.push_back(std::move(kid));
+    }
+    return true;
+  }
+
+  bool alternation(pty_regex_ast &node) {
+    pty_regex_ast first;
+    if (!concat(first)) return false;
+    if (eof() || peek() != '|') {
+      node = std::move(first);
+      return true;
+    }
+    node.kind = pty_regex_ast::ALT;
+    node.nesting = first.nesting;
+    node.kids.push_back(std::move(first));
+    while (!eof() && peek() == '|') {
+      pos++;
+      pty_regex_ast kid;
+      if (!concat(kid)) return false;
+      node.nesting = std::max(node.nesting, kid.nesting);
+      node.kids.push_back(std::move(kid));
+    }
+    return true;
+  }
+
+  bool parse(pty_regex_ast &root) {
+    if (!alternation(root)) return false;
+    if (!eof()) return fail("unmatched )");
+    return true;
+  }
+};
+
+struct pty_regex_dstate {
+  // sorted NFA node set, EOL nodes are kept as pending assertions
+  std::vector<int32_t> nfa;
+  bool line_start;
+  // pattern index matching here, -1 if none
+  int32_t accept;
+  // pattern index matching here if followed by '\n' or the end of the output
+  int32_t accept_eol;
+  int32_t next[256];
+};
+
+struct pty_regex_set {
+  std::vector<pty_regex_node> nodes;
+  std::vector<std::bitset<256>> classes;
+  // NFA start of each pattern, and of the combined (unanchored) search
+  std::vector<int32_t> starts;
+  std::vector<int> ngroups;
+  int32_t start = -1;
+
+  std::vector<pty_regex_dstate> dstates;
+  std::map<std::vector<int32_t>, int32_t> dcache;
+  size_t max_states = 1024;
+  // counted repeats are expanded by copying, bounds what `(a{1000}){1000}` costs
+  size_t max_nodes = 100000;
+  int32_t state = -1;
+  // number of times the DFA cache was flushed
+  uint64_t flushes = 0;
+
+  // closure() membership, a node is in the set being built if its mark
+  // equals the current generation
+  mutable std::vector<uint32_t> marks;
+  mutable uint32_t generation = 0;
+
+  int32_t emit(pty_regex_node::kind_t kind, int32_t out, int32_t out1 = -1, int32_t arg = -1) {
+    nodes.push_back(pty_regex_node{kind, out, out1, arg});
+    return (int32_t)nodes.size() - 1;
+  }
+
+  // Thompson construction, compiling `ast` in front of the continuation `next`
+  int32_t compile(const pty_regex_ast &ast, int32_t next) {
+    // past the limit the result is discarded, stop expanding
+    if (nodes.size() > max_nodes) return next;
+    switch (ast.kind) {
+      case pty_regex_ast::EMPTY:
+        return next;
+      case pty_regex_ast::CLASS:
+        return emit(pty_regex_node::CHAR, next, -1, ast.arg);
+      case pty_regex_ast::BOL:
+        return emit(pty_regex_node::BOL, next);
+      case pty_regex_ast::EOL:
+        return emit(pty_regex_node::EOL, next);
+      case pty_regex_ast::CAT:
+        for (size_t i = ast.kids.size(); i > 0; i--) {
+          next = compile(ast.kids[i - 1], next);
+        }
+        return next;
+      case pty_regex_ast::ALT: {
+        int32_t entry = compile(ast.kids.back(), next);
+        for (size_t i = ast.kids.size() - 1; i > 0; i--) {
+          int32_t branch = compile(ast.kids[i - 1], next);
+          entry = emit(pty_regex_node::SPLIT, branch, entry);
+        }
+        return entry;
+      }
+      case pty_regex_ast::GROUP: {
+        int32_t close = emit(pty_regex_node::SAVE, next, -1, ast.arg * 2 + 1);
+        int32_t body = compile(ast.kids[0], close);
+        return emit(pty_regex_node::SAVE, body, -1, ast.arg * 2);
+      }
+      case pty_regex_ast::REPEAT: {
+        const pty_regex_ast &kid = ast.kids[0];
+        int32_t tail = next;
+        if (ast.max == -1) {
+          int32_t loop = emit(pty_regex_node::SPLIT, -1, -1);
+          int32_t body = compile(kid, loop);
+          nodes[loop].out = ast.greedy ? body : next;
+          nodes[loop].out1 = ast.greedy ? next : body;
+          tail = loop;
+        } else {
+          for (int i = ast.max - ast.min; i > 0 && nodes.size() <= max_nodes; i--) {
+            int32_t body = compile(kid, tail);
+            tail = ast.greedy ?
+              emit(pty_regex_node::SPLIT, body, next) :
+              emit(pty_regex_node::SPLIT, next, body);
+          }
+        }
+        for (int i = 0; i < ast.min && nodes.size() <= max_nodes; i++) {
+          tail = compile(kid, tail);
+        }
+        return tail;
+      }
+    }
+    return next;
+  }
+
+  bool compile(const std::vector<std::string> &patterns, std::string &error) {
+    nodes.clear();
+    classes.clear();
+    starts.clear();
+    ngroups.clear();
+
+    for (size_t i = 0; i < patterns.size(); i++) {
+      pty_regex_ast root;
+      pty_regex_parser parser(patterns[i], classes);
+      if (!parser.parse(root)) {
+        error = "pattern " + std::to_string(i) + ": " + parser.error;
+        return false;
+      }
+      int32_t match = emit(pty_regex_node::MATCH, -1, -1, (int32_t)i);
+      int32_t close = emit(pty_regex_node::SAVE, match, -1, 1);
+      int32_t body = compile(root, close);
+      if (nodes.size() > max_nodes) {
+        error = "pattern " + std::to_string(i) + ": pattern too large";
+        return false;
+      }
+      starts.push_back(emit(pty_regex_node::SAVE, body, -1, 0));
+      ngroups.push_back(parser.ngroups);
+    }
+
+    start = starts.back();
+    for (size_t i = starts.size() - 1; i > 0; i--) {
+      start = emit(pty_regex_node::SPLIT, starts[i - 1], start);
+    }
+
+    marks.assign(nodes.size(), 0);
+    generation = 0;
+    reset();
+    // `$` is pending at the start, the first newline would end an empty match
+    const pty_regex_dstate &initial = dstates[state];
+    int32_t empty = initial.accept != -1 ? initial.accept : initial.accept_eol;
+    if (empty != -1) {
+      error = "pattern " + std::to_string(empty) + " matches the empty string";
+      return false;
+    }
+    return true;
+  }
+
+  void reset() {
+    dstates.clear();
+    dcache.clear();
+    std::vector<int32_t> set;
+    closure(set, start, true, false);
+    state = intern(set, true);
+  }
+
+  /**
+   * Adds the nodes reachable from `n` without consuming input to `set`.
+   * Callers build a set with successive calls starting from an empty
+   * one, which is when a new generation of marks begins.
+   */
+  void closure(std::vector<int32_t> &set, int32_t n, bool bol, bool eol) const {
+    if (set.empty() && ++generation == 0) {
+      std::fill(marks.begin(), marks.end(), 0);
+      generation = 1;
+    }
+    std::vector<int32_t> stack(1, n);
+    while (!stack.empty()) {
+      int32_t id = stack.back();
+      stack.pop_back();
+      if (id < 0 || marks[id] == generation) continue;
+      marks[id] = generation;
+      const pty_regex_node &node = nodes[id];
+      switch (node.kind) {
+        case pty_regex_node::SPLIT:
+          set.push_back(id);
+          stack.push_back(node.out1);
+          stack.push_back(node.out);
+          break;
+        case pty_regex_node::JMP:
+        case pty_regex_node::SAVE:
+          set.push_back(id);
+          stack.push_back(node.out);
+          break;
+        case pty_regex_node::BOL:
+          set.push_back(id);
+          if (bol) stack.push_back(node.out);
+          break;
+        case pty_regex_node::EOL:
+          set.push_back(id);
+          if (eol) stack.push_back(node.out);
+          break;
+        default:
+          set.push_back(id);
+          break;
+      }
+    }
+  }
+
+  int32_t accepting(const std::vector<int32_t> &set) const {
+    int32_t best = -1;
+    for (int32_t id : set) {
+      if (nodes[id].kind == pty_regex_node::MATCH && (best == -1 || nodes[id].arg < best)) {
+        best = nodes[id].arg;
+      }
+    }
+    return best;
+  }
+
+  int32_t intern(std::vector<int32_t> &set, bool line_start) {
+    // only nodes that consume input or wait for an assertion matter
+    std::vector<int32_t> key;
+    key.reserve(set.size() + 1);
+    for (int32_t id : set) {
+      pty_regex_node::kind_t k = nodes[id].kind;
+      if (k == pty_regex_node::CHAR || k == pty_regex_node::EOL || k == pty_regex_node::MATCH) {
+        key.push_back(id);
+      }
+    }
+    std::sort(key.begin(), key.end());
+    key.push_back(line_start ? 1 : 0);
+
+    auto it = dcache.find(key);
+    if (it != dcache.end()) return it->second;
+
+    if (dstates.size() >= max_states) {
+      // flush the cache, the caller re-resolves its current state
+      dstates.clear();
+      dcache.clear();
+      flushes++;
+    }
+
+    pty_regex_dstate d;
+    d.nfa.assign(key.begin(), key.end() - 1);
+    d.line_start = line_start;
+    d.accept = accepting(d.nfa);
+    std::vector<int32_t> eol_set;
+    for (int32_t id : d.nfa) closure(eol_set, id, line_start, true);
+    d.accept_eol = accepting(eol_set);
+    for (int i = 0; i < 256; i++) d.next[i] = -1;
+
+    dstates.push_back(std::move(d));
+    int32_t index = (int32_t)dstates.size() - 1;
+    dcache[key] = index;
+    return index;
+  }
+
+  int32_t step(int32_t s, unsigned char c) {
+    int32_t cached = dstates[s].next[c];
+    if (cached >= 0) return cached;
+
+    std::vector<int32_t> from = dstates[s].nfa;
+    bool line_start = dstates[s].line_start;
+    if (c == '\n') {
+      // '$' holds right before a newline
+      std::vector<int32_t> expanded;
+      for (int32_t id : from) closure(expanded, id, line_start, true);
+      from.swap(expanded);
+    }
+
+    std::vector<int32_t> to;
+    bool next_line_start = (c == '\n');
+    for (int32_t id : from) {
+      const pty_regex_node &node = nodes[id];
+      if (node.kind == pty_regex_node::CHAR && classes[node.arg].test(c)) {
+        closure(to, node.out, next_line_start, false);
+      }
+    }
+    // unanchored search, a match may start at any position
+    closure(to, start, next_line_start, false);
+
+    size_t before = flushes;
+    int32_t t = intern(to, next_line_start);
+    if (flushes == before) {
+      dstates[s].next[c] = t;
+    }
+    return t;
+  }
+
+  /**
+   * Scan `len` bytes, returns the index of the first pattern whose
+   * earliest match ends in this chunk and sets `end` to one past the
+   * end of the match, or -1 if nothing matched.
+   */
+  int32_t feed(const unsigned char *data, size_t len, size_t &end) {
+    int32_t s = state;
+    for (size_t i = 0; i < len; i++) {
+      s = step(s, data[i]);
+      const pty_regex_dstate &d = dstates[s];
+      int32_t id = d.accept;
+      if (d.accept_eol != -1 && (i + 1 == len || data[i + 1] == '\n') &&
+          (id == -1 || d.accept_eol < id)) {
+        id = d.accept_eol;
+      }
+      if (id != -1) {
+        reset();
+        end = i + 1;
+        return id;
+      }
+    }
+    state = s;
+    return -1;
+  }
+
+  /**
+   * Pike VM over `text`, finds the leftmost match of pattern `id` that
+   * ends exactly at the end of `text`. `caps` receives 2 offsets per
+   * group, -1 for groups that did not participate.
+   */
+  bool captures(int32_t id, const unsigned char *text, size_t n,
+                bool line_start, bool eol_at_end, std::vector<int> &caps) const {
+    struct thread {
+      int32_t pc;
+      std::vector<int> caps;
+    };
+    size_t nslots = (size_t)ngroups[id] * 2;
+    std::vector<thread> clist, nlist;
+    std::vector<size_t> seen(nodes.size(), (size_t)-1);
+
+    for (size_t pos = 0; pos <= n; pos++) {
+      bool bol = pos == 0 ? line_start : text[pos - 1] == '\n';
+      bool eol = pos == n ? eol_at_end : text[pos] == '\n';
+
+      // threads carried over keep their priority, a new match
+      // starting here has the lowest
+      std::vector<thread> pending;
+      pending.swap(clist);
+      pending.push_back(thread{starts[id], std::vector<int>(nslots, -1)});
+
+      // follow epsilon transitions in priority order
+      for (thread &t : pending) {
+        std::vector<thread> work(1, std::move(t));
+        while (!work.empty()) {
+          thread cur = std::move(work.back());
+          work.pop_back();
+          if (cur.pc < 0 || seen[cur.pc] == pos) continue;
+          seen[cur.pc] = pos;
+          const pty_regex_node &node = nodes[cur.pc];
+          switch (node.kind) {
+            case pty_regex_node::SPLIT: {
+              thread alt{node.out1, cur.caps};
+              work.push_back(std::move(alt));
+              cur.pc = node.out;
+              work.push_back(std::move(cur));
+              break;
+            }
+            case pty_regex_node::JMP:
+              cur.pc = node.out;
+              work.push_back(std::move(cur));
+              break;
+            case pty_regex_node::SAVE:
+              if ((size_t)node.arg < nslots) cur.caps[node.arg] = (int)pos;
+              cur.pc = node.out;
+              work.push_back(std::move(cur));
+              break;
+            case pty_regex_node::BOL:
+              if (bol) {
+                cur.pc = node.out;
+                work.push_back(std::move(cur));
+              }
+              break;
+            case pty_regex_node::EOL:
+              if (eol) {
+                cur.pc = node.out;
+                work.push_back(std::move(cur));
+              }
+              break;
+            case pty_regex_node::MATCH:
+              if (pos == n && node.arg == id) {
+                caps = std::move(cur.caps);
+                return true;
+              }
+              break;
+            case pty_regex_node::CHAR:
+              clist.push_back(std::move(cur));
+              break;
+          }
+        }
+      }
+
+      if (pos == n) break;
+
+      nlist.clear();
+      for (thread &t : clist) {
+        const pty_regex_node &node = nodes[t.pc];
+        if (classes[node.arg].test(text[pos])) {
+          t.pc = node.out;
+          nlist.push_back(std::move(t));
+        }
+      }
+      clist.swap(nlist);
+    }
+    return false;
+  }
+};
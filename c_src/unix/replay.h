@@ -0,0 +1,325 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <erl_nif.h>
+#include <uv.h>
+#include "nif_utils.h"
+#include "recording.h"
+
+/**
+ * Session replay
+ * Plays indexed recordings back at a multiple of the recorded speed,
+ * or as fast as possible, either to a process as the {:data, binary}
+ * and {:exit, 0, 0} messages of a live session, or into a PTY as its
+ * input.
+ *
+ * Replays are spread over a few worker threads, each one keeps its
+ * replays in a hashed timer wheel with 1 ms ticks: a replay sits in
+ * the slot of the tick its next record is due, so a tick only looks
+ * at the replays that may be due and the cost does not grow with the
+ * number of idle replays.
+ */
+
+struct pty_replay {
+  pty_recording *recording = nullptr;
+  ErlNifPid target;
+  // when set, output is written into this resource instead of sent;
+  // write_into returns the bytes taken, -1 once it will take no more
+  void *into = nullptr;
+  ssize_t (*write_into)(void *, const void *, size_t) = nullptr;
+
+  // sent before the first record, the screen when not starting at 0
+  std::string prefix;
+
+  // 0 plays as fast as possible
+  double speed = 1.0;
+  // longer pauses in the recording are shortened to this (us), 0 keeps them
+  uint64_t idle_limit = 0;
+
+  // worker thread only
+  size_t offset = 0;
+  // how much of the prefix, or else of the record at offset, `into`
+  // has taken when it did not take all of it
+  size_t written = 0;
+  uint64_t last_ts = 0;
+  // position in the recording after idle_limit, in us
+  uint64_t clock = 0;
+  // uv_hrtime() of clock 0
+  uint64_t origin = 0;
+  uint64_t due = 0;
+  size_t worker = 0;
+
+  std::atomic<bool> stopped{false};
+
+  static ErlNifResourceType * type;
+
+  ~pty_replay() {
+    if (recording) enif_release_resource(recording);
+    if (into) enif_release_resource(into);
+  }
+};
+
+struct pty_replay_worker {
+  static const size_t slots = 512;
+  // a replay at full speed yields after this many records or bytes
+  static const size_t batch_records = 256;
+  static const size_t batch_bytes = 64 << 10;
+
+  uv_thread_t tid;
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  std::vector<pty_replay *> added;
+  std::vector<pty_replay *> removed;
+
+  // worker thread only
+  std::vector<pty_replay *> wheel[slots];
+  size_t count = 0;
+  uint64_t tick = 0;
+
+  pty_replay_worker() {
+    uv_mutex_init(&mutex);
+    uv_cond_init(&cond);
+  }
+
+  static uint64_t tick_of(uint64_t ns) {
+    return ns / 1000000ULL;
+  }
+
+  void insert(pty_replay *replay) {
+    // never into the slot being processed
+    uint64_t at = std::max(tick_of(replay->due), tick + 1);
+    wheel[at % slots].push_back(replay);
+    count++;
+  }
+
+  // drops a stopped replay, along with the reference taken by remove()
+  void erase(pty_replay *replay) {
+    for (std::vector<pty_replay *> &slot : wheel) {
+      auto it = std::find(slot.begin(), slot.end(), replay);
+      if (it != slot.end()) {
+        slot.erase(it);
+        count--;
+        enif_release_resource(replay);
+        break;
+      }
+    }
+    enif_release_resource(replay);
+  }
+
+  /**
+   * Sends `bytes` or writes them into `into`, returns false when `into`
+   * did not take all of them, `written` then counts what it took.
+   */
+  bool send_data(pty_replay *replay, const unsigned char *bytes, size_t len, bool mapped, ErlNifEnv *msg_env) {
+    if (replay->into) {
+      ssize_t n = replay->write_into(replay->into, bytes + replay->written, len - replay->written);
+      // a closed session takes nothing more, the rest of the replay is dropped as it was
+      if (n < 0) n = (ssize_t)(len - replay->written);
+      replay->written += (size_t)n;
+      if (replay->written < len) return false;
+      replay->written = 0;
+      return true;
+    }
+    ERL_NIF_TERM data;
+    if (mapped) {
+      // a sub-binary of the mapping, the recording stays alive as long as it does
+      data = enif_make_resource_binary(msg_env, replay->recording, bytes, len);
+    } else {
+      unsigned char *ptr = enif_make_new_binary(msg_env, len, &data);
+      if (!ptr) return true;
+      memcpy(ptr, bytes, len);
+    }
+    if (!enif_send(NULL, &replay->target, msg_env, enif_make_tuple2(msg_env, nif::atom(msg_env, "data"), data))) {
+      // nobody is listening anymore
+      replay->stopped = true;
+    }
+    enif_clear_env(msg_env);
+    return true;
+  }
+
+  /**
+   * Delivers the records of `replay` that are due at `now`, returns
+   * false when it has ended.
+   */
+  bool fire(pty_replay *replay, uint64_t now, ErlNifEnv *msg_env) {
+    const pty_recording &recording = *replay->recording;
+    pty_recording::record rec;
+    size_t records = 0, bytes = 0;
+
+    if (!replay->prefix.empty()) {
+      if (!send_data(replay, (const unsigned char *)replay->prefix.data(), replay->prefix.size(), false, msg_env)) {
+        // the PTY is full, the rest goes first on the next tick
+        replay->due = now;
+        return true;
+      }
+      std::string().swap(replay->prefix);
+    }
+
+    while (!replay->stopped) {
+      if (!recording.at(replay->offset, rec)) {
+        enif_send(NULL, &replay->target, msg_env, enif_make_tuple3(msg_env,
+          nif::atom(msg_env, "exit"),
+          enif_make_int(msg_env, 0),
+          enif_make_int(msg_env, 0)
+        ));
+        enif_clear_env(msg_env);
+        return false;
+      }
+
+      uint64_t gap = rec.ts > replay->last_ts ? rec.ts - replay->last_ts : 0;
+      if (replay->idle_limit > 0) gap = std::min(gap, replay->idle_limit);
+      if (replay->speed > 0) {
+        replay->due = replay->origin + (uint64_t)((double)(replay->clock + gap) * 1000.0 / replay->speed);
+        if (replay->due > now) return true;
+      }
+      if (records >= batch_records || bytes >= batch_bytes) {
+        // let the other replays of this tick go first
+        replay->due = now;
+        return true;
+      }
+
+      // input and resizes only make sense to a live session, keyframes to seek
+      if (rec.type == 'o') {
+        if (!send_data(replay, rec.data, rec.len, true, msg_env)) {
+          // the record stays current until the PTY has taken all of it
+          replay->due = now;
+          return true;
+        }
+        records++;
+        bytes += rec.len;
+      }
+      replay->clock += gap;
+      replay->last_ts = rec.ts;
+      replay->offset = recording.next(replay->offset, rec);
+    }
+    return false;
+  }
+
+  static void worker_fn(void *data) {
+    pty_replay_worker *worker = static_cast<pty_replay_worker *>(data);
+    ErlNifEnv *msg_env = enif_alloc_env();
+    std::vector<pty_replay *> due;
+
+    worker->tick = tick_of(uv_hrtime());
+    uv_mutex_lock(&worker->mutex);
+    for (;;) {
+      for (pty_replay *replay : worker->added) worker->insert(replay);
+      worker->added.clear();
+      for (pty_replay *replay : worker->removed) worker->erase(replay);
+      worker->removed.clear();
+
+      if (worker->count == 0) {
+        uv_cond_wait(&worker->cond, &worker->mutex);
+        worker->tick = tick_of(uv_hrtime());
+        continue;
+      }
+      uv_mutex_unlock(&worker->mutex);
+
+      uint64_t now = uv_hrtime();
+      uint64_t target = tick_of(now);
+      // after a stall every slot is looked at once
+      uint64_t from = target - worker->tick > slots ? target - slots : worker->tick;
+      for (uint64_t t = from + 1; t <= target; t++) {
+        std::vector<pty_replay *> &slot = worker->wheel[t % slots];
+        due.clear();
+        for (size_t i = 0; i < slot.size();) {
+          if (tick_of(slot[i]->due) <= target) {
+            due.push_back(slot[i]);
+            slot[i] = slot.back();
+            slot.pop_back();
+          } else {
+            i++;
+          }
+        }
+        worker->tick = t;
+        worker->count -= due.size();
+        for (pty_replay *replay : due) {
+          if (worker->fire(replay, now, msg_env)) {
+            worker->insert(replay);
+          } else {
+            enif_release_resource(replay);
+          }
+        }
+      }
+      worker->tick = target;
+
+      uv_mutex_lock(&worker->mutex);
+      if (worker->added.empty() && worker->removed.empty()) {
+        uint64_t next = (target + 1) * 1000000ULL;
+        now = uv_hrtime();
+        if (next > now) uv_cond_timedwait(&worker->cond, &worker->mutex, next - now);
+      }
+    }
+  }
+};
+
+struct pty_replay_scheduler {
+  uv_mutex_t mutex;
+  size_t threads = 2;
+  std::vector<std::unique_ptr<pty_replay_worker>> workers;
+  std::atomic<size_t> next{0};
+
+  pty_replay_scheduler() {
+    uv_mutex_init(&mutex);
+  }
+
+  // only before the first replay, returns false afterwards
+  bool set_threads(size_t n) {
+    uv_mutex_lock(&mutex);
+    bool ok = workers.empty();
+    if (ok) threads = n;
+    uv_mutex_unlock(&mutex);
+    return ok;
+  }
+
+  // the workers are started with the first replay
+  void start() {
+    uv_mutex_lock(&mutex);
+    if (workers.empty()) {
+      for (size_t i = 0; i < threads; i++) {
+        workers.emplace_back(new pty_replay_worker());
+        uv_thread_create(&workers.back()->tid, pty_replay_worker::worker_fn, workers.back().get());
+      }
+    }
+    uv_mutex_unlock(&mutex);
+  }
+
+  void add(pty_replay *replay) {
+    start();
+    replay->worker = next++ % workers.size();
+    replay->origin = uv_hrtime();
+    replay->due = replay->origin;
+    enif_keep_resource(replay);
+
+    pty_replay_worker *worker = workers[replay->worker].get();
+    uv_mutex_lock(&worker->mutex);
+    worker->added.push_back(replay);
+    uv_cond_signal(&worker->cond);
+    uv_mutex_unlock(&worker->mutex);
+  }
+
+  void remove(pty_replay *replay) {
+    if (replay->stopped.exchange(true) || workers.empty()) return;
+    pty_replay_worker *worker = workers[replay->worker].get();
+    uv_mutex_lock(&worker->mutex);
+    auto it = std::find(worker->added.begin(), worker->added.end(), replay);
+    if (it != worker->added.end()) {
+      worker->added.erase(it);
+      enif_release_resource(replay);
+    } else {
+      // the worker may drop it before it gets to the removal
+      enif_keep_resource(replay);
+      worker->removed.push_back(replay);
+      uv_cond_signal(&worker->cond);
+    }
+    uv_mutex_unlock(&worker->mutex);
+  }
+};
@@ -0,0 +1,943 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+/**
+ * pty_screen
+ * Headless VT100/xterm screen model, fed with the output of a session
+ * so that the server side knows what is on screen without a client.
+ *
+ * Handles UTF-8, C0 controls, ESC and CSI sequences for cursor
+ * movement, erasing, insert/delete, scrolling regions, tab stops,
+ * SGR (16/256/truecolor), DEC line drawing, the alternate screen
+ * (47/1047/1049), the window title (OSC 0/2) and scrollback for the
+ * lines that scroll off the top of the main screen. Sequences that
+ * would need a reply (DSR, DA) are left to the real client.
+ *
+ * Damage is tracked per row for remote viewers: every change stamps
+ * the row with the frame it will be part of, and remembers which
+ * columns changed during that frame. A viewer that has seen frame N
+ * only needs the rows stamped after N, so a slow viewer skips the
+ * frames in between instead of replaying every byte.
+ */
+
+enum pty_cell_flag : uint16_t {
+  PTY_CELL_BOLD = 1 << 0,
+  PTY_CELL_DIM = 1 << 1,
+  PTY_CELL_ITALIC = 1 << 2,
+  PTY_CELL_UNDERLINE = 1 << 3,
+  PTY_CELL_BLINK = 1 << 4,
+  PTY_CELL_INVERSE = 1 << 5,
+  PTY_CELL_HIDDEN = 1 << 6,
+  PTY_CELL_STRIKE = 1 << 7,
+};
+
+// colors: 0 is the default, PTY_COLOR_INDEXED | n for the palette,
+// PTY_COLOR_RGB | 0xRRGGBB for truecolor
+#define PTY_COLOR_DEFAULT 0u
+#define PTY_COLOR_INDEXED 0x01000000u
+#define PTY_COLOR_RGB 0x02000000u
+
+// largest screen a session or a snapshot may have, sizes themselves are
+// bounded by struct winsize
+#define PTY_SCREEN_MAX_SIZE 65535
+#define PTY_SCREEN_MAX_CELLS (1 << 24)
+
+struct pty_attr {
+  uint32_t fg = PTY_COLOR_DEFAULT;
+  uint32_t bg = PTY_COLOR_DEFAULT;
+  uint16_t flags = 0;
+
+  bool operator==(const pty_attr &o) const { return fg == o.fg && bg == o.bg && flags == o.flags; }
+  bool operator!=(const pty_attr &o) const { return !(*this == o); }
+};
+
+struct pty_cell {
+  // 0 for the right half of a wide character
+  uint32_t ch = ' ';
+  pty_attr attr;
+};
+
+struct pty_line {
+  std::vector<pty_cell> cells;
+  // the line continues on the next one (soft wrap)
+  bool wrapped = false;
+  // damage: last frame that changed the line, and the columns
+  // [dirty_from, dirty_to) changed during that frame
+  uint64_t version = 0;
+  int dirty_from = 0;
+  int dirty_to = 0;
+};
+
+static inline int pty_wcwidth(uint32_t cp) {
+  if (cp < 0x300) return 1;
+  // combining marks and zero width characters
+  if ((cp >= 0x0300 && cp <= 0x036F) || (cp >= 0x0483 && cp <= 0x0489) ||
+      (cp >= 0x0591 && cp <= 0x05BD) || (cp >= 0x0610 && cp <= 0x061A) ||
+      (cp >= 0x064B && cp <= 0x065F) || (cp >= 0x1AB0 && cp <= 0x1AFF) ||
+      (cp >= 0x1DC0 && cp <= 0x1DFF) || (cp >= 0x200B && cp <= 0x200F) ||
+      (cp >= 0x20D0 && cp <= 0x20FF) || (cp >= 0xFE00 && cp <= 0xFE0F) ||
+      (cp >= 0xFE20 && cp <= 0xFE2F) || (cp >= 0xE0100 && cp <= 0xE01EF)) {
+    return 0;
+  }
+  // east asian wide and emoji
+  if ((cp >= 0x1100 && cp <= 0x115F) || (cp >= 0x2E80 && cp <= 0x303E) ||
+      (cp >= 0x3041 && cp <= 0x33FF) || (cp >= 0x3400 && cp <= 0x4DBF) ||
+      (cp >= 0x4E00 && cp <= 0x9FFF) || (cp >= 0xA000 && cp <= 0xA4CF) ||
+      (cp >= 0xAC00 && cp <= 0xD7A3) || (cp >= 0xF900 && cp <= 0xFAFF) ||
+      (cp >= 0xFE30 && cp <= 0xFE4F) || (cp >= 0xFF00 && cp <= 0xFF60) ||
+      (cp >= 0xFFE0 && cp <= 0xFFE6) || (cp >= 0x1F300 && cp <= 0x1F64F) ||
+      (cp >= 0x1F900 && cp <= 0x1F9FF) || (cp >= 0x20000 && cp <= 0x3FFFD)) {
+    return 2;
+  }
+  return 1;
+}
+
+static inline void pty_utf8_encode(uint32_t cp, std::string &out) {
+  if (cp < 0x80) {
+    out.push_back((char)cp);
+  } else if (cp < 0x800) {
+    out.push_back((char)(0xC0 | (cp >> 6)));
+    out.push_back((char)(0x80 | (cp & 0x3F)));
+  } else if (cp < 0x10000) {
+    out.push_back((char)(0xE0 | (cp >> 12)));
+    out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back((char)(0x80 | (cp & 0x3F)));
+  } else {
+    out.push_back((char)(0xF0 | (cp >> 18)));
+    out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+    out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+    out.push_back((char)(0x80 | (cp & 0x3F)));
+  }
+}
+
+static inline void pty_sgr_color(uint32_t color, int base, std::string &out) {
+  char buf[32];
+  if (color & PTY_COLOR_RGB) {
+    snprintf(buf, sizeof(buf), ";%d;2;%u;%u;%u", base + 8,
+             (color >> 16) & 0xFF, (color >> 8) & 0xFF, color & 0xFF);
+  } else if (color & PTY_COLOR_INDEXED) {
+    unsigned n = color & 0xFF;
+    if (n < 8) snprintf(buf, sizeof(buf), ";%u", base + n);
+    else if (n < 16) snprintf(buf, sizeof(buf), ";%u", base + 60 + n - 8);
+    else snprintf(buf, sizeof(buf), ";%d;5;%u", base + 8, n);
+  } else {
+    return;
+  }
+  out += buf;
+}
+
+// SGR sequence that sets exactly `attr`, starting from a reset
+static inline void pty_sgr(const pty_attr &attr, std::string &out) {
+  static const char *flags[] = {";1", ";2", ";3", ";4", ";5", ";7", ";8", ";9"};
+  out += "\x1b[0";
+  for (int i = 0; i < 8; i++) {
+    if (attr.flags & (1 << i)) out += flags[i];
+  }
+  pty_sgr_color(attr.fg, 30, out);
+  pty_sgr_color(attr.bg, 40, out);
+  out += 'm';
+}
+
+/**
+ * Appends cells [from, to) of `line` with the SGR changes between them.
+ * With `trim`, `to` is the right margin and the trailing blanks are
+ * cleared with EL instead, which fills with the background color.
+ */
+static inline void pty_render_cells(const pty_line &line, int from, int to, bool trim, std::string &out) {
+  int end = to;
+  if (trim && to > from) {
+    const pty_attr &last = line.cells[to - 1].attr;
+    while (end > from && line.cells[end - 1].ch == ' ' && line.cells[end - 1].attr == last &&
+           last.fg == PTY_COLOR_DEFAULT && last.flags == 0) {
+      end--;
+    }
+  }
+
+  for (int x = from; x < end; x++) {
+    const pty_cell &cell = line.cells[x];
+    if (x == from || cell.attr != line.cells[x - 1].attr) pty_sgr(cell.attr, out);
+    if (cell.ch != 0) pty_utf8_encode(cell.ch, out);
+  }
+  if (end < to) {
+    if (end == from || line.cells[end].attr != line.cells[end - 1].attr) pty_sgr(line.cells[end].attr, out);
+    out += "\x1b[K";
+  }
+}
+
+struct pty_screen {
+  enum parser_state { GROUND, ESCAPE, ESCAPE_INTERMEDIATE, CSI_PARAM, CSI_IGNORE, OSC, STRING };
+
+  struct cursor_state {
+    int x = 0;
+    int y = 0;
+    pty_attr pen;
+    bool origin = false;
+    bool autowrap = true;
+    bool line_drawing = false;
+  };
+
+  int cols = 80;
+  int rows = 24;
+
+  std::vector<pty_line> main;
+  std::vector<pty_line> alt;
+  bool alternate = false;
+  // oldest first, at most max_scrollback lines
+  std::deque<pty_line> scrollback;
+  size_t max_scrollback = 0;
+
+  cursor_state cursor;
+  cursor_state saved;
+  cursor_state saved_main;
+  // a character was written to the last column, the next one wraps
+  bool wrap_pending = false;
+  bool insert_mode = false;
+  bool cursor_visible = true;
+  int scroll_top = 0;
+  int scroll_bottom = 23;
+  std::vector<bool> tabs;
+  std::string title;
+
+  // damage tracking, see commit()
+  uint64_t frame = 0;
+  bool rows_damaged = false;
+  uint64_t title_version = 0;
+  int frame_x = -1;
+  int frame_y = -1;
+  bool frame_cursor_visible = true;
+
+  // parser
+  parser_state state = GROUND;
+  static const int max_params = 16;
+  int params[max_params];
+  int nparams = 0;
+  char private_marker = 0;
+  char intermediate = 0;
+  std::string osc;
+  bool string_esc = false;
+  uint32_t utf8_cp = 0;
+  int utf8_need = 0;
+  // range of the next continuation byte, narrower after E0, ED, F0 and
+  // F4 to rule out overlong, surrogate and out of range forms
+  unsigned char utf8_lower = 0x80;
+  unsigned char utf8_upper = 0xBF;
+
+  pty_screen(int c = 80, int r = 24) : cols(c), rows(r) {
+    reset();
+  }
+
+  std::vector<pty_line> &lines() { return alternate ? alt : main; }
+  const std::vector<pty_line> &lines() const { return alternate ? alt : main; }
+
+  pty_line blank_line() const {
+    pty_line line;
+    pty_cell blank;
+    blank.attr.bg = cursor.pen.bg;
+    line.cells.assign(cols, blank);
+    return line;
+  }
+
+  void reset() {
+    cursor = cursor_state();
+    saved = cursor_state();
+    saved_main = cursor_state();
+    main.assign(rows, blank_line());
+    alt.assign(rows, blank_line());
+    alternate = false;
+    wrap_pending = false;
+    insert_mode = false;
+    cursor_visible = true;
+    scroll_top = 0;
+    scroll_bottom = rows - 1;
+    tabs.assign(cols, false);
+    for (int i = 0; i < cols; i += 8) tabs[i] = true;
+    title.clear();
+    title_version = frame + 1;
+    state = GROUND;
+    utf8_need = 0;
+    touch_rows(0, rows - 1);
+  }
+
+  void touch(int y, int from, int to) {
+    pty_line &line = lines()[y];
+    from = std::max(from, 0);
+    to = std::min(to, cols);
+    if (line.version <= frame) {
+      line.version = frame + 1;
+      line.dirty_from = from;
+      line.dirty_to = to;
+    } else {
+      line.dirty_from = std::min(line.dirty_from, from);
+      line.dirty_to = std::max(line.dirty_to, to);
+    }
+    rows_damaged = true;
+  }
+
+  /**
+   * Erasing, inserting or deleting cells may split a wide character,
+   * blanks the halves left behind around [from, to) and marks the
+   * columns as changed.
+   */
+  void repair_wide(int y, int from, int to) {
+    auto &cells = lines()[y].cells;
+    from = std::max(from - 1, 0);
+    to = std::min(to + 1, cols);
+    for (int x = from; x < to; x++) {
+      if (cells[x].ch == 0 && (x == 0 || cells[x - 1].ch == 0 || pty_wcwidth(cells[x - 1].ch) != 2)) {
+        cells[x].ch = ' ';
+      } else if (cells[x].ch != 0 && pty_wcwidth(cells[x].ch) == 2 && (x + 1 == cols || cells[x + 1].ch != 0)) {
+        cells[x].ch = ' ';
+      }
+    }
+    touch(y, from, to);
+  }
+
+  void touch_rows(int top, int bottom) {
+    for (int y = top; y <= bottom; y++) touch(y, 0, cols);
+  }
+
+  bool damaged() const {
+    return rows_damaged || title_version > frame || cursor.x != frame_x ||
+           cursor.y != frame_y || cursor_visible != frame_cursor_visible;
+  }
+
+  /**
+   * Closes the current frame if anything changed since the last one,
+   * returns the number of the latest frame.
+   */
+  uint64_t commit() {
+    if (damaged()) {
+      frame++;
+      rows_damaged = false;
+      frame_x = cursor.x;
+      frame_y = cursor.y;
+      frame_cursor_visible = cursor_visible;
+    }
+    return frame;
+  }
+
+  /**
+   * Columns [from, to) of `line` that a viewer who has seen frame
+   * `since` has to redraw, false if it is up to date. Only a viewer
+   * exactly one frame behind gets a partial row. Call after commit().
+   */
+  bool changed(const pty_line &line, uint64_t since, int &from, int &to) const {
+    if (line.version <= since) return false;
+    from = 0;
+    to = cols;
+    if (since + 1 == frame && line.version == frame) {
+      from = line.dirty_from;
+      to = line.dirty_to;
+      // never split a wide character
+      if (from > 0 && line.cells[from].ch == 0) from--;
+      if (to < cols && line.cells[to].ch == 0) to++;
+    }
+    return from < to;
+  }
+
+  /**
+   * Appends the escape sequences that bring a terminal of the same
+   * size from frame `since` to the current one. Call after commit().
+   */
+  void render_diff(uint64_t since, std::string &out) const {
+    char seq[32];
+    out += "\x1b[?25l";
+    if (title_version > since) {
+      out += "\x1b]2;";
+      out += title;
+      out += '\x07';
+    }
+
+    const auto &buf = lines();
+    for (int y = 0; y < rows; y++) {
+      int from, to;
+      const pty_line &line = buf[y];
+      if (!changed(line, since, from, to)) continue;
+
+      snprintf(seq, sizeof(seq), "\x1b[%d;%dH", y + 1, from + 1);
+      out += seq;
+      pty_render_cells(line, from, to, to == cols, out);
+    }
+
+    snprintf(seq, sizeof(seq), "\x1b[0m\x1b[%d;%dH", cursor.y + 1, cursor.x + 1);
+    out += seq;
+    if (cursor_visible) out += "\x1b[?25h";
+  }
+
+  void push_scrollback(pty_line &line) {
+    if (max_scrollback == 0) return;
+    if (scrollback.size() == max_scrollback) scrollback.pop_front();
+    scrollback.push_back(std::move(line));
+  }
+
+  void resize(int new_cols, int new_rows) {
+    if (new_cols == cols && new_rows == rows) return;
+
+    // when shrinking, drop lines from the top so that the cursor stays on screen
+    int drop = std::max(0, cursor.y + 1 - new_rows);
+    auto &active = lines();
+    if (!alternate) {
+      for (int y = 0; y < drop; y++) push_scrollback(active[y]);
+    }
+    active.erase(active.begin(), active.begin() + drop);
+    cursor.y -= drop;
+
+    pty_line blank;
+    blank.cells.assign(new_cols, pty_cell());
+    for (std::vector<pty_line> *buf : {&main, &alt}) {
+      buf->resize(std::min((int)buf->size(), new_rows));
+      for (auto &line : *buf) line.cells.resize(new_cols);
+      buf->resize(new_rows, blank);
+    }
+
+    cols = new_cols;
+    rows = new_rows;
+    tabs.assign(cols, false);
+    for (int i = 0; i < cols; i += 8) tabs[i] = true;
+    scroll_top = 0;
+    scroll_bottom = rows - 1;
+    cursor.x = std::min(std::max(cursor.x, 0), cols - 1);
+    cursor.y = std::min(std::max(cursor.y, 0), rows - 1);
+    saved_main.x = std::min(saved_main.x, cols - 1);
+    saved_main.y = std::min(saved_main.y, rows - 1);
+    saved.x = std::min(saved.x, cols - 1);
+    saved.y = std::min(saved.y, rows - 1);
+    wrap_pending = false;
+    touch_rows(0, rows - 1);
+  }
+
+  // lines scrolled off the top of the main screen go to the scrollback,
+  // unless deleted with DL
+  void scroll_up(int top, int bottom, int n, bool save = true) {
+    auto &buf = lines();
+    n = std::min(n, bottom - top + 1);
+    for (int i = 0; i < n; i++) {
+      if (save && top == 0 && !alternate) push_scrollback(buf[top]);
+      buf.erase(buf.begin() + top);
+      buf.insert(buf.begin() + bottom, blank_line());
+    }
+    touch_rows(top, bottom);
+  }
+
+  void scroll_down(int top, int bottom, int n) {
+    auto &buf = lines();
+    n = std::min(n, bottom - top + 1);
+    for (int i = 0; i < n; i++) {
+      buf.erase(buf.begin() + bottom);
+      buf.insert(buf.begin() + top, blank_line());
+    }
+    touch_rows(top, bottom);
+  }
+
+  void erase_cells(int y, int from, int to) {
+    auto &cells = lines()[y].cells;
+    pty_cell blank;
+    blank.attr.bg = cursor.pen.bg;
+    for (int x = std::max(from, 0); x < std::min(to, cols); x++) cells[x] = blank;
+    repair_wide(y, from, to);
+  }
+
+  void linefeed() {
+    wrap_pending = false;
+    if (cursor.y == scroll_bottom) {
+      scroll_up(scroll_top, scroll_bottom, 1);
+    } else if (cursor.y < rows - 1) {
+      cursor.y++;
+    }
+  }
+
+  void reverse_index() {
+    wrap_pending = false;
+    if (cursor.y == scroll_top) {
+      scroll_down(scroll_top, scroll_bottom, 1);
+    } else if (cursor.y > 0) {
+      cursor.y--;
+    }
+  }
+
+  void move_to(int x, int y) {
+    int top = cursor.origin ? scroll_top : 0;
+    int bottom = cursor.origin ? scroll_bottom : rows - 1;
+    cursor.x = std::min(std::max(x, 0), cols - 1);
+    cursor.y = std::min(std::max(y + top, top), bottom);
+    wrap_pending = false;
+  }
+
+  void put(uint32_t cp) {
+    if (cursor.line_drawing && cp >= 0x5F && cp <= 0x7E) {
+      static const uint16_t dec[] = {
+        0x00A0, 0x25C6, 0x2592, 0x2409, 0x240C, 0x240D, 0x240A, 0x00B0,
+        0x00B1, 0x2424, 0x240B, 0x2518, 0x2510, 0x250C, 0x2514, 0x253C,
+        0x23BA, 0x23BB, 0x2500, 0x23BC, 0x23BD, 0x251C, 0x2524, 0x2534,
+        0x252C, 0x2502, 0x2264, 0x2265, 0x03C0, 0x2260, 0x00A3, 0x00B7,
+      };
+      cp = dec[cp - 0x5F];
+    }
+
+    int width = pty_wcwidth(cp);
+    if (width == 0) return;
+    if (width == 2 && cols < 2) {
+      // no room for both halves
+      cp = 0xFFFD;
+      width = 1;
+    }
+
+    if (wrap_pending && cursor.autowrap) {
+      lines()[cursor.y].wrapped = true;
+      cursor.x = 0;
+      linefeed();
+    }
+    wrap_pending = false;
+
+    if (width == 2 && cursor.x == cols - 1) {
+      if (!cursor.autowrap) return;
+      erase_cells(cursor.y, cursor.x, cols);
+      lines()[cursor.y].wrapped = true;
+      cursor.x = 0;
+      linefeed();
+    }
+
+    touch(cursor.y, cursor.x - 1, insert_mode ? cols : cursor.x + width + 1);
+    auto &cells = lines()[cursor.y].cells;
+    if (insert_mode) {
+      cells.insert(cells.begin() + cursor.x, width, pty_cell());
+      cells.resize(cols);
+      repair_wide(cursor.y, cursor.x, cursor.x + width);
+      repair_wide(cursor.y, cols - 1, cols);
+    }
+    // overwriting half of a wide character blanks the other half
+    if (cells[cursor.x].ch == 0 && cursor.x > 0) cells[cursor.x - 1].ch = ' ';
+    if (cursor.x + width < cols && cells[cursor.x + width].ch == 0) cells[cursor.x + width].ch = ' ';
+
+    cells[cursor.x].ch = cp;
+    cells[cursor.x].attr = cursor.pen;
+    if (width == 2) {
+      cells[cursor.x + 1].ch = 0;
+      cells[cursor.x + 1].attr = cursor.pen;
+    }
+
+    cursor.x += width;
+    if (cursor.x >= cols) {
+      cursor.x = cols - 1;
+      wrap_pending = cursor.autowrap;
+    }
+  }
+
+  void control(unsigned char c) {
+    switch (c) {
+      case '\b':
+        if (cursor.x > 0) cursor.x--;
+        wrap_pending = false;
+        break;
+      case '\t': {
+        int x = cursor.x + 1;
+        while (x < cols - 1 && !tabs[x]) x++;
+        cursor.x = std::min(x, cols - 1);
+        break;
+      }
+      case '\n': case '\v': case '\f':
+        linefeed();
+        break;
+      case '\r':
+        cursor.x = 0;
+        wrap_pending = false;
+        break;
+      case 0x0E: case 0x0F:
+        // SO/SI, only G0 is supported
+        break;
+    }
+  }
+
+  void sgr() {
+    if (nparams == 0) {
+      cursor.pen = pty_attr();
+      return;
+    }
+    for (int i = 0; i < nparams; i++) {
+      int p = params[i];
+      pty_attr &pen = cursor.pen;
+      switch (p) {
+        case 0: pen = pty_attr(); break;
+        case 1: pen.flags |= PTY_CELL_BOLD; break;
+        case 2: pen.flags |= PTY_CELL_DIM; break;
+        case 3: pen.flags |= PTY_CELL_ITALIC; break;
+        case 4: pen.flags |= PTY_CELL_UNDERLINE; break;
+        case 5: case 6: pen.flags |= PTY_CELL_BLINK; break;
+        case 7: pen.flags |= PTY_CELL_INVERSE; break;
+        case 8: pen.flags |= PTY_CELL_HIDDEN; break;
+        case 9: pen.flags |= PTY_CELL_STRIKE; break;
+        case 21: case 22: pen.flags &= ~(PTY_CELL_BOLD | PTY_CELL_DIM); break;
+        case 23: pen.flags &= ~PTY_CELL_ITALIC; break;
+        case 24: pen.flags &= ~PTY_CELL_UNDERLINE; break;
+        case 25: pen.flags &= ~PTY_CELL_BLINK; break;
+        case 27: pen.flags &= ~PTY_CELL_INVERSE; break;
+        case 28: pen.flags &= ~PTY_CELL_HIDDEN; break;
+        case 29: pen.flags &= ~PTY_CELL_STRIKE; break;
+        case 39: pen.fg = PTY_COLOR_DEFAULT; break;
+        case 49: pen.bg = PTY_COLOR_DEFAULT; break;
+        case 38: case 48: {
+          uint32_t color = PTY_COLOR_DEFAULT;
+          if (i + 2 < nparams && params[i + 1] == 5) {
+            color = PTY_COLOR_INDEXED | (params[i + 2] & 0xFF);
+            i += 2;
+          } else if (i + 4 < nparams && params[i + 1] == 2) {
+            color = PTY_COLOR_RGB | ((params[i + 2] & 0xFF) << 16) | ((params[i + 3] & 0xFF) << 8) | (params[i + 4] & 0xFF);
+            i += 4;
+          } else {
+            i = nparams;
+            break;
+          }
+          if (p == 38) pen.fg = color; else pen.bg = color;
+          break;
+        }
+        default:
+          if (p >= 30 && p <= 37) pen.fg = PTY_COLOR_INDEXED | (p - 30);
+          else if (p >= 40 && p <= 47) pen.bg = PTY_COLOR_INDEXED | (p - 40);
+          else if (p >= 90 && p <= 97) pen.fg = PTY_COLOR_INDEXED | (p - 90 + 8);
+          else if (p >= 100 && p <= 107) pen.bg = PTY_COLOR_INDEXED | (p - 100 + 8);
+          break;
+      }
+    }
+  }
+
+  void switch_screen(bool to_alt, bool save, bool clear) {
+    if (to_alt == alternate) return;
+    if (to_alt) {
+      if (save) saved_main = cursor;
+      alternate = true;
+      if (clear) alt.assign(rows, blank_line());
+    } else {
+      if (clear) alt.assign(rows, blank_line());
+      alternate = false;
+      if (save) cursor = saved_main;
+    }
+    wrap_pending = false;
+    touch_rows(0, rows - 1);
+  }
+
+  void set_mode(bool on) {
+    for (int i = 0; i < std::max(nparams, 1); i++) {
+      int p = nparams ? params[i] : 0;
+      if (private_marker == '?') {
+        switch (p) {
+          case 6: cursor.origin = on; move_to(0, 0); break;
+          case 7: cursor.autowrap = on; break;
+          case 25: cursor_visible = on; break;
+          case 47: switch_screen(on, false, false); break;
+          case 1047: switch_screen(on, false, !on); break;
+          case 1048: if (on) saved = cursor; else cursor = saved; break;
+          case 1049: switch_screen(on, true, true); break;
+        }
+      } else if (private_marker == 0 && p == 4) {
+        insert_mode = on;
+      }
+    }
+  }
+
+  int param(int i, int def) const {
+    return (i < nparams && params[i] > 0) ? params[i] : def;
+  }
+
+  void csi(unsigned char final) {
+    auto &buf = lines();
+    int n = param(0, 1);
+    if (private_marker != 0 && private_marker != '?') return;
+    if (private_marker == '?' && final != 'h' && final != 'l') return;
+
+    switch (final) {
+      case '@': {
+        auto &cells = buf[cursor.y].cells;
+        n = std::min(n, cols - cursor.x);
+        cells.insert(cells.begin() + cursor.x, n, pty_cell());
+        cells.resize(cols);
+        repair_wide(cursor.y, cursor.x, cols);
+        break;
+      }
+      case 'A': cursor.y = std::max(cursor.y - n, cursor.y >= scroll_top ? scroll_top : 0); wrap_pending = false; break;
+      case 'B': case 'e': cursor.y = std::min(cursor.y + n, cursor.y <= scroll_bottom ? scroll_bottom : rows - 1); wrap_pending = false; break;
+      case 'C': case 'a': cursor.x = std::min(cursor.x + n, cols - 1); wrap_pending = false; break;
+      case 'D': cursor.x = std::max(cursor.x - n, 0); wrap_pending = false; break;
+      case 'E': cursor.x = 0; cursor.y = std::min(cursor.y + n, rows - 1); wrap_pending = false; break;
+      case 'F': cursor.x = 0; cursor.y = std::max(cursor.y - n, 0); wrap_pending = false; break;
+      case 'G': case '`': cursor.x = std::min(n, cols) - 1; wrap_pending = false; break;
+      case 'H': case 'f': move_to(param(1, 1) - 1, param(0, 1) - 1); break;
+      case 'd': {
+        int x = cursor.x;
+        move_to(x, param(0, 1) - 1);
+        break;
+      }
+      case 'J': {
+        int mode = nparams ? params[0] : 0;
+        if (mode == 0) {
+          erase_cells(cursor.y, cursor.x, cols);
+          for (int y = cursor.y + 1; y < rows; y++) erase_cells(y, 0, cols);
+        } else if (mode == 1) {
+          for (int y = 0; y < cursor.y; y++) erase_cells(y, 0, cols);
+          erase_cells(cursor.y, 0, cursor.x + 1);
+        } else if (mode == 2) {
+          for (int y = 0; y < rows; y++) erase_cells(y, 0, cols);
+        } else if (mode == 3) {
+          scrollback.clear();
+        }
+        break;
+      }
+      case 'K': {
+        int mode = nparams ? params[0] : 0;
+        if (mode == 0) erase_cells(cursor.y, cursor.x, cols);
+        else if (mode == 1) erase_cells(cursor.y, 0, cursor.x + 1);
+        else if (mode == 2) erase_cells(cursor.y, 0, cols);
+        break;
+      }
+      case 'L':
+        if (cursor.y >= scroll_top && cursor.y <= scroll_bottom) {
+          scroll_down(cursor.y, scroll_bottom, n);
+          cursor.x = 0;
+        }
+        break;
+      case 'M':
+        if (cursor.y >= scroll_top && cursor.y <= scroll_bottom) {
+          scroll_up(cursor.y, scroll_bottom, n, false);
+          cursor.x = 0;
+        }
+        break;
+      case 'P': {
+        auto &cells = buf[cursor.y].cells;
+        n = std::min(n, cols - cursor.x);
+        cells.erase(cells.begin() + cursor.x, cells.begin() + cursor.x + n);
+        pty_cell blank;
+        blank.attr.bg = cursor.pen.bg;
+        cells.resize(cols, blank);
+        repair_wide(cursor.y, cursor.x, cols);
+        break;
+      }
+      case 'S': scroll_up(scroll_top, scroll_bottom, n); break;
+      case 'T': scroll_down(scroll_top, scroll_bottom, n); break;
+      case 'X': erase_cells(cursor.y, cursor.x, cursor.x + n); break;
+      case 'Z':
+        for (int i = 0; i < n && cursor.x > 0; i++) {
+          do { cursor.x--; } while (cursor.x > 0 && !tabs[cursor.x]);
+        }
+        break;
+      case 'b': {
+        // REP, repeat the preceding character
+        int x = cursor.x > 0 ? cursor.x - 1 : 0;
+        uint32_t ch = buf[cursor.y].cells[x].ch;
+        for (int i = 0; i < n && ch; i++) put(ch);
+        break;
+      }
+      case 'g': {
+        int mode = nparams ? params[0] : 0;
+        if (mode == 0) tabs[cursor.x] = false;
+        else if (mode == 3) std::fill(tabs.begin(), tabs.end(), false);
+        break;
+      }
+      case 'h': set_mode(true); break;
+      case 'l': set_mode(false); break;
+      case 'm': sgr(); break;
+      case 'r': {
+        int top = param(0, 1) - 1;
+        int bottom = param(1, rows) - 1;
+        if (top < bottom && bottom < rows) {
+          scroll_top = top;
+          scroll_bottom = bottom;
+          move_to(0, 0);
+        }
+        break;
+      }
+      case 's': saved = cursor; break;
+      case 'u': cursor = saved; wrap_pending = false; break;
+    }
+  }
+
+  void esc(unsigned char final) {
+    if (intermediate == '(') {
+      cursor.line_drawing = (final == '0');
+      return;
+    }
+    if (intermediate != 0) return;
+    switch (final) {
+      case '7': saved = cursor; break;
+      case '8': cursor = saved; wrap_pending = false; break;
+      case 'D': linefeed(); break;
+      case 'E': cursor.x = 0; linefeed(); break;
+      case 'H': tabs[cursor.x] = true; break;
+      case 'M': reverse_index(); break;
+      case 'c': reset(); break;
+    }
+  }
+
+  void osc_done() {
+    // OSC 0 / OSC 2: window title
+    size_t semi = osc.find(';');
+    if (semi != std::string::npos) {
+      std::string code = osc.substr(0, semi);
+      if (code == "0" || code == "2") {
+        std::string text = osc.substr(semi + 1);
+        if (text != title) {
+          title.swap(text);
+          title_version = frame + 1;
+        }
+      }
+    }
+    osc.clear();
+  }
+
+  void feed(const unsigned char *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+      unsigned char c = data[i];
+
+      // CAN and SUB abort any sequence, ESC starts a new one
+      if (state != OSC && state != STRING) {
+        if (c == 0x18 || c == 0x1A) {
+          state = GROUND;
+          continue;
+        }
+        if (c == 0x1B) {
+          state = ESCAPE;
+          intermediate = 0;
+          utf8_need = 0;
+          continue;
+        }
+      }
+
+      switch (state) {
+        case GROUND:
+          if (utf8_need > 0) {
+            if (c >= utf8_lower && c <= utf8_upper) {
+              utf8_cp = (utf8_cp << 6) | (c & 0x3F);
+              utf8_lower = 0x80;
+              utf8_upper = 0xBF;
+              if (--utf8_need == 0) put(utf8_cp);
+              continue;
+            }
+            utf8_need = 0;
+            put(0xFFFD);
+          }
+          if (c < 0x20) {
+            control(c);
+          } else if (c < 0x7F) {
+            put(c);
+          } else if (c >= 0xC2 && c <= 0xDF) {
+            utf8_cp = c & 0x1F; utf8_need = 1;
+            utf8_lower = 0x80; utf8_upper = 0xBF;
+          } else if (c >= 0xE0 && c <= 0xEF) {
+            utf8_cp = c & 0x0F; utf8_need = 2;
+            utf8_lower = c == 0xE0 ? 0xA0 : 0x80;
+            utf8_upper = c == 0xED ? 0x9F : 0xBF;
+          } else if (c >= 0xF0 && c <= 0xF4) {
+            utf8_cp = c & 0x07; utf8_need = 3;
+            utf8_lower = c == 0xF0 ? 0x90 : 0x80;
+            utf8_upper = c == 0xF4 ? 0x8F : 0xBF;
+          } else if (c != 0x7F) {
+            put(0xFFFD);
+          }
+          break;
+        case ESCAPE:
+          if (c == '[') {
+            state = CSI_PARAM;
+            nparams = 0;
+            private_marker = 0;
+            intermediate = 0;
+            params[0] = 0;
+          } else if (c == ']') {
+            state = OSC;
+            osc.clear();
+            string_esc = false;
+          } else if (c == 'P' || c == 'X' || c == '^' || c == '_') {
+            state = STRING;
+            string_esc = false;
+          } else if (c >= 0x20 && c <= 0x2F) {
+            intermediate = (char)c;
+            state = ESCAPE_INTERMEDIATE;
+          } else if (c < 0x20) {
+            control(c);
+          } else {
+            esc(c);
+            state = GROUND;
+          }
+          break;
+        case ESCAPE_INTERMEDIATE:
+          if (c < 0x20) {
+            control(c);
+          } else if (c >= 0x30) {
+            esc(c);
+            state = GROUND;
+          }
+          break;
+        case CSI_PARAM:
+          if (c >= '0' && c <= '9') {
+            if (nparams == 0) nparams = 1;
+            int &p = params[nparams - 1];
+            if (p < 100000) p = p * 10 + (c - '0');
+          } else if (c == ';' || c == ':') {
+            if (nparams == 0) nparams = 1;
+            if (nparams < max_params) {
+              params[nparams++] = 0;
+            } else {
+              state = CSI_IGNORE;
+            }
+          } else if (c >= '<' && c <= '?') {
+            private_marker = (char)c;
+          } else if (c >= 0x20 && c <= 0x2F) {
+            intermediate = (char)c;
+          } else if (c >= 0x40 && c <= 0x7E) {
+            if (intermediate == 0) {
+              csi(c);
+            } else if (intermediate == '!' && c == 'p') {
+              // DECSTR, soft reset
+              cursor.pen = pty_attr();
+              cursor.origin = false;
+              cursor.autowrap = true;
+              insert_mode = false;
+              cursor_visible = true;
+              scroll_top = 0;
+              scroll_bottom = rows - 1;
+            }
+            state = GROUND;
+          } else if (c < 0x20) {
+            control(c);
+          }
+          break;
+        case CSI_IGNORE:
+          if (c >= 0x40 && c <= 0x7E) state = GROUND;
+          break;
+        case OSC:
+        case STRING:
+          // DCS, SOS, PM and APC are ignored up to ST
+          if (c == 0x07 || (string_esc && c == '\\')) {
+            if (state == OSC) osc_done();
+            state = GROUND;
+          } else if (string_esc) {
+            // ESC without '\\' aborts the string and starts a new sequence
+            osc.clear();
+            state = ESCAPE;
+            intermediate = 0;
+            i--;
+          } else if (c == 0x1B) {
+            string_esc = true;
+          } else if (state == OSC && osc.size() < 4096) {
+            osc.push_back((char)c);
+          }
+          break;
+      }
+    }
+  }
+
+  // text of row `y`, trailing blanks trimmed
+  std::string row_text(const pty_line &line) const {
+    std::string out;
+    size_t end = line.cells.size();
+    while (end > 0 && (line.cells[end - 1].ch == ' ' || line.cells[end - 1].ch == 0)) end--;
+    for (size_t x = 0; x < end; x++) {
+      if (line.cells[x].ch != 0) pty_utf8_encode(line.cells[x].ch, out);
+    }
+    return out;
+  }
+};
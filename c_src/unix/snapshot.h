@@ -0,0 +1,375 @@
+#pragma once
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "screen.h"
+
+/**
+ * Screen snapshots
+ * Serializes a pty_screen, with up to `scrollback` lines of its
+ * scrollback, so that a new viewer gets the current state without
+ * the byte history. The cost is O(screen + scrollback).
+ *
+ * Binary format, every integer is an unsigned LEB128 varint:
+ *
+ *   "EXPS" version(1)
+ *   cols rows nscrollback
+ *   cursor_x cursor_y scroll_top scroll_bottom modes
+ *   title_len title
+ *   nattrs (fg bg flags)*              interned attribute table
+ *   pen                                attribute index
+ *   saved_main: x y pen modes          main screen cursor (1049)
+ *   saved: x y pen modes               DECSC cursor
+ *   lines: nscrollback + rows [+ rows of the alternate screen]
+ *     ncells wrapped runs*
+ *     run: (len << 1 | repeat) attr, then one codepoint if repeat,
+ *          else `len` codepoints (0 for the right half of a wide char)
+ */
+
+#define PTY_SNAPSHOT_VERSION 1
+
+enum pty_snapshot_mode : uint32_t {
+  PTY_SNAPSHOT_CURSOR_VISIBLE = 1 << 0,
+  PTY_SNAPSHOT_ALTERNATE = 1 << 1,
+  PTY_SNAPSHOT_AUTOWRAP = 1 << 2,
+  PTY_SNAPSHOT_ORIGIN = 1 << 3,
+  PTY_SNAPSHOT_INSERT = 1 << 4,
+  PTY_SNAPSHOT_WRAP_PENDING = 1 << 5,
+  PTY_SNAPSHOT_LINE_DRAWING = 1 << 6,
+};
+
+static inline void pty_put_varint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out.push_back((char)(v | 0x80));
+    v >>= 7;
+  }
+  out.push_back((char)v);
+}
+
+struct pty_snapshot_reader {
+  const unsigned char *p;
+  const unsigned char *end;
+  bool ok = true;
+
+  pty_snapshot_reader(const unsigned char *data, size_t len) : p(data), end(data + len) {}
+
+  uint64_t varint() {
+    uint64_t v = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      if (p == end) break;
+      unsigned char b = *p++;
+      v |= (uint64_t)(b & 0x7F) << shift;
+      if (!(b & 0x80)) return v;
+    }
+    ok = false;
+    return 0;
+  }
+
+  // a varint that has to be at most `max`
+  uint64_t varint(uint64_t max) {
+    uint64_t v = varint();
+    if (v > max) ok = false;
+    return ok ? v : 0;
+  }
+};
+
+struct pty_snapshot_writer {
+  std::string body;
+  std::vector<pty_attr> attrs;
+  std::unordered_map<uint64_t, uint32_t> attr_index;
+
+  uint32_t intern(const pty_attr &attr) {
+    // colors use 26 bits and flags 8, so the key is exact
+    uint64_t key = (uint64_t)attr.fg | ((uint64_t)attr.bg << 26) | ((uint64_t)attr.flags << 52);
+    auto it = attr_index.find(key);
+    if (it != attr_index.end()) return it->second;
+    uint32_t index = (uint32_t)attrs.size();
+    attrs.push_back(attr);
+    attr_index.emplace(key, index);
+    return index;
+  }
+
+  void line(const pty_line &line) {
+    const auto &cells = line.cells;
+    pty_put_varint(body, cells.size());
+    body.push_back(line.wrapped ? 1 : 0);
+
+    size_t x = 0;
+    while (x < cells.size()) {
+      const pty_attr &attr = cells[x].attr;
+      uint32_t ch = cells[x].ch;
+
+      // blanks and box drawing repeat a lot, store them once
+      size_t n = 1;
+      while (x + n < cells.size() && cells[x + n].ch == ch && cells[x + n].attr == attr) n++;
+      if (n >= 3) {
+        pty_put_varint(body, (n << 1) | 1);
+        pty_put_varint(body, intern(attr));
+        pty_put_varint(body, ch);
+        x += n;
+        continue;
+      }
+
+      // a literal run up to the next attribute change or repetition
+      n = 1;
+      while (x + n < cells.size() && cells[x + n].attr == attr &&
+             !(x + n + 2 < cells.size() && cells[x + n + 1].ch == cells[x + n].ch &&
+               cells[x + n + 2].ch == cells[x + n].ch && cells[x + n + 1].attr == attr &&
+               cells[x + n + 2].attr == attr)) {
+        n++;
+      }
+      pty_put_varint(body, n << 1);
+      pty_put_varint(body, intern(attr));
+      for (size_t i = 0; i < n; i++) pty_put_varint(body, cells[x + i].ch);
+      x += n;
+    }
+  }
+};
+
+static uint32_t pty_snapshot_cursor_modes(const pty_screen::cursor_state &cursor) {
+  uint32_t modes = 0;
+  if (cursor.autowrap) modes |= PTY_SNAPSHOT_AUTOWRAP;
+  if (cursor.origin) modes |= PTY_SNAPSHOT_ORIGIN;
+  if (cursor.line_drawing) modes |= PTY_SNAPSHOT_LINE_DRAWING;
+  return modes;
+}
+
+static void pty_snapshot_encode_cursor(const pty_screen::cursor_state &cursor, uint32_t pen, std::string &out) {
+  pty_put_varint(out, cursor.x);
+  pty_put_varint(out, cursor.y);
+  pty_put_varint(out, pen);
+  pty_put_varint(out, pty_snapshot_cursor_modes(cursor));
+}
+
+static bool pty_snapshot_decode_cursor(pty_snapshot_reader &in, const std::vector<pty_attr> &attrs,
+                                       int cols, int rows, pty_screen::cursor_state &cursor) {
+  cursor.x = (int)in.varint(cols - 1);
+  cursor.y = (int)in.varint(rows - 1);
+  uint32_t pen = (uint32_t)in.varint();
+  uint32_t modes = (uint32_t)in.varint();
+  if (!in.ok || pen >= attrs.size()) return false;
+  cursor.pen = attrs[pen];
+  cursor.autowrap = modes & PTY_SNAPSHOT_AUTOWRAP;
+  cursor.origin = modes & PTY_SNAPSHOT_ORIGIN;
+  cursor.line_drawing = modes & PTY_SNAPSHOT_LINE_DRAWING;
+  return true;
+}
+
+/**
+ * Appends the snapshot of `screen` with its last `scrollback` lines
+ * of scrollback (all of them if larger) to `out`.
+ */
+static void pty_snapshot_encode(const pty_screen &screen, size_t scrollback, std::string &out) {
+  pty_snapshot_writer writer;
+  size_t nscroll = std::min(scrollback, screen.scrollback.size());
+  uint32_t pen = writer.intern(screen.cursor.pen);
+  uint32_t saved_main_pen = writer.intern(screen.saved_main.pen);
+  uint32_t saved_pen = writer.intern(screen.saved.pen);
+  for (size_t i = screen.scrollback.size() - nscroll; i < screen.scrollback.size(); i++) {
+    writer.line(screen.scrollback[i]);
+  }
+  for (const pty_line &line : screen.main) writer.line(line);
+  if (screen.alternate) {
+    for (const pty_line &line : screen.alt) writer.line(line);
+  }
+
+  uint32_t modes = pty_snapshot_cursor_modes(screen.cursor);
+  if (screen.cursor_visible) modes |= PTY_SNAPSHOT_CURSOR_VISIBLE;
+  if (screen.alternate) modes |= PTY_SNAPSHOT_ALTERNATE;
+  if (screen.insert_mode) modes |= PTY_SNAPSHOT_INSERT;
+  if (screen.wrap_pending) modes |= PTY_SNAPSHOT_WRAP_PENDING;
+
+  out.append("EXPS", 4);
+  out.push_back(PTY_SNAPSHOT_VERSION);
+  pty_put_varint(out, screen.cols);
+  pty_put_varint(out, screen.rows);
+  pty_put_varint(out, nscroll);
+  pty_put_varint(out, screen.cursor.x);
+  pty_put_varint(out, screen.cursor.y);
+  pty_put_varint(out, screen.scroll_top);
+  pty_put_varint(out, screen.scroll_bottom);
+  pty_put_varint(out, modes);
+  pty_put_varint(out, screen.title.size());
+  out += screen.title;
+  pty_put_varint(out, writer.attrs.size());
+  for (const pty_attr &attr : writer.attrs) {
+    pty_put_varint(out, attr.fg);
+    pty_put_varint(out, attr.bg);
+    pty_put_varint(out, attr.flags);
+  }
+  pty_put_varint(out, pen);
+  pty_snapshot_encode_cursor(screen.saved_main, saved_main_pen, out);
+  pty_snapshot_encode_cursor(screen.saved, saved_pen, out);
+  out += writer.body;
+}
+
+static bool pty_snapshot_decode_line(pty_snapshot_reader &in, const std::vector<pty_attr> &attrs,
+                                     int cols, pty_line &line) {
+  size_t ncells = (size_t)in.varint(1 << 16);
+  line.wrapped = in.varint(1) != 0;
+  line.cells.clear();
+  line.cells.reserve(ncells);
+  while (in.ok && line.cells.size() < ncells) {
+    uint64_t head = in.varint();
+    size_t n = (size_t)(head >> 1);
+    uint32_t attr = (uint32_t)in.varint(attrs.empty() ? 0 : attrs.size() - 1);
+    if (!in.ok || attrs.empty() || n == 0 || n > ncells - line.cells.size()) return false;
+
+    pty_cell cell;
+    cell.attr = attrs[attr];
+    if (head & 1) {
+      cell.ch = (uint32_t)in.varint(0x10FFFF);
+      line.cells.insert(line.cells.end(), n, cell);
+    } else {
+      for (size_t i = 0; i < n; i++) {
+        cell.ch = (uint32_t)in.varint(0x10FFFF);
+        line.cells.push_back(cell);
+      }
+    }
+  }
+  // scrollback lines keep the width they had when they scrolled off
+  if (cols > 0) line.cells.resize(cols);
+  return in.ok;
+}
+
+/**
+ * Restores `screen` from a snapshot, returns false if it is malformed,
+ * in which case `screen` is left untouched.
+ */
+static bool pty_snapshot_decode(const unsigned char *data, size_t len, pty_screen &screen) {
+  if (len < 5 || memcmp(data, "EXPS", 4) != 0 || data[4] != PTY_SNAPSHOT_VERSION) return false;
+  pty_snapshot_reader in(data + 5, len - 5);
+
+  int cols = (int)in.varint(PTY_SCREEN_MAX_SIZE);
+  int rows = (int)in.varint(PTY_SCREEN_MAX_SIZE);
+  size_t nscroll = (size_t)in.varint(1 << 24);
+  if (!in.ok || cols == 0 || rows == 0 || (size_t)cols * rows > PTY_SCREEN_MAX_CELLS) return false;
+
+  pty_screen restored(cols, rows);
+  restored.max_scrollback = screen.max_scrollback;
+  restored.cursor.x = (int)in.varint(cols - 1);
+  restored.cursor.y = (int)in.varint(rows - 1);
+  restored.scroll_top = (int)in.varint(rows - 1);
+  restored.scroll_bottom = (int)in.varint(rows - 1);
+  uint32_t modes = (uint32_t)in.varint();
+  size_t title_len = (size_t)in.varint(4096);
+  if (!in.ok || (size_t)(in.end - in.p) < title_len) return false;
+  restored.title.assign((const char *)in.p, title_len);
+  in.p += title_len;
+
+  std::vector<pty_attr> attrs((size_t)in.varint(1 << 20));
+  for (pty_attr &attr : attrs) {
+    attr.fg = (uint32_t)in.varint(0xFFFFFFFF);
+    attr.bg = (uint32_t)in.varint(0xFFFFFFFF);
+    attr.flags = (uint16_t)in.varint(0xFFFF);
+  }
+  uint32_t pen = (uint32_t)in.varint();
+  if (!in.ok || pen >= attrs.size()) return false;
+  restored.cursor.pen = attrs[pen];
+  if (!pty_snapshot_decode_cursor(in, attrs, cols, rows, restored.saved_main) ||
+      !pty_snapshot_decode_cursor(in, attrs, cols, rows, restored.saved)) {
+    return false;
+  }
+
+  restored.cursor_visible = modes & PTY_SNAPSHOT_CURSOR_VISIBLE;
+  restored.alternate = modes & PTY_SNAPSHOT_ALTERNATE;
+  restored.cursor.autowrap = modes & PTY_SNAPSHOT_AUTOWRAP;
+  restored.cursor.origin = modes & PTY_SNAPSHOT_ORIGIN;
+  restored.insert_mode = modes & PTY_SNAPSHOT_INSERT;
+  restored.wrap_pending = modes & PTY_SNAPSHOT_WRAP_PENDING;
+  restored.cursor.line_drawing = modes & PTY_SNAPSHOT_LINE_DRAWING;
+  if (restored.scroll_top > restored.scroll_bottom) return false;
+
+  pty_line line;
+  for (size_t i = 0; i < nscroll; i++) {
+    if (!pty_snapshot_decode_line(in, attrs, 0, line)) return false;
+    restored.push_scrollback(line);
+  }
+  for (pty_line &row : restored.main) {
+    if (!pty_snapshot_decode_line(in, attrs, cols, row)) return false;
+  }
+  if (restored.alternate) {
+    for (pty_line &row : restored.alt) {
+      if (!pty_snapshot_decode_line(in, attrs, cols, row)) return false;
+    }
+  }
+  if (in.p != in.end) return false;
+
+  // viewers of the old screen need a full repaint
+  restored.frame = screen.frame;
+  restored.title_version = screen.frame + 1;
+  restored.touch_rows(0, rows - 1);
+  screen = std::move(restored);
+  return true;
+}
+
+/**
+ * Appends an ANSI byte stream that recreates the screen, the last
+ * `scrollback` lines of scrollback included, on a terminal of the
+ * same size in a single write.
+ */
+static void pty_snapshot_ansi(const pty_screen &screen, size_t scrollback, std::string &out) {
+  char seq[32];
+  const int cols = screen.cols;
+  size_t nscroll = std::min(scrollback, screen.scrollback.size());
+
+  // RIS, then the main screen is written top to bottom so that the
+  // lines above it end up in the scrollback of the terminal
+  out += "\x1b" "c";
+  bool newline = false;
+  auto emit = [&](const pty_line &line) {
+    int width = std::min((int)line.cells.size(), cols);
+    int from = 0;
+    if (newline) {
+      out += "\r\n";
+    } else if (width > 0) {
+      // EL right after a soft wrap would erase the last cell of the
+      // previous line instead, a character has to come first
+      pty_render_cells(line, 0, 1, false, out);
+      from = 1;
+    }
+    pty_render_cells(line, from, width, !line.wrapped || width < cols, out);
+    out += "\x1b[0m";
+    // a soft wrapped line continues on the next one by itself
+    newline = !(line.wrapped && width == cols);
+  };
+  for (size_t i = screen.scrollback.size() - nscroll; i < screen.scrollback.size(); i++) {
+    emit(screen.scrollback[i]);
+  }
+  for (const pty_line &line : screen.main) emit(line);
+
+  if (screen.alternate) {
+    snprintf(seq, sizeof(seq), "\x1b[%d;%dH", screen.saved_main.y + 1, screen.saved_main.x + 1);
+    out += seq;
+    pty_sgr(screen.saved_main.pen, out);
+    out += "\x1b[?1049h\x1b[0m";
+    for (int y = 0; y < screen.rows; y++) {
+      snprintf(seq, sizeof(seq), "\x1b[%d;1H", y + 1);
+      out += seq;
+      pty_render_cells(screen.alt[y], 0, cols, true, out);
+    }
+  }
+
+  if (screen.scroll_top != 0 || screen.scroll_bottom != screen.rows - 1) {
+    snprintf(seq, sizeof(seq), "\x1b[%d;%dr", screen.scroll_top + 1, screen.scroll_bottom + 1);
+    out += seq;
+  }
+  if (!screen.cursor.autowrap) out += "\x1b[?7l";
+  if (screen.insert_mode) out += "\x1b[4h";
+  if (screen.cursor.line_drawing) out += "\x1b(0";
+  if (screen.cursor.origin) out += "\x1b[?6h";
+  int top = screen.cursor.origin ? screen.scroll_top : 0;
+  snprintf(seq, sizeof(seq), "\x1b[%d;%dH", screen.cursor.y - top + 1, screen.cursor.x + 1);
+  out += seq;
+  pty_sgr(screen.cursor.pen, out);
+  if (!screen.cursor_visible) out += "\x1b[?25l";
+  if (!screen.title.empty()) {
+    out += "\x1b]2;";
+    out += screen.title;
+    out += '\x07';
+  }
+}
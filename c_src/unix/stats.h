@@ -0,0 +1,206 @@
+#pragma once
+
+#include <stdint.h>
+#include <algorithm>
+#include <atomic>
+
+/**
+ * Session statistics
+ * Counters and latency histograms updated on the hot paths with
+ * relaxed atomic increments, no lock is taken; readers get a view
+ * that is consistent per counter, which is all they need.
+ */
+
+/**
+ * pty_histogram
+ * Log-linear buckets in the spirit of HdrHistogram: values below 8
+ * get one bucket each, every power of two above is split in 8, so a
+ * value is known within 12.5% from 1 ns up to 2^41 ns (~37 min).
+ */
+
+struct pty_histogram {
+  static const int sub_bits = 3;
+  static const int max_exponent = 40;
+  static const int buckets = (max_exponent - sub_bits + 2) << sub_bits;
+
+  std::atomic<uint64_t> counts[buckets];
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> max{0};
+
+  pty_histogram() {
+    for (auto &c : counts) c.store(0, std::memory_order_relaxed);
+  }
+
+  static int bucket(uint64_t v) {
+    if (v < (1u << sub_bits)) return (int)v;
+    int e = 63 - __builtin_clzll(v);
+    if (e > max_exponent) return buckets - 1;
+    return ((e - sub_bits + 1) << sub_bits) + (int)((v >> (e - sub_bits)) & ((1u << sub_bits) - 1));
+  }
+
+  // the largest value that falls into bucket `b`
+  static uint64_t upper(int b) {
+    if (b < (1 << sub_bits)) return (uint64_t)b;
+    int e = (b >> sub_bits) + sub_bits - 1;
+    uint64_t sub = (uint64_t)(b & ((1 << sub_bits) - 1));
+    return (((1ULL << sub_bits) + sub + 1) << (e - sub_bits)) - 1;
+  }
+
+  void record(uint64_t v) {
+    counts[bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    count.fetch_add(1, std::memory_order_relaxed);
+    sum.fetch_add(v, std::memory_order_relaxed);
+    uint64_t m = max.load(std::memory_order_relaxed);
+    while (v > m && !max.compare_exchange_weak(m, v, std::memory_order_relaxed)) {}
+  }
+};
+
+// a plain copy of one or more histograms, for reporting
+struct pty_histogram_view {
+  uint64_t counts[pty_histogram::buckets] = {};
+  uint64_t count = 0;
+  uint64_t sum = 0;
+  uint64_t max = 0;
+
+  void add(const pty_histogram &h) {
+    for (int i = 0; i < pty_histogram::buckets; i++) {
+      counts[i] += h.counts[i].load(std::memory_order_relaxed);
+    }
+    count += h.count.load(std::memory_order_relaxed);
+    sum += h.sum.load(std::memory_order_relaxed);
+    max = std::max(max, h.max.load(std::memory_order_relaxed));
+  }
+
+  // upper bound of the bucket holding the q-quantile, capped at max
+  uint64_t quantile(double q) const {
+    uint64_t total = 0;
+    for (int i = 0; i < pty_histogram::buckets; i++) total += counts[i];
+    if (total == 0) return 0;
+    uint64_t rank = (uint64_t)(q * (double)(total - 1)) + 1;
+    uint64_t seen = 0;
+    for (int i = 0; i < pty_histogram::buckets; i++) {
+      seen += counts[i];
+      if (seen >= rank) return std::min(pty_histogram::upper(i), max);
+    }
+    return max;
+  }
+};
+
+struct pty_stats {
+  std::atomic<uint64_t> reads{0};
+  std::atomic<uint64_t> bytes_read{0};
+  // {:data, _} and {:lines, _} messages
+  std::atomic<uint64_t> messages{0};
+  std::atomic<uint64_t> writes{0};
+  std::atomic<uint64_t> bytes_written{0};
+  std::atomic<uint64_t> partial_writes{0};
+  std::atomic<uint64_t> write_retries{0};
+  std::atomic<uint64_t> eagain{0};
+  std::atomic<uint64_t> echo_probes{0};
+  std::atomic<uint64_t> echo_timeouts{0};
+  // discarded by an output budget, see budget.h
+  std::atomic<uint64_t> bytes_dropped{0};
+  // superseded progress bar rewrites, see collapse.h
+  std::atomic<uint64_t> bytes_collapsed{0};
+  // written to the peer or the socket of ExPTY.connect/3, see link.h
+  std::atomic<uint64_t> bytes_forwarded{0};
+
+  // from read() returning to the chunk having been sent, in ns
+  pty_histogram read_to_send;
+  // of pty_pipesocket::write(), in ns
+  pty_histogram write_duration;
+  // from a probed write to its echo having been read, in ns
+  pty_histogram echo_latency;
+
+  static void bump(std::atomic<uint64_t> &counter, uint64_t n = 1) {
+    counter.fetch_add(n, std::memory_order_relaxed);
+  }
+};
+
+/**
+ * pty_echo_probe
+ * Keystroke echo latency: a probed write remembers the first run of
+ * printable bytes it carries and when it started, the reader looks
+ * for them in the output and the probe completes once they have all
+ * come back. One probe is in flight at a time; one that does not come
+ * back, e.g. with echo off, is given up after `timeout`.
+ */
+
+struct pty_echo_probe {
+  static const size_t max_pattern = 16;
+  static const uint64_t timeout = 2000000000ULL;
+
+  // every nth write is probed, 0 only on request
+  std::atomic<uint32_t> every{0};
+  std::atomic<uint64_t> writes{0};
+  std::atomic<bool> requested{false};
+
+  // guarded by the reader_mutex of the pipesocket
+  bool armed = false;
+  char pattern[max_pattern];
+  // KMP failure function of `pattern`
+  uint8_t fail[max_pattern];
+  size_t len = 0;
+  size_t matched = 0;
+  uint64_t sent = 0;
+
+  // whether the next write should be probed, lock-free; a request
+  // stands until a write could be probed
+  bool wanted() {
+    if (requested.load(std::memory_order_relaxed)) return true;
+    uint32_t n = every.load(std::memory_order_relaxed);
+    return n > 0 && writes.fetch_add(1, std::memory_order_relaxed) % n == 0;
+  }
+
+  // returns true when a probe in flight has been given up
+  bool expire(uint64_t now) {
+    if (!armed || now - sent < timeout) return false;
+    armed = false;
+    return true;
+  }
+
+  // false when `data` has nothing printable or a probe is in flight
+  bool arm(const char *data, size_t n, uint64_t now) {
+    if (armed) return false;
+    size_t i = 0;
+    while (i < n && !printable(data[i])) {
+      // keys like arrows are escape sequences, not echoed as typed
+      if (data[i++] == 0x1b && i < n && (data[i] == '[' || data[i] == 'O')) {
+        for (i++; i < n && !(data[i] >= 0x40 && data[i] <= 0x7e); i++) {}
+        i++;
+      }
+    }
+    len = 0;
+    while (i < n && len < max_pattern && printable(data[i])) pattern[len++] = data[i++];
+    if (len == 0) return false;
+
+    fail[0] = 0;
+    for (size_t k = 0, j = 1; j < len; j++) {
+      while (k > 0 && pattern[j] != pattern[k]) k = fail[k - 1];
+      if (pattern[j] == pattern[k]) k++;
+      fail[j] = (uint8_t)k;
+    }
+    matched = 0;
+    sent = now;
+    armed = true;
+    requested = false;
+    return true;
+  }
+
+  // returns true when the echo is complete within `data`
+  bool feed(const char *data, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+      while (matched > 0 && data[i] != pattern[matched]) matched = fail[matched - 1];
+      if (data[i] == pattern[matched] && ++matched == len) {
+        armed = false;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  static bool printable(char c) {
+    return (unsigned char)c >= 0x20 && c != 0x7f;
+  }
+};
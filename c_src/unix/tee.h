@@ -0,0 +1,402 @@
+#pragma once
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <erl_nif.h>
+#include <uv.h>
+#include "nif_utils.h"
+
+/**
+ * pty_tee
+ * Copies the output of a session, as it is read, to files and local
+ * Unix sockets without it going through the BEAM, e.g. for audit logs.
+ *
+ * The reader only appends each chunk to the pending buffer; a writer
+ * thread, started with the first target, swaps it out and writes it to
+ * every target. The pending buffer is bounded and the reader never
+ * waits: what does not fit while the targets are slow is dropped and
+ * counted. A target that fails is closed and reported to the owner as
+ * {:tee_error, id, reason}, the others carry on.
+ *
+ * On Linux, with more than one target, a batch is copied into the
+ * kernel once: written to a pipe, tee(2)'d into a second pipe for all
+ * but the last target and splice(2)'d from there, without coming back
+ * to user space. A single target gets a plain write(2), which is as few
+ * copies; so does a target that splice(2) refuses.
+ */
+
+// a connected Unix stream socket, -1 with errno set on failure
+static inline int
+pty_unix_connect(const std::string &path) {
+  struct sockaddr_un addr;
+  if (path.size() >= sizeof(addr.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd == -1) return -1;
+  fcntl(fd, F_SETFD, FD_CLOEXEC);
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  memcpy(addr.sun_path, path.data(), path.size());
+  if (::connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+    int err = errno;
+    ::close(fd);
+    errno = err;
+    return -1;
+  }
+#if defined(SO_NOSIGPIPE)
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+  return fd;
+}
+
+struct pty_tee_target {
+  int id;
+  int fd;
+  bool socket = false;
+  bool splice = true;
+  // writer thread only, nothing more is written to it
+  bool stopped = false;
+  // set by remove(), guarded by the tee's mutex
+  bool removed = false;
+
+  pty_tee_target(int i, int f) : id(i), fd(f) {}
+  ~pty_tee_target() {
+    if (fd != -1) ::close(fd);
+  }
+};
+
+struct pty_tee {
+  ErlNifPid owner;
+  size_t max_pending = 4 << 20;
+  // how long the writer waits for a target before checking on closing
+  int poll_ms = 100;
+
+  uv_mutex_t mutex;
+  uv_cond_t cond;
+  uv_thread_t tid;
+  bool running = false;
+  bool closing = false;
+  int next_id = 1;
+  std::string pending;
+  std::vector<std::shared_ptr<pty_tee_target>> targets;
+  // read by the reader without the lock, 0 costs it a single load
+  std::atomic<size_t> active{0};
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> dropped{0};
+
+  // writer thread only
+  std::string writing;
+  int pipe_fds[2] = {-1, -1};
+  int spare_fds[2] = {-1, -1};
+
+  pty_tee() {
+    uv_mutex_init(&mutex);
+    uv_cond_init(&cond);
+  }
+
+  ~pty_tee() {
+    close();
+    uv_cond_destroy(&cond);
+    uv_mutex_destroy(&mutex);
+  }
+
+  /**
+   * Opens `path` for appending, or connects to it with `socket`, and
+   * starts copying to it; returns the id of the target or -errno.
+   */
+  int add(const std::string &path, bool socket, const ErlNifPid &pid) {
+    // appended to with the file offset, splice(2) refuses O_APPEND
+    int fd = socket ? pty_unix_connect(path) : ::open(path.c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0600);
+    if (fd == -1) return -errno;
+    if (!socket) lseek(fd, 0, SEEK_END);
+
+    struct stat st;
+    bool regular = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (!regular) {
+      // sockets and FIFOs must not hold the writer when closing
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    uv_mutex_lock(&mutex);
+    if (closing) {
+      uv_mutex_unlock(&mutex);
+      ::close(fd);
+      return -EPIPE;
+    }
+    owner = pid;
+    int id = next_id++;
+    targets.push_back(std::make_shared<pty_tee_target>(id, fd));
+    targets.back()->socket = socket;
+    active = targets.size();
+    if (!running) {
+      running = true;
+      uv_thread_create(&tid, writer_fn, this);
+    }
+    uv_mutex_unlock(&mutex);
+    return id;
+  }
+
+  // stops copying to `id`, false if there is no such target
+  bool remove(int id) {
+    uv_mutex_lock(&mutex);
+    bool found = false;
+    for (size_t i = 0; i < targets.size(); i++) {
+      if (targets[i]->id == id) {
+        targets[i]->removed = true;
+        targets.erase(targets.begin() + i);
+        found = true;
+        break;
+      }
+    }
+    active = targets.size();
+    uv_mutex_unlock(&mutex);
+    return found;
+  }
+
+  void feed(const char *data, size_t len) {
+    if (active.load(std::memory_order_relaxed) == 0) return;
+
+    uv_mutex_lock(&mutex);
+    if (pending.size() + len > max_pending) {
+      dropped.fetch_add(len, std::memory_order_relaxed);
+    } else {
+      bool wake = pending.empty();
+      pending.append(data, len);
+      if (wake) uv_cond_signal(&cond);
+    }
+    uv_mutex_unlock(&mutex);
+  }
+
+  /**
+   * Writes out what is pending and stops the writer. Files get all of
+   * it, a socket or FIFO that takes nothing for poll_ms is left with
+   * what it has, without an error.
+   */
+  void close() {
+    uv_mutex_lock(&mutex);
+    bool join = running && !closing;
+    closing = true;
+    uv_cond_signal(&cond);
+    uv_mutex_unlock(&mutex);
+
+    if (join) {
+      uv_thread_join(&tid);
+    }
+    targets.clear();
+    active = 0;
+    close_pipe(pipe_fds);
+    close_pipe(spare_fds);
+  }
+
+ private:
+  static void close_pipe(int fds[2]) {
+    for (int i = 0; i < 2; i++) {
+      if (fds[i] != -1) ::close(fds[i]);
+      fds[i] = -1;
+    }
+  }
+
+  /**
+   * Waits for `target` to take more after EAGAIN. Once closing, or
+   * once the target was removed, the writer stops at it without an
+   * error; it fails only if poll(2) does.
+   */
+  void wait_writable(pty_tee_target &target) {
+    struct pollfd pfd = {target.fd, POLLOUT, 0};
+    for (;;) {
+      // POLLERR and POLLHUP as well, the next write tells what went wrong
+      int n = poll(&pfd, 1, poll_ms);
+      if (n > 0) return;
+      if (n < 0 && errno != EINTR) {
+        fail(target, errno);
+        return;
+      }
+      uv_mutex_lock(&mutex);
+      bool done = closing || target.removed;
+      uv_mutex_unlock(&mutex);
+      if (done) {
+        target.stopped = true;
+        return;
+      }
+    }
+  }
+
+  // reported to the owner, unless it has removed the target already
+  void fail(pty_tee_target &target, int err) {
+    if (target.stopped) return;
+    target.stopped = true;
+    uv_mutex_lock(&mutex);
+    ErlNifPid to = owner;
+    bool removed = target.removed;
+    uv_mutex_unlock(&mutex);
+    if (removed) return;
+    remove(target.id);
+
+    ErlNifEnv * msg_env = enif_alloc_env();
+    const char *reason = strerror(err);
+    ERL_NIF_TERM term;
+    unsigned char * ptr = enif_make_new_binary(msg_env, strlen(reason), &term);
+    if (ptr) {
+      memcpy(ptr, reason, strlen(reason));
+      enif_send(NULL, &to, msg_env, enif_make_tuple3(msg_env,
+        nif::atom(msg_env, "tee_error"),
+        enif_make_int(msg_env, target.id),
+        term
+      ));
+    }
+    enif_free_env(msg_env);
+  }
+
+  void write_to(pty_tee_target &target, const char *data, size_t len) {
+    size_t pos = 0;
+    while (!target.stopped && pos < len) {
+#if defined(MSG_NOSIGNAL)
+      ssize_t n = target.socket ? ::send(target.fd, data + pos, len - pos, MSG_NOSIGNAL)
+                                : ::write(target.fd, data + pos, len - pos);
+#else
+      ssize_t n = ::write(target.fd, data + pos, len - pos);
+#endif
+      if (n > 0) {
+        pos += (size_t)n;
+      } else if (n == -1 && errno == EAGAIN) {
+        wait_writable(target);
+      } else if (n == -1 && errno != EINTR) {
+        fail(target, errno);
+      }
+    }
+  }
+
+#if defined(__linux__)
+  static bool open_pipe(int fds[2]) {
+    if (fds[0] != -1) return true;
+    if (pipe2(fds, O_CLOEXEC) == -1) return false;
+    fcntl(fds[1], F_SETPIPE_SZ, 1 << 20);
+    return true;
+  }
+
+  // how much of `len` splice(2) moved from the pipe `from` to `target`
+  size_t splice_to(pty_tee_target &target, int from, size_t len) {
+    size_t moved = 0;
+    while (!target.stopped && moved < len) {
+      ssize_t n = splice(from, nullptr, target.fd, nullptr, len - moved, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n > 0) {
+        moved += (size_t)n;
+      } else if (n == -1 && errno == EAGAIN) {
+        wait_writable(target);
+      } else if (n == -1 && (errno == EINVAL || errno == ENOSYS)) {
+        // not supported by the target, it gets write(2) from now on
+        target.splice = false;
+        break;
+      } else if (n == -1 && errno != EINTR) {
+        fail(target, errno);
+      }
+    }
+    return moved;
+  }
+
+  // empties the pipe read by `fd`
+  static void discard(int fd) {
+    char buf[4096];
+    int available = 0;
+    while (ioctl(fd, FIONREAD, &available) == 0 && available > 0) {
+      if (::read(fd, buf, sizeof(buf)) <= 0) break;
+    }
+  }
+
+  /**
+   * One piece, at most the size of the pipes: written to the pipe once,
+   * then tee(2)'d into the spare pipe and spliced from there for each
+   * target but the last, which takes it from the pipe itself. What a
+   * target does not take is discarded, the pipes are empty after.
+   */
+  void splice_piece(std::vector<std::shared_ptr<pty_tee_target>> &to, const char *data, size_t len) {
+    size_t pos = 0;
+    while (pos < len) {
+      ssize_t n = ::write(pipe_fds[1], data + pos, len - pos);
+      if (n > 0) {
+        pos += (size_t)n;
+      } else if (n == -1 && errno != EINTR) {
+        break;
+      }
+    }
+
+    for (size_t i = 0; i < to.size(); i++) {
+      pty_tee_target &target = *to[i];
+      if (target.stopped) continue;
+
+      size_t moved = 0;
+      if (target.splice && pos == len) {
+        if (i + 1 == to.size()) {
+          moved = splice_to(target, pipe_fds[0], len);
+        } else if (tee(pipe_fds[0], spare_fds[1], len, 0) == (ssize_t)len) {
+          moved = splice_to(target, spare_fds[0], len);
+        }
+        discard(spare_fds[0]);
+      }
+      if (moved < len) write_to(target, data + moved, len - moved);
+    }
+    discard(pipe_fds[0]);
+  }
+#endif
+
+  void write_batch(std::vector<std::shared_ptr<pty_tee_target>> &to, const std::string &batch) {
+#if defined(__linux__)
+    bool splice = false;
+    for (auto &target : to) splice = splice || target->splice;
+    if (to.size() > 1 && splice && open_pipe(pipe_fds) && open_pipe(spare_fds)) {
+      int size = std::min(fcntl(pipe_fds[1], F_GETPIPE_SZ), fcntl(spare_fds[1], F_GETPIPE_SZ));
+      size_t piece = size > 0 ? (size_t)size : 4096;
+      for (size_t pos = 0; pos < batch.size(); pos += piece) {
+        size_t len = batch.size() - pos < piece ? batch.size() - pos : piece;
+        splice_piece(to, batch.data() + pos, len);
+      }
+      return;
+    }
+#endif
+    for (auto &target : to) {
+      write_to(*target, batch.data(), batch.size());
+    }
+  }
+
+  static void writer_fn(void *data) {
+    pty_tee *tee = static_cast<pty_tee *>(data);
+    std::vector<std::shared_ptr<pty_tee_target>> to;
+
+    uv_mutex_lock(&tee->mutex);
+    for (;;) {
+      while (!tee->closing && tee->pending.empty()) {
+        uv_cond_wait(&tee->cond, &tee->mutex);
+      }
+      if (tee->pending.empty()) break;
+      std::swap(tee->pending, tee->writing);
+      // targets removed meanwhile stay open until this batch is out
+      to = tee->targets;
+      uv_mutex_unlock(&tee->mutex);
+
+      tee->write_batch(to, tee->writing);
+      tee->bytes.fetch_add(tee->writing.size(), std::memory_order_relaxed);
+      tee->writing.clear();
+      to.clear();
+
+      uv_mutex_lock(&tee->mutex);
+    }
+    uv_mutex_unlock(&tee->mutex);
+  }
+};
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <string.h>
+#include <termios.h>
+#include <string>
+
+/**
+ * Termios profiles
+ * Named line discipline settings for ExPTY.set_termios/2 and the
+ * `termios` spawn option, plus the flag names they are spelled with
+ * on the Elixir side. The profiles only touch the flags that make the
+ * difference, so whatever else was set (e.g. IUTF8, HUPCL, the speeds)
+ * carries over.
+ */
+
+enum pty_termios_field {
+  PTY_IFLAG,
+  PTY_OFLAG,
+  PTY_CFLAG,
+  PTY_LFLAG,
+};
+
+struct pty_termios_flag {
+  const char *name;
+  pty_termios_field field;
+  tcflag_t bit;
+};
+
+static const pty_termios_flag pty_termios_flags[] = {
+  {"ignbrk", PTY_IFLAG, IGNBRK},
+  {"brkint", PTY_IFLAG, BRKINT},
+  {"ignpar", PTY_IFLAG, IGNPAR},
+  {"parmrk", PTY_IFLAG, PARMRK},
+  {"inpck", PTY_IFLAG, INPCK},
+  {"istrip", PTY_IFLAG, ISTRIP},
+  {"inlcr", PTY_IFLAG, INLCR},
+  {"igncr", PTY_IFLAG, IGNCR},
+  {"icrnl", PTY_IFLAG, ICRNL},
+  {"ixon", PTY_IFLAG, IXON},
+  {"ixany", PTY_IFLAG, IXANY},
+  {"ixoff", PTY_IFLAG, IXOFF},
+  {"imaxbel", PTY_IFLAG, IMAXBEL},
+#if defined(IUTF8)
+  {"iutf8", PTY_IFLAG, IUTF8},
+#endif
+  {"opost", PTY_OFLAG, OPOST},
+  {"onlcr", PTY_OFLAG, ONLCR},
+  {"ocrnl", PTY_OFLAG, OCRNL},
+  {"onocr", PTY_OFLAG, ONOCR},
+  {"onlret", PTY_OFLAG, ONLRET},
+  {"cread", PTY_CFLAG, CREAD},
+  {"cstopb", PTY_CFLAG, CSTOPB},
+  {"parenb", PTY_CFLAG, PARENB},
+  {"parodd", PTY_CFLAG, PARODD},
+  {"hupcl", PTY_CFLAG, HUPCL},
+  {"clocal", PTY_CFLAG, CLOCAL},
+  {"isig", PTY_LFLAG, ISIG},
+  {"icanon", PTY_LFLAG, ICANON},
+  {"iexten", PTY_LFLAG, IEXTEN},
+  {"echo", PTY_LFLAG, ECHO},
+  {"echoe", PTY_LFLAG, ECHOE},
+  {"echok", PTY_LFLAG, ECHOK},
+  {"echonl", PTY_LFLAG, ECHONL},
+  {"echoctl", PTY_LFLAG, ECHOCTL},
+  {"echoke", PTY_LFLAG, ECHOKE},
+  {"noflsh", PTY_LFLAG, NOFLSH},
+  {"tostop", PTY_LFLAG, TOSTOP},
+};
+
+static const size_t pty_termios_nflags = sizeof(pty_termios_flags) / sizeof(pty_termios_flags[0]);
+
+// what ExPTY.set_echo/2 turns on and off
+static const tcflag_t pty_termios_echo = ECHO | ECHOE | ECHOK | ECHOKE | ECHOCTL;
+
+static inline tcflag_t &
+pty_termios_flags_of(struct termios &t, pty_termios_field field) {
+  switch (field) {
+    case PTY_IFLAG: return t.c_iflag;
+    case PTY_OFLAG: return t.c_oflag;
+    case PTY_CFLAG: return t.c_cflag;
+    default: return t.c_lflag;
+  }
+}
+
+static inline const pty_termios_flag *
+pty_termios_find(const std::string &name) {
+  for (size_t i = 0; i < pty_termios_nflags; i++) {
+    if (name == pty_termios_flags[i].name) return &pty_termios_flags[i];
+  }
+  return nullptr;
+}
+
+/**
+ * Applies a profile, false if there is no such profile.
+ *
+ * - cooked: canonical input with signals, CR to NL on input and NL to
+ *   CRLF on output, as spawned; echo is left as it is.
+ * - raw: cfmakeraw(3), every byte goes through untouched and reads
+ *   return as soon as there is one, no echo, no signals.
+ * - cbreak: tty.setcbreak() of Python, bytes are available to the
+ *   program as they are typed, without echo, while signals and output
+ *   processing stay.
+ */
+static inline bool
+pty_termios_profile(struct termios &t, const std::string &profile) {
+  if (profile == "cooked") {
+    t.c_iflag &= ~(IGNBRK | PARMRK | ISTRIP | INLCR | IGNCR);
+    t.c_iflag |= BRKINT | ICRNL | IXON | IXANY | IMAXBEL;
+    t.c_oflag |= OPOST | ONLCR;
+    t.c_cflag = (t.c_cflag & ~(CSIZE | PARENB)) | CS8 | CREAD;
+    t.c_lflag |= ICANON | ISIG | IEXTEN;
+  } else if (profile == "raw") {
+    t.c_iflag &= ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
+    t.c_oflag &= ~OPOST;
+    t.c_lflag &= ~(ECHO | ECHONL | ICANON | ISIG | IEXTEN);
+    t.c_cflag = (t.c_cflag & ~(CSIZE | PARENB)) | CS8;
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+  } else if (profile == "cbreak") {
+    t.c_lflag &= ~(ECHO | ICANON);
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+  } else {
+    return false;
+  }
+  return true;
+}
@@ -156,6 +156,13 @@ export async function init(ctx, info) {
     term.write(Uint8Array.from(atob(data), c => c.charCodeAt(0)))
   })
 
+  ctx.handleEvent("frame", ({ frame, data }) => {
+    // ask for the next frame only once this one is drawn
+    term.write(Uint8Array.from(atob(data), c => c.charCodeAt(0)), () => {
+      ctx.pushEvent("frame_ack", {frame: frame})
+    })
+  })
+
   ctx.handleEvent("executable_exited", ({ code }) => {
     const status = ctx.root.querySelector("[data-el-status-label]");
     status.innerText = `Process exited with code ${code}`;
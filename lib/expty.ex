@@ -16,6 +16,7 @@ defmodule ExPTY do
     :pty,
     :on_data,
     :on_exit,
+    :on_event,
     :echo?,
 
     # unix
@@ -23,6 +24,8 @@ defmodule ExPTY do
     :handle_flow_control,
     :flow_control_pause,
     :flow_control_resume,
+    :packet_mode,
+    :expect,
 
     # windows
     :conin,
@@ -53,11 +56,29 @@ defmodule ExPTY do
       cwd: Application.get_env(:expty, :cwd, Path.expand("~")),
       on_data: nil,
       on_exit: nil,
+      on_event: nil,
       echo?: Application.get_env(:expty, :echo?, false),
       encoding: Application.get_env(:expty, :encoding, "utf-8"),
       handle_flow_control: Application.get_env(:expty, :handle_flow_control, false),
       flow_control_pause: Application.get_env(:expty, :flow_control_pause, "\x13"),
-      flow_control_resume: Application.get_env(:expty, :flow_control_resume, "\x11")
+      flow_control_resume: Application.get_env(:expty, :flow_control_resume, "\x11"),
+      idle_timeout: Application.get_env(:expty, :idle_timeout, nil),
+      framing: Application.get_env(:expty, :framing, :raw),
+      max_line_length: Application.get_env(:expty, :max_line_length, 65536),
+      normalize_crlf: Application.get_env(:expty, :normalize_crlf, false),
+      collapse_progress: Application.get_env(:expty, :collapse_progress, nil),
+      filters: Application.get_env(:expty, :filters, []),
+      timestamps: Application.get_env(:expty, :timestamps, false),
+      screen: Application.get_env(:expty, :screen, false),
+      scrollback: Application.get_env(:expty, :scrollback, 1000),
+      frame_rate: Application.get_env(:expty, :frame_rate, nil),
+      echo_probe: Application.get_env(:expty, :echo_probe, nil),
+      termios: Application.get_env(:expty, :termios, nil),
+      packet_mode: Application.get_env(:expty, :packet_mode, false),
+      output_budget: Application.get_env(:expty, :output_budget, nil),
+      record: nil,
+      record_format: Application.get_env(:expty, :record_format, :asciicast),
+      record_input: Application.get_env(:expty, :record_input, false)
     ]
   end
 
@@ -98,13 +119,13 @@ defmodule ExPTY do
 
   - `cols`: `pos_integer()`
 
-    Number of columns.
+    Number of columns, at most 65535.
 
     Defaults to 80.
 
   - `rows`: `pos_integer()`
 
-    Number of rows.
+    Number of rows, at most 65535.
 
     Defaults to 24.
 
@@ -172,6 +193,196 @@ defmodule ExPTY do
     The return value of this callback function is ignored.
 
   ##### Unix-specific Keyword Parameters
+  - `on_event`: `(ExPTY, pid(), tuple() -> term()) | atom`
+
+    Callback for events reported by the native reader other than data and exit.
+
+    Defaults to `nil`.
+
+    When passing a function, the function should expect 3 arguments,
+
+      1. `ExPTY`: The module name of `ExPTY`.
+      2. `pid()`: The genserver pid so that you can reuse the same function for different processes spawned.
+      3. `tuple()`: The event, for example `{:idle, ms}`, `{:active}` or `{:frame, n}`.
+
+    When passing a module name, the module should export an `on_event/3` function,
+    this function should expect the same arguments as mentioned above.
+
+    The return value of this callback function is ignored.
+
+  - `idle_timeout`: `non_neg_integer() | nil`
+
+    Once the output has been quiet for `idle_timeout` milliseconds, the native reader
+    reports `{:idle, ms}` to `on_event`, where `ms` is how long the output has been quiet.
+    When output resumes, `{:active}` is reported before the data.
+
+    Defaults to `nil`, i.e., disabled.
+
+  - `framing`: `:raw | :line`
+
+    With `:line`, the native reader splits the output into lines, like `packet: :line`
+    in `:gen_tcp`, and `on_data` receives a list of lines instead of a binary.
+    Each line keeps its trailing `"\n"`. An incomplete line is carried over to the next
+    read, and is delivered when the output goes idle (see `idle_timeout`) or on exit.
+
+    Defaults to `:raw`.
+
+  - `max_line_length`: `pos_integer()`
+
+    With `framing: :line`, lines longer than this are delivered in pieces of this size.
+
+    Defaults to `65536`.
+
+  - `normalize_crlf`: `boolean()`
+
+    With `framing: :line`, replace the `"\r\n"` produced by `ONLCR` with `"\n"`.
+
+    Defaults to `false`.
+
+  - `collapse_progress`: `pos_integer() | nil`
+
+    Collapse the `"\r"` rewrites of progress bars (pip, npm, cargo, curl...) natively, so
+    that only the final state of each line is delivered: a segment of a line is dropped when
+    the one written over it after a `"\r"` covers it anyway, being at least as long or erasing
+    the line. Complete lines are delivered right away, a line being rewritten is held back
+    for at most `collapse_progress` milliseconds and delivered in its latest state. Output
+    without rewrites, e.g. a prompt, is not held back.
+
+    This can cut the output delivered for progress-heavy sessions by orders of magnitude;
+    `screen`, `record` and `expect` still see every byte. The bytes saved are counted in the
+    `bytes_collapsed` of `ExPTY.stats/1`. A shorthand for `{:collapse_progress, ms}` first in
+    `filters`.
+
+    Defaults to `nil`, i.e., disabled.
+
+  - `filters`: `[:strip_ansi | :utf8 | {:collapse_progress, pos_integer()}]`
+
+    Filters the native reader passes the output through, in this order, before it is framed
+    and delivered:
+
+    - `{:collapse_progress, ms}`: see `collapse_progress`.
+    - `:strip_ansi`: remove escape sequences (colors, cursor movement, titles...), for logs
+      and consumers of plain text. Control characters such as `"\r"` and `"\n"` are kept.
+    - `:utf8`: never split a UTF-8 character between two messages, the end of a character
+      cut by a read is held back until the next read.
+
+    The combinations of these in this order are compiled into a single loop, other orders
+    work as well at the cost of an indirect call per filter and read. `screen`, `record` and
+    `expect` still see the output as it was read. Sessions without filters pay nothing.
+
+    Defaults to `[]`.
+
+  - `timestamps`: `boolean()`
+
+    Stamp the output with the time it was read off the PTY, rather than the time the
+    message got to this process: `on_data` receives `{ts, data}` instead of `data`, where
+    `ts` is in `erlang:monotonic_time(:nanosecond)` units, see `System.convert_time_unit/3`.
+    Output coalesced from several reads, like lines with `framing: :line`, carries
+    `{first, last}`, the read times of its first and last bytes.
+
+    Defaults to `false`.
+
+  - `screen`: `boolean()`
+
+    Keep a headless terminal emulator in sync with the output natively, so that the
+    visible screen can be read with `ExPTY.screen/2`. It understands the usual VT100/xterm
+    control sequences (cursor movement, erase, scroll regions, SGR colors, alternate screen).
+
+    Defaults to `false`.
+
+  - `scrollback`: `non_neg_integer()`
+
+    With `screen: true`, how many lines that scrolled off the top of the screen are kept
+    for `ExPTY.snapshot/3`.
+
+    Defaults to `1000`.
+
+  - `frame_rate`: `pos_integer() | nil`
+
+    With `screen: true`, report `{:frame, n}` to `on_event` at most `frame_rate` times per
+    second while the screen changes. Remote viewers then fetch what changed since the last
+    frame they have drawn with `ExPTY.screen_diff/3`, so a slow viewer skips the frames in
+    between instead of falling behind on the raw output.
+
+    Defaults to `nil`, i.e., disabled.
+
+  - `echo_probe`: `pos_integer() | nil`
+
+    Measure the keystroke echo latency of one in `echo_probe` writes, from the write to its
+    printable bytes having been read back, see `ExPTY.probe_echo/1` to probe on demand.
+    Results go to the `echo_latency` histogram of `ExPTY.stats/1` and to the
+    `[:expty, :echo]` telemetry event.
+
+    Defaults to `nil`, i.e., only on demand.
+
+  - `termios`: `:cooked | :raw | :cbreak | keyword | nil`
+
+    Line discipline settings to spawn with instead of the usual cooked mode, e.g. `:raw` for
+    binary transfers or for programs driven by another program, see `ExPTY.set_termios/2`.
+
+    Defaults to `nil`, i.e., `:cooked` with echo as set by `echo?`.
+
+  - `packet_mode`: `boolean()`
+
+    Put the PTY in packet mode (`TIOCPKT`), so that the line discipline tells the native
+    reader what it does with the output. It reports `{:flow, :stopped}` and
+    `{:flow, :started}` to `on_event` when the output is stopped and restarted with XOFF/XON
+    (with `IXON`, i.e., the line discipline does the flow control and the child blocks while
+    stopped), `{:flush, :read | :write}` when a queue is flushed and `{:flow_control, boolean}`
+    when XON/XOFF handling is turned on or off, e.g. by `stty ixon`.
+
+    Writes are then not compared with `flow_control_pause` and `flow_control_resume`,
+    `handle_flow_control` has no effect.
+
+    Defaults to `false`.
+
+  - `output_budget`: `keyword | nil`
+
+    Limit how fast the output of the session is read, so that one session flooding its
+    output (e.g. `cat` of a large file, a runaway loop) cannot keep the native reader and the
+    consumers of the output busy at the expense of the others. The budget is a token bucket
+    enforced by the native reader, see `ExPTY.set_output_budget/2`:
+
+    - `rate`: bytes per second.
+    - `burst`: bytes that may be read at once after a quiet period, at least 4096. Defaults
+      to `rate`.
+    - `policy`: what happens to the output beyond the budget. `:throttle` (the default)
+      stops reading until the budget allows it, the child then blocks in `write()` like it
+      would on a slow terminal and nothing is lost. `:drop` discards it and reports
+      `{:dropped, bytes}` to `on_event` once output is let through again. `:tail` does the
+      same but keeps the last screenful of lines, which is delivered to `on_data` right after
+      `{:dropped, bytes}` (not counted in `bytes`).
+
+    The current rate is the `output_rate` of `ExPTY.stats/1`, the bytes discarded are counted
+    in `bytes_dropped`.
+
+    Defaults to `nil`, i.e., unlimited.
+
+  - `record`: `Path.t() | nil`
+
+    Record the session to this file, by default in the [asciicast v2](https://docs.asciinema.org/manual/asciicast/v2/)
+    format (only available on Unix systems at the moment). The output is timestamped when
+    it is read and written by a native background thread in large batches, resizes are
+    recorded as `"r"` events. The file is synced periodically and when the process exits.
+
+    If writing fails, `{:record_error, reason}` is reported to `on_event`.
+
+    Defaults to `nil`, i.e., disabled.
+
+  - `record_format`: `:asciicast | :indexed`
+
+    With `record`, the format of the file. `:indexed` writes a binary format with periodic
+    screen keyframes and a time index, so that `ExPTY.Recording` can jump to any point of a
+    long session without reading everything before it.
+
+    Defaults to `:asciicast`.
+
+  - `record_input`: `boolean()`
+
+    With `record`, also record what is written with `ExPTY.write/2` as `"i"` events.
+
+    Defaults to `false`.
+
   - `encoding`: `String.t()`
 
     Defaults to `utf-8`. This keyword parameter will probably be removed in the first release.
@@ -220,23 +431,56 @@ defmodule ExPTY do
   """
   @spec spawn(String.t(), [String.t()], keyword) :: {:ok, pid} | {:error, String.t()}
   def spawn(file, args, opts \\ []) do
-    case GenServer.start(__MODULE__, {file, args, opts}) do
-      {:ok, pid} ->
-        case GenServer.call(pid, :do_spawn) do
-          :ok ->
-            {:ok, pid}
+    metadata = %{file: file, args: args}
+    start = System.monotonic_time()
+
+    ExPTY.Telemetry.execute(
+      [:expty, :spawn, :start],
+      %{system_time: System.system_time(), monotonic_time: start},
+      metadata
+    )
+
+    {result, timings} =
+      case GenServer.start(__MODULE__, {file, args, opts}) do
+        {:ok, pid} ->
+          case GenServer.call(pid, :do_spawn) do
+            {:ok, timings} ->
+              {{:ok, pid}, timings}
+
+            error ->
+              {error, %{}}
+          end
+
+        error ->
+          {error, %{}}
+      end
 
-          error ->
-            error
-        end
+    measurements =
+      timings
+      |> Map.new(fn {phase, ns} -> {phase, ExPTY.Telemetry.from_nanoseconds(ns)} end)
+      |> Map.put(:duration, System.monotonic_time() - start)
 
-      error ->
-        error
-    end
+    {status, pty} =
+      case result do
+        {:ok, pid} -> {:ok, pid}
+        error -> {error, nil}
+      end
+
+    ExPTY.Telemetry.execute(
+      [:expty, :spawn, :stop],
+      measurements,
+      Map.merge(metadata, %{result: status, pty: pty})
+    )
+
+    result
   end
 
   @doc """
   Write data to the pseudoterminal.
+
+  Blocks until the child has taken all of `data`, waiting for it to read while the input
+  buffer of the terminal is full. Returns `{:partial, written}` if the pseudoterminal was
+  closed, or the child side went away, before that.
   """
   @spec write(pid, binary) :: :ok | {:error, String.t()} | {:partial, integer}
   def write(pty, data) do
@@ -283,8 +527,136 @@ defmodule ExPTY do
     end
   end
 
+  @doc """
+  Set callback function or module for events other than data and exit
+  (only available on Unix systems at the moment).
+  """
+  @spec on_event(pid(), atom | (ExPTY, pid(), tuple() -> any)) :: :ok
+  def on_event(pty, callback) when is_function(callback, 3) do
+    GenServer.call(pty, {:update_on_event, {:func, callback}})
+  end
+
+  def on_event(pty, module) when is_atom(module) do
+    if Kernel.function_exported?(module, :on_event, 3) do
+      GenServer.call(pty, {:update_on_event, {:module, module}})
+    else
+      {:error, "expecting #{module}.on_event/3 to be exist"}
+    end
+  end
+
+  @doc """
+  Set the idle timeout in milliseconds, `nil` or `0` disables idle detection
+  (only available on Unix systems at the moment).
+
+  Please see the `idle_timeout` option of `ExPTY.spawn/3` for details.
+  """
+  @spec set_idle_timeout(pid, non_neg_integer | nil) :: :ok | {:error, String.t()}
+  def set_idle_timeout(pty, idle_timeout)
+      when is_pid(pty) and
+             (is_nil(idle_timeout) or (is_integer(idle_timeout) and idle_timeout >= 0)) do
+    GenServer.call(pty, {:set_idle_timeout, idle_timeout || 0})
+  end
+
+  @doc """
+  Wait until one of the literal `patterns` shows up in the output
+  (only available on Unix systems at the moment).
+
+  `patterns` is either a list of patterns, in which case the id of a pattern is its
+  index in the list, or a list of `{id, pattern}` tuples. A pattern is a binary or a `Regex`.
+
+  Literal patterns are compiled into an Aho-Corasick automaton and the output is scanned
+  incrementally by the native reader, matches that straddle reads are found as well.
+
+  Returns `{:match, id, before, matched}` as soon as a pattern hits, where `before` is the
+  output since `expect/4` was called up to the match (at most the last 1 MiB).
+  Returns `{:error, :timeout}` if nothing matched in `timeout` milliseconds.
+
+  Only one expect can be in progress per pseudoterminal.
+
+  ##### Regular expressions
+  If any pattern is a `Regex`, all patterns are matched natively as regular expressions
+  (binaries are escaped with `Regex.escape/1`). The source of the regex is compiled into a
+  lazily built DFA that is run over the output stream, so matching is linear in the output
+  regardless of how long the expect waits. Modifiers are not supported.
+
+  The native engine works on bytes and supports literals, `.`, `[...]`, `[^...]`,
+  `\\d \\w \\s \\D \\W \\S`, `\\n \\r \\t \\e \\xHH`, groups `(...)` and `(?:...)`,
+  alternation, `* + ? {m,n}` (and their lazy forms), `^` (start of a line) and `$`
+  (before a newline or at the end of the output read so far, like Tcl expect).
+
+  The earliest ending match is reported as `{:match, id, before, matched, captures}`, where
+  `captures` is a list of `{offset, length}` into `matched` for the whole match and
+  each group, `{-1, 0}` for groups that did not participate.
+
+  ##### Keyword Parameters
+  - `suppress_data`: `boolean()`
+
+    Do not deliver output to `on_data` until the match. Output after the match is delivered
+    as usual, and the held back output is delivered if the expect times out. Output that no
+    longer fits in the 1 MiB of `before` is delivered as it falls out of it.
+
+    Defaults to `false`.
+
+  - `lookbehind`: `pos_integer()`
+
+    Regular expressions only. How many bytes before the end of a match are searched for the
+    start of the match and its captures. Longer matches are truncated to this window.
+
+    Defaults to `4096`.
+
+  - `max_states`: `pos_integer()`
+
+    Regular expressions only. Upper bound of the DFA state cache, the cache is flushed and
+    rebuilt on demand when it is full.
+
+    Defaults to `1024`.
+  """
+  @spec expect(pid, [binary | Regex.t()] | [{term, binary | Regex.t()}], timeout, Keyword.t()) ::
+          {:match, term, binary, binary}
+          | {:match, term, binary, binary, [{integer, non_neg_integer}]}
+          | {:error, :timeout}
+          | {:error, String.t()}
+  def expect(pty, patterns, timeout \\ 5000, opts \\ [])
+      when is_pid(pty) and is_list(patterns) and
+             (timeout == :infinity or (is_integer(timeout) and timeout >= 0)) do
+    {ids, patterns} =
+      patterns
+      |> Enum.with_index()
+      |> Enum.map(fn
+        {{id, pattern}, _index} -> {id, pattern}
+        {pattern, index} -> {index, pattern}
+      end)
+      |> Enum.unzip()
+
+    suppress_data = opts[:suppress_data] || false
+
+    mode =
+      if Enum.any?(patterns, &is_struct(&1, Regex)) do
+        {:regex, opts[:lookbehind] || 4096, opts[:max_states] || 1024}
+      else
+        :literal
+      end
+
+    patterns = Enum.map(patterns, &expect_pattern(&1, mode))
+    GenServer.call(pty, {:expect, ids, patterns, timeout, suppress_data, mode}, :infinity)
+  end
+
+  defp expect_pattern(pattern, :literal) when is_binary(pattern), do: pattern
+  defp expect_pattern(pattern, {:regex, _, _}) when is_binary(pattern), do: Regex.escape(pattern)
+
+  defp expect_pattern(%Regex{} = regex, {:regex, _, _}) do
+    if Regex.opts(regex) not in ["", []] do
+      raise ArgumentError, "regex modifiers are not supported by ExPTY.expect/4"
+    end
+
+    Regex.source(regex)
+  end
+
   @doc """
   Resize the pseudoterminal.
+
+  `cols` and `rows` are at most 65535, and with `screen: true` the screen has at most
+  16777216 cells.
   """
   @spec resize(pid, pos_integer, pos_integer) :: :ok | {:error, String.t()}
   def resize(pty, cols, rows)
@@ -332,6 +704,338 @@ defmodule ExPTY do
     GenServer.call(pty, {:set_echo, echo?})
   end
 
+  @doc """
+  Change the line discipline settings of the pseudoterminal (only available on Unix systems
+  at the moment).
+
+  `spec` is a profile or a keyword list of
+
+  - `profile`: one of
+    - `:cooked`, canonical input with signals, `"\r"` to `"\n"` on input and `"\n"` to
+      `"\r\n"` on output, what processes are spawned with. Echo is left as it is.
+    - `:raw`, like `cfmakeraw(3)`: every byte goes through untouched in both directions and
+      is available to the program as soon as it is written. No echo, no signals. This is the
+      fastest for bulk transfers.
+    - `:cbreak`, input is available to the program as it is typed, without echo, while
+      signals and output processing stay.
+  - `clear` and `set`: lists of flags, applied after the profile, in this order. The flags
+    are the lowercase names of `termios(3)` flags: `:ignbrk`, `:brkint`, `:ignpar`, `:parmrk`,
+    `:inpck`, `:istrip`, `:inlcr`, `:igncr`, `:icrnl`, `:ixon`, `:ixany`, `:ixoff`, `:imaxbel`,
+    `:iutf8`, `:opost`, `:onlcr`, `:ocrnl`, `:onocr`, `:onlret`, `:cread`, `:cstopb`,
+    `:parenb`, `:parodd`, `:hupcl`, `:clocal`, `:isig`, `:icanon`, `:iexten`, `:echo`,
+    `:echoe`, `:echok`, `:echonl`, `:echoctl`, `:echoke`, `:noflsh` and `:tostop`.
+  - `vmin` and `vtime`: `VMIN` and `VTIME` (in tenths of a second) for non-canonical reads.
+
+  The settings are read, changed and written back in one call that does not go through the
+  genserver of the pseudoterminal. They take effect once the output already written has
+  been processed.
+
+      ExPTY.set_termios(pty, :raw)
+      ExPTY.set_termios(pty, profile: :raw, set: [:isig])
+      ExPTY.set_termios(pty, profile: :cooked, clear: [:onlcr])
+  """
+  @spec set_termios(pid, atom | keyword) :: :ok | {:error, String.t()}
+  def set_termios(pty, spec) when is_pid(pty) do
+    with {:ok, spec} <- termios_spec(spec),
+         {:ok, pipesocket} <- pipesocket(pty) do
+      ExPTY.Nif.set_termios(pipesocket, spec)
+    end
+  end
+
+  @doc """
+  Get the line discipline settings of the pseudoterminal (only available on Unix systems at
+  the moment).
+
+  Returns the flags that are set, by field (`iflag`, `oflag`, `cflag` and `lflag`), named
+  like in `ExPTY.set_termios/2`, along with `vmin` and `vtime`.
+  """
+  @spec get_termios(pid) :: {:ok, map()} | {:error, String.t()}
+  def get_termios(pty) when is_pid(pty) do
+    with {:ok, pipesocket} <- pipesocket(pty) do
+      ExPTY.Nif.get_termios(pipesocket)
+    end
+  end
+
+  @doc """
+  Set or lift the output budget of the pseudoterminal (only available on Unix systems at the
+  moment).
+
+  `budget` is a keyword list as for the `output_budget` option of `ExPTY.spawn/3`, or `nil`
+  for unlimited output. The budget starts with a full burst and applies from the next read of
+  the native reader, a throttled reader is woken up to pick it up. This does not go through
+  the genserver of the pseudoterminal.
+
+      ExPTY.set_output_budget(pty, rate: 64 * 1024, policy: :tail)
+      ExPTY.set_output_budget(pty, nil)
+  """
+  @spec set_output_budget(pid, keyword | nil) :: :ok | {:error, String.t()}
+  def set_output_budget(pty, budget) when is_pid(pty) do
+    with {:ok, budget} <- output_budget(budget),
+         {:ok, pipesocket} <- pipesocket(pty) do
+      ExPTY.Nif.set_output_budget(pipesocket, budget)
+    end
+  end
+
+  @doc """
+  Copy the output of the pseudoterminal to a file or a Unix socket as it is read (only
+  available on Unix systems at the moment).
+
+  `target` is a path or `{:file, path}`, appended to and created if need be, or
+  `{:socket, path}`, a listening Unix socket to connect to. The copy is made by the native
+  reader and a writer thread of the session and never goes through the BEAM: the output is
+  written to each target as it is, before any filter, budget or framing, and with more than
+  one target it is spliced to all of them from a pipe without going back to user space.
+
+  A slow target never holds up the output: what it has not taken once 4 MiB are pending is
+  dropped for every target and counted in `tee_dropped` of `ExPTY.stats/1`. A target that
+  fails is closed and `{:tee_error, id, reason}` is reported to `on_event`. When the session
+  closes, what is pending is written out; a socket that stops taking it is left with what it
+  has, which is not an error.
+
+  Returns the id of the target for `ExPTY.untee/2`.
+
+      {:ok, id} = ExPTY.tee(pty, {:file, "/var/log/sessions/42.log"})
+      {:ok, _} = ExPTY.tee(pty, {:socket, "/run/shipper.sock"})
+  """
+  @spec tee(pid, Path.t() | {:file | :socket, Path.t()}) ::
+          {:ok, integer} | {:error, String.t()}
+  def tee(pty, target) when is_pid(pty) do
+    target =
+      case target do
+        {kind, path} when kind in [:file, :socket] -> {kind, to_string(path)}
+        path -> {:file, to_string(path)}
+      end
+
+    with {:ok, pipesocket} <- pipesocket(pty) do
+      ExPTY.Nif.tee(pipesocket, target)
+    end
+  end
+
+  @doc """
+  Stop copying the output of the pseudoterminal to the target `id` of `ExPTY.tee/2` (only
+  available on Unix systems at the moment). What has been read so far is still written to it
+  while it keeps taking it, and no error is reported for it anymore.
+  """
+  @spec untee(pid, integer) :: :ok | {:error, String.t()}
+  def untee(pty, id) when is_pid(pty) and is_integer(id) do
+    with {:ok, pipesocket} <- pipesocket(pty) do
+      ExPTY.Nif.untee(pipesocket, id)
+    end
+  end
+
+  @doc """
+  Connect the output of the pseudoterminal to the input of another one, or to a Unix socket
+  (only available on Unix systems at the moment).
+
+  `target` is the pid of another pseudoterminal or `{:socket, path}`, a listening Unix socket
+  to connect to. The native reader writes the output straight to the target instead of
+  sending it to the genserver: `on_data` is not called, expects do not match, and filters,
+  framing and the output budget do not apply; recordings, tees, the screen and the counters
+  still see it. With `bidirectional: true`, the output of the other pseudoterminal, or what
+  the socket sends, is written to this one too.
+
+  The other side sets the pace: the reader does not read on until the target has taken the
+  last read, so the faster child blocks in `write()` rather than output piling up anywhere.
+
+  The connection lasts until `ExPTY.disconnect/1`, or until the other pseudoterminal exits or
+  the socket is closed, which is reported as `{:disconnected, reason}` to `on_event`.
+
+      :ok = ExPTY.connect(pty, other, bidirectional: true)
+      :ok = ExPTY.connect(pty, {:socket, "/run/console.sock"})
+  """
+  @spec connect(pid, pid | {:socket, Path.t()}, keyword) :: :ok | {:error, String.t()}
+  def connect(pty, target, opts \\ []) when is_pid(pty) and is_list(opts) do
+    bidirectional = Keyword.get(opts, :bidirectional, false)
+
+    with true <- is_boolean(bidirectional) || {:error, "bidirectional should be a boolean"},
+         {:ok, pipesocket} <- pipesocket(pty),
+         {:ok, target} <- connect_target(target) do
+      ExPTY.Nif.connect(pipesocket, target, bidirectional)
+    end
+  end
+
+  @doc """
+  End the connection of `ExPTY.connect/3` (only available on Unix systems at the moment),
+  along with the way back when it was bidirectional. The output goes to `on_data` again from
+  the next read, with whatever the target had not taken yet.
+  """
+  @spec disconnect(pid) :: :ok | {:error, String.t()}
+  def disconnect(pty) when is_pid(pty) do
+    with {:ok, pipesocket} <- pipesocket(pty) do
+      ExPTY.Nif.disconnect(pipesocket)
+    end
+  end
+
+  defp connect_target({:socket, path}), do: {:ok, {:socket, to_string(path)}}
+  defp connect_target(pty) when is_pid(pty), do: pipesocket(pty)
+  defp connect_target(_), do: {:error, "target should be a pseudoterminal or {:socket, path}"}
+
+  @doc """
+  Get the foreground process of the pseudoterminal (only available on Unix systems at the moment).
+
+  Returns the process group id (from `tcgetpgrp(3)` on the master side), the command name
+  and the current working directory of the foreground process group leader.
+
+  `cwd` is `nil` if it is not permitted to inspect the process.
+
+  Lookups are cached per process group for `Application.get_env(:expty, :proc_cache_ttl, 1000)`
+  milliseconds.
+  """
+  @spec foreground_process(pid) ::
+          {:ok, %{pgid: integer, name: String.t(), cwd: String.t() | nil}} | {:error, String.t()}
+  def foreground_process(pty) when is_pid(pty) do
+    GenServer.call(pty, :foreground_process)
+  end
+
+  @doc """
+  Get the foreground processes of many pseudoterminals in one pass
+  (only available on Unix systems at the moment).
+
+  This does not go through the genserver of each pseudoterminal, therefore it is
+  cheap enough to poll for thousands of sessions.
+
+  Results are returned in the same order as `ptys`, see `ExPTY.foreground_process/1`.
+  """
+  @spec foreground_processes([pid]) :: [
+          {:ok, %{pgid: integer, name: String.t(), cwd: String.t() | nil}} | {:error, String.t()}
+        ]
+  def foreground_processes(ptys) when is_list(ptys) do
+    ptys
+    |> Enum.map(fn pty ->
+      case pipesocket(pty) do
+        {:ok, pipesocket} -> pipesocket
+        _ -> nil
+      end
+    end)
+    |> ExPTY.Nif.foreground_processes()
+  end
+
+  @doc """
+  Get the native counters and latency histograms of the pseudoterminal
+  (only available on Unix systems at the moment).
+
+  The counters are `reads`, `bytes_read`, `messages` (data and lines messages sent),
+  `writes`, `bytes_written`, `partial_writes`, `write_retries`, `eagain`, `echo_probes`,
+  `echo_timeouts` (see `ExPTY.probe_echo/1`), `bytes_dropped` and `bytes_collapsed` (see the
+  `output_budget` and `collapse_progress` options of `ExPTY.spawn/3`), `bytes_teed`,
+  `tee_dropped` (see `ExPTY.tee/2`) and `bytes_forwarded` (see `ExPTY.connect/3`).
+  `output_rate` is the bytes per second read over the last quarter of a second, 0 for a
+  session that has been quiet for a second. The histograms `read_to_send` (from `read()`
+  returning to the chunk having been sent), `write_duration` and `echo_latency` are maps of
+  `count`, `mean`, `p50`, `p90`, `p99`, `p999` and `max` in nanoseconds, percentiles are
+  accurate within 12.5%.
+
+  This does not go through the genserver of the pseudoterminal, the counters are updated
+  without locks and can be read at any time.
+  """
+  @spec stats(pid) :: {:ok, map()} | {:error, String.t()}
+  def stats(pty) when is_pid(pty) do
+    with {:ok, pipesocket} <- pipesocket(pty) do
+      {:ok, ExPTY.Nif.stats([pipesocket])}
+    end
+  end
+
+  @doc """
+  Measure the keystroke echo latency of the next write with printable bytes
+  (only available on Unix systems at the moment).
+
+  The native writer remembers the first run of printable bytes of the write and the time it
+  started, the native reader records the time until they have all been read back into the
+  `echo_latency` histogram of `ExPTY.stats/1` and emits `[:expty, :echo]`. This covers the
+  write path, the line discipline and the program doing the echo, not the genserver.
+
+  One write is probed at a time. A probe that does not come back within 2 seconds, e.g. with
+  echo off, counts as an `echo_timeouts` instead.
+  """
+  @spec probe_echo(pid) :: :ok | {:error, String.t()}
+  def probe_echo(pty) when is_pid(pty) do
+    with {:ok, pipesocket} <- pipesocket(pty) do
+      ExPTY.Nif.probe_echo(pipesocket)
+    end
+  end
+
+  @doc """
+  Get the counters and histograms of `ExPTY.stats/1` summed over every live pseudoterminal
+  of the node, along with their number as `sessions`.
+  """
+  @spec stats() :: map()
+  def stats do
+    ExPTY.Registry
+    |> Registry.select([{{:_, :_, :"$1"}, [], [:"$1"]}])
+    |> ExPTY.Nif.stats()
+  end
+
+  @doc """
+  Get the visible screen of the pseudoterminal (only available on Unix systems at the moment).
+
+  The session must have been spawned with `screen: true`.
+
+  With `format: :text`, each line is a binary with trailing blanks removed. With `:cells`,
+  each line is a list of `{text, fg, bg, flags}` runs of equally styled cells, where a color
+  is `:default`, an index in `0..255` or an `{r, g, b}` tuple, and `flags` is a list of
+  `:bold`, `:dim`, `:italic`, `:underline`, `:blink`, `:inverse`, `:hidden` and `:strike`.
+
+  The cursor is given as zero-based `{row, col}`.
+  """
+  @spec screen(pid, :text | :cells) :: {:ok, map()} | {:error, String.t()}
+  def screen(pty, format \\ :text) when is_pid(pty) and format in [:text, :cells] do
+    GenServer.call(pty, {:screen, format})
+  end
+
+  @doc """
+  Get what changed on the screen since frame `since` (only available on Unix systems at the moment).
+
+  The session must have been spawned with `screen: true`. Pass `0` to get the whole screen.
+  The returned map has the number of the current `frame`, which is the `since` of the
+  next call, whether it is a `full` repaint, the screen size, cursor and title as in
+  `ExPTY.screen/2`, and
+
+    - with `format: :cells`, `changes`: a list of `{row, col, runs}`, where `runs` replace
+      the cells starting at `col` and are formatted as in `ExPTY.screen/2`.
+
+    - with `format: :ansi`, `data`: escape sequences that bring a terminal of the same size
+      from frame `since` to the current one, or `""` if nothing has changed.
+
+  Only rows that changed since `since` are included, and a viewer exactly one frame behind
+  only gets the changed columns.
+  """
+  @spec screen_diff(pid, non_neg_integer, :cells | :ansi) :: {:ok, map()} | {:error, String.t()}
+  def screen_diff(pty, since, format \\ :cells)
+      when is_pid(pty) and is_integer(since) and since >= 0 and format in [:cells, :ansi] do
+    GenServer.call(pty, {:screen_diff, since, format})
+  end
+
+  @doc """
+  Serialize the current screen (only available on Unix systems at the moment).
+
+  The session must have been spawned with `screen: true`. The cost depends on the size of
+  the screen and the scrollback, not on how much output the session has produced, so this
+  is how a newly connected viewer should be brought up to date.
+
+  - with `format: :binary`, a compact snapshot: cells are run-length encoded against an
+    interned attribute table, along with the cursor, the modes and the title.
+
+  - with `format: :ansi`, escape sequences that recreate the screen and the scrollback on a
+    terminal of the same size in a single write.
+
+  ## Options
+
+  - `scrollback`: `non_neg_integer() | :all`
+
+    How many lines of scrollback to include, defaults to `:all`.
+  """
+  @spec snapshot(pid, :binary | :ansi, Keyword.t()) :: {:ok, binary()} | {:error, String.t()}
+  def snapshot(pty, format \\ :binary, opts \\ [])
+      when is_pid(pty) and format in [:binary, :ansi] and is_list(opts) do
+    scrollback = Keyword.get(opts, :scrollback, :all)
+
+    unless scrollback == :all or (is_integer(scrollback) and scrollback >= 0) do
+      raise "value of `scrollback` should be a non-negative integer or `:all`"
+    end
+
+    GenServer.call(pty, {:snapshot, format, scrollback})
+  end
+
   # GenServer callbacks
 
   @impl true
@@ -374,6 +1078,19 @@ defmodule ExPTY do
         end
       end
 
+    on_event = options[:on_event] || nil
+
+    on_event =
+      if is_function(on_event, 3) do
+        {:func, on_event}
+      else
+        if is_atom(on_event) and Kernel.function_exported?(on_event, :on_event, 3) do
+          {:module, on_event}
+        else
+          nil
+        end
+      end
+
     init_pack =
       case :os.type() do
         {os_type = :unix, _} ->
@@ -414,6 +1131,8 @@ defmodule ExPTY do
               raise "value of `flow_control_resume` should be a binary string"
             end
 
+          native_options = native_options(options)
+
           {
             os_type,
             file,
@@ -433,8 +1152,10 @@ defmodule ExPTY do
             handle_flow_control,
             flow_control_pause,
             flow_control_resume,
+            native_options,
             on_data,
-            on_exit
+            on_exit,
+            on_event
           }
 
         {os_type = :win32, _} ->
@@ -470,7 +1191,7 @@ defmodule ExPTY do
         _from,
         {os_type = :unix, file, args, env, cwd, cols, rows, ibaudrate, obaudrate, uid, gid,
          is_utf8, closeFDs, echo?, helperPath, handle_flow_control, flow_control_pause,
-         flow_control_resume, on_data, on_exit}
+         flow_control_resume, native_options, on_data, on_exit, on_event} = state
       ) do
     ret =
       ExPTY.Nif.spawn_unix(
@@ -487,13 +1208,16 @@ defmodule ExPTY do
         is_utf8,
         closeFDs,
         echo?,
-        helperPath
+        helperPath,
+        native_options
       )
 
     case ret do
-      {pipesocket, pid, pty}
+      {pipesocket, pid, pty, timings}
       when is_reference(pipesocket) and is_integer(pid) and is_binary(pty) ->
-        {:reply, :ok,
+        Registry.register(ExPTY.Registry, self(), pipesocket)
+
+        {:reply, {:ok, timings},
          %T{
            os_type: os_type,
            pipesocket: pipesocket,
@@ -502,10 +1226,15 @@ defmodule ExPTY do
            handle_flow_control: handle_flow_control,
            flow_control_pause: flow_control_pause,
            flow_control_resume: flow_control_resume,
+           packet_mode: native_options.packet_mode,
            on_data: on_data,
            on_exit: on_exit,
+           on_event: on_event,
            echo?: echo?
          }}
+
+      {:error, reason} ->
+        {:stop, :normal, {:error, reason}, state}
     end
   end
 
@@ -523,7 +1252,7 @@ defmodule ExPTY do
 
         case ExPTY.Nif.connect_win32(pty_id, command_line, cwd, env) do
           {:ok, inner_pid} ->
-            {:reply, :ok,
+            {:reply, {:ok, %{}},
              %T{
                os_type: os_type,
                pty: pty_id,
@@ -552,16 +1281,20 @@ defmodule ExPTY do
           pipesocket: pipesocket,
           handle_flow_control: handle_flow_control,
           flow_control_pause: flow_control_pause,
-          flow_control_resume: flow_control_resume
+          flow_control_resume: flow_control_resume,
+          packet_mode: packet_mode
         } = state
       ) do
-    if handle_flow_control do
+    # in packet mode the line discipline does it and reports {:flow, _}
+    if handle_flow_control and not packet_mode do
       case data do
         ^flow_control_pause ->
           ExPTY.Nif.pause(pipesocket)
+          ExPTY.Telemetry.execute([:expty, :pause], %{}, %{pty: self(), source: :flow_control})
 
         ^flow_control_resume ->
           ExPTY.Nif.resume(pipesocket)
+          ExPTY.Telemetry.execute([:expty, :resume], %{}, %{pty: self(), source: :flow_control})
 
         _ ->
           :ok
@@ -569,14 +1302,13 @@ defmodule ExPTY do
 
       {:reply, :ok, state}
     else
-      ret = ExPTY.Nif.write(pipesocket, data)
-      {:reply, ret, state}
+      {:reply, timed_write(fn -> ExPTY.Nif.write(pipesocket, data) end, data), state}
     end
   end
 
   @impl true
   def handle_call({:write, data}, _from, %T{os_type: :win32, pty: pty} = state) do
-    {:reply, ExPTY.Nif.write(pty, data), state}
+    {:reply, timed_write(fn -> ExPTY.Nif.write(pty, data) end, data), state}
   end
 
   @impl true
@@ -613,6 +1345,61 @@ defmodule ExPTY do
     {:reply, :ok, %T{state | on_exit: {:module, module}}}
   end
 
+  @impl true
+  def handle_call({:update_on_event, {:func, callback}}, _from, %T{} = state) do
+    {:reply, :ok, %T{state | on_event: {:func, callback}}}
+  end
+
+  @impl true
+  def handle_call({:update_on_event, {:module, module}}, _from, %T{} = state) do
+    {:reply, :ok, %T{state | on_event: {:module, module}}}
+  end
+
+  @impl true
+  def handle_call(
+        {:set_idle_timeout, idle_timeout},
+        _from,
+        %T{os_type: :unix, pipesocket: pipesocket} = state
+      ) do
+    {:reply, ExPTY.Nif.set_idle_timeout(pipesocket, idle_timeout), state}
+  end
+
+  @impl true
+  def handle_call({:expect, _, _, _, _, _}, _from, %T{expect: {_, _, _, _}} = state) do
+    {:reply, {:error, "another expect is in progress"}, state}
+  end
+
+  @impl true
+  def handle_call(
+        {:expect, ids, patterns, timeout, suppress_data, mode},
+        from,
+        %T{os_type: :unix, pipesocket: pipesocket} = state
+      ) do
+    ret =
+      case mode do
+        :literal ->
+          ExPTY.Nif.expect(pipesocket, patterns, suppress_data)
+
+        {:regex, lookbehind, max_states} ->
+          ExPTY.Nif.expect_regex(pipesocket, patterns, suppress_data, lookbehind, max_states)
+      end
+
+    case ret do
+      :ok ->
+        ref = make_ref()
+
+        timer =
+          if timeout != :infinity do
+            Process.send_after(self(), {:expect_timeout, ref}, timeout)
+          end
+
+        {:noreply, %T{state | expect: {from, ids, ref, timer}}}
+
+      error ->
+        {:reply, error, state}
+    end
+  end
+
   @impl true
   def handle_call(
         {:resize, {cols, rows}},
@@ -650,12 +1437,14 @@ defmodule ExPTY do
   @impl true
   def handle_call(:pause, _from, %T{pipesocket: pipesocket} = state) do
     ret = ExPTY.Nif.pause(pipesocket)
+    ExPTY.Telemetry.execute([:expty, :pause], %{}, %{pty: self(), source: :call})
     {:reply, ret, state}
   end
 
   @impl true
   def handle_call(:resume, _from, %T{pipesocket: pipesocket} = state) do
     ret = ExPTY.Nif.resume(pipesocket)
+    ExPTY.Telemetry.execute([:expty, :resume], %{}, %{pty: self(), source: :call})
     {:reply, ret, state}
   end
 
@@ -667,13 +1456,101 @@ defmodule ExPTY do
   end
 
   @impl true
-  def handle_info({:data, data}, %T{on_data: on_data} = state) do
-    case on_data do
+  def handle_call(:pipesocket, _from, %T{os_type: :unix, pipesocket: pipesocket} = state) do
+    {:reply, {:ok, pipesocket}, state}
+  end
+
+  @impl true
+  def handle_call(:pipesocket, _from, %T{os_type: :win32} = state) do
+    {:reply, {:error, "not implemented yet"}, state}
+  end
+
+  @impl true
+  def handle_call(:foreground_process, _from, %T{os_type: :unix, pipesocket: pipesocket} = state) do
+    {:reply, ExPTY.Nif.foreground_process(pipesocket), state}
+  end
+
+  @impl true
+  def handle_call(:foreground_process, _from, %T{os_type: :win32} = state) do
+    {:reply, {:error, "not implemented yet"}, state}
+  end
+
+  @impl true
+  def handle_call({:screen, format}, _from, %T{os_type: :unix, pipesocket: pipesocket} = state) do
+    {:reply, ExPTY.Nif.screen(pipesocket, format), state}
+  end
+
+  @impl true
+  def handle_call({:screen, _format}, _from, %T{os_type: :win32} = state) do
+    {:reply, {:error, "not implemented yet"}, state}
+  end
+
+  @impl true
+  def handle_call(
+        {:screen_diff, since, format},
+        _from,
+        %T{os_type: :unix, pipesocket: pipesocket} = state
+      ) do
+    {:reply, ExPTY.Nif.screen_diff(pipesocket, since, format), state}
+  end
+
+  @impl true
+  def handle_call({:screen_diff, _since, _format}, _from, %T{os_type: :win32} = state) do
+    {:reply, {:error, "not implemented yet"}, state}
+  end
+
+  @impl true
+  def handle_call(
+        {:snapshot, format, scrollback},
+        _from,
+        %T{os_type: :unix, pipesocket: pipesocket} = state
+      ) do
+    {:reply, ExPTY.Nif.snapshot(pipesocket, format, scrollback), state}
+  end
+
+  @impl true
+  def handle_call({:snapshot, _format, _scrollback}, _from, %T{os_type: :win32} = state) do
+    {:reply, {:error, "not implemented yet"}, state}
+  end
+
+  @impl true
+  def handle_info({:data, data}, state) do
+    dispatch_data(data, state)
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info({:lines, lines}, state) do
+    dispatch_data(lines, state)
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info({:data, ts, data}, state) do
+    dispatch_data({ts, data}, state)
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info({:lines, ts, lines}, state) do
+    dispatch_data({ts, lines}, state)
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info({:exit, exit_code, signal_code}, %T{on_exit: on_exit} = state) do
+    ExPTY.Telemetry.execute([:expty, :exit], %{}, %{
+      pty: self(),
+      exit_code: exit_code,
+      signal_code: signal_code
+    })
+
+    case on_exit do
       {:module, module} ->
-        module.on_data(__MODULE__, self(), data)
+        module.on_exit(__MODULE__, self(), exit_code, signal_code)
 
       {:func, func} ->
-        func.(__MODULE__, self(), data)
+        func.(__MODULE__, self(), exit_code, signal_code)
 
       _ ->
         nil
@@ -683,13 +1560,170 @@ defmodule ExPTY do
   end
 
   @impl true
-  def handle_info({:exit, exit_code, signal_code}, %T{on_exit: on_exit} = state) do
-    case on_exit do
+  def handle_info({:echo, latency}, state) do
+    ExPTY.Telemetry.execute(
+      [:expty, :echo],
+      %{duration: ExPTY.Telemetry.from_nanoseconds(latency)},
+      %{pty: self()}
+    )
+
+    {:noreply, state}
+  end
+
+  @impl true
+  def handle_info({:idle, _ms} = event, state) do
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:active} = event, state) do
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:frame, _n} = event, state) do
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:flow, flow} = event, state) do
+    ExPTY.Telemetry.execute(
+      if(flow == :stopped, do: [:expty, :pause], else: [:expty, :resume]),
+      %{},
+      %{pty: self(), source: :packet_mode}
+    )
+
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:dropped, bytes} = event, state) do
+    ExPTY.Telemetry.execute([:expty, :dropped], %{bytes: bytes}, %{pty: self()})
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:flush, _queue} = event, state) do
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:flow_control, _enabled?} = event, state) do
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:record_error, _reason} = event, state) do
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:tee_error, _id, _reason} = event, state) do
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:disconnected, _reason} = event, state) do
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info(
+        {:match, index, before, matched},
+        %T{expect: {from, ids, _ref, timer}} = state
+      ) do
+    if timer, do: Process.cancel_timer(timer)
+    GenServer.reply(from, {:match, Enum.at(ids, index), before, matched})
+    {:noreply, %T{state | expect: nil}}
+  end
+
+  @impl true
+  def handle_info(
+        {:match, index, before, matched, captures},
+        %T{expect: {from, ids, _ref, timer}} = state
+      ) do
+    if timer, do: Process.cancel_timer(timer)
+    GenServer.reply(from, {:match, Enum.at(ids, index), before, matched, captures})
+    {:noreply, %T{state | expect: nil}}
+  end
+
+  @impl true
+  def handle_info({:match, _, _, _, _} = event, state) do
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info({:match, _, _, _} = event, state) do
+    # the expect has timed out before this match was handled
+    dispatch_event(event, state)
+  end
+
+  @impl true
+  def handle_info(
+        {:expect_timeout, ref},
+        %T{pipesocket: pipesocket, expect: {from, _ids, ref, _timer}} = state
+      ) do
+    ExPTY.Nif.cancel_expect(pipesocket)
+    GenServer.reply(from, {:error, :timeout})
+    {:noreply, %T{state | expect: nil}}
+  end
+
+  @impl true
+  def handle_info({:expect_timeout, _ref}, state) do
+    {:noreply, state}
+  end
+
+  @impl true
+  def terminate(_reason, %T{os_type: :unix, pipesocket: pipesocket}) when pipesocket != nil do
+    # hangs up like closing the terminal would, the native side of the
+    # session goes away once the process has exited; a no-op if it has
+    ExPTY.Nif.kill(pipesocket, 1)
+  end
+
+  def terminate(_reason, _state), do: :ok
+
+  defp timed_write(write, data) do
+    start = System.monotonic_time()
+    ret = write.()
+    duration = System.monotonic_time() - start
+
+    # only iodata that has been accepted is measured
+    bytes =
+      case ret do
+        :ok -> IO.iodata_length(data)
+        {:partial, written} -> written
+        _ -> 0
+      end
+
+    ExPTY.Telemetry.execute(
+      [:expty, :write],
+      %{bytes: bytes, duration: duration},
+      %{pty: self(), result: ret}
+    )
+
+    ret
+  end
+
+  defp dispatch_data(data, %T{on_data: on_data}) do
+    case on_data do
       {:module, module} ->
-        module.on_exit(__MODULE__, self(), exit_code, signal_code)
+        module.on_data(__MODULE__, self(), data)
 
       {:func, func} ->
-        func.(__MODULE__, self(), exit_code, signal_code)
+        func.(__MODULE__, self(), data)
+
+      _ ->
+        nil
+    end
+  end
+
+  defp dispatch_event(event, %T{on_event: on_event} = state) do
+    case on_event do
+      {:module, module} ->
+        module.on_event(__MODULE__, self(), event)
+
+      {:func, func} ->
+        func.(__MODULE__, self(), event)
 
       _ ->
         nil
@@ -698,6 +1732,220 @@ defmodule ExPTY do
     {:noreply, state}
   end
 
+  # Options that are handled by the native reader, passed to `spawn_unix` as a map
+  defp native_options(options) do
+    idle_timeout = options[:idle_timeout] || 0
+
+    unless is_integer(idle_timeout) and idle_timeout >= 0 do
+      raise "value of `idle_timeout` should be a non-negative integer"
+    end
+
+    framing = options[:framing] || :raw
+
+    unless framing in [:raw, :line] do
+      raise "value of `framing` should be either `:raw` or `:line`"
+    end
+
+    max_line_length = options[:max_line_length] || 65536
+
+    unless is_integer(max_line_length) and max_line_length > 0 do
+      raise "value of `max_line_length` should be a positive integer"
+    end
+
+    normalize_crlf = options[:normalize_crlf] || false
+
+    unless is_boolean(normalize_crlf) do
+      raise "value of `normalize_crlf` should be a boolean"
+    end
+
+    collapse_progress = options[:collapse_progress] || 0
+
+    unless is_integer(collapse_progress) and collapse_progress >= 0 do
+      raise "value of `collapse_progress` should be a positive integer"
+    end
+
+    filters = options[:filters] || []
+
+    unless is_list(filters) and
+             Enum.all?(filters, fn
+               filter when filter in [:strip_ansi, :utf8] -> true
+               {:collapse_progress, ms} -> is_integer(ms) and ms > 0
+               _ -> false
+             end) do
+      raise "value of `filters` should be a list of `:strip_ansi`, `:utf8` and " <>
+              "`{:collapse_progress, ms}`"
+    end
+
+    filters =
+      if collapse_progress > 0 and not List.keymember?(filters, :collapse_progress, 0),
+        do: [{:collapse_progress, collapse_progress} | filters],
+        else: filters
+
+    timestamps = options[:timestamps] || false
+
+    unless is_boolean(timestamps) do
+      raise "value of `timestamps` should be a boolean"
+    end
+
+    screen = options[:screen] || false
+
+    unless is_boolean(screen) do
+      raise "value of `screen` should be a boolean"
+    end
+
+    scrollback = options[:scrollback] || 0
+
+    unless is_integer(scrollback) and scrollback >= 0 do
+      raise "value of `scrollback` should be a non-negative integer"
+    end
+
+    frame_rate = options[:frame_rate] || 0
+
+    unless is_integer(frame_rate) and frame_rate >= 0 do
+      raise "value of `frame_rate` should be a positive integer"
+    end
+
+    if frame_rate > 0 and not screen do
+      raise "`frame_rate` requires `screen: true`"
+    end
+
+    echo_probe = options[:echo_probe] || 0
+
+    unless is_integer(echo_probe) and echo_probe >= 0 do
+      raise "value of `echo_probe` should be a positive integer"
+    end
+
+    record = options[:record]
+
+    unless is_nil(record) or is_binary(record) do
+      raise "value of `record` should be a path"
+    end
+
+    record_format = options[:record_format] || :asciicast
+
+    unless record_format in [:asciicast, :indexed] do
+      raise "value of `record_format` should be either `:asciicast` or `:indexed`"
+    end
+
+    record_input = options[:record_input] || false
+
+    unless is_boolean(record_input) do
+      raise "value of `record_input` should be a boolean"
+    end
+
+    termios =
+      case options[:termios] do
+        nil ->
+          %{}
+
+        spec ->
+          case termios_spec(spec) do
+            {:ok, spec} -> %{termios: spec}
+            {:error, message} -> raise "value of `termios` is invalid: #{message}"
+          end
+      end
+
+    record_options =
+      if record do
+        %{record: Path.expand(record), record_format: record_format, record_input: record_input}
+      else
+        %{}
+      end
+
+    packet_mode = options[:packet_mode] || false
+
+    unless is_boolean(packet_mode) do
+      raise "value of `packet_mode` should be a boolean"
+    end
+
+    output_budget =
+      case output_budget(options[:output_budget]) do
+        {:ok, %{rate: 0}} -> %{}
+        {:ok, budget} -> %{output_budget: budget}
+        {:error, message} -> raise "value of `output_budget` is invalid: #{message}"
+      end
+
+    record_options
+    |> Map.merge(termios)
+    |> Map.merge(output_budget)
+    |> Map.merge(%{
+      idle_timeout: idle_timeout,
+      framing: framing,
+      max_line_length: max_line_length,
+      normalize_crlf: normalize_crlf,
+      filters: filters,
+      timestamps: timestamps,
+      screen: screen,
+      scrollback: scrollback,
+      frame_rate: frame_rate,
+      echo_probe: echo_probe,
+      packet_mode: packet_mode
+    })
+  end
+
+  @output_budget_policies [:throttle, :drop, :tail]
+
+  # The map of `ExPTY.set_output_budget/2` and the `output_budget` option, `rate: 0` lifts it
+  # the functions that do not go through the genserver look the session up in the registry
+  defp pipesocket(pty) do
+    case Registry.lookup(ExPTY.Registry, pty) do
+      [{_, pipesocket}] -> {:ok, pipesocket}
+      _ -> {:error, "no such pseudoterminal"}
+    end
+  end
+
+  defp output_budget(nil), do: {:ok, %{rate: 0}}
+
+  defp output_budget(budget) when is_list(budget) or is_map(budget) do
+    Enum.reduce_while(budget, {:ok, %{}}, fn
+      {key, value}, {:ok, acc} when key in [:rate, :burst] and is_integer(value) and value > 0 ->
+        {:cont, {:ok, Map.put(acc, key, value)}}
+
+      {:policy, policy}, {:ok, acc} when policy in @output_budget_policies ->
+        {:cont, {:ok, Map.put(acc, :policy, policy)}}
+
+      other, _ ->
+        {:halt, {:error, "invalid output budget setting #{inspect(other)}"}}
+    end)
+    |> case do
+      {:ok, %{rate: _}} = ok -> ok
+      {:ok, _} -> {:error, "`rate` is required"}
+      error -> error
+    end
+  end
+
+  defp output_budget(budget) do
+    {:error, "expected a keyword list or nil, got: #{inspect(budget)}"}
+  end
+
+  @termios_profiles [:cooked, :raw, :cbreak]
+
+  # The map of `ExPTY.set_termios/2` and the `termios` option, flag names are checked natively
+  defp termios_spec(profile) when profile in @termios_profiles, do: {:ok, %{profile: profile}}
+
+  defp termios_spec(spec) when is_list(spec) or is_map(spec) do
+    Enum.reduce_while(spec, {:ok, %{}}, fn
+      {:profile, profile}, {:ok, acc} when profile in @termios_profiles ->
+        {:cont, {:ok, Map.put(acc, :profile, profile)}}
+
+      {key, flags}, {:ok, acc} when key in [:set, :clear] and is_list(flags) ->
+        if Enum.all?(flags, &is_atom/1),
+          do: {:cont, {:ok, Map.put(acc, key, flags)}},
+          else: {:halt, {:error, "`#{key}` should be a list of flags"}}
+
+      {key, value}, {:ok, acc} when key in [:vmin, :vtime] and value in 0..255 ->
+        {:cont, {:ok, Map.put(acc, key, value)}}
+
+      other, _ ->
+        {:halt, {:error, "invalid termios setting #{inspect(other)}"}}
+    end)
+  end
+
+  defp termios_spec(spec) do
+    {:error,
+     "expected one of #{inspect(@termios_profiles)} or a keyword list, got: #{inspect(spec)}"}
+  end
+
   @doc """
   Convert argc/argv into a Win32 command-line following the escaping convention
   documented on MSDN (e.g. see CommandLineToArgvW documentation). Copied from
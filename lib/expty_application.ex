@@ -4,6 +4,33 @@ defmodule ExPTY.Application do
 
   def start(_type, _args) do
     if Code.ensure_loaded?(Kino), do: Kino.SmartCell.register(ExPTY.SmartCell)
-    Supervisor.start_link([], strategy: :one_for_one)
+
+    case :os.type() do
+      {:unix, _} ->
+        ExPTY.Nif.set_proc_cache_ttl(Application.get_env(:expty, :proc_cache_ttl, 1000))
+        ExPTY.Nif.set_replay_threads(Application.get_env(:expty, :replay_threads, 2))
+
+      _ ->
+        nil
+    end
+
+    children = [
+      {Registry, keys: :unique, name: ExPTY.Registry}
+    ]
+
+    interval = Application.get_env(:expty, :telemetry_interval, 10_000)
+
+    children =
+      case :os.type() do
+        {:unix, _} when is_integer(interval) and interval > 0 ->
+          if ExPTY.Telemetry.available?(),
+            do: children ++ [{ExPTY.Telemetry, interval}],
+            else: children
+
+        _ ->
+          children
+      end
+
+    Supervisor.start_link(children, strategy: :one_for_one)
   end
 end
@@ -40,7 +40,8 @@ defmodule ExPTY.Nif do
         _is_utf8,
         _closeFDs,
         _echo?,
-        _helperPath
+        _helperPath,
+        _native_options
       ),
       do: :erlang.nif_error(:not_loaded)
 
@@ -64,4 +65,85 @@ defmodule ExPTY.Nif do
 
   def set_echo(_arg1, _echo?),
     do: :erlang.nif_error(:not_loaded)
+
+  def set_termios(_pipesocket, _spec),
+    do: :erlang.nif_error(:not_loaded)
+
+  def get_termios(_pipesocket),
+    do: :erlang.nif_error(:not_loaded)
+
+  def set_idle_timeout(_pipesocket, _idle_timeout),
+    do: :erlang.nif_error(:not_loaded)
+
+  def set_output_budget(_pipesocket, _budget),
+    do: :erlang.nif_error(:not_loaded)
+
+  def tee(_pipesocket, _target),
+    do: :erlang.nif_error(:not_loaded)
+
+  def untee(_pipesocket, _id),
+    do: :erlang.nif_error(:not_loaded)
+
+  def connect(_pipesocket, _target, _bidirectional),
+    do: :erlang.nif_error(:not_loaded)
+
+  def disconnect(_pipesocket),
+    do: :erlang.nif_error(:not_loaded)
+
+  def probe_echo(_pipesocket),
+    do: :erlang.nif_error(:not_loaded)
+
+  def expect(_pipesocket, _patterns, _suppress_data),
+    do: :erlang.nif_error(:not_loaded)
+
+  def expect_regex(_pipesocket, _patterns, _suppress_data, _lookbehind, _max_states),
+    do: :erlang.nif_error(:not_loaded)
+
+  def cancel_expect(_pipesocket),
+    do: :erlang.nif_error(:not_loaded)
+
+  def screen(_pipesocket, _format),
+    do: :erlang.nif_error(:not_loaded)
+
+  def screen_diff(_pipesocket, _since, _format),
+    do: :erlang.nif_error(:not_loaded)
+
+  def snapshot(_pipesocket, _format, _scrollback),
+    do: :erlang.nif_error(:not_loaded)
+
+  def recording_open(_path),
+    do: :erlang.nif_error(:not_loaded)
+
+  def recording_info(_recording),
+    do: :erlang.nif_error(:not_loaded)
+
+  def recording_seek(_recording, _ts, _format),
+    do: :erlang.nif_error(:not_loaded)
+
+  def recording_read(_recording, _cursor, _max),
+    do: :erlang.nif_error(:not_loaded)
+
+  def replay_start(_recording, _target, _into, _speed, _from, _idle_limit),
+    do: :erlang.nif_error(:not_loaded)
+
+  def replay_stop(_replay),
+    do: :erlang.nif_error(:not_loaded)
+
+  def set_replay_threads(_threads),
+    do: :erlang.nif_error(:not_loaded)
+
+  def foreground_process(_pipesocket),
+    do: :erlang.nif_error(:not_loaded)
+
+  def foreground_processes(_pipesockets),
+    do: :erlang.nif_error(:not_loaded)
+
+  def set_proc_cache_ttl(_ttl_ms),
+    do: :erlang.nif_error(:not_loaded)
+
+  def stats(_pipesockets),
+    do: :erlang.nif_error(:not_loaded)
+
+  def live,
+    do: :erlang.nif_error(:not_loaded)
 end
@@ -0,0 +1,74 @@
+defmodule ExPTY.Recording do
+  @moduledoc """
+  Read indexed recordings, i.e., sessions spawned with `record_format: :indexed`
+  (only available on Unix systems at the moment).
+
+  The file is mapped into memory when it is opened. Seeking restores the screen from the
+  nearest keyframe before the requested time and only decodes the output after it, so
+  jumping to any point of a long session costs the same. A recording that was not closed,
+  e.g. because the VM crashed, is still readable up to its last complete event.
+
+  Timestamps are in microseconds since the start of the recording.
+
+      {:ok, rec} = ExPTY.Recording.open("session.expr")
+      {:ok, %{duration: duration}} = ExPTY.Recording.info(rec)
+      {:ok, screen, cursor} = ExPTY.Recording.seek(rec, div(duration, 2), :ansi)
+      {:ok, events, cursor} = ExPTY.Recording.read(rec, cursor, 1000)
+  """
+
+  @type t :: reference()
+
+  @type event ::
+          {non_neg_integer(), :output | :input, binary()}
+          | {non_neg_integer(), :resize, {non_neg_integer(), non_neg_integer()}}
+
+  @doc """
+  Open an indexed recording.
+  """
+  @spec open(Path.t()) :: {:ok, t()} | {:error, String.t()}
+  def open(path) when is_binary(path) do
+    ExPTY.Nif.recording_open(Path.expand(path))
+  end
+
+  @doc """
+  Size of the terminal when recording started, the start time (Unix time in milliseconds),
+  the duration and the number of keyframes.
+  """
+  @spec info(t()) ::
+          {:ok,
+           %{
+             cols: pos_integer(),
+             rows: pos_integer(),
+             started_at: non_neg_integer(),
+             duration: non_neg_integer(),
+             keyframes: non_neg_integer()
+           }}
+          | {:error, String.t()}
+  def info(recording) do
+    ExPTY.Nif.recording_info(recording)
+  end
+
+  @doc """
+  The screen at `ts` as a snapshot in the same formats as `ExPTY.snapshot/3`, and a
+  cursor to `read/3` the events after it.
+  """
+  @spec seek(t(), non_neg_integer(), :binary | :ansi) ::
+          {:ok, binary(), non_neg_integer()} | {:error, String.t()}
+  def seek(recording, ts, format \\ :binary)
+      when is_integer(ts) and ts >= 0 and format in [:binary, :ansi] do
+    ExPTY.Nif.recording_seek(recording, ts, format)
+  end
+
+  @doc """
+  Read up to `max` events starting at `cursor`, returns the cursor of the next event or
+  `:eof`.
+
+  Output and input are sub-binaries of the mapped file, they are not copied.
+  """
+  @spec read(t(), non_neg_integer(), pos_integer()) ::
+          {:ok, [event()], non_neg_integer() | :eof} | {:error, String.t()}
+  def read(recording, cursor, max \\ 1000)
+      when is_integer(cursor) and cursor >= 0 and is_integer(max) and max > 0 do
+    ExPTY.Nif.recording_read(recording, cursor, max)
+  end
+end
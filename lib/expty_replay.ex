@@ -0,0 +1,101 @@
+defmodule ExPTY.Replay do
+  @moduledoc """
+  Replay indexed recordings (see `ExPTY.Recording`) for load and regression testing
+  (only available on Unix systems at the moment).
+
+  A replay either sends the recorded output to a process as the same `{:data, binary}`
+  messages, chunk for chunk, and the same `{:exit, 0, 0}` message at the end as a live
+  session, or writes it into a PTY spawned with `ExPTY.spawn/3` as its input.
+
+  Replays are scheduled natively on a few threads with a timer wheel, so thousands of them
+  can run at once. The number of threads is `Application.get_env(:expty, :replay_threads, 2)`.
+
+      {:ok, replay} = ExPTY.Replay.start("session.expr", speed: 10)
+
+      receive do
+        {:data, data} -> ...
+        {:exit, 0, 0} -> ...
+      end
+  """
+
+  @type t :: reference()
+
+  @doc """
+  Start replaying a recording, given as a path or as an `ExPTY.Recording`.
+
+  ## Options
+
+  - `to`: `pid()`
+
+    The process that gets the messages, defaults to the caller.
+
+  - `into`: `pid() | nil`
+
+    An `ExPTY` process to write the output into instead of sending it. `to` still gets
+    `{:exit, 0, 0}` when the replay has ended.
+
+  - `speed`: `number() | :max`
+
+    A multiple of the recorded speed, or `:max` to replay as fast as possible. Defaults to `1`.
+
+  - `from`: `non_neg_integer()`
+
+    Where to start, in microseconds since the start of the recording. The screen as it was at
+    that point is sent first as escape sequences. Defaults to `0`.
+
+  - `idle_limit`: `pos_integer() | nil`
+
+    Shorten longer pauses of the recording to this many milliseconds. Defaults to `nil`.
+  """
+  @spec start(Path.t() | ExPTY.Recording.t(), Keyword.t()) :: {:ok, t()} | {:error, String.t()}
+  def start(recording, opts \\ [])
+
+  def start(path, opts) when is_binary(path) do
+    with {:ok, recording} <- ExPTY.Recording.open(path) do
+      start(recording, opts)
+    end
+  end
+
+  def start(recording, opts) when is_reference(recording) do
+    to = opts[:to] || self()
+    speed = opts[:speed] || 1
+    from = opts[:from] || 0
+    idle_limit = opts[:idle_limit]
+
+    unless is_pid(to) do
+      raise "value of `to` should be a pid"
+    end
+
+    unless speed == :max or (is_number(speed) and speed > 0) do
+      raise "value of `speed` should be a positive number or `:max`"
+    end
+
+    unless is_integer(from) and from >= 0 do
+      raise "value of `from` should be a non-negative integer"
+    end
+
+    unless is_nil(idle_limit) or (is_integer(idle_limit) and idle_limit > 0) do
+      raise "value of `idle_limit` should be a positive integer"
+    end
+
+    into =
+      case opts[:into] do
+        nil -> {:ok, nil}
+        pty when is_pid(pty) -> GenServer.call(pty, :pipesocket)
+        _ -> raise "value of `into` should be an ExPTY pid"
+      end
+
+    with {:ok, pipesocket} <- into do
+      speed = if speed == :max, do: 0.0, else: speed * 1.0
+      ExPTY.Nif.replay_start(recording, to, pipesocket, speed, from, (idle_limit || 0) * 1000)
+    end
+  end
+
+  @doc """
+  Stop a replay, a stopped replay does not send `{:exit, 0, 0}`.
+  """
+  @spec stop(t()) :: :ok | {:error, String.t()}
+  def stop(replay) when is_reference(replay) do
+    ExPTY.Nif.replay_stop(replay)
+  end
+end
@@ -18,12 +18,20 @@ else
           executable: executable,
           pty: nil,
           pty_ref: nil,
-          started?: false
+          started?: false,
+          viewers: %{}
         )
 
       {:ok, ctx}
     end
 
+    # frames per second sent to each viewer at most
+    @frame_rate 30
+
+    # a viewer that has not acked its frame for this many frames, e.g. a closed
+    # tab, is dropped; it is added back if it acks later on
+    @max_unacked 10 * @frame_rate
+
     @impl true
     def handle_connect(ctx) do
       fields = %{
@@ -31,7 +39,12 @@ else
         started: ctx.assigns.started?
       }
 
-      {:ok, fields, ctx}
+      # a new viewer starts from a full repaint
+      viewer = %{frame: 0, in_flight?: false, unacked: 0}
+      viewers = Map.put(ctx.assigns.viewers, ctx.origin, viewer)
+      if ctx.assigns.started?, do: send(self(), :push_frames)
+
+      {:ok, fields, assign(ctx, viewers: viewers)}
     end
 
     @impl true
@@ -50,22 +63,45 @@ else
           end
 
         Logger.info("Starting executable: #{executable}")
-        {:ok, pty} = ExPTY.spawn(executable, [])
+        self = self()
 
-        ExPTY.on_data(pty, fn _, _, data ->
-          broadcast_event(ctx, "data", %{data: Base.encode64(data)})
-        end)
+        pty =
+          case :os.type() do
+            {:unix, _} ->
+              # viewers pull screen diffs at their own pace instead of the raw output
+              {:ok, pty} = ExPTY.spawn(executable, [], screen: true, frame_rate: @frame_rate)
 
-        self = self()
+              ExPTY.on_event(pty, fn
+                _, _, {:frame, _} -> send(self, :push_frames)
+                _, _, _ -> nil
+              end)
+
+              pty
+
+            {:win32, _} ->
+              {:ok, pty} = ExPTY.spawn(executable, [])
+
+              ExPTY.on_data(pty, fn _, _, data ->
+                broadcast_event(ctx, "data", %{data: Base.encode64(data)})
+              end)
+
+              pty
+          end
 
         ExPTY.on_exit(pty, fn _, _, exit_code, _ ->
           Process.send_after(self, {:executable_exited, exit_code}, 0)
         end)
 
+        viewers =
+          Map.new(ctx.assigns.viewers, fn {origin, _} ->
+            {origin, %{frame: 0, in_flight?: false, unacked: 0}}
+          end)
+
         {:noreply,
          assign(ctx,
            pty: pty,
-           started?: true
+           started?: true,
+           viewers: viewers
          )}
       end
     end
@@ -90,6 +126,12 @@ else
       {:noreply, ctx}
     end
 
+    def handle_event("frame_ack", %{"frame" => frame}, ctx) when is_integer(frame) do
+      viewer = %{frame: frame, in_flight?: false, unacked: 0}
+      viewers = Map.put(ctx.assigns.viewers, ctx.origin, viewer)
+      {:noreply, push_frames(assign(ctx, viewers: viewers))}
+    end
+
     def handle_event("resize", %{"cols" => cols, "rows" => rows}, ctx)
         when is_integer(cols) and cols > 0 and is_integer(rows) and rows > 0 do
       if is_pid(ctx.assigns.pty) do
@@ -114,6 +156,10 @@ else
       {:noreply, ctx}
     end
 
+    def handle_info(:push_frames, ctx) do
+      {:noreply, push_frames(ctx)}
+    end
+
     def handle_info({:executable_exited, code}, ctx) do
       broadcast_event(ctx, "executable_exited", %{code: code})
       {:noreply, assign(ctx, pty: nil, pty_ref: nil, started?: false)}
@@ -151,6 +197,35 @@ else
       end
     end
 
+    # Sends each viewer that has drawn its last frame what changed since then,
+    # a viewer still busy with a frame skips the ones produced in the meantime
+    defp push_frames(%{assigns: %{pty: pty}} = ctx) when is_pid(pty) do
+      viewers =
+        ctx.assigns.viewers
+        |> Enum.flat_map(fn
+          {origin, %{in_flight?: false, frame: since} = viewer} ->
+            case ExPTY.screen_diff(pty, since, :ansi) do
+              {:ok, %{frame: frame, data: data}} when frame != since ->
+                send_event(ctx, origin, "frame", %{frame: frame, data: Base.encode64(data)})
+                [{origin, %{viewer | in_flight?: true}}]
+
+              _ ->
+                [{origin, viewer}]
+            end
+
+          {_origin, %{unacked: unacked}} when unacked >= @max_unacked ->
+            []
+
+          {origin, %{unacked: unacked} = viewer} ->
+            [{origin, %{viewer | unacked: unacked + 1}}]
+        end)
+        |> Map.new()
+
+      assign(ctx, viewers: viewers)
+    end
+
+    defp push_frames(ctx), do: ctx
+
     defp stop_executable(ctx) do
       if is_pid(ctx.assigns.pty) do
         # signal 9: SIGKILL
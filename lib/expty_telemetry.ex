@@ -0,0 +1,105 @@
+defmodule ExPTY.Telemetry do
+  @moduledoc """
+  `:telemetry` events emitted by ExPTY, when `:telemetry` is available.
+
+  Durations are in `:native` time units, like `:telemetry.span/3`.
+
+  - `[:expty, :spawn, :start]` and `[:expty, :spawn, :stop]`
+
+    Around `ExPTY.spawn/3`. Measurements of `:start` are `system_time` and `monotonic_time`,
+    those of `:stop` are `duration` and, on Unix systems, the time spent in `openpty`,
+    `posix_spawn` and `handshake` (waiting for the spawn helper to exec). Metadata are
+    `file`, `args` and, for `:stop`, `result` (`:ok` or `{:error, reason}`) and `pty`.
+
+  - `[:expty, :write]`
+
+    For each `ExPTY.write/2`, with `bytes` and `duration` measurements and `pty` and
+    `result` metadata.
+
+  - `[:expty, :exit]`
+
+    When the process has exited, with `exit_code` and `signal_code` metadata along with `pty`.
+
+  - `[:expty, :echo]`
+
+    For each completed echo latency probe (see `ExPTY.probe_echo/1` and the `echo_probe`
+    option of `ExPTY.spawn/3`), with a `duration` measurement and `pty` metadata.
+
+  - `[:expty, :pause]` and `[:expty, :resume]`
+
+    When output is paused or resumed, with `pty` and `source` (`:call` for `ExPTY.pause/1`
+    and `ExPTY.resume/1`, `:flow_control` for the flow control characters, `:packet_mode` when
+    the line discipline reports it with the `packet_mode` option) metadata.
+
+  - `[:expty, :dropped]`
+
+    When output beyond the `output_budget` of a session has been discarded, with a `bytes`
+    measurement and `pty` metadata.
+
+  - `[:expty, :output]`
+
+    Sampled every `Application.get_env(:expty, :telemetry_interval, 10_000)` milliseconds
+    from the native counters of each live session (see `ExPTY.stats/1`) rather than per chunk,
+    with `bytes`, `reads` and `messages` since the previous sample as measurements and `pty`
+    metadata. Only emitted on Unix systems; `nil` disables sampling.
+  """
+
+  use GenServer
+
+  @doc false
+  def available? do
+    Code.ensure_loaded?(:telemetry)
+  end
+
+  @doc false
+  def execute(event, measurements, metadata) do
+    if available?() do
+      :telemetry.execute(event, measurements, metadata)
+    end
+
+    :ok
+  end
+
+  @doc false
+  def from_nanoseconds(ns) do
+    System.convert_time_unit(ns, :nanosecond, :native)
+  end
+
+  @doc false
+  def start_link(interval) do
+    GenServer.start_link(__MODULE__, interval, name: __MODULE__)
+  end
+
+  @impl true
+  def init(interval) do
+    Process.send_after(self(), :sample, interval)
+    {:ok, {interval, %{}}}
+  end
+
+  @impl true
+  def handle_info(:sample, {interval, last}) do
+    sessions = Registry.select(ExPTY.Registry, [{{:"$1", :_, :"$2"}, [], [{{:"$1", :"$2"}}]}])
+
+    current =
+      Map.new(sessions, fn {pty, pipesocket} ->
+        stats = ExPTY.Nif.stats([pipesocket])
+        counters = {stats.bytes_read, stats.reads, stats.messages}
+        {bytes, reads, messages} = Map.get(last, pty, {0, 0, 0})
+
+        execute(
+          [:expty, :output],
+          %{
+            bytes: stats.bytes_read - bytes,
+            reads: stats.reads - reads,
+            messages: stats.messages - messages
+          },
+          %{pty: pty}
+        )
+
+        {pty, counters}
+      end)
+
+    Process.send_after(self(), :sample, interval)
+    {:noreply, {interval, current}}
+  end
+end
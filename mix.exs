@@ -41,7 +41,11 @@ defmodule ExPTY.MixProject do
       {:cc_precompiler, "~> 0.1"},
       {:elixir_make, "~> 0.8"},
       {:kino, "~> 0.7", optional: true},
-      {:ex_doc, "~> 0.34", only: :docs, runtime: false}
+      {:telemetry, "~> 0.4 or ~> 1.0", optional: true},
+      {:ex_doc, "~> 0.34", only: :docs, runtime: false},
+      {:benchee, "~> 1.3", only: :bench},
+      {:benchee_json, "~> 1.0", only: :bench},
+      {:jason, "~> 1.4", only: :bench}
     ]
   end
 
@@ -0,0 +1,70 @@
+defmodule ExPTY.ExpectTest do
+  use ExUnit.Case, async: true
+
+  if match?({:win32, _}, :os.type()) do
+    @moduletag skip: "expect is only available on Unix"
+  end
+
+  test "suppressed output beyond the 1 MiB of before still reaches on_data" do
+    pty = spawn_sh("read _; head -c 1500000 /dev/zero | tr '\\000' a; echo DONE; read _")
+
+    assert {:match, 0, before, "DONE"} = expect_after_go(pty, ["DONE"], suppress_data: true)
+    assert byte_size(before) <= 1_048_576
+    assert count_a(before) + count_a(collect_data()) == 1_500_000
+  end
+
+  test "a literal split between two reads is found" do
+    pty = spawn_sh("read _; printf 'log: hel'; sleep 0.2; printf 'lo world; done'; read _")
+
+    assert {:match, :greeting, "log: ", "hello world"} =
+             expect_after_go(pty, [{:other, "world; x"}, {:greeting, "hello world"}])
+  end
+
+  test "a regex match split between two reads reports its captures" do
+    pty = spawn_sh("read _; printf 'x id=12'; sleep 0.2; printf '34; y'; read _")
+
+    assert {:match, 0, "x ", "id=1234;", [{0, 8}, {3, 4}, {7, 1}, {-1, 0}]} =
+             expect_after_go(pty, [~r/id=(\d+)([;,])(z)?/])
+  end
+
+  test "regexes nested too deep or matching the empty string are rejected" do
+    pty = spawn_sh("read _")
+
+    deep = String.duplicate("(?:", 200) <> "a" <> String.duplicate(")*", 200)
+    assert {:error, "pattern 0: pattern too deep" <> _} =
+             ExPTY.expect(pty, [Regex.compile!(deep)])
+
+    for source <- ["$", "x*$", "^", "(a|$)"] do
+      assert {:error, "pattern 1 matches the empty string"} =
+               ExPTY.expect(pty, [~r/a/, Regex.compile!(source)])
+    end
+  end
+
+  defp spawn_sh(script) do
+    test = self()
+
+    {:ok, pty} =
+      ExPTY.spawn("sh", ["-c", script], on_data: fn _, _, data -> send(test, {:data, data}) end)
+
+    on_exit(fn -> if Process.alive?(pty), do: GenServer.stop(pty) end)
+    pty
+  end
+
+  # arms the expect, then lets the script go on past its first `read`
+  defp expect_after_go(pty, patterns, opts \\ []) do
+    task = Task.async(fn -> ExPTY.expect(pty, patterns, 10_000, opts) end)
+    Process.sleep(200)
+    :ok = ExPTY.write(pty, "\n")
+    Task.await(task, 15_000)
+  end
+
+  defp collect_data(acc \\ []) do
+    receive do
+      {:data, data} -> collect_data([acc | data])
+    after
+      200 -> IO.iodata_to_binary(acc)
+    end
+  end
+
+  defp count_a(data), do: data |> :binary.matches("a") |> length()
+end
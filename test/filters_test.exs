@@ -0,0 +1,63 @@
+defmodule ExPTY.FiltersTest do
+  use ExUnit.Case, async: true
+
+  if match?({:win32, _}, :os.type()) do
+    @moduletag skip: "filters are only available on Unix"
+  end
+
+  test "collapse_progress keeps only the last state of a line rewritten across reads" do
+    # the window is longer than the pause, the rewritten line is still held when it ends
+    script = "printf '10%%\\r20%%'; sleep 0.2; printf '\\r100%%\\ndone\\n'"
+    {data, pty} = run(script, collapse_progress: 2_000)
+
+    # the kept segment keeps its "\r", the cursor may not be at the start of the line
+    assert IO.iodata_to_binary(data) == "\r100%\ndone\n"
+    assert {:ok, %{bytes_collapsed: collapsed}} = ExPTY.stats(pty)
+    assert collapsed > 0
+  end
+
+  test "strip_ansi removes an escape sequence split between reads" do
+    script = "printf 'a\\033'; sleep 0.2; printf '[31mred\\033[0m\\n'"
+    {data, _pty} = run(script, filters: [:strip_ansi])
+
+    assert IO.iodata_to_binary(data) == "ared\n"
+  end
+
+  test "utf8 holds back a character cut by a read until it is complete" do
+    # 中 is E4 B8 AD
+    script = "printf 'x\\344\\270'; sleep 0.2; printf '\\255y\\n'"
+    {data, _pty} = run(script, filters: [:utf8])
+
+    assert Enum.all?(data, &String.valid?/1)
+    assert IO.iodata_to_binary(data) == "x中y\n"
+  end
+
+  defp run(script, opts) do
+    test = self()
+
+    {:ok, pty} =
+      ExPTY.spawn(
+        "sh",
+        ["-c", script],
+        [
+          # the output is what the script prints, without ONLCR
+          termios: :raw,
+          on_data: fn _, _, data -> send(test, {:data, data}) end,
+          on_exit: fn _, pty, _, _ -> send(test, {:exit, pty}) end
+        ] ++ opts
+      )
+
+    on_exit(fn -> if Process.alive?(pty), do: GenServer.stop(pty) end)
+    assert_receive {:exit, ^pty}, 5_000
+    {collect_data(), pty}
+  end
+
+  # what the filters hold back is delivered on exit, which may come after the exit
+  defp collect_data(acc \\ []) do
+    receive do
+      {:data, data} -> collect_data(acc ++ [data])
+    after
+      200 -> acc
+    end
+  end
+end
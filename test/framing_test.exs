@@ -0,0 +1,49 @@
+defmodule ExPTY.FramingTest do
+  use ExUnit.Case, async: true
+
+  if match?({:win32, _}, :os.type()) do
+    @moduletag skip: "framing is only available on Unix"
+  end
+
+  test "lines and CRLF split between reads are put back together" do
+    script = "printf 'one\\r'; sleep 0.2; printf '\\ntw'; sleep 0.2; printf 'o\\r\\nthree'"
+    assert run_lines(script, normalize_crlf: true) == ["one\n", "two\n", "three"]
+  end
+
+  test "long lines are delivered in pieces of max_line_length, across reads" do
+    script = "printf 'abcdefghij\\n'; printf 'abcdef'; sleep 0.2; printf 'gh\\r\\n'"
+
+    assert run_lines(script, max_line_length: 4, normalize_crlf: true) ==
+             ["abcd", "efgh", "ij\n", "abcd", "efgh", "\n"]
+  end
+
+  defp run_lines(script, opts) do
+    test = self()
+
+    {:ok, pty} =
+      ExPTY.spawn(
+        "sh",
+        ["-c", script],
+        [
+          # the output is what the script prints, without ONLCR
+          termios: :raw,
+          framing: :line,
+          on_data: fn _, _, lines -> send(test, {:lines, lines}) end,
+          on_exit: fn _, pty, _, _ -> send(test, {:exit, pty}) end
+        ] ++ opts
+      )
+
+    on_exit(fn -> if Process.alive?(pty), do: GenServer.stop(pty) end)
+    assert_receive {:exit, ^pty}, 5_000
+    collect_lines()
+  end
+
+  # the incomplete last line is delivered on exit, which may come after the exit
+  defp collect_lines(acc \\ []) do
+    receive do
+      {:lines, lines} -> collect_lines(acc ++ lines)
+    after
+      200 -> acc
+    end
+  end
+end
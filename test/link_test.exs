@@ -0,0 +1,57 @@
+defmodule ExPTY.LinkTest do
+  use ExUnit.Case, async: true
+
+  if match?({:win32, _}, :os.type()) do
+    @moduletag skip: "connect is only available on Unix"
+  end
+
+  test "the output of one cat goes into another until disconnected" do
+    a = spawn_cat(:a)
+    b = spawn_cat(:b)
+
+    assert :ok = ExPTY.connect(a, b)
+    assert {:error, "already connected"} = ExPTY.connect(a, b)
+    # the reader picks the link up once it has been woken up
+    Process.sleep(100)
+
+    :ok = ExPTY.write(a, "ping\n")
+    assert collect(:b, 5) == "ping\n"
+    refute_receive {:a, _}, 100
+
+    assert :ok = ExPTY.disconnect(a)
+    assert {:error, "not connected"} = ExPTY.disconnect(a)
+    Process.sleep(100)
+
+    :ok = ExPTY.write(a, "pong\n")
+    assert collect(:a, 5) == "pong\n"
+    refute_receive {:b, _}, 100
+
+    assert {:ok, %{bytes_forwarded: 5}} = ExPTY.stats(a)
+  end
+
+  defp spawn_cat(name) do
+    test = self()
+
+    {:ok, pty} =
+      ExPTY.spawn("cat", [],
+        # cat gives back what it is given, byte for byte
+        termios: :raw,
+        on_data: fn _, _, data -> send(test, {name, data}) end
+      )
+
+    on_exit(fn -> if Process.alive?(pty), do: GenServer.stop(pty) end)
+    pty
+  end
+
+  defp collect(name, size, acc \\ []) do
+    if IO.iodata_length(acc) >= size do
+      IO.iodata_to_binary(acc)
+    else
+      receive do
+        {^name, data} -> collect(name, size, [acc | data])
+      after
+        5_000 -> IO.iodata_to_binary(acc)
+      end
+    end
+  end
+end
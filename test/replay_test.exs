@@ -0,0 +1,90 @@
+defmodule ExPTY.ReplayTest do
+  use ExUnit.Case, async: true
+
+  @moduletag :tmp_dir
+
+  if match?({:win32, _}, :os.type()) do
+    @moduletag skip: "replays are only available on Unix"
+  end
+
+  # SIGSTOP and SIGCONT
+  @signals if match?({:unix, :linux}, :os.type()), do: {19, 18}, else: {17, 19}
+
+  test "a replay into a stopped child goes on where the child stopped taking it",
+       %{tmp_dir: dir} do
+    # more than the PTY holds while nobody reads it
+    expected = Enum.map_join(1..100_000, &"#{&1}\r\n")
+    path = Path.join(dir, "seq.expr")
+    record(path, "seq 1 100000", expected)
+
+    test = self()
+    {stop, cont} = @signals
+
+    {:ok, cat} =
+      ExPTY.spawn("cat", [],
+        termios: :raw,
+        on_data: fn _, _, data -> send(test, {:cat, data}) end
+      )
+
+    on_exit(fn -> if Process.alive?(cat), do: GenServer.stop(cat) end)
+
+    :ok = ExPTY.kill(cat, stop)
+    {:ok, _replay} = ExPTY.Replay.start(path, into: cat, speed: :max)
+    refute_receive {:exit, 0, 0}, 500
+
+    :ok = ExPTY.kill(cat, cont)
+    assert_receive {:exit, 0, 0}, 10_000
+    assert collect(byte_size(expected)) == expected
+  end
+
+  defp record(path, command, expected) do
+    test = self()
+    [file | args] = String.split(command)
+
+    {:ok, pty} =
+      ExPTY.spawn(file, args,
+        record: path,
+        record_format: :indexed,
+        on_exit: fn _, pty, _, _ -> send(test, {:exited, pty}) end
+      )
+
+    assert_receive {:exited, ^pty}, 10_000
+    GenServer.stop(pty)
+    await_recorded(path, expected)
+  end
+
+  # the recording is closed by the reader, which may finish after the exit
+  defp await_recorded(path, expected, deadline \\ 5_000) do
+    {:ok, rec} = ExPTY.Recording.open(path)
+
+    cond do
+      recorded_output(rec, 0, []) == expected ->
+        :ok
+
+      deadline <= 0 ->
+        flunk("the recording does not hold the output of the session")
+
+      true ->
+        Process.sleep(50)
+        await_recorded(path, expected, deadline - 50)
+    end
+  end
+
+  defp recorded_output(rec, cursor, acc) do
+    {:ok, events, next} = ExPTY.Recording.read(rec, cursor)
+    acc = [acc | for({_, :output, data} <- events, do: data)]
+    if next == :eof, do: IO.iodata_to_binary(acc), else: recorded_output(rec, next, acc)
+  end
+
+  defp collect(size, acc \\ []) do
+    if IO.iodata_length(acc) >= size do
+      IO.iodata_to_binary(acc)
+    else
+      receive do
+        {:cat, data} -> collect(size, [acc | data])
+      after
+        5_000 -> IO.iodata_to_binary(acc)
+      end
+    end
+  end
+end
@@ -0,0 +1,64 @@
+defmodule ExPTY.ScreenTest do
+  use ExUnit.Case, async: true
+
+  if match?({:win32, _}, :os.type()) do
+    @moduletag skip: "the screen model is only available on Unix"
+  end
+
+  test "a wide character on a 1-column screen is replaced" do
+    pty = spawn_screen(cols: 1, rows: 3)
+
+    # the terminal echoes it back
+    :ok = ExPTY.write(pty, "中")
+    screen = await_screen(pty, fn %{lines: lines} -> "�" in lines end)
+    assert screen.cols == 1
+    assert screen.cursor == {0, 0}
+  end
+
+  test "resize keeps the screen usable and rejects sizes a winsize cannot hold" do
+    pty = spawn_screen(cols: 4, rows: 2)
+
+    :ok = ExPTY.write(pty, "中中")
+    await_screen(pty, fn %{lines: [first | _]} -> first == "中中" end)
+
+    assert :ok = ExPTY.resize(pty, 1, 2)
+    assert {:ok, %{cols: 1, rows: 2}} = ExPTY.screen(pty)
+
+    :ok = ExPTY.write(pty, "中")
+    await_screen(pty, fn %{lines: lines} -> "�" in lines end)
+
+    assert {:error, _} = ExPTY.resize(pty, 65536, 24)
+    assert {:error, _} = ExPTY.resize(pty, 65535, 65535)
+    assert {:ok, %{cols: 1, rows: 2}} = ExPTY.screen(pty)
+
+    assert :ok = ExPTY.resize(pty, 80, 24)
+    assert {:ok, %{cols: 80, rows: 24}} = ExPTY.screen(pty)
+  end
+
+  test "spawn rejects sizes a winsize cannot hold" do
+    assert {:error, _} = ExPTY.spawn("cat", [], cols: 65536)
+    assert {:error, _} = ExPTY.spawn("cat", [], cols: 65535, rows: 65535, screen: true)
+  end
+
+  defp spawn_screen(opts) do
+    {:ok, pty} = ExPTY.spawn("cat", [], [screen: true, echo?: true] ++ opts)
+    on_exit(fn -> if Process.alive?(pty), do: GenServer.stop(pty) end)
+    pty
+  end
+
+  defp await_screen(pty, fun, deadline \\ 5_000) do
+    {:ok, screen} = ExPTY.screen(pty)
+
+    cond do
+      fun.(screen) ->
+        screen
+
+      deadline <= 0 ->
+        flunk("screen did not settle: #{inspect(screen)}")
+
+      true ->
+        Process.sleep(20)
+        await_screen(pty, fun, deadline - 20)
+    end
+  end
+end
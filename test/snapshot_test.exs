@@ -0,0 +1,77 @@
+defmodule ExPTY.SnapshotTest do
+  # Keyframes of indexed recordings are binary snapshots, seeking decodes one and
+  # encodes the result again, so it has to give back what the live screen encodes.
+  use ExUnit.Case, async: true
+
+  @moduletag :tmp_dir
+
+  if match?({:win32, _}, :os.type()) do
+    @moduletag skip: "snapshots are only available on Unix"
+  end
+
+  test "a 1-row screen survives a round trip", %{tmp_dir: dir} do
+    assert_round_trip(dir, "printf hello", cols: 20, rows: 1)
+  end
+
+  test "invalid UTF-8 is stored as U+FFFD and survives a round trip", %{tmp_dir: dir} do
+    # F4 BF and ED A0 are out of range and surrogate forms, the BELs leave the screen
+    # as it is and are enough output for a keyframe to be taken after them
+    script =
+      "printf '\\364\\277\\277\\277 \\355\\240\\200'; " <>
+        "head -c 300000 /dev/zero | tr '\\000' '\\007'"
+
+    {%{lines: [line | _]}, path} = assert_round_trip(dir, script, cols: 20, rows: 2)
+    assert line == "���� ���"
+
+    {:ok, rec} = ExPTY.Recording.open(path)
+    assert {:ok, %{keyframes: keyframes}} = ExPTY.Recording.info(rec)
+    assert keyframes >= 2
+  end
+
+  defp assert_round_trip(dir, script, opts) do
+    test = self()
+    path = Path.join(dir, "session.expr")
+
+    {:ok, pty} =
+      ExPTY.spawn(
+        "sh",
+        ["-c", script],
+        [
+          screen: true,
+          record: path,
+          record_format: :indexed,
+          on_exit: fn _, pty, _, _ -> send(test, {:exit, pty}) end
+        ] ++ opts
+      )
+
+    assert_receive {:exit, ^pty}, 10_000
+    {:ok, live} = ExPTY.snapshot(pty, :binary, scrollback: 0)
+    {:ok, text} = ExPTY.screen(pty)
+    GenServer.stop(pty)
+
+    await_seek(path, live)
+    {text, path}
+  end
+
+  # the recording is closed by the reader, which may finish after the exit
+  defp await_seek(path, live, deadline \\ 5_000) do
+    seeked =
+      with {:ok, rec} <- ExPTY.Recording.open(path),
+           {:ok, %{duration: duration}} <- ExPTY.Recording.info(rec),
+           {:ok, snapshot, _} <- ExPTY.Recording.seek(rec, duration, :binary) do
+        snapshot
+      end
+
+    cond do
+      seeked == live ->
+        :ok
+
+      deadline <= 0 ->
+        flunk("the recording does not give back the live screen: #{inspect(seeked)}")
+
+      true ->
+        Process.sleep(50)
+        await_seek(path, live, deadline - 50)
+    end
+  end
+end
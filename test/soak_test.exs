@@ -0,0 +1,188 @@
+defmodule ExPTY.SoakTest do
+  # Churns through spawn/write/kill cycles and checks that file descriptors,
+  # threads, native memory and children come back to where they started.
+  # Excluded by default, run it with
+  #
+  #     SOAK_CYCLES=1000 mix test --only soak
+  #
+  # SOAK_CYCLES defaults to 200, SOAK_RSS_SLACK (bytes, default 16 MiB) is how
+  # much the resident set may grow over all cycles, allocators keep some.
+  use ExUnit.Case, async: false
+
+  @moduletag :soak
+  @moduletag timeout: :infinity
+
+  unless File.dir?("/proc/self/task") do
+    @moduletag skip: "needs /proc"
+  end
+
+  @cycles String.to_integer(System.get_env("SOAK_CYCLES", "200"))
+  @rss_slack String.to_integer(System.get_env("SOAK_RSS_SLACK", "#{16 * 1024 * 1024}"))
+  @warmup 10
+
+  test "spawn, write and kill" do
+    soak("kill", fn pty ->
+      :ok = ExPTY.kill(pty, 9)
+      assert_receive {:exit, ^pty, _, 9}, 5_000
+      GenServer.stop(pty)
+    end)
+  end
+
+  test "spawn, write and stop the owner while the child is running" do
+    soak("stop", fn pty ->
+      # terminate/2 hangs up, nobody is left to receive {:exit, ...}
+      GenServer.stop(pty)
+    end)
+  end
+
+  test "spawn and wait for the child to exit by itself" do
+    soak(
+      "exit",
+      fn pty ->
+        :ok = ExPTY.write(pty, "exit 0\n")
+        assert_receive {:exit, ^pty, 0, 0}, 5_000
+        GenServer.stop(pty)
+      end,
+      "sh"
+    )
+  end
+
+  defp soak(name, teardown, file \\ "cat") do
+    for _ <- 1..@warmup, do: cycle(file, teardown)
+    settle(baseline_live())
+
+    before = measure()
+
+    durations =
+      for _ <- 1..@cycles do
+        start = System.monotonic_time()
+        cycle(file, teardown)
+        System.monotonic_time() - start
+      end
+
+    settle(before.live)
+    after_ = measure()
+
+    report(name, durations, before, after_)
+
+    assert after_.live == before.live
+    assert after_.fds == before.fds
+    assert after_.threads == before.threads
+    assert after_.children == before.children
+    assert after_.zombies == before.zombies
+    assert after_.rss - before.rss < @rss_slack
+  end
+
+  defp cycle(file, teardown) do
+    test = self()
+
+    {:ok, pty} =
+      ExPTY.spawn(file, [],
+        on_data: fn _, pty, data -> send(test, {:data, pty, data}) end,
+        on_exit: fn _, pty, exit_code, signal_code ->
+          send(test, {:exit, pty, exit_code, signal_code})
+        end
+      )
+
+    :ok = ExPTY.write(pty, "soak\n")
+    assert_receive {:data, ^pty, _}, 5_000
+    teardown.(pty)
+    flush(pty)
+  end
+
+  defp flush(pty) do
+    receive do
+      {:data, ^pty, _} -> flush(pty)
+      {:exit, ^pty, _, _} -> flush(pty)
+    after
+      0 -> :ok
+    end
+  end
+
+  # whatever the previous test left behind has to be gone first
+  defp baseline_live, do: %{sessions: 0, threads: 0, children: 0}
+
+  # the reader goes away once the child and everything it left
+  # running have closed the PTY, which may be after the exit
+  defp settle(live, deadline \\ 10_000) do
+    Enum.each(Process.list(), &:erlang.garbage_collect/1)
+
+    cond do
+      ExPTY.Nif.live() == live ->
+        :ok
+
+      deadline <= 0 ->
+        flunk("native sessions did not settle: #{inspect(ExPTY.Nif.live())}")
+
+      true ->
+        Process.sleep(50)
+        settle(live, deadline - 50)
+    end
+  end
+
+  defp measure do
+    {children, zombies} = children()
+
+    %{
+      live: ExPTY.Nif.live(),
+      fds: length(File.ls!("/proc/self/fd")),
+      threads: length(File.ls!("/proc/self/task")),
+      rss: rss(),
+      system: :erlang.memory(:system),
+      children: children,
+      zombies: zombies
+    }
+  end
+
+  defp rss do
+    "/proc/self/status"
+    |> File.read!()
+    |> String.split("\n")
+    |> Enum.find_value(0, fn
+      "VmRSS:" <> kb ->
+        kb |> String.trim() |> String.trim_trailing(" kB") |> String.to_integer() |> Kernel.*(1024)
+
+      _ ->
+        nil
+    end)
+  end
+
+  # children of the VM, running and zombies, from /proc/*/stat
+  defp children do
+    self_pid = List.to_string(:os.getpid())
+
+    "/proc"
+    |> File.ls!()
+    |> Enum.filter(&(&1 =~ ~r/^\d+$/))
+    |> Enum.flat_map(fn pid ->
+      case File.read("/proc/#{pid}/stat") do
+        {:ok, stat} ->
+          # the command name may contain anything, fields start after its ")"
+          [state, ppid | _] = stat |> String.split(")") |> List.last() |> String.split()
+          if ppid == self_pid, do: [state], else: []
+
+        _ ->
+          []
+      end
+    end)
+    |> Enum.split_with(&(&1 != "Z"))
+    |> then(fn {running, zombies} -> {length(running), length(zombies)} end)
+  end
+
+  defp report(name, durations, before, after_) do
+    sorted = Enum.sort(durations)
+    us = &System.convert_time_unit(&1, :native, :microsecond)
+    at = fn q -> us.(Enum.at(sorted, min(length(sorted) - 1, trunc(q * length(sorted))))) end
+
+    IO.puts("""
+
+    soak #{name}: #{length(durations)} cycles, per cycle \
+    mean #{us.(div(Enum.sum(durations), length(durations)))} us, \
+    p50 #{at.(0.5)} us, p99 #{at.(0.99)} us, max #{us.(List.last(sorted))} us
+      fds #{before.fds} -> #{after_.fds}, threads #{before.threads} -> #{after_.threads}, \
+    children #{before.children} -> #{after_.children}, zombies #{before.zombies} -> #{after_.zombies}
+      rss #{before.rss} -> #{after_.rss} (#{div(after_.rss - before.rss, length(durations))} B/cycle), \
+    system #{before.system} -> #{after_.system}
+    """)
+  end
+end
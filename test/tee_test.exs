@@ -0,0 +1,63 @@
+defmodule ExPTY.TeeTest do
+  use ExUnit.Case, async: true
+
+  @moduletag :tmp_dir
+
+  if match?({:win32, _}, :os.type()) do
+    @moduletag skip: "tee is only available on Unix"
+  end
+
+  test "the output is copied to a file as it is delivered", %{tmp_dir: dir} do
+    path = Path.join(dir, "session.log")
+    test = self()
+
+    {:ok, pty} =
+      ExPTY.spawn("sh", ["-c", "read _; seq 1 20000; read _; echo after; read _"],
+        on_data: fn _, _, data -> send(test, {:data, data}) end
+      )
+
+    on_exit(fn -> if Process.alive?(pty), do: GenServer.stop(pty) end)
+
+    assert {:ok, id} = ExPTY.tee(pty, {:file, path})
+    :ok = ExPTY.write(pty, "\n")
+
+    expected = Enum.map_join(1..20_000, &"#{&1}\r\n")
+    assert collect(byte_size(expected)) == expected
+    await_file(path, expected)
+
+    # what is read after untee is not copied anymore
+    assert :ok = ExPTY.untee(pty, id)
+    assert {:error, _} = ExPTY.untee(pty, id)
+    :ok = ExPTY.write(pty, "\n")
+    assert collect(byte_size("after\r\n")) == "after\r\n"
+    Process.sleep(200)
+    assert File.read!(path) == expected
+  end
+
+  defp collect(size, acc \\ []) do
+    if IO.iodata_length(acc) >= size do
+      IO.iodata_to_binary(acc)
+    else
+      receive do
+        {:data, data} -> collect(size, [acc | data])
+      after
+        5_000 -> IO.iodata_to_binary(acc)
+      end
+    end
+  end
+
+  # the file is written by the writer thread of the session
+  defp await_file(path, expected, deadline \\ 5_000) do
+    cond do
+      File.read!(path) == expected ->
+        :ok
+
+      deadline <= 0 ->
+        flunk("the file does not hold the output: #{byte_size(File.read!(path))} bytes")
+
+      true ->
+        Process.sleep(50)
+        await_file(path, expected, deadline - 50)
+    end
+  end
+end
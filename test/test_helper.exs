@@ -1 +1 @@
-ExUnit.start()
+ExUnit.start(exclude: [:soak])